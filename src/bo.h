@@ -37,6 +37,11 @@ struct bo_ops {
 	void *(*bo_map)(struct omap_bo *bo);
 	int (*bo_cpu_prep)(struct omap_bo *bo, enum omap_gem_op op);
 	int (*bo_cpu_fini)(struct omap_bo *bo, enum omap_gem_op op);
+	/* PRIME, optional: share bos with clients as dma-buf fds */
+	int (*bo_export_fd)(struct omap_bo *bo, int *fd);
+	int (*bo_import_fd)(struct omap_device *dev, int fd, uint32_t *handle);
+	/* CPU reads of bo mappings are slow, render into a shadow instead */
+	int prefer_shadow;
 };
 
 int bo_device_init(struct omap_device *dev);
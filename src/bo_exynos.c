@@ -126,6 +126,16 @@ static int bo_exynos_cpu_fini(struct omap_bo *bo, enum omap_gem_op op)
 	return ret;
 }
 
+static int bo_exynos_export_fd(struct omap_bo *bo, int *fd)
+{
+	return drmPrimeHandleToFD(bo->dev->fd, bo->handle, DRM_CLOEXEC, fd);
+}
+
+static int bo_exynos_import_fd(struct omap_device *dev, int fd, uint32_t *handle)
+{
+	return drmPrimeFDToHandle(dev->fd, fd, handle);
+}
+
 static const struct bo_ops bo_exynos_ops = {
 	.bo_create = bo_exynos_create,
 	.bo_destroy = bo_exynos_destroy,
@@ -133,6 +143,10 @@ static const struct bo_ops bo_exynos_ops = {
 	.bo_map = bo_exynos_map,
 	.bo_cpu_prep = bo_exynos_cpu_prep,
 	.bo_cpu_fini = bo_exynos_cpu_fini,
+	.bo_export_fd = bo_exynos_export_fd,
+	.bo_import_fd = bo_exynos_import_fd,
+	/* bos are created without EXYNOS_BO_CACHABLE */
+	.prefer_shadow = 1,
 };
 
 int bo_device_init(struct omap_device *dev)
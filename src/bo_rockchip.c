@@ -103,6 +103,16 @@ static int bo_rockchip_cpu_fini(struct omap_bo *bo, enum omap_gem_op op)
 	return 0;
 }
 
+static int bo_rockchip_export_fd(struct omap_bo *bo, int *fd)
+{
+	return drmPrimeHandleToFD(bo->dev->fd, bo->handle, DRM_CLOEXEC, fd);
+}
+
+static int bo_rockchip_import_fd(struct omap_device *dev, int fd, uint32_t *handle)
+{
+	return drmPrimeFDToHandle(dev->fd, fd, handle);
+}
+
 static const struct bo_ops bo_rockchip_ops = {
 	.bo_create = bo_rockchip_create,
 	.bo_destroy = bo_rockchip_destroy,
@@ -110,6 +120,8 @@ static const struct bo_ops bo_rockchip_ops = {
 	.bo_map = bo_rockchip_map,
 	.bo_cpu_prep = bo_rockchip_cpu_prep,
 	.bo_cpu_fini = bo_rockchip_cpu_fini,
+	.bo_export_fd = bo_rockchip_export_fd,
+	.bo_import_fd = bo_rockchip_import_fd,
 };
 
 int bo_device_init(struct omap_device *dev)
@@ -81,6 +81,9 @@
 #include <X11/extensions/dpmsconst.h>
 
 #include "omap_driver.h"
+#include "omap_copy.h"
+#include "omap_rotate.h"
+#include "omap_thread.h"
 
 #include "xf86Crtc.h"
 
@@ -90,19 +93,208 @@
 
 #include <sys/ioctl.h>
 #include <libudev.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+
+/* may be missing from older libdrm headers */
+#ifndef DRM_CAP_ASYNC_PAGE_FLIP
+#define DRM_CAP_ASYNC_PAGE_FLIP 0x7
+#endif
+#ifndef DRM_CAP_CURSOR_WIDTH
+#define DRM_CAP_CURSOR_WIDTH 0x8
+#define DRM_CAP_CURSOR_HEIGHT 0x9
+#endif
+#ifndef DRM_MODE_PAGE_FLIP_ASYNC
+#define DRM_MODE_PAGE_FLIP_ASYNC 0x02
+#endif
 
 typedef struct {
 	int fd;
 	struct udev_monitor *uevent_monitor;
 	InputHandlerProc uevent_handler;
+	/* connectors are re-probed on a thread, see drmmode_hotplug_main() */
+	struct drmmode_hotplug *hotplug;
+	/* the outputs' connectors were just probed, detect() takes them */
+	Bool outputs_probed;
+	/* kernel can flip without waiting for vblank */
+	Bool async_flip;
+	/* use atomic commits, see drmmode_atomic_init_crtc() */
+	Bool atomic;
+	/* overlay planes windows can be scanned out on */
+	struct _drmmode_plane *planes;
+	int num_planes;
+	/* the device only shows what it is told changed, and the root damage
+	 * for that, see drmmode_dirty_update() */
+	Bool dirty_fb;
+	DamagePtr dirty_damage;
+	/* root damage for the per-crtc copies, see drmmode_copies_update() */
+	DamagePtr copy_damage;
+	/* largest hardware cursor, and whether smaller ones were refused */
+	int cursor_width;
+	int cursor_height;
+	Bool cursor_full_size;
 } drmmode_rec, *drmmode_ptr;
 
+/* primary plane properties set by atomic commits */
+enum drmmode_plane_prop {
+	PLANE_FB_ID,
+	PLANE_CRTC_ID,
+	PLANE_SRC_X,
+	PLANE_SRC_Y,
+	PLANE_SRC_W,
+	PLANE_SRC_H,
+	PLANE_CRTC_X,
+	PLANE_CRTC_Y,
+	PLANE_CRTC_W,
+	PLANE_CRTC_H,
+	PLANE_NUM_PROPS,
+};
+
+static const char *const drmmode_plane_prop_names[PLANE_NUM_PROPS] = {
+	"FB_ID", "CRTC_ID", "SRC_X", "SRC_Y", "SRC_W", "SRC_H",
+	"CRTC_X", "CRTC_Y", "CRTC_W", "CRTC_H",
+};
+
+/* an overlay plane, see drmmode_plane_show() */
+typedef struct _drmmode_plane {
+	uint32_t id;
+	uint32_t possible_crtcs;
+	/* atomic modesetting property ids, all 0 if the plane has none */
+	uint32_t props[PLANE_NUM_PROPS];
+	/* what it can show */
+	uint32_t *formats;
+	uint32_t count_formats;
+	/* the zpos property, if we can set it, and its range */
+	uint32_t zpos_prop;
+	uint64_t zpos_min;
+	uint64_t zpos_max;
+	/* who has the plane, NULL if it is free, and what it shows where */
+	void *owner;
+	xf86CrtcPtr crtc;
+	uint32_t fb_id;
+	uint32_t src[4];
+	BoxRec dst;
+	/* that is waiting for the crtc's flip or commit, whether it needs the
+	 * zpos, and its event, see drmmode_planes_flush() */
+	Bool queued;
+	Bool queued_zpos;
+	OMAPDRMEventPtr queued_event;
+} drmmode_plane_rec, *drmmode_plane_ptr;
+
+enum drmmode_crtc_prop {
+	CRTC_ACTIVE,
+	CRTC_MODE_ID,
+	CRTC_NUM_PROPS,
+};
+
+static const char *const drmmode_crtc_prop_names[CRTC_NUM_PROPS] = {
+	"ACTIVE", "MODE_ID",
+};
+
+/* Cursor images each crtc keeps around, see drmmode_load_cursor_argb() */
+#define DRMMODE_CURSOR_CACHE	4
+
+typedef struct {
+	struct omap_bo *bo;
+	/* a copy of the image in it, its size and hash, and when it was last
+	 * loaded */
+	CARD32 *image;
+	int width;
+	int height;
+	uint32_t hash;
+	unsigned int used;
+} drmmode_cursor_rec, *drmmode_cursor_ptr;
+
 typedef struct {
 	drmmode_ptr drmmode;
 	uint32_t id;
-	struct omap_bo *cursor_bo;
+	/* position in the crtc config */
+	int index;
+	/* hardware cursor images, the one loaded last, and whether it is
+	 * shown */
+	drmmode_cursor_rec cursors[DRMMODE_CURSOR_CACHE];
+	drmmode_cursor_ptr cursor;
+	Bool cursor_visible;
+	unsigned int cursor_clock;
+	/* cursor position not passed on yet, and when we last did, see
+	 * drmmode_set_cursor_position() */
+	int cursor_x;
+	int cursor_y;
+	Bool cursor_moved;
+	CARD32 cursor_time;
+	/* its per-crtc scanout, see drmmode_update_scanouts() */
+	OMAPScanoutPtr scanout;
+	/* flips and plane swaps queued for this crtc, see
+	 * drmmode_swap_queued() */
+	int pending_swaps;
+	/* a page flip has been submitted and not completed yet */
+	Bool flip_pending;
+	/* a non-blocking atomic mode transition has not completed yet */
+	Bool commit_pending;
+	/* mailbox flip waiting for the pending one, see drmmode_page_flip() */
+	uint32_t queued_fb_id;
+	OMAPDRMEventPtr queued_event;
+	/* the kernel's 32 bit frame counter, widened, see drmmode_crtc_msc() */
+	uint32_t msc_prev;
+	uint64_t msc_high;
+	/* not set by us yet, see drmmode_set_crtc() */
+	Bool first_modeset;
+	/* frame and timestamp of the last completed flip */
+	unsigned int last_frame;
+	unsigned int last_tv_sec;
+	unsigned int last_tv_usec;
+	/* atomic modesetting: primary plane and cached property ids */
+	uint32_t plane_id;
+	uint32_t plane_props[PLANE_NUM_PROPS];
+	uint32_t crtc_props[CRTC_NUM_PROPS];
+	/* the cursor plane and its CRTC_X and CRTC_Y property ids, 0 if
+	 * there is none */
+	uint32_t cursor_plane;
+	uint32_t cursor_props[2];
+	uint32_t mode_blob_id;
+	/* explicit fencing, 0 if the kernel has none */
+	uint32_t in_fence_prop;
+	uint32_t out_fence_prop;
+	/* where the kernel puts the out-fence of an atomic flip */
+	int32_t out_fence;
+	/* bo last flipped to with an atomic commit, which holds a ref */
+	struct omap_bo *flip_bo;
+	/* TearFree and software rotation: front (shown) and back copies of
+	 * the crtc's part of the root, and what each is missing, in root
+	 * coordinates, see drmmode_copies_update() */
+	struct omap_bo *copy_bo[2];
+	RegionRec copy_damage[2];
+	/* the "rotation" property of the primary plane, and the RR_Rotate_
+	 * and RR_Reflect_ bits it takes, which are the DRM ones too */
+	uint32_t rotation_plane;
+	uint32_t rotation_prop;
+	uint64_t rotation_set;
+	Rotation rotations;
+	/* the current rotation is done by the plane, or by us in the copies */
+	Bool hw_rotate;
+	Bool sw_rotate;
+	/* the bo behind the xf86 shadow of other transforms */
+	struct omap_bo *rotate_bo;
+	/* DIRTYFB: root damage not reported yet, and when we last did */
+	RegionRec dirty;
+	CARD32 dirty_time;
 } drmmode_crtc_private_rec, *drmmode_crtc_private_ptr;
 
+/*
+ * User data of the flips and commits we submit.  An atomic commit spanning
+ * several crtcs gets one event per crtc, all with the same user data.
+ */
+typedef struct {
+	OMAPDRMEvent event;
+	ScrnInfoPtr pScrn;
+	/* the caller's event, called once per crtc; NULL for our own commits */
+	OMAPDRMEventPtr user;
+	/* crtcs in the flip, by index, and how many have still to complete */
+	uint32_t crtc_mask;
+	int count;
+} drmmode_flip_rec, *drmmode_flip_ptr;
+
 typedef struct {
 	drmModePropertyPtr mode_prop;
 	int index; /* Index within the kernel-side property arrays for
@@ -110,6 +302,9 @@ typedef struct {
 	int num_atoms; /* if range prop, num_atoms == 1; if enum prop,
 	 * num_atoms == num_enums + 1 */
 	Atom *atoms;
+	/* last value read or set, until the next uevent */
+	uint64_t value;
+	Bool value_valid;
 } drmmode_prop_rec, *drmmode_prop_ptr;
 
 typedef struct {
@@ -117,12 +312,20 @@ typedef struct {
 	int id;
 	drmModeConnectorPtr mode_output;
 	drmModePropertyBlobPtr edid_blob;
+	uint32_t edid_id;
+	/* the connector's modes, kept until the connector changes */
+	DisplayModePtr modes;
+	Bool modes_stale;
 	uint32_t dpms_id;
+	/* atomic modesetting: the connector's CRTC_ID property */
+	uint32_t crtc_id_prop;
 	int num_props;
 	drmmode_prop_ptr props;
 } drmmode_output_private_rec, *drmmode_output_private_ptr;
 
 static void drmmode_output_dpms(xf86OutputPtr output, int mode);
+static int drmmode_crtc_flip(xf86CrtcPtr crtc, uint32_t fb_id,
+		OMAPDRMEventPtr user, Bool async);
 
 static uint32_t
 drmmode_get_prop_id(int fd, uint32_t count_props, const uint32_t props[],
@@ -143,12 +346,101 @@ drmmode_get_prop_id(int fd, uint32_t count_props, const uint32_t props[],
 	return prop_id;
 }
 
+/*
+ * Look up the ids of the named properties of a KMS object.  Returns FALSE
+ * unless all of them were found.
+ */
+static Bool
+drmmode_get_prop_ids(int fd, uint32_t obj_id, uint32_t obj_type,
+		const char *const names[], uint32_t ids[], int count)
+{
+	drmModeObjectPropertiesPtr props;
+	uint32_t i;
+	int j, found = 0;
+
+	props = drmModeObjectGetProperties(fd, obj_id, obj_type);
+	if (!props)
+		return FALSE;
+
+	for (i = 0; i < props->count_props; i++) {
+		drmModePropertyPtr prop = drmModeGetProperty(fd, props->props[i]);
+		if (!prop)
+			continue;
+		for (j = 0; j < count; j++) {
+			if (!strcmp(prop->name, names[j])) {
+				ids[j] = prop->prop_id;
+				found++;
+			}
+		}
+		drmModeFreeProperty(prop);
+	}
+	drmModeFreeObjectProperties(props);
+
+	return found == count;
+}
+
+/* Returns the value of a KMS object's property, or @def if it has none */
+static uint64_t
+drmmode_get_prop_value(int fd, uint32_t obj_id, uint32_t obj_type,
+		const char *name, uint64_t def)
+{
+	drmModeObjectPropertiesPtr props;
+	uint64_t value = def;
+	uint32_t i;
+
+	props = drmModeObjectGetProperties(fd, obj_id, obj_type);
+	if (!props)
+		return def;
+
+	for (i = 0; i < props->count_props; i++) {
+		drmModePropertyPtr prop = drmModeGetProperty(fd, props->props[i]);
+		if (!prop)
+			continue;
+		if (!strcmp(prop->name, name))
+			value = props->prop_values[i];
+		drmModeFreeProperty(prop);
+	}
+	drmModeFreeObjectProperties(props);
+
+	return value;
+}
+
+/*
+ * The part of the root @crtc shows.  Rotated or otherwise transformed, that
+ * is the bounds xf86CrtcRotate() worked out.
+ */
+static void
+drmmode_crtc_box(xf86CrtcPtr crtc, BoxPtr box)
+{
+	if (crtc->transform_in_use) {
+		*box = crtc->bounds;
+		return;
+	}
+	box->x1 = crtc->x;
+	box->y1 = crtc->y;
+	box->x2 = crtc->x + crtc->mode.HDisplay;
+	box->y2 = crtc->y + crtc->mode.VDisplay;
+}
+
+/*
+ * Returns TRUE if @crtc shows the root through a transformed copy, ours or
+ * the xf86 shadow, so it can neither scan out nor flip to anything else.
+ */
+static Bool
+drmmode_crtc_transformed(xf86CrtcPtr crtc)
+{
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+
+	return drmmode_crtc->sw_rotate || crtc->rotatedData;
+}
+
+/* Find the scanout with this geometry in @scanouts, of @num entries */
 static OMAPScanoutPtr
-drmmode_scanout_from_size(OMAPScanoutPtr scanouts, int x, int y, int width,
-		int height)
+drmmode_scanout_from_size(OMAPScanoutPtr scanouts, int num, int x, int y,
+		int width, int height)
 {
 	int i;
-	for (i = 0; i < MAX_SCANOUTS; i++) {
+	for (i = 0; i < num; i++) {
 		if (scanouts[i].x == x && scanouts[i].y == y &&
 		    scanouts[i].width == width && scanouts[i].height == height)
 			return &scanouts[i];
@@ -157,49 +449,99 @@ drmmode_scanout_from_size(OMAPScanoutPtr scanouts, int x, int y, int width,
 }
 
 static OMAPScanoutPtr
-drmmode_scanout_from_crtc(OMAPScanoutPtr scanouts, xf86CrtcPtr crtc)
+drmmode_scanout_from_crtc(xf86CrtcPtr crtc)
 {
-	return drmmode_scanout_from_size(scanouts, crtc->x, crtc->y,
-			crtc->mode.HDisplay, crtc->mode.VDisplay);
-}
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
 
-OMAPScanoutPtr
-drmmode_scanout_from_drawable(OMAPScanoutPtr scanouts, DrawablePtr pDraw)
-{
-	return drmmode_scanout_from_size(scanouts, pDraw->x, pDraw->y,
-			pDraw->width, pDraw->height);
+	return drmmode_crtc->scanout;
 }
 
+/* The span scanout, if the crtc layout has one */
 static OMAPScanoutPtr
-drmmode_scanout_add(OMAPScanoutPtr scanouts, xf86CrtcPtr crtc,
-		struct omap_bo *bo)
+drmmode_span_scanout(OMAPPtr pOMAP)
 {
 	int i;
-	for (i = 0; i < MAX_SCANOUTS; i++) {
-		OMAPScanoutPtr s = &scanouts[i];
 
-		if (s->bo)
-			continue;
+	for (i = 0; i < pOMAP->num_scanouts; i++)
+		if (pOMAP->scanouts[i].span)
+			return &pOMAP->scanouts[i];
+	return NULL;
+}
 
-		omap_bo_reference(bo);
-		s->x = crtc->x;
-		s->y = crtc->y;
-		s->width = crtc->mode.HDisplay;
-		s->height = crtc->mode.VDisplay;
-		s->bo = bo;
-		return s;
+/* Give the span scanout its root sized bo, if it has none yet */
+static Bool
+drmmode_span_scanout_alloc(ScrnInfoPtr pScrn)
+{
+	OMAPPtr pOMAP = OMAPPTR(pScrn);
+	OMAPScanoutPtr scanout = drmmode_span_scanout(pOMAP);
+
+	if (!scanout)
+		return FALSE;
+	if (scanout->bo)
+		return TRUE;
+
+	scanout->bo = omap_bo_new_with_depth(pOMAP->dev, scanout->width,
+			scanout->height, pScrn->depth, pScrn->bitsPerPixel);
+	if (!scanout->bo) {
+		ERROR_MSG("Span scanout buffer allocation failed");
+		return FALSE;
 	}
+	scanout->valid = FALSE;
+	return TRUE;
+}
+
+/* Returns TRUE if @pDraw covers the whole root, and so all crtcs */
+static Bool
+drmmode_drawable_spans(ScrnInfoPtr pScrn, DrawablePtr pDraw)
+{
+	return pDraw->x == 0 && pDraw->y == 0 &&
+	       pDraw->width == pScrn->virtualX &&
+	       pDraw->height == pScrn->virtualY;
+}
+
+/*
+ * A drawable matching a crtc exactly gets the crtc's scanout, one covering
+ * the root of a multi-crtc layout the span scanout.
+ */
+OMAPScanoutPtr
+drmmode_scanout_from_drawable(ScrnInfoPtr pScrn, DrawablePtr pDraw)
+{
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+	int index = drmmode_crtc_index_from_drawable(pScrn, pDraw);
 
+	if (index != -1)
+		return drmmode_scanout_from_crtc(xf86_config->crtc[index]);
+	if (drmmode_drawable_spans(pScrn, pDraw))
+		return drmmode_span_scanout(OMAPPTR(pScrn));
 	return NULL;
 }
 
+/* Append a scanout for @crtc to @scanouts, which has room for it */
+static OMAPScanoutPtr
+drmmode_scanout_add(OMAPScanoutPtr scanouts, int *num, xf86CrtcPtr crtc,
+		struct omap_bo *bo)
+{
+	OMAPScanoutPtr s = &scanouts[(*num)++];
+	BoxRec box;
+
+	drmmode_crtc_box(crtc, &box);
+	omap_bo_reference(bo);
+	s->x = box.x1;
+	s->y = box.y1;
+	s->width = box.x2 - box.x1;
+	s->height = box.y2 - box.y1;
+	s->bo = bo;
+	return s;
+}
+
 void
-drmmode_scanout_set(OMAPScanoutPtr scanouts, int x, int y, struct omap_bo *bo)
+drmmode_scanout_set(ScrnInfoPtr pScrn, int x, int y, struct omap_bo *bo)
 {
+	OMAPPtr pOMAP = OMAPPTR(pScrn);
 	OMAPScanoutPtr s;
 
-	s = drmmode_scanout_from_size(scanouts, x, y, omap_bo_width(bo),
-			omap_bo_height(bo));
+	s = drmmode_scanout_from_size(pOMAP->scanouts, pOMAP->num_scanouts,
+			x, y, omap_bo_width(bo), omap_bo_height(bo));
 	if (!s) {
 		/* The scanout may not exist after flip, just ignore */
 		return;
@@ -220,22 +562,61 @@ int drmmode_crtc_index_from_drawable(ScrnInfoPtr pScrn, DrawablePtr pDraw)
 {
 	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
 	xf86CrtcPtr crtc;
-	DisplayModePtr mode;
+	BoxRec box;
 	int i;
 
 	for (i = 0; i < xf86_config->num_crtc; i++) {
 		crtc = xf86_config->crtc[i];
 		if (!crtc->enabled)
 			continue;
-		mode = &crtc->mode;
-		if (crtc->x == pDraw->x && crtc->y == pDraw->y &&
-		    mode->HDisplay == pDraw->width &&
-		    mode->VDisplay == pDraw->height)
+		drmmode_crtc_box(crtc, &box);
+		if (box.x1 == pDraw->x && box.y1 == pDraw->y &&
+		    box.x2 - box.x1 == pDraw->width &&
+		    box.y2 - box.y1 == pDraw->height)
 			return i;
 	}
 	return -1;
 }
 
+/*
+ * Returns the index of the enabled crtc showing the largest part of a
+ * window, or -1 if the drawable is not a window or is not visible on any
+ * crtc.  Unlike drmmode_crtc_index_from_drawable(), the window need not
+ * match the crtc geometry, so this is the crtc to sync windowed blits to.
+ */
+int drmmode_crtc_index_covering_drawable(ScrnInfoPtr pScrn, DrawablePtr pDraw)
+{
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+	int i, best = -1, best_area = 0;
+
+	if (pDraw->type != DRAWABLE_WINDOW)
+		return -1;
+
+	for (i = 0; i < xf86_config->num_crtc; i++) {
+		xf86CrtcPtr crtc = xf86_config->crtc[i];
+		int x1, y1, x2, y2, area;
+		BoxRec box;
+
+		if (!crtc->enabled)
+			continue;
+
+		drmmode_crtc_box(crtc, &box);
+		x1 = max(pDraw->x, box.x1);
+		y1 = max(pDraw->y, box.y1);
+		x2 = min(pDraw->x + pDraw->width, box.x2);
+		y2 = min(pDraw->y + pDraw->height, box.y2);
+		if (x2 <= x1 || y2 <= y1)
+			continue;
+
+		area = (x2 - x1) * (y2 - y1);
+		if (area > best_area) {
+			best_area = area;
+			best = i;
+		}
+	}
+	return best;
+}
+
 int drmmode_crtc_id_from_drawable(ScrnInfoPtr pScrn, DrawablePtr pDraw)
 {
 	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
@@ -259,6 +640,27 @@ drmmode_from_scrn(ScrnInfoPtr pScrn)
 	return drmmode_crtc->drmmode;
 }
 
+/*
+ * Can @pDraw be flipped in blit mode, to a bo of its own size?  Legacy flips
+ * keep the offset each crtc scans out from there, see
+ * drmmode_set_blit_crtc(), so a bo the size of one crtc only fits if that
+ * crtc is at (0, 0).  Atomic flips set the offset, but async ones are always
+ * legacy.
+ */
+Bool
+drmmode_blit_mode_can_flip(ScrnInfoPtr pScrn, DrawablePtr pDraw, Bool async)
+{
+	OMAPScanoutPtr scanout = drmmode_scanout_from_drawable(pScrn, pDraw);
+
+	if (!scanout)
+		return FALSE;
+	if (scanout->span)
+		return TRUE;
+	if (drmmode_from_scrn(pScrn)->atomic && !async)
+		return TRUE;
+	return scanout->x == 0 && scanout->y == 0;
+}
+
 static void
 drmmode_ConvertFromKMode(ScrnInfoPtr pScrn, drmModeModeInfo *kmode,
 		DisplayModePtr	mode)
@@ -342,1455 +744,4315 @@ drmmode_set_crtc_off(xf86CrtcPtr crtc)
 	return (rc) ? FALSE : TRUE;
 }
 
-static Bool
-drmmode_set_crtc(ScrnInfoPtr pScrn, xf86CrtcPtr crtc, struct omap_bo *bo, int x,
-			int y)
-{
-	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
-	xf86OutputPtr output;
-	drmmode_crtc_private_ptr drmmode_crtc;
-	drmmode_output_private_ptr drmmode_output;
-	int rc, output_count, i;
-	uint32_t *output_ids = NULL;
-	uint32_t fb_id;
-	uint32_t crtc_id = drmmode_crtc_id(crtc);
-	drmModeModeInfo kmode;
-	Bool ret;
+/*
+ * Rotation
+ *
+ * RandR rotations and reflections are done by the primary plane where its
+ * "rotation" property takes them.  Otherwise the crtc gets its own copies of
+ * its part of the root, which we rotate into, see drmmode_copies_update().
+ * Either way xf86 leaves the output to us and only turns the cursor.  Any
+ * other transform goes through the xf86 shadow, in a bo of ours.
+ */
 
-	output_ids = calloc(xf86_config->num_output, sizeof *output_ids);
-	assert(output_ids);
+/* xorg-server 1.16 lets the driver transform the output alone */
+#if GET_ABI_MAJOR(ABI_VIDEODRV_VERSION) >= 18
+#define DRMMODE_ROTATE 1
+#endif
 
-	output_count = 0;
-	for (i = 0; i < xf86_config->num_output; i++) {
-		output = xf86_config->output[i];
-		drmmode_output = output->driver_private;
+/* Returns the id of the @type plane of crtc @num, 0 if it has none */
+static uint32_t
+drmmode_crtc_plane(int fd, const drmModePlaneResPtr plane_res, int num,
+		uint64_t type)
+{
+	uint32_t i;
 
-		if (output->crtc != crtc)
-			continue;
+	for (i = 0; i < plane_res->count_planes; i++) {
+		uint32_t plane_id = plane_res->planes[i];
+		drmModePlanePtr plane = drmModeGetPlane(fd, plane_id);
+		Bool match;
 
-		output_ids[output_count] = drmmode_output->id;
-		output_count++;
+		if (!plane)
+			continue;
+		match = (plane->possible_crtcs & (1 << num)) &&
+			drmmode_get_prop_value(fd, plane_id,
+					DRM_MODE_OBJECT_PLANE, "type",
+					DRM_PLANE_TYPE_OVERLAY) == type;
+		drmModeFreePlane(plane);
+		if (match)
+			return plane_id;
 	}
-	if (!output_count) {
-		ERROR_MSG("[CRTC:%u] No outputs found", crtc_id);
-		ret = FALSE;
-		goto out;
+	return 0;
+}
+
+/* Find out which rotations the primary plane of crtc @num can do */
+static void
+drmmode_rotation_init(ScrnInfoPtr pScrn,
+		drmmode_crtc_private_ptr drmmode_crtc,
+		const drmModePlaneResPtr plane_res, int num)
+{
+	int fd = drmmode_crtc->drmmode->fd;
+	drmModeObjectPropertiesPtr props;
+	uint32_t plane_id, i;
+	int j;
+
+	plane_id = drmmode_crtc_plane(fd, plane_res, num,
+			DRM_PLANE_TYPE_PRIMARY);
+	if (!plane_id)
+		return;
+	props = drmModeObjectGetProperties(fd, plane_id, DRM_MODE_OBJECT_PLANE);
+	if (!props)
+		return;
+
+	for (i = 0; i < props->count_props; i++) {
+		drmModePropertyPtr prop = drmModeGetProperty(fd, props->props[i]);
+
+		if (!prop)
+			continue;
+		if (!strcmp(prop->name, "rotation") &&
+		    (prop->flags & DRM_MODE_PROP_BITMASK)) {
+			drmmode_crtc->rotation_prop = prop->prop_id;
+			/* the enums hold bit numbers */
+			for (j = 0; j < prop->count_enums; j++)
+				if (prop->enums[j].value < 6)
+					drmmode_crtc->rotations |=
+						1 << prop->enums[j].value;
+		}
+		drmModeFreeProperty(prop);
 	}
+	drmModeFreeObjectProperties(props);
 
-	drmmode_ConvertToKMode(pScrn, &kmode, &crtc->mode);
+	if (!drmmode_crtc->rotation_prop)
+		return;
+	drmmode_crtc->rotation_plane = plane_id;
+	INFO_MSG("[CRTC:%u] [PLANE:%u] rotations 0x%x", drmmode_crtc->id,
+			plane_id, drmmode_crtc->rotations);
+}
 
-	drmmode_crtc = crtc->driver_private;
-	fb_id = omap_bo_fb(bo);
-	/* drmModeSetCrtc returns non-zero on error; convert to Bool */
-	rc = drmModeSetCrtc(drmmode_crtc->drmmode->fd, crtc_id, fb_id, x, y,
-			output_ids, output_count, &kmode);
-	if (rc)
-		ERROR_MSG("[CRTC:%u] failed to set mode with [FB:%u] @ (%d, %d): %s",
-				crtc_id, fb_id, x, y, strerror(errno));
-	ret = rc ? FALSE : TRUE;
+/* What the "rotation" property of the primary plane of @crtc should say */
+static uint64_t
+drmmode_plane_rotation(xf86CrtcPtr crtc)
+{
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
 
-out:
-	free(output_ids);
-	return ret;
+	return drmmode_crtc->hw_rotate ? crtc->rotation : RR_Rotate_0;
 }
 
-/*
- * Copy region of @src starting at (@src_x, @src_y) to @dst at (@dst_x, dst_y).
- * This function does no conversions, so it assumes same src and dst bpp.
- *  @src         source buffer
- *  @src_x       x coordinate from which to start copying
- *  @src_y       y coordinate from which to start copying
- *  @src_width   max number of pixels per src row to copy
- *  @src_height  max number of src rows to copy
- *  @src_pitch   total length of each src row, in bytes
- *  @src_cpp     bytes (ie, chars) per pixel of source
- *  @dst         destination buffer
- *  @dst_x       x coordinate to which to start copying
- *  @dst_y       y coordinate to which to start copying
- *  @dst_width   max number of pixels per dst row to copy
- *  @dst_height  max number of dst rows to copy
- *  @dst_pitch   total length of each dst row, in bytes
- *  @dst_cpp     bytes (ie, chars) per pixel of dst, must be same as src_cpp
- */
+/* Legacy modesets leave the rotation of the plane to us */
 static void
-drmmode_copy_from_to(const uint8_t *src, int src_x, int src_y, int src_width,
-		     int src_height, int src_pitch, int src_cpp,
-		     uint8_t *dst, int dst_x, int dst_y, int dst_width,
-		     int dst_height, int dst_pitch, int dst_cpp)
+drmmode_set_plane_rotation(xf86CrtcPtr crtc)
 {
-	int y;
-	int src_x_start = max(dst_x - src_x, 0);
-	int dst_x_start = max(src_x - dst_x, 0);
-	int src_y_start = max(dst_y - src_y, 0);
-	int dst_y_start = max(src_y - dst_y, 0);
-	int width = min(src_width - src_x_start, dst_width - dst_x_start);
-	int height = min(src_height - src_y_start, dst_height - dst_y_start);
-
+	ScrnInfoPtr pScrn = crtc->scrn;
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	uint64_t rotation = drmmode_plane_rotation(crtc);
 
-	assert(src_cpp == dst_cpp);
+	if (!drmmode_crtc->rotation_prop ||
+	    drmmode_crtc->rotation_set == rotation)
+		return;
 
-	if (width <= 0 || height <= 0)
+	if (drmModeObjectSetProperty(drmmode_crtc->drmmode->fd,
+			drmmode_crtc->rotation_plane, DRM_MODE_OBJECT_PLANE,
+			drmmode_crtc->rotation_prop, rotation)) {
+		ERROR_MSG("[PLANE:%u] rotation 0x%x failed: %s",
+				drmmode_crtc->rotation_plane,
+				(unsigned int)rotation, strerror(errno));
 		return;
+	}
+	drmmode_crtc->rotation_set = rotation;
+}
+
+/*
+ * Decide how to do the rotation of @crtc, before xf86CrtcRotate() does its
+ * part.  A transform on top of it goes to xf86.
+ */
+static void
+drmmode_crtc_init_rotation(xf86CrtcPtr crtc)
+{
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
 
-	src += src_y_start * src_pitch + src_x_start * src_cpp;
-	dst += dst_y_start * dst_pitch + dst_x_start * src_cpp;
+	drmmode_crtc->hw_rotate = FALSE;
+	drmmode_crtc->sw_rotate = FALSE;
+#ifdef DRMMODE_ROTATE
+	crtc->driverIsPerformingTransform = XF86DriverTransformNone;
+	if (crtc->rotation == RR_Rotate_0 || crtc->transformPresent)
+		return;
 
-	for (y = 0; y < height; y++, src += src_pitch, dst += dst_pitch)
-		memcpy(dst, src, width * dst_cpp);
+	if (drmmode_crtc->rotation_prop &&
+	    !(crtc->rotation & ~drmmode_crtc->rotations))
+		drmmode_crtc->hw_rotate = TRUE;
+	else
+		drmmode_crtc->sw_rotate = TRUE;
+	crtc->driverIsPerformingTransform = XF86DriverTransformOutput;
+#endif
 }
 
 /*
- * Copy region of src buffer located at (src_x, src_y) that overlaps the dst
- * buffer at dst_x, dst_y.
- * This function does no conversions, so it assumes same bpp and depth.
- * It also assumes the two regions are non-overlapping memory areas, even though
- * they may overlap in pixel space.
+ * Atomic modesetting
+ *
+ * With Option "Atomic" and a kernel supporting it, modesets, the switches
+ * between blit and flip mode and page flips go through atomic commits on the
+ * primary plane of each crtc.  Each is validated with a TEST_ONLY commit
+ * first, and whatever the kernel won't take falls back to the legacy ioctls.
  */
+
+/* Find the primary plane of crtc @num and cache the property ids we need. */
 static Bool
-drmmode_copy_bo(ScrnInfoPtr pScrn, struct omap_bo *src_bo, int src_x, int src_y,
-		struct omap_bo *dst_bo, int dst_x, int dst_y)
+drmmode_atomic_init_crtc(ScrnInfoPtr pScrn,
+		drmmode_crtc_private_ptr drmmode_crtc,
+		const drmModePlaneResPtr plane_res, int num)
 {
-	void *dst;
-	const void *src;
-
-	if (!src_bo || !dst_bo) {
-		ERROR_MSG("copy_bo received invalid arguments");
+	static const char *const in_fence_name = "IN_FENCE_FD";
+	static const char *const out_fence_name = "OUT_FENCE_PTR";
+	int fd = drmmode_crtc->drmmode->fd;
+	uint32_t plane_id;
+
+	if (!drmmode_get_prop_ids(fd, drmmode_crtc->id, DRM_MODE_OBJECT_CRTC,
+			drmmode_crtc_prop_names, drmmode_crtc->crtc_props,
+			CRTC_NUM_PROPS))
 		return FALSE;
-	}
 
-	assert(omap_bo_bpp(src_bo) == omap_bo_bpp(dst_bo));
-
-	src = omap_bo_map(src_bo);
-	if (!src) {
-		ERROR_MSG("Couldn't map src bo");
-		return FALSE;
-	}
-	dst = omap_bo_map(dst_bo);
-	if (!dst) {
-		ERROR_MSG("Couldn't map dst bo");
+	plane_id = drmmode_crtc_plane(fd, plane_res, num,
+			DRM_PLANE_TYPE_PRIMARY);
+	if (!plane_id || !drmmode_get_prop_ids(fd, plane_id,
+			DRM_MODE_OBJECT_PLANE, drmmode_plane_prop_names,
+			drmmode_crtc->plane_props, PLANE_NUM_PROPS))
 		return FALSE;
+	drmmode_crtc->plane_id = plane_id;
+
+	/* optional, cursor moves go with the flips if it is there */
+	drmmode_crtc->cursor_plane = drmmode_crtc_plane(fd, plane_res, num,
+			DRM_PLANE_TYPE_CURSOR);
+	if (drmmode_crtc->cursor_plane && !drmmode_get_prop_ids(fd,
+			drmmode_crtc->cursor_plane, DRM_MODE_OBJECT_PLANE,
+			&drmmode_plane_prop_names[PLANE_CRTC_X],
+			drmmode_crtc->cursor_props, 2))
+		drmmode_crtc->cursor_plane = 0;
+
+	/* optional, fences are only used if both are there */
+	if (!drmmode_get_prop_ids(fd, drmmode_crtc->plane_id,
+			DRM_MODE_OBJECT_PLANE, &in_fence_name,
+			&drmmode_crtc->in_fence_prop, 1) ||
+	    !drmmode_get_prop_ids(fd, drmmode_crtc->id, DRM_MODE_OBJECT_CRTC,
+			&out_fence_name, &drmmode_crtc->out_fence_prop, 1))
+		drmmode_crtc->in_fence_prop = drmmode_crtc->out_fence_prop = 0;
+
+	DEBUG_MSG("[CRTC:%u] primary [PLANE:%u]%s", drmmode_crtc->id,
+			drmmode_crtc->plane_id,
+			drmmode_crtc->out_fence_prop ? " fenced" : "");
+	return TRUE;
+}
+
+/* Scan out @fb_id from (@x, @y) on the whole of @crtc */
+static void
+drmmode_atomic_add_plane(drmModeAtomicReqPtr req, xf86CrtcPtr crtc,
+		uint32_t fb_id, int x, int y)
+{
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	uint32_t plane_id = drmmode_crtc->plane_id;
+	const uint32_t *props = drmmode_crtc->plane_props;
+	uint32_t w = crtc->mode.HDisplay, h = crtc->mode.VDisplay;
+	uint32_t src_w = w, src_h = h;
+
+	/* the plane turns what it reads, so it reads it turned */
+	if (drmmode_crtc->rotation_prop &&
+	    drmmode_crtc->rotation_plane == plane_id) {
+		drmModeAtomicAddProperty(req, plane_id,
+				drmmode_crtc->rotation_prop,
+				drmmode_plane_rotation(crtc));
+		if (drmmode_crtc->hw_rotate &&
+		    (crtc->rotation & (RR_Rotate_90 | RR_Rotate_270))) {
+			src_w = h;
+			src_h = w;
+		}
 	}
 
-	// acquire for write first, so if (probably impossible) src==dst acquire
-	// for read can succeed
-	omap_bo_cpu_prep(dst_bo, OMAP_GEM_WRITE);
-	omap_bo_cpu_prep(src_bo, OMAP_GEM_READ);
+	drmModeAtomicAddProperty(req, plane_id, props[PLANE_FB_ID], fb_id);
+	drmModeAtomicAddProperty(req, plane_id, props[PLANE_CRTC_ID],
+			drmmode_crtc->id);
+	drmModeAtomicAddProperty(req, plane_id, props[PLANE_SRC_X],
+			(uint64_t)x << 16);
+	drmModeAtomicAddProperty(req, plane_id, props[PLANE_SRC_Y],
+			(uint64_t)y << 16);
+	drmModeAtomicAddProperty(req, plane_id, props[PLANE_SRC_W],
+			(uint64_t)src_w << 16);
+	drmModeAtomicAddProperty(req, plane_id, props[PLANE_SRC_H],
+			(uint64_t)src_h << 16);
+	drmModeAtomicAddProperty(req, plane_id, props[PLANE_CRTC_X], 0);
+	drmModeAtomicAddProperty(req, plane_id, props[PLANE_CRTC_Y], 0);
+	drmModeAtomicAddProperty(req, plane_id, props[PLANE_CRTC_W], w);
+	drmModeAtomicAddProperty(req, plane_id, props[PLANE_CRTC_H], h);
+}
 
-	drmmode_copy_from_to(src, src_x, src_y,
-			     omap_bo_width(src_bo), omap_bo_height(src_bo),
-			     omap_bo_pitch(src_bo), omap_bo_Bpp(src_bo),
-			     dst, dst_x, dst_y,
-			     omap_bo_width(dst_bo), omap_bo_height(dst_bo),
-			     omap_bo_pitch(dst_bo), omap_bo_Bpp(dst_bo));
+/* Validate @req, and only then commit it for real */
+static int
+drmmode_atomic_commit(int fd, drmModeAtomicReqPtr req, uint32_t flags,
+		void *user_data)
+{
+	int ret;
 
-	omap_bo_cpu_fini(src_bo, 0);
-	omap_bo_cpu_fini(dst_bo, 0);
+	ret = drmModeAtomicCommit(fd, req, flags | DRM_MODE_ATOMIC_TEST_ONLY,
+			NULL);
+	if (ret)
+		return ret;
+	return drmModeAtomicCommit(fd, req, flags, user_data);
+}
 
-	return TRUE;
+/* The crtc the kernel has @output on, 0 if none or unknown */
+static uint32_t
+drmmode_output_kernel_crtc(xf86OutputPtr output)
+{
+	drmmode_output_private_ptr drmmode_output = output->driver_private;
+	drmModeObjectPropertiesPtr props;
+	uint32_t i, crtc_id = 0;
+
+	props = drmModeObjectGetProperties(drmmode_output->drmmode->fd,
+			drmmode_output->id, DRM_MODE_OBJECT_CONNECTOR);
+	if (!props)
+		return 0;
+	for (i = 0; i < props->count_props; i++)
+		if (props->props[i] == drmmode_output->crtc_id_prop)
+			crtc_id = props->prop_values[i];
+	drmModeFreeObjectProperties(props);
+	return crtc_id;
 }
 
-static Bool drmmode_set_blit_crtc(ScrnInfoPtr pScrn, xf86CrtcPtr crtc)
+/* Returns 0 on success, otherwise the error of the failed commit */
+static int
+drmmode_atomic_set_crtc(xf86CrtcPtr crtc, drmModeModeInfo *kmode,
+		uint32_t fb_id, int x, int y)
 {
-	OMAPPtr pOMAP = OMAPPTR(pScrn);
-	Bool ret;
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(crtc->scrn);
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	int fd = drmmode_crtc->drmmode->fd;
+	drmModeAtomicReqPtr req;
+	uint32_t blob_id;
+	int i, ret;
 
-	if (!crtc->enabled)
-		return TRUE;
+	if (drmModeCreatePropertyBlob(fd, kmode, sizeof(*kmode), &blob_id))
+		return -errno;
 
-	ret = drmmode_set_crtc(pScrn, crtc, pOMAP->scanout, crtc->x, crtc->y);
-	if (!ret) {
-		ERROR_MSG("[CRTC:%u] set root scanout failed",
-				drmmode_crtc_id(crtc));
-		drmmode_set_crtc_off(crtc);
+	req = drmModeAtomicAlloc();
+	if (!req) {
+		drmModeDestroyPropertyBlob(fd, blob_id);
+		return -ENOMEM;
 	}
 
-	return ret;
+	drmModeAtomicAddProperty(req, drmmode_crtc->id,
+			drmmode_crtc->crtc_props[CRTC_MODE_ID], blob_id);
+	drmModeAtomicAddProperty(req, drmmode_crtc->id,
+			drmmode_crtc->crtc_props[CRTC_ACTIVE], 1);
+	for (i = 0; i < xf86_config->num_output; i++) {
+		xf86OutputPtr output = xf86_config->output[i];
+		drmmode_output_private_ptr drmmode_output =
+				output->driver_private;
+
+		if (output->crtc == crtc)
+			drmModeAtomicAddProperty(req, drmmode_output->id,
+					drmmode_output->crtc_id_prop,
+					drmmode_crtc->id);
+		/* let go of the outputs that moved away or were turned off,
+		 * or the kernel keeps them here or rejects the commit */
+		else if (drmmode_output_kernel_crtc(output) == drmmode_crtc->id)
+			drmModeAtomicAddProperty(req, drmmode_output->id,
+					drmmode_output->crtc_id_prop, 0);
+	}
+	drmmode_atomic_add_plane(req, crtc, fb_id, x, y);
+
+	ret = drmmode_atomic_commit(fd, req, DRM_MODE_ATOMIC_ALLOW_MODESET,
+			NULL);
+	drmModeAtomicFree(req);
+	if (ret) {
+		drmModeDestroyPropertyBlob(fd, blob_id);
+		return ret;
+	}
+
+	if (drmmode_crtc->mode_blob_id)
+		drmModeDestroyPropertyBlob(fd, drmmode_crtc->mode_blob_id);
+	drmmode_crtc->mode_blob_id = blob_id;
+	return 0;
 }
 
-static Bool drmmode_set_flip_crtc(ScrnInfoPtr pScrn, xf86CrtcPtr crtc)
-{
-	OMAPPtr pOMAP = OMAPPTR(pScrn);
-	OMAPScanoutPtr scanout;
-	Bool ret;
+static void drmmode_flip_handler(OMAPDRMEventPtr event, unsigned int frame,
+		unsigned int tv_sec, unsigned int tv_usec);
 
-	if (!crtc->enabled)
-		return TRUE;
+/* Wait for the non-blocking mode transitions still in flight on the crtcs
+ * in @crtc_mask, by index.
+ */
+static void
+drmmode_wait_for_commits(ScrnInfoPtr pScrn, uint32_t crtc_mask)
+{
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+	int i;
 
-	scanout = drmmode_scanout_from_crtc(pOMAP->scanouts, crtc);
-	if (!scanout)
-		return TRUE;
+	for (i = 0; i < xf86_config->num_crtc; i++) {
+		drmmode_crtc_private_ptr drmmode_crtc =
+				xf86_config->crtc[i]->driver_private;
 
-	ret = drmmode_set_crtc(pScrn, crtc, scanout->bo, 0, 0);
-	if (!ret) {
-		ERROR_MSG("[CRTC:%u] set per-crtc scanout failed",
-				drmmode_crtc_id(crtc));
-		drmmode_set_crtc_off(crtc);
+		if (!(crtc_mask & (1 << i)))
+			continue;
+		while (drmmode_crtc->commit_pending)
+			drmmode_wait_for_event(pScrn);
 	}
-
-	return ret;
 }
 
-Bool drmmode_update_scanout_from_crtcs(ScrnInfoPtr pScrn)
+/* Mask of the crtcs, by index, which have a per-crtc scanout */
+static uint32_t
+drmmode_crtcs_with_scanout(ScrnInfoPtr pScrn)
 {
-	OMAPPtr pOMAP = OMAPPTR(pScrn);
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+	uint32_t crtc_mask = 0;
 	int i;
-	Bool res;
 
-	if (pOMAP->flip_mode == OMAP_FLIP_DISABLED)
+	for (i = 0; i < xf86_config->num_crtc; i++) {
+		drmmode_crtc_private_ptr drmmode_crtc =
+				xf86_config->crtc[i]->driver_private;
+
+		if (drmmode_crtc->scanout)
+			crtc_mask |= 1 << i;
+	}
+	return crtc_mask;
+}
+
+/*
+ * Returns TRUE if flipping @pDraw flips @crtc: the crtc shows exactly the
+ * drawable, or its part of a drawable covering the whole root.
+ */
+static Bool
+drmmode_crtc_in_drawable(xf86CrtcPtr crtc, DrawablePtr pDraw)
+{
+	BoxRec box;
+
+	if (!crtc->enabled || drmmode_crtc_transformed(crtc))
+		return FALSE;
+	if (drmmode_drawable_spans(crtc->scrn, pDraw))
 		return TRUE;
+	drmmode_crtc_box(crtc, &box);
+	return box.x1 == pDraw->x && box.y1 == pDraw->y &&
+	       box.x2 - box.x1 == pDraw->width &&
+	       box.y2 - box.y1 == pDraw->height;
+}
 
-	TRACE_ENTER();
+/* Mask of the crtcs, by index, which flipping @pDraw flips */
+uint32_t
+drmmode_crtcs_showing(ScrnInfoPtr pScrn, DrawablePtr pDraw)
+{
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+	uint32_t crtc_mask = 0;
+	int i;
 
-	/* Only copy if source is valid. */
-	for (i = 0; i < MAX_SCANOUTS; i++) {
-		OMAPScanoutPtr scanout = &pOMAP->scanouts[i];
+	for (i = 0; i < xf86_config->num_crtc; i++)
+		if (drmmode_crtc_in_drawable(xf86_config->crtc[i], pDraw))
+			crtc_mask |= 1 << i;
+	return crtc_mask;
+}
 
-		if (!scanout->bo)
-			continue;
-		if (!scanout->valid)
-			continue;
+/*
+ * Extend a frame counter value the kernel reported for @crtc to 64 bits, so
+ * that it keeps growing when the counter wraps.  A big step back is a wrap,
+ * a big step forward a value from before it.
+ */
+uint64_t
+drmmode_crtc_msc(xf86CrtcPtr crtc, uint32_t sequence)
+{
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
 
-		res = drmmode_copy_bo(pScrn, scanout->bo, scanout->x,
-				scanout->y, pOMAP->scanout, 0, 0);
-		if (!res) {
-			ERROR_MSG("Copy crtc to scanout failed");
-			goto out;
-		}
-	}
-	res = TRUE;
-out:
-	TRACE_EXIT();
-	return res;
+	if ((int64_t)sequence < (int64_t)drmmode_crtc->msc_prev - 0x40000000)
+		drmmode_crtc->msc_high += 0x100000000ULL;
+	if ((int64_t)sequence > (int64_t)drmmode_crtc->msc_prev + 0x40000000 &&
+			drmmode_crtc->msc_high)
+		drmmode_crtc->msc_high -= 0x100000000ULL;
+	drmmode_crtc->msc_prev = sequence;
+	return drmmode_crtc->msc_high + sequence;
 }
 
 /*
- * Enter blit mode.
- *
- * First, wait for all pending flips to complete.
- * Next, copy all valid per-crtc bo contents to the root bo, and mark their
- * scanouts as invalid to ensure they get updated when switching back to flip
- * mode.
- * Lastly, set all enabled crtcs to scan out from the root bo.
+ * A swap which changes what the crtcs in @crtc_mask scan out was queued: a
+ * page flip, or an overlay plane update.  drmmode_wait_for_swaps() waits on
+ * it until the matching drmmode_swap_done().  Blit swaps, which may wait for
+ * a vblank far ahead, are not counted.
  */
-Bool drmmode_set_blit_mode(ScrnInfoPtr pScrn)
+void
+drmmode_swap_queued(ScrnInfoPtr pScrn, uint32_t crtc_mask)
 {
-	OMAPPtr pOMAP = OMAPPTR(pScrn);
 	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
 	int i;
-	Bool ret;
 
-	if (pOMAP->flip_mode == OMAP_FLIP_DISABLED)
-		return TRUE;
+	for (i = 0; i < xf86_config->num_crtc; i++) {
+		drmmode_crtc_private_ptr drmmode_crtc =
+				xf86_config->crtc[i]->driver_private;
 
-	// wait for all flips to finish so we will read from the current buffer
-	while (pOMAP->pending_flips > 0)
-		drmmode_wait_for_event(pScrn);
+		if (crtc_mask & (1 << i))
+			drmmode_crtc->pending_swaps++;
+	}
+}
 
-	/* Only copy if source is valid. */
-	for (i = 0; i < MAX_SCANOUTS; i++) {
-		OMAPScanoutPtr scanout = &pOMAP->scanouts[i];
+void
+drmmode_swap_done(ScrnInfoPtr pScrn, uint32_t crtc_mask)
+{
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+	int i;
 
-		if (!scanout->bo)
-			continue;
-		if (!scanout->valid)
-			continue;
+	for (i = 0; i < xf86_config->num_crtc; i++) {
+		drmmode_crtc_private_ptr drmmode_crtc =
+				xf86_config->crtc[i]->driver_private;
 
-		ret = drmmode_copy_bo(pScrn, scanout->bo, scanout->x,
-					  scanout->y, pOMAP->scanout, 0, 0);
-		if (!ret) {
-			ERROR_MSG("Copy crtc to scanout failed");
-			return FALSE;
-		}
-		scanout->valid = FALSE;
+		if ((crtc_mask & (1 << i)) && drmmode_crtc->pending_swaps > 0)
+			drmmode_crtc->pending_swaps--;
 	}
+}
+
+/*
+ * Wait until the crtcs in @crtc_mask have no swap, flip or commit in flight
+ * any more.  Other crtcs carry on at their own pace.
+ */
+void
+drmmode_wait_for_swaps(ScrnInfoPtr pScrn, uint32_t crtc_mask)
+{
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+	int i;
+
 	for (i = 0; i < xf86_config->num_crtc; i++) {
-		xf86CrtcPtr crtc = xf86_config->crtc[i];
-		if (!drmmode_set_blit_crtc(pScrn, crtc)) {
-			ERROR_MSG("[CRTC:%u] could not set blit mode",
-					drmmode_crtc_id(crtc));
-			goto unwind;
-		}
-	}
-	pOMAP->flip_mode = OMAP_FLIP_DISABLED;
-	return TRUE;
+		drmmode_crtc_private_ptr drmmode_crtc =
+				xf86_config->crtc[i]->driver_private;
 
-unwind:
-	/* try restoring already transitioned CRTCs back to flip mode */
-	while (--i >= 0) {
-		xf86CrtcPtr crtc = xf86_config->crtc[i];
-		if (!drmmode_set_flip_crtc(pScrn, crtc))
-			ERROR_MSG("[CRTC:%u] could not restore flip mode",
-					drmmode_crtc_id(crtc));
+		if (!(crtc_mask & (1 << i)))
+			continue;
+		while (drmmode_crtc->pending_swaps ||
+		       drmmode_crtc->flip_pending ||
+		       drmmode_crtc->commit_pending)
+			drmmode_wait_for_event(pScrn);
 	}
-	return FALSE;
 }
 
 /*
- * Enter flip mode.
+ * @crtc now shows @bo, or nothing we keep track of if it is NULL.  The bo it
+ * showed before gets @fence_fd, which signals once scanout is done with it.
+ */
+static void
+drmmode_crtc_set_flip_bo(xf86CrtcPtr crtc, struct omap_bo *bo, int fence_fd)
+{
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	struct omap_bo *old = drmmode_crtc->flip_bo;
+
+	if (old && fence_fd >= 0)
+		omap_bo_set_fence(old, fence_fd);
+	else if (fence_fd >= 0)
+		close(fence_fd);
+	if (bo)
+		omap_bo_reference(bo);
+	drmmode_crtc->flip_bo = bo;
+	omap_bo_unreference(old);
+}
+
+static void
+drmmode_release_flip_bos(ScrnInfoPtr pScrn)
+{
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+	int i;
+
+	for (i = 0; i < xf86_config->num_crtc; i++)
+		drmmode_crtc_set_flip_bo(xf86_config->crtc[i], NULL, -1);
+}
+
+static struct omap_bo *drmmode_blit_scanout(xf86CrtcPtr crtc, int *x, int *y);
+
+/*
+ * Switch every enabled crtc to its blit mode (root) or flip mode (per-crtc)
+ * scanout in a single non-blocking commit.  Flips wait for it to land, see
+ * drmmode_page_flip().  Returns FALSE if the kernel won't take the commit,
+ * the caller then goes crtc by crtc with the legacy ioctls.
  *
- * First, copy contents from the root bo to each invalid per-crtc bo, and mark
- * its scanout as valid.
- * Lastly, set all enabled crtcs to scan out from their per-crtc bos.
+ * Like a flip, the commit fences what the crtcs showed until now, and the
+ * next flip fences the scanouts shown from now on.
  */
-Bool drmmode_set_flip_mode(ScrnInfoPtr pScrn)
+static Bool
+drmmode_atomic_set_scanouts(ScrnInfoPtr pScrn, enum OMAPFlipMode mode)
 {
 	OMAPPtr pOMAP = OMAPPTR(pScrn);
 	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
-	int i;
-	Bool ret;
+	drmmode_ptr drmmode = drmmode_from_scrn(pScrn);
+	/* one per bit of the crtc mask */
+	struct omap_bo *bos[32] = { NULL };
+	drmModeAtomicReqPtr req;
+	drmmode_flip_ptr commit;
+	int i, ret;
 
-	if (pOMAP->flip_mode == OMAP_FLIP_ENABLED)
-		return TRUE;
+	if (!drmmode->atomic || !OMAP_USE_PAGE_FLIP_EVENTS)
+		return FALSE;
 
-	/* Only copy if destination is invalid. */
-	for (i = 0; i < MAX_SCANOUTS; i++) {
-		OMAPScanoutPtr scanout = &pOMAP->scanouts[i];
+	commit = calloc(1, sizeof *commit);
+	if (!commit)
+		return FALSE;
+	commit->event.handler = drmmode_flip_handler;
+	commit->pScrn = pScrn;
 
-		if (!scanout->bo)
-			continue;
-		if (scanout->valid)
+	req = drmModeAtomicAlloc();
+	if (!req) {
+		free(commit);
+		return FALSE;
+	}
+
+	for (i = 0; i < xf86_config->num_crtc && i < (int)ARRAY_SIZE(bos); i++) {
+		xf86CrtcPtr crtc = xf86_config->crtc[i];
+		drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+		OMAPScanoutPtr scanout;
+
+		if (!crtc->enabled)
 			continue;
 
-		ret = drmmode_copy_bo(pScrn, pOMAP->scanout, 0, 0,
-					  scanout->bo, scanout->x,
-					  scanout->y);
-		if (!ret) {
-			ERROR_MSG("Copy scanout to crtc failed");
-			return FALSE;
+		if (mode == OMAP_FLIP_ENABLED) {
+			scanout = drmmode_scanout_from_crtc(crtc);
+			if (!scanout)
+				continue;
+			bos[i] = scanout->bo;
+			drmmode_atomic_add_plane(req, crtc,
+					omap_bo_fb(scanout->bo), 0, 0);
+		} else if (mode == OMAP_FLIP_SPANNING) {
+			scanout = drmmode_span_scanout(pOMAP);
+			bos[i] = scanout->bo;
+			drmmode_atomic_add_plane(req, crtc,
+					omap_bo_fb(scanout->bo),
+					crtc->x, crtc->y);
+		} else {
+			int x, y;
+
+			bos[i] = drmmode_blit_scanout(crtc, &x, &y);
+			drmmode_atomic_add_plane(req, crtc, omap_bo_fb(bos[i]),
+					x, y);
 		}
-		scanout->valid = TRUE;
+		drmmode_crtc->out_fence = -1;
+		if (drmmode_crtc->out_fence_prop)
+			drmModeAtomicAddProperty(req, drmmode_crtc->id,
+					drmmode_crtc->out_fence_prop,
+					(uintptr_t)&drmmode_crtc->out_fence);
+		commit->crtc_mask |= 1 << i;
+		commit->count++;
+	}
+
+	if (!commit->count) {
+		drmModeAtomicFree(req);
+		free(commit);
+		return TRUE;
+	}
+
+	/* only one commit per crtc can be in flight */
+	drmmode_wait_for_commits(pScrn, commit->crtc_mask);
+
+	ret = drmmode_atomic_commit(drmmode->fd, req,
+			DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT,
+			commit);
+	drmModeAtomicFree(req);
+	if (ret) {
+		DEBUG_MSG("atomic %s mode commit failed: %s",
+				mode == OMAP_FLIP_DISABLED ? "blit" : "flip",
+				strerror(errno));
+		free(commit);
+		return FALSE;
 	}
 
 	for (i = 0; i < xf86_config->num_crtc; i++) {
 		xf86CrtcPtr crtc = xf86_config->crtc[i];
-		if (!drmmode_set_flip_crtc(pScrn, crtc)) {
-			ERROR_MSG("[CRTC:%u] could not set flip mode",
-					drmmode_crtc_id(crtc));
-			goto unwind;
-		}
+		drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+
+		if (!(commit->crtc_mask & (1 << i)))
+			continue;
+		drmmode_crtc->commit_pending = TRUE;
+		drmmode_crtc_set_flip_bo(crtc, bos[i], drmmode_crtc->out_fence);
 	}
-	pOMAP->flip_mode = OMAP_FLIP_ENABLED;
 	return TRUE;
+}
 
-unwind:
-	/* try restoring already transitioned CRTCs back to blit mode */
-	while (--i >= 0) {
-		xf86CrtcPtr crtc = xf86_config->crtc[i];
-		if (!drmmode_set_blit_crtc(pScrn, crtc))
-			ERROR_MSG("[CRTC:%u] could not restore blit mode",
-					drmmode_crtc_id(crtc));
-	}
-	return FALSE;
+static Bool
+drmmode_kmode_equal(const drmModeModeInfo *a, const drmModeModeInfo *b)
+{
+	return a->clock == b->clock &&
+			a->hdisplay == b->hdisplay &&
+			a->hsync_start == b->hsync_start &&
+			a->hsync_end == b->hsync_end &&
+			a->htotal == b->htotal &&
+			a->hskew == b->hskew &&
+			a->vdisplay == b->vdisplay &&
+			a->vsync_start == b->vsync_start &&
+			a->vsync_end == b->vsync_end &&
+			a->vtotal == b->vtotal &&
+			a->vscan == b->vscan &&
+			a->flags == b->flags;
 }
 
-static Bool drmmode_update_scanouts(ScrnInfoPtr pScrn)
+/*
+ * Returns TRUE if @crtc already shows @kmode at (@x, @y) on just the outputs
+ * X puts on it, as it does when X starts on what the boot loader or fbcon
+ * set up, and the fb it shows in *@fb_id.  Then a flip to the new fb is all
+ * the modeset has to do.
+ */
+static Bool
+drmmode_crtc_keeps_mode(xf86CrtcPtr crtc, const drmModeModeInfo *kmode,
+		int x, int y, uint32_t *fb_id)
 {
-	OMAPPtr pOMAP = OMAPPTR(pScrn);
-	OMAPScanoutPtr scanout;
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(crtc->scrn);
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	int fd = drmmode_crtc->drmmode->fd;
+	drmModeCrtcPtr kcrtc;
+	Bool ret;
 	int i;
+
+	kcrtc = drmModeGetCrtc(fd, drmmode_crtc->id);
+	if (!kcrtc)
+		return FALSE;
+	ret = kcrtc->buffer_id && kcrtc->mode_valid &&
+			kcrtc->x == x && kcrtc->y == y &&
+			drmmode_kmode_equal(&kcrtc->mode, kmode);
+	*fb_id = kcrtc->buffer_id;
+	drmModeFreeCrtc(kcrtc);
+
+	for (i = 0; ret && i < xf86_config->num_output; i++) {
+		xf86OutputPtr output = xf86_config->output[i];
+		drmmode_output_private_ptr drmmode_output =
+				output->driver_private;
+		uint32_t encoder_id = drmmode_output->mode_output->encoder_id;
+		drmModeEncoderPtr kencoder = NULL;
+		Bool on_crtc;
+
+		if (encoder_id)
+			kencoder = drmModeGetEncoder(fd, encoder_id);
+		on_crtc = kencoder && kencoder->crtc_id == drmmode_crtc->id;
+		if (kencoder)
+			drmModeFreeEncoder(kencoder);
+
+		if (on_crtc != (output->crtc == crtc))
+			ret = FALSE;
+	}
+
+	return ret;
+}
+
+static Bool
+drmmode_set_crtc(ScrnInfoPtr pScrn, xf86CrtcPtr crtc, struct omap_bo *bo, int x,
+			int y)
+{
 	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
-	xf86CrtcPtr crtc;
-	struct omap_bo *bo;
-	Bool valid;
+	xf86OutputPtr output;
+	drmmode_crtc_private_ptr drmmode_crtc;
+	drmmode_output_private_ptr drmmode_output;
+	int rc, output_count, i;
+	uint32_t *output_ids = NULL;
+	uint32_t fb_id, shown_fb_id;
+	uint32_t crtc_id = drmmode_crtc_id(crtc);
+	drmModeModeInfo kmode;
+	Bool first, ret;
 
-	OMAPScanout old_scanouts[MAX_SCANOUTS];
-	memcpy(old_scanouts, pOMAP->scanouts, sizeof(old_scanouts));
-	memset(pOMAP->scanouts, 0, sizeof(pOMAP->scanouts));
+	output_ids = calloc(xf86_config->num_output, sizeof *output_ids);
+	assert(output_ids);
 
-	for (i = 0; i < xf86_config->num_crtc; i++) {
-		crtc = xf86_config->crtc[i];
-		if (!crtc->enabled || !crtc->mode.HDisplay ||
-				!crtc->mode.VDisplay)
+	output_count = 0;
+	for (i = 0; i < xf86_config->num_output; i++) {
+		output = xf86_config->output[i];
+		drmmode_output = output->driver_private;
+
+		if (output->crtc != crtc)
 			continue;
 
-		scanout = drmmode_scanout_from_crtc(old_scanouts, crtc);
-		if (scanout) {
-			/* Use existing BO */
-			bo = scanout->bo;
-			valid = scanout->valid;
-			memset(scanout, 0, sizeof(*scanout));
-		} else {
-			/* Allocate a new BO */
-			bo = omap_bo_new_with_depth(pOMAP->dev,
-					crtc->mode.HDisplay,
-					crtc->mode.VDisplay, pScrn->depth,
-					pScrn->bitsPerPixel);
-			if (!bo) {
-				ERROR_MSG("Scanout buffer allocation failed");
-				return FALSE;
-			}
-			valid = FALSE;
-		}
-		scanout = drmmode_scanout_add(pOMAP->scanouts, crtc, bo);
-		if (!scanout) {
-			ERROR_MSG("Add scanout failed");
-			omap_bo_unreference(bo);
-			return FALSE;
-		}
-		scanout->valid = valid;
+		output_ids[output_count] = drmmode_output->id;
+		output_count++;
+	}
+	if (!output_count) {
+		ERROR_MSG("[CRTC:%u] No outputs found", crtc_id);
+		ret = FALSE;
+		goto out;
+	}
 
-		/*
-		 * drmmode_scanout_add() adds a reference, but we either:
-		 * * already have a reference, from a recycled BO
-		 * * was given a reference when a new BO was allocated
-		 */
-		omap_bo_unreference(bo);
+	drmmode_ConvertToKMode(pScrn, &kmode, &crtc->mode);
+
+	drmmode_crtc = crtc->driver_private;
+	fb_id = omap_bo_fb(bo);
+	first = drmmode_crtc->first_modeset;
+	drmmode_crtc->first_modeset = FALSE;
+
+	if (drmmode_crtc->drmmode->atomic) {
+		rc = drmmode_atomic_set_crtc(crtc, &kmode, fb_id, x, y);
+		if (!rc) {
+			ret = TRUE;
+			goto out;
+		}
+		DEBUG_MSG("[CRTC:%u] atomic modeset failed, trying legacy: %s",
+				crtc_id, strerror(errno));
 	}
 
-	/* Drop the remaining unused BOs. */
-	for (i = 0; i < MAX_SCANOUTS; i++)
-		if (old_scanouts[i].bo != NULL) {
-			/*
-			 * Set has_resized when discarding active scanouts. This
-			 * ensures we trigger the blit/flip logic which will
-			 * setcrtc to a valid fb if needed
-			 */
-			pOMAP->has_resized = TRUE;
-			omap_bo_unreference(old_scanouts[i].bo);
+	drmmode_set_plane_rotation(crtc);
+
+	/* skip the first modeset, and the blank screen it may show for a
+	 * while, if the crtc is already set up the way we want it; after
+	 * that it is only ever set by us
+	 */
+	if (first && drmmode_crtc_keeps_mode(crtc, &kmode, x, y,
+			&shown_fb_id)) {
+		if (shown_fb_id == fb_id) {
+			DEBUG_MSG("[CRTC:%u] already shows [FB:%u]", crtc_id,
+					fb_id);
+			ret = TRUE;
+			goto out;
+		}
+		if (!drmmode_crtc_flip(crtc, fb_id, NULL, FALSE)) {
+			DEBUG_MSG("[CRTC:%u] mode unchanged, flipped to [FB:%u]",
+					crtc_id, fb_id);
+			drmmode_wait_for_swaps(pScrn,
+					1 << drmmode_crtc->index);
+			ret = TRUE;
+			goto out;
 		}
+	}
 
-	return TRUE;
+	/* drmModeSetCrtc returns non-zero on error; convert to Bool */
+	rc = drmModeSetCrtc(drmmode_crtc->drmmode->fd, crtc_id, fb_id, x, y,
+			output_ids, output_count, &kmode);
+	if (rc)
+		ERROR_MSG("[CRTC:%u] failed to set mode with [FB:%u] @ (%d, %d): %s",
+				crtc_id, fb_id, x, y, strerror(errno));
+	ret = rc ? FALSE : TRUE;
+
+out:
+	/* the modeset is done with the old bo, the next flip fences @bo */
+	if (ret)
+		drmmode_crtc_set_flip_bo(crtc, bo, -1);
+	free(output_ids);
+	return ret;
 }
 
-static Bool
-drmmode_set_mode_major(xf86CrtcPtr crtc, DisplayModePtr mode,
-		Rotation rotation, int x, int y)
+/*
+ * Copy region of @src starting at (@src_x, @src_y) to @dst at (@dst_x, dst_y).
+ * This function does no conversions, so it assumes same src and dst bpp.
+ *  @src         source buffer
+ *  @src_x       x coordinate from which to start copying
+ *  @src_y       y coordinate from which to start copying
+ *  @src_width   max number of pixels per src row to copy
+ *  @src_height  max number of src rows to copy
+ *  @src_pitch   total length of each src row, in bytes
+ *  @src_cpp     bytes (ie, chars) per pixel of source
+ *  @dst         destination buffer
+ *  @dst_x       x coordinate to which to start copying
+ *  @dst_y       y coordinate to which to start copying
+ *  @dst_width   max number of pixels per dst row to copy
+ *  @dst_height  max number of dst rows to copy
+ *  @dst_pitch   total length of each dst row, in bytes
+ *  @dst_cpp     bytes (ie, chars) per pixel of dst, must be same as src_cpp
+ *  @box         if not NULL, only copy this part of src, in src pixels
+ */
+static void
+drmmode_copy_from_to(const uint8_t *src, int src_x, int src_y, int src_width,
+		     int src_height, int src_pitch, int src_cpp,
+		     uint8_t *dst, int dst_x, int dst_y, int dst_width,
+		     int dst_height, int dst_pitch, int dst_cpp,
+		     const BoxRec *box)
 {
-	ScrnInfoPtr pScrn = crtc->scrn;
-	OMAPPtr pOMAP = OMAPPTR(pScrn);
-	xf86CrtcConfigPtr   xf86_config = XF86_CRTC_CONFIG_PTR(crtc->scrn);
-	Bool ret;
-	int i;
+	/* the overlap of both buffers, where they sit */
+	int x1 = max(src_x, dst_x);
+	int y1 = max(src_y, dst_y);
+	int x2 = min(src_x + src_width, dst_x + dst_width);
+	int y2 = min(src_y + src_height, dst_y + dst_height);
 
-	TRACE_ENTER();
+	assert(src_cpp == dst_cpp);
 
-	ret = xf86CrtcRotate(crtc);
-	if (!ret)
-		goto done;
+	if (box) {
+		x1 = max(x1, src_x + box->x1);
+		y1 = max(y1, src_y + box->y1);
+		x2 = min(x2, src_x + box->x2);
+		y2 = min(y2, src_y + box->y2);
+	}
 
-	// On a modeset, we should switch to blit mode to get a single scanout buffer
-	// and we will switch back to flip mode on the next flip request
-	if (pOMAP->flip_mode == OMAP_FLIP_DISABLED)
-		ret = drmmode_set_crtc(pScrn, crtc, pOMAP->scanout, crtc->x, crtc->y);
-	else
-		ret = drmmode_set_blit_mode(pScrn);
-	if (!ret)
-		goto done;
+	if (x2 <= x1 || y2 <= y1)
+		return;
 
-	// Fixme - Intel puts this function here, and Nouveau puts it at the end
-	// of this function -> determine what's best for TI'S OMAP4:
-	if (crtc->funcs->gamma_set)
-		crtc->funcs->gamma_set(crtc, crtc->gamma_red, crtc->gamma_green,
-				       crtc->gamma_blue, crtc->gamma_size);
+	src += (y1 - src_y) * src_pitch + (x1 - src_x) * src_cpp;
+	dst += (y1 - dst_y) * dst_pitch + (x1 - dst_x) * src_cpp;
 
-	ret = drmmode_update_scanouts(pScrn);
-	if (!ret) {
-		ERROR_MSG("Update scanouts failed");
-		goto done;
-	}
+	omap_copy_rows(dst, dst_pitch, src, src_pitch, (x2 - x1) * dst_cpp,
+			y2 - y1);
+}
 
-	// FIXME - DO WE NEED TO CALL TO THE PVR EXA/DRI2 CODE TO UPDATE THEM???
+/*
+ * Copy region of src buffer located at (src_x, src_y) that overlaps the dst
+ * buffer at dst_x, dst_y.  If @clip is not NULL, only the part of src inside
+ * it, in src pixels, is copied.
+ * This function does no conversions, so it assumes same bpp and depth.
+ * It also assumes the two regions are non-overlapping memory areas, even though
+ * they may overlap in pixel space.
+ */
+static Bool
+drmmode_copy_bo(ScrnInfoPtr pScrn, struct omap_bo *src_bo, int src_x, int src_y,
+		struct omap_bo *dst_bo, int dst_x, int dst_y, RegionPtr clip)
+{
+	void *dst;
+	const void *src;
+	const BoxRec *boxes = NULL;
+	int i, num_boxes = 1;
 
-	/* Turn on any outputs on this crtc that may have been disabled: */
-	for (i = 0; i < xf86_config->num_output; i++) {
-		xf86OutputPtr output = xf86_config->output[i];
+	if (!src_bo || !dst_bo) {
+		ERROR_MSG("copy_bo received invalid arguments");
+		return FALSE;
+	}
 
-		if (output->crtc != crtc)
-			continue;
+	assert(omap_bo_bpp(src_bo) == omap_bo_bpp(dst_bo));
 
-		drmmode_output_dpms(output, DPMSModeOn);
+	src = omap_bo_map(src_bo);
+	if (!src) {
+		ERROR_MSG("Couldn't map src bo");
+		return FALSE;
+	}
+	dst = omap_bo_map(dst_bo);
+	if (!dst) {
+		ERROR_MSG("Couldn't map dst bo");
+		return FALSE;
 	}
 
-	/*
-	 * The screen has reconfigured, so reload hw cursor images as needed,
-	 * and adjust cursor positions.
-	 */
-	xf86_reload_cursors(pScrn->pScreen);
+	if (clip) {
+		boxes = RegionRects(clip);
+		num_boxes = RegionNumRects(clip);
+	}
 
-done:
-	TRACE_EXIT();
-	return ret;
-}
+	// acquire for write first, so if (probably impossible) src==dst acquire
+	// for read can succeed
+	omap_bo_cpu_prep(dst_bo, OMAP_GEM_WRITE);
+	omap_bo_cpu_prep(src_bo, OMAP_GEM_READ);
 
-#define CURSORW  64
-#define CURSORH  64
+	for (i = 0; i < num_boxes; i++)
+		drmmode_copy_from_to(src, src_x, src_y,
+				     omap_bo_width(src_bo),
+				     omap_bo_height(src_bo),
+				     omap_bo_pitch(src_bo), omap_bo_Bpp(src_bo),
+				     dst, dst_x, dst_y,
+				     omap_bo_width(dst_bo),
+				     omap_bo_height(dst_bo),
+				     omap_bo_pitch(dst_bo), omap_bo_Bpp(dst_bo),
+				     boxes ? &boxes[i] : NULL);
 
-static void
-drmmode_set_cursor_position(xf86CrtcPtr crtc, int x, int y)
-{
-	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
-	drmmode_ptr drmmode = drmmode_crtc->drmmode;
+	omap_bo_cpu_fini(src_bo, 0);
+	omap_bo_cpu_fini(dst_bo, 0);
 
-	drmModeMoveCursor(drmmode->fd, drmmode_crtc_id(crtc), x, y);
+	return TRUE;
 }
 
-static void
-drmmode_hide_cursor(xf86CrtcPtr crtc)
+/*
+ * Per-crtc copies of the root
+ *
+ * In blit mode the root is drawn to while the crtcs show it, so they may
+ * show half a frame.  With TearFree each crtc shows a copy of its part of the
+ * root instead.  Damage to the root is copied to a second copy, which is
+ * flipped to on the next vblank, see drmmode_copies_update().  The flip modes
+ * are left alone, there clients render into the back buffers themselves.
+ *
+ * A crtc rotated in software always shows such copies, which we rotate into,
+ * and keeps updating them in flip mode too.
+ */
+
+/* Returns TRUE if @crtc should show copies of the root in blit mode */
+static Bool
+drmmode_crtc_needs_copies(xf86CrtcPtr crtc)
 {
 	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
-	drmmode_ptr drmmode = drmmode_crtc->drmmode;
 
-	drmModeSetCursor(drmmode->fd, drmmode_crtc_id(crtc), 0, CURSORW, CURSORH);
+	return OMAPPTR(crtc->scrn)->tearfree || drmmode_crtc->sw_rotate;
 }
 
 static void
-drmmode_show_cursor(xf86CrtcPtr crtc)
+drmmode_copies_free(xf86CrtcPtr crtc)
 {
 	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
-	drmmode_ptr drmmode = drmmode_crtc->drmmode;
-	struct omap_bo* cursor_bo = drmmode_crtc->cursor_bo;
-	uint32_t handle = cursor_bo ? omap_bo_handle(cursor_bo) : 0;
-	drmModeSetCursor(drmmode->fd, drmmode_crtc_id(crtc), handle, CURSORW, CURSORH);
+	int i;
+
+	for (i = 0; i < 2; i++) {
+		omap_bo_unreference(drmmode_crtc->copy_bo[i]);
+		drmmode_crtc->copy_bo[i] = NULL;
+		RegionEmpty(&drmmode_crtc->copy_damage[i]);
+	}
 }
 
+/* Bands of a rotated copy for the worker threads */
+struct drmmode_rotate_job {
+	uint8_t *dst;
+	int dst_xstep;
+	int dst_ystep;
+	const uint8_t *src;
+	int src_pitch;
+	int width;
+	int height;
+	int cpp;
+};
+
+/* Rotated boxes this big are split over the worker threads */
+#define DRMMODE_ROTATE_THREAD_PIXELS	(256 * 256)
+
 static void
-drmmode_load_cursor_argb(xf86CrtcPtr crtc, CARD32 *image)
+drmmode_rotate_band(void *data, int band, int bands)
 {
-	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
-	struct omap_bo* cursor_bo = drmmode_crtc->cursor_bo;
-	int row;
-	void* dst;
-	const char* src_row;
-	char* dst_row;
-
-	if (!cursor_bo)
-		return;
+	const struct drmmode_rotate_job *job = data;
+	int y1 = job->height * band / bands;
+	int y2 = job->height * (band + 1) / bands;
 
-	dst = omap_bo_map(cursor_bo);
-	omap_bo_cpu_prep(cursor_bo, OMAP_GEM_WRITE);
-	for (row = 0; row < CURSORH; row += 1) {
-		// we're operating with ARGB data (32bpp)
-		src_row = (const char*)image + row * 4 * CURSORW;
-		dst_row = (char*)dst + row * 4 * CURSORW;
-		memcpy(dst_row, src_row, 4 * CURSORW);
-	}
-	omap_bo_cpu_fini(cursor_bo, 0);
+	omap_rotate_rect(job->dst + y1 * job->dst_ystep, job->dst_xstep,
+			job->dst_ystep, job->src + y1 * job->src_pitch,
+			job->src_pitch, job->width, y2 - y1, job->cpp);
 }
 
-#ifdef OMAP_SUPPORT_GAMMA
+/*
+ * Where root pixel (@x, @y), shown by @crtc, is in the crtc's own rotated
+ * copy.  xf86 reflects after rotating, so undo the reflections first.
+ */
 static void
-drmmode_gamma_set(xf86CrtcPtr crtc, CARD16 *red, CARD16 *green, CARD16 *blue,
-		int size)
+drmmode_rotate_point(xf86CrtcPtr crtc, int x, int y, int *u, int *v)
 {
-	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
-	drmmode_ptr drmmode = drmmode_crtc->drmmode;
-	int ret;
-
-	ret = drmModeCrtcSetGamma(drmmode->fd, drmmode_crtc_id(crtc),
-			size, red, green, blue);
-	if (ret != 0) {
-		xf86DrvMsg(crtc->scrn->scrnIndex, X_ERROR,
-				"failed to set gamma: %s\n", strerror(-ret));
+	int width = crtc->mode.HDisplay, height = crtc->mode.VDisplay;
+	BoxRec box;
+
+	drmmode_crtc_box(crtc, &box);
+	x -= box.x1;
+	y -= box.y1;
+	if (crtc->rotation & RR_Reflect_X)
+		x = box.x2 - box.x1 - 1 - x;
+	if (crtc->rotation & RR_Reflect_Y)
+		y = box.y2 - box.y1 - 1 - y;
+
+	switch (crtc->rotation & 0xf) {
+	case RR_Rotate_90:
+		*u = y;
+		*v = height - 1 - x;
+		break;
+	case RR_Rotate_180:
+		*u = width - 1 - x;
+		*v = height - 1 - y;
+		break;
+	case RR_Rotate_270:
+		*u = width - 1 - y;
+		*v = x;
+		break;
+	default:
+		*u = x;
+		*v = y;
+		break;
 	}
 }
-#endif
 
-static void
-drmmode_crtc_destroy(xf86CrtcPtr crtc)
+/* Byte offset of root pixel (@x, @y) in the rotated copy @bo of @crtc */
+static int
+drmmode_rotate_offset(xf86CrtcPtr crtc, struct omap_bo *bo, int x, int y)
 {
-	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	int u, v;
 
-	omap_bo_unreference(drmmode_crtc->cursor_bo);
-	free(drmmode_crtc);
-	crtc->driver_private = NULL;
+	drmmode_rotate_point(crtc, x, y, &u, &v);
+	return v * (int)omap_bo_pitch(bo) + u * (int)omap_bo_Bpp(bo);
 }
 
-static const xf86CrtcFuncsRec drmmode_crtc_funcs = {
-		.destroy = drmmode_crtc_destroy,
-		.dpms = drmmode_crtc_dpms,
-		.set_mode_major = drmmode_set_mode_major,
-		.set_cursor_position = drmmode_set_cursor_position,
-		.show_cursor = drmmode_show_cursor,
-		.hide_cursor = drmmode_hide_cursor,
-		.load_cursor_argb = drmmode_load_cursor_argb,
-#ifdef OMAP_SUPPORT_GAMMA
-		.gamma_set = drmmode_gamma_set,
-#endif
-};
-
-
+/*
+ * Rotate the part of the root in @clip, or all of it without one, into
+ * @dst_bo, a copy for @crtc.  Big boxes are split over the worker threads.
+ */
 static Bool
-drmmode_crtc_pre_init(ScrnInfoPtr pScrn, drmmode_ptr drmmode,
-		const drmModeResPtr mode_res,
-		const drmModePlaneResPtr plane_res, int num)
+drmmode_copy_rotated(xf86CrtcPtr crtc, struct omap_bo *dst_bo,
+		RegionPtr clip)
 {
-	xf86CrtcPtr crtc;
-	drmmode_crtc_private_ptr drmmode_crtc;
-	Bool ret;
-	uint32_t crtc_id = mode_res->crtcs[num];
+	ScrnInfoPtr pScrn = crtc->scrn;
 	OMAPPtr pOMAP = OMAPPTR(pScrn);
-
-	TRACE_ENTER();
-
-	drmmode_crtc = calloc(1, sizeof *drmmode_crtc);
-	if (!drmmode_crtc) {
-		ERROR_MSG("CRTC[%u]: Failed to allocate drmmode_crtc",
-				crtc_id);
-		ret = FALSE;
-		goto out;
-	}
-	drmmode_crtc->id = crtc_id;
-	drmmode_crtc->drmmode = drmmode;
-	drmmode_crtc->cursor_bo = omap_bo_new_with_format(pOMAP->dev, CURSORW, CURSORH,
-			DRM_FORMAT_ARGB8888, 32);
-	if (!drmmode_crtc->cursor_bo) {
-		ERROR_MSG("error allocating hw cursor buffer");
-		ret = FALSE;
-		goto err_free_drmmode_crtc;
+	struct omap_bo *src_bo = pOMAP->scanout;
+	struct drmmode_rotate_job job;
+	const BoxRec *boxes;
+	RegionRec region;
+	BoxRec box;
+	uint8_t *src, *dst;
+	int origin, i, n;
+
+	/* read the cached shadow rather than the scanout, if there is one */
+	src = OMAPBoCpuMap(pScrn, src_bo);
+	dst = omap_bo_map(dst_bo);
+	if (!src || !dst) {
+		ERROR_MSG("[CRTC:%u] couldn't map bos to rotate",
+				drmmode_crtc_id(crtc));
+		return FALSE;
 	}
 
-	crtc = xf86CrtcCreate(pScrn, &drmmode_crtc_funcs);
-	if (crtc == NULL) {
-		ERROR_MSG("CRTC[%u]: Failed to create xf86Crtc", crtc_id);
-		ret = FALSE;
-		goto err_destroy_cursor;
-	}
+	drmmode_crtc_box(crtc, &box);
+	RegionInit(&region, &box, 1);
+	if (clip)
+		RegionIntersect(&region, &region, clip);
 
-	INFO_MSG("[CRTC:%u] HW Cursor using [BO:%u]",
-			drmmode_crtc->id,
-			omap_bo_handle(drmmode_crtc->cursor_bo));
+	/* the offsets are linear in x and y */
+	origin = drmmode_rotate_offset(crtc, dst_bo, 0, 0);
+	job.dst_xstep = drmmode_rotate_offset(crtc, dst_bo, 1, 0) - origin;
+	job.dst_ystep = drmmode_rotate_offset(crtc, dst_bo, 0, 1) - origin;
+	job.src_pitch = omap_bo_pitch(src_bo);
+	job.cpp = omap_bo_Bpp(src_bo);
 
-	crtc->driver_private = drmmode_crtc;
+	omap_bo_cpu_prep(dst_bo, OMAP_GEM_WRITE);
+	omap_bo_cpu_prep(src_bo, OMAP_GEM_READ);
 
-	ret = TRUE;
-	goto out;
+	boxes = RegionRects(&region);
+	n = RegionNumRects(&region);
+	for (i = 0; i < n; i++) {
+		int bands = 1;
+
+		job.width = boxes[i].x2 - boxes[i].x1;
+		job.height = boxes[i].y2 - boxes[i].y1;
+		job.dst = dst + (origin + boxes[i].x1 * job.dst_xstep +
+				boxes[i].y1 * job.dst_ystep);
+		job.src = src + boxes[i].y1 * job.src_pitch +
+				boxes[i].x1 * job.cpp;
+		if (job.width * job.height >= DRMMODE_ROTATE_THREAD_PIXELS)
+			bands = omap_thread_pool_size(OMAPThreadPool(pScrn));
+		omap_thread_run(pOMAP->threads, drmmode_rotate_band, &job,
+				bands);
+	}
 
-err_destroy_cursor:
-	omap_bo_unreference(drmmode_crtc->cursor_bo);
-err_free_drmmode_crtc:
-	free(drmmode_crtc);
-out:
-	TRACE_EXIT();
-	return ret;
+	omap_bo_cpu_fini(src_bo, 0);
+	omap_bo_cpu_fini(dst_bo, 0);
+	RegionUninit(&region);
+	return TRUE;
 }
 
-static xf86OutputStatus
-drmmode_output_detect(xf86OutputPtr output)
+/* Bring the part of the root in @clip, or all of it, to the copy @bo */
+static Bool
+drmmode_copy_to(xf86CrtcPtr crtc, struct omap_bo *bo, RegionPtr clip)
 {
-	/* go to the hw and retrieve a new output struct */
-	drmmode_output_private_ptr drmmode_output = output->driver_private;
-	drmmode_ptr drmmode = drmmode_output->drmmode;
-	xf86OutputStatus status;
-	drmModeFreeConnector(drmmode_output->mode_output);
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	OMAPPtr pOMAP = OMAPPTR(crtc->scrn);
+	BoxRec box;
 
-	drmmode_output->mode_output =
-			drmModeGetConnector(drmmode->fd, drmmode_output->id);
+	if (drmmode_crtc->sw_rotate)
+		return drmmode_copy_rotated(crtc, bo, clip);
 
-	switch (drmmode_output->mode_output->connection) {
-	case DRM_MODE_CONNECTED:
-		status = XF86OutputStatusConnected;
-		break;
-	case DRM_MODE_DISCONNECTED:
-		status = XF86OutputStatusDisconnected;
-		break;
-	default:
-	case DRM_MODE_UNKNOWNCONNECTION:
-		status = XF86OutputStatusUnknown;
-		break;
-	}
-	return status;
+	drmmode_crtc_box(crtc, &box);
+	return drmmode_copy_bo(crtc->scrn, pOMAP->scanout, 0, 0, bo, box.x1,
+			box.y1, clip);
 }
 
+/*
+ * (Re)allocate the copies of @crtc for its current mode, and fill the front
+ * one from the root.  The back one is stale until the next update.  Rotated
+ * by us they have the size of the mode, otherwise that of the part of the
+ * root the crtc shows, which the plane may rotate.
+ */
 static Bool
-drmmode_output_mode_valid(xf86OutputPtr output, DisplayModePtr mode)
+drmmode_copies_alloc(xf86CrtcPtr crtc)
 {
-	if (mode->type & M_T_DEFAULT)
-		/* Default modes are harmful here. */
-		return MODE_BAD;
+	ScrnInfoPtr pScrn = crtc->scrn;
+	OMAPPtr pOMAP = OMAPPTR(pScrn);
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	int width, height;
+	BoxRec box;
+	int i;
 
-	return MODE_OK;
-}
+	drmmode_crtc_box(crtc, &box);
+	if (drmmode_crtc->sw_rotate) {
+		width = crtc->mode.HDisplay;
+		height = crtc->mode.VDisplay;
+	} else {
+		width = box.x2 - box.x1;
+		height = box.y2 - box.y1;
+	}
 
-static DisplayModePtr
-drmmode_output_get_modes(xf86OutputPtr output)
-{
-	ScrnInfoPtr pScrn = output->scrn;
-	drmmode_output_private_ptr drmmode_output = output->driver_private;
-	drmModeConnectorPtr koutput = drmmode_output->mode_output;
-	drmmode_ptr drmmode = drmmode_output->drmmode;
-	DisplayModePtr Modes = NULL, Mode;
-	drmModePropertyPtr prop;
-	xf86MonPtr ddc_mon = NULL;
-	int i;
+	/* neither buffer may be on its way to the screen */
+	while (drmmode_crtc->flip_pending || drmmode_crtc->commit_pending)
+		drmmode_wait_for_event(pScrn);
 
-	/* look for an EDID property */
-	for (i = 0; i < koutput->count_props; i++) {
-		prop = drmModeGetProperty(drmmode->fd, koutput->props[i]);
-		if (!prop)
+	for (i = 0; i < 2; i++) {
+		struct omap_bo *bo = drmmode_crtc->copy_bo[i];
+
+		if (bo && omap_bo_width(bo) == width &&
+		    omap_bo_height(bo) == height &&
+		    omap_bo_bpp(bo) == pScrn->bitsPerPixel)
 			continue;
 
-		if ((prop->flags & DRM_MODE_PROP_BLOB) &&
-		    !strcmp(prop->name, "EDID")) {
-			if (drmmode_output->edid_blob)
-				drmModeFreePropertyBlob(drmmode_output->edid_blob);
-			drmmode_output->edid_blob =
-					drmModeGetPropertyBlob(drmmode->fd,
-							koutput->prop_values[i]);
+		omap_bo_unreference(bo);
+		drmmode_crtc->copy_bo[i] = omap_bo_new_with_depth(pOMAP->dev,
+				width, height, pScrn->depth,
+				pScrn->bitsPerPixel);
+		if (!drmmode_crtc->copy_bo[i]) {
+			ERROR_MSG("[CRTC:%u] copy buffer allocation failed",
+					drmmode_crtc->id);
+			goto fail;
 		}
-		drmModeFreeProperty(prop);
-	}
-
-	if (drmmode_output->edid_blob)
-		ddc_mon = xf86InterpretEDID(pScrn->scrnIndex,
-				drmmode_output->edid_blob->data);
-
-	if (ddc_mon) {
-		xf86OutputSetEDID(output, ddc_mon);
-		xf86SetDDCproperties(pScrn, ddc_mon);
 	}
 
-	DEBUG_MSG("count_modes: %d", koutput->count_modes);
+	if (!drmmode_copy_to(crtc, drmmode_crtc->copy_bo[0], NULL))
+		goto fail;
 
-	/* modes should already be available */
-	for (i = 0; i < koutput->count_modes; i++) {
-		Mode = xnfalloc(sizeof(DisplayModeRec));
-
-		drmmode_ConvertFromKMode(pScrn, &koutput->modes[i],
-				Mode);
-		Modes = xf86ModesAdd(Modes, Mode);
+	RegionEmpty(&drmmode_crtc->copy_damage[0]);
+	RegionReset(&drmmode_crtc->copy_damage[1], &box);
+	return TRUE;
 
-	}
-	return Modes;
+fail:
+	drmmode_copies_free(crtc);
+	return FALSE;
 }
 
-static void
-drmmode_output_destroy(xf86OutputPtr output)
+/*
+ * What @crtc scans out in blit mode, and where from in it: the root, the
+ * crtc's front copy, or the xf86 shadow of a transform.  Without the copies
+ * we fall back to the root, which tears, or is not rotated, but works.
+ */
+static struct omap_bo *
+drmmode_blit_scanout(xf86CrtcPtr crtc, int *x, int *y)
 {
-	drmmode_output_private_ptr drmmode_output = output->driver_private;
-	int i;
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	OMAPPtr pOMAP = OMAPPTR(crtc->scrn);
 
-	if (drmmode_output->edid_blob)
-		drmModeFreePropertyBlob(drmmode_output->edid_blob);
-	for (i = 0; i < drmmode_output->num_props; i++) {
-		drmModeFreeProperty(drmmode_output->props[i].mode_prop);
-		free(drmmode_output->props[i].atoms);
+	if (crtc->rotatedData && drmmode_crtc->rotate_bo) {
+		*x = 0;
+		*y = 0;
+		return drmmode_crtc->rotate_bo;
 	}
-	free(drmmode_output->props);
-	drmModeFreeConnector(drmmode_output->mode_output);
-	free(drmmode_output);
-	output->driver_private = NULL;
+	if (drmmode_crtc_needs_copies(crtc) && drmmode_copies_alloc(crtc)) {
+		*x = 0;
+		*y = 0;
+		return drmmode_crtc->copy_bo[0];
+	}
+	*x = crtc->x;
+	*y = crtc->y;
+	return pOMAP->scanout;
 }
 
+/*
+ * With ShadowFB, whatever is copied to the root bo has to end up in the
+ * shadow too.  Copies @src_bo located at (@src_x, @src_y) there.
+ */
 static void
-drmmode_output_dpms(xf86OutputPtr output, int mode)
+drmmode_copy_bo_to_shadow(ScrnInfoPtr pScrn, struct omap_bo *src_bo,
+		int src_x, int src_y)
 {
-	ScrnInfoPtr pScrn = output->scrn;
-	drmmode_output_private_ptr drmmode_output = output->driver_private;
-	drmmode_ptr drmmode = drmmode_output->drmmode;
-	int ret;
+	OMAPPtr pOMAP = OMAPPTR(pScrn);
+	const void *src;
 
-	if (!drmmode_output->dpms_id)
+	if (!pOMAP->shadow)
 		return;
 
-	ret = drmModeConnectorSetProperty(drmmode->fd, drmmode_output->id,
-			drmmode_output->dpms_id, mode);
-	if (ret)
-		ERROR_MSG("[CONNECTOR:%u] Failed to set [DPMS:%u]",
-				drmmode_output->id, mode);
+	src = omap_bo_map(src_bo);
+	if (!src)
+		return;
+
+	omap_bo_cpu_prep(src_bo, OMAP_GEM_READ);
+	drmmode_copy_from_to(src, src_x, src_y,
+			     omap_bo_width(src_bo), omap_bo_height(src_bo),
+			     omap_bo_pitch(src_bo), omap_bo_Bpp(src_bo),
+			     pOMAP->shadow, 0, 0,
+			     omap_bo_width(pOMAP->scanout),
+			     omap_bo_height(pOMAP->scanout),
+			     omap_bo_pitch(pOMAP->scanout),
+			     omap_bo_Bpp(pOMAP->scanout), NULL);
+	omap_bo_cpu_fini(src_bo, 0);
 }
 
-static Bool
-drmmode_property_ignore(drmModePropertyPtr prop)
+static Bool drmmode_set_blit_crtc(ScrnInfoPtr pScrn, xf86CrtcPtr crtc)
 {
-	if (!prop)
-		return TRUE;
-	/* ignore blob prop */
-	if (prop->flags & DRM_MODE_PROP_BLOB)
-		return TRUE;
-	/* ignore standard property */
-	if (!strcmp(prop->name, "EDID") ||
-			!strcmp(prop->name, "DPMS"))
+	struct omap_bo *bo;
+	int x, y;
+	Bool ret;
+
+	if (!crtc->enabled)
 		return TRUE;
 
-	return FALSE;
+	bo = drmmode_blit_scanout(crtc, &x, &y);
+	ret = drmmode_set_crtc(pScrn, crtc, bo, x, y);
+	if (!ret) {
+		ERROR_MSG("[CRTC:%u] set root scanout failed",
+				drmmode_crtc_id(crtc));
+		drmmode_set_crtc_off(crtc);
+	}
+
+	return ret;
 }
 
-static void
-drmmode_output_create_resources(xf86OutputPtr output)
+static Bool drmmode_set_flip_crtc(ScrnInfoPtr pScrn, xf86CrtcPtr crtc,
+		enum OMAPFlipMode mode)
 {
-	drmmode_output_private_ptr drmmode_output = output->driver_private;
-	drmModeConnectorPtr mode_output = drmmode_output->mode_output;
-	drmmode_ptr drmmode = drmmode_output->drmmode;
-	drmModePropertyPtr drmmode_prop;
-	uint32_t value;
-	int i, j, err;
+	OMAPScanoutPtr scanout;
+	Bool ret;
 
-	drmmode_output->props = calloc(mode_output->count_props,
-			sizeof *drmmode_output->props);
-	if (!drmmode_output->props)
-		return;
+	if (!crtc->enabled)
+		return TRUE;
 
-	drmmode_output->num_props = 0;
-	for (i = 0, j = 0; i < mode_output->count_props; i++) {
-		drmmode_prop = drmModeGetProperty(drmmode->fd, mode_output->props[i]);
-		if (drmmode_property_ignore(drmmode_prop)) {
-			drmModeFreeProperty(drmmode_prop);
-			continue;
-		}
-		drmmode_output->props[j].mode_prop = drmmode_prop;
-		drmmode_output->props[j].index = i;
-		drmmode_output->num_props++;
-		j++;
+	if (mode == OMAP_FLIP_SPANNING) {
+		scanout = drmmode_span_scanout(OMAPPTR(pScrn));
+		ret = drmmode_set_crtc(pScrn, crtc, scanout->bo, crtc->x,
+				crtc->y);
+	} else {
+		scanout = drmmode_scanout_from_crtc(crtc);
+		if (!scanout)
+			return TRUE;
+		ret = drmmode_set_crtc(pScrn, crtc, scanout->bo, 0, 0);
+	}
+	if (!ret) {
+		ERROR_MSG("[CRTC:%u] set per-crtc scanout failed",
+				drmmode_crtc_id(crtc));
+		drmmode_set_crtc_off(crtc);
 	}
 
-	for (i = 0; i < drmmode_output->num_props; i++) {
-		drmmode_prop_ptr p = &drmmode_output->props[i];
-		drmmode_prop = p->mode_prop;
+	return ret;
+}
 
-		value = drmmode_output->mode_output->prop_values[p->index];
+Bool drmmode_update_scanout_from_crtcs(ScrnInfoPtr pScrn)
+{
+	OMAPPtr pOMAP = OMAPPTR(pScrn);
+	int i;
+	Bool res;
 
-		if (drmmode_prop->flags & DRM_MODE_PROP_RANGE) {
-			INT32 range[2];
+	if (pOMAP->flip_mode == OMAP_FLIP_DISABLED)
+		return TRUE;
 
-			p->num_atoms = 1;
-			p->atoms = calloc(p->num_atoms, sizeof *p->atoms);
-			if (!p->atoms)
-				continue;
-			p->atoms[0] = MakeAtom(drmmode_prop->name, strlen(drmmode_prop->name), TRUE);
-			range[0] = drmmode_prop->values[0];
-			range[1] = drmmode_prop->values[1];
-			err = RRConfigureOutputProperty(output->randr_output, p->atoms[0],
-					FALSE, TRUE,
-					drmmode_prop->flags & DRM_MODE_PROP_IMMUTABLE ? TRUE : FALSE,
-							2, range);
-			if (err != 0) {
-				xf86DrvMsg(output->scrn->scrnIndex, X_ERROR,
-						"RRConfigureOutputProperty error, %d\n", err);
-			}
-			err = RRChangeOutputProperty(output->randr_output, p->atoms[0],
-					XA_INTEGER, 32, PropModeReplace, 1,
-					&value, FALSE, FALSE);
-			if (err != 0) {
-				xf86DrvMsg(output->scrn->scrnIndex, X_ERROR,
-						"RRChangeOutputProperty error, %d\n", err);
-			}
-		} else if (drmmode_prop->flags & DRM_MODE_PROP_ENUM) {
-			p->num_atoms = drmmode_prop->count_enums + 1;
-			p->atoms = calloc(p->num_atoms, sizeof *p->atoms);
-			if (!p->atoms)
-				continue;
-			p->atoms[0] = MakeAtom(drmmode_prop->name, strlen(drmmode_prop->name), TRUE);
-			for (j = 1; j <= drmmode_prop->count_enums; j++) {
-				struct drm_mode_property_enum *e = &drmmode_prop->enums[j-1];
-				p->atoms[j] = MakeAtom(e->name, strlen(e->name), TRUE);
-			}
-			err = RRConfigureOutputProperty(output->randr_output, p->atoms[0],
-					FALSE, FALSE,
-					drmmode_prop->flags & DRM_MODE_PROP_IMMUTABLE ? TRUE : FALSE,
-							p->num_atoms - 1, (INT32 *)&p->atoms[1]);
-			if (err != 0) {
-				xf86DrvMsg(output->scrn->scrnIndex, X_ERROR,
-						"RRConfigureOutputProperty error, %d\n", err);
-			}
-			for (j = 0; j < drmmode_prop->count_enums; j++)
-				if (drmmode_prop->enums[j].value == value)
-					break;
-			/* there's always a matching value */
-			err = RRChangeOutputProperty(output->randr_output, p->atoms[0],
-					XA_ATOM, 32, PropModeReplace, 1, &p->atoms[j+1], FALSE, FALSE);
-			if (err != 0) {
-				xf86DrvMsg(output->scrn->scrnIndex, X_ERROR,
-						"RRChangeOutputProperty error, %d\n", err);
+	TRACE_ENTER();
+
+	/* Only copy if source is valid. */
+	for (i = 0; i < pOMAP->num_scanouts; i++) {
+		OMAPScanoutPtr scanout = &pOMAP->scanouts[i];
+
+		if (!scanout->bo)
+			continue;
+		if (!scanout->valid)
+			continue;
+
+		res = drmmode_copy_bo(pScrn, scanout->bo, scanout->x,
+				scanout->y, pOMAP->scanout, 0, 0, NULL);
+		if (!res) {
+			ERROR_MSG("Copy crtc to scanout failed");
+			goto out;
+		}
+	}
+	res = TRUE;
+out:
+	TRACE_EXIT();
+	return res;
+}
+
+/*
+ * Enter blit mode.
+ *
+ * First, wait for all pending flips to complete.
+ * Next, copy all valid per-crtc bo contents to the root bo, and mark their
+ * scanouts as invalid to ensure they get updated when switching back to flip
+ * mode.
+ * Lastly, set all enabled crtcs to scan out from the root bo.
+ */
+Bool drmmode_set_blit_mode(ScrnInfoPtr pScrn)
+{
+	OMAPPtr pOMAP = OMAPPTR(pScrn);
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+	int i;
+	Bool ret;
+
+	if (pOMAP->flip_mode == OMAP_FLIP_DISABLED)
+		return TRUE;
+
+	/* wait for the flips to the per-crtc scanouts to finish, so we will
+	 * read from the current buffers
+	 */
+	drmmode_wait_for_swaps(pScrn, drmmode_crtcs_with_scanout(pScrn));
+
+	/* Only copy if source is valid. */
+	for (i = 0; i < pOMAP->num_scanouts; i++) {
+		OMAPScanoutPtr scanout = &pOMAP->scanouts[i];
+
+		if (!scanout->bo)
+			continue;
+		if (!scanout->valid)
+			continue;
+
+		ret = drmmode_copy_bo(pScrn, scanout->bo, scanout->x,
+					  scanout->y, pOMAP->scanout, 0, 0, NULL);
+		if (!ret) {
+			ERROR_MSG("Copy crtc to scanout failed");
+			return FALSE;
+		}
+		drmmode_copy_bo_to_shadow(pScrn, scanout->bo, scanout->x,
+				scanout->y);
+		scanout->valid = FALSE;
+	}
+
+	if (drmmode_atomic_set_scanouts(pScrn, OMAP_FLIP_DISABLED)) {
+		pOMAP->flip_mode = OMAP_FLIP_DISABLED;
+		return TRUE;
+	}
+
+	for (i = 0; i < xf86_config->num_crtc; i++) {
+		xf86CrtcPtr crtc = xf86_config->crtc[i];
+		if (!drmmode_set_blit_crtc(pScrn, crtc)) {
+			ERROR_MSG("[CRTC:%u] could not set blit mode",
+					drmmode_crtc_id(crtc));
+			goto unwind;
+		}
+	}
+	pOMAP->flip_mode = OMAP_FLIP_DISABLED;
+	return TRUE;
+
+unwind:
+	/* try restoring already transitioned CRTCs back to flip mode */
+	while (--i >= 0) {
+		xf86CrtcPtr crtc = xf86_config->crtc[i];
+		if (!drmmode_set_flip_crtc(pScrn, crtc, pOMAP->flip_mode))
+			ERROR_MSG("[CRTC:%u] could not restore flip mode",
+					drmmode_crtc_id(crtc));
+	}
+	return FALSE;
+}
+
+/*
+ * Enter flip mode: @mode is OMAP_FLIP_ENABLED for the per-crtc scanouts, or
+ * OMAP_FLIP_SPANNING for the span scanout.
+ *
+ * First, copy contents from the root bo to each invalid scanout of the mode,
+ * and mark it as valid.
+ * Lastly, set all enabled crtcs to scan out from their scanout bos.
+ */
+Bool drmmode_set_flip_mode(ScrnInfoPtr pScrn, enum OMAPFlipMode mode)
+{
+	OMAPPtr pOMAP = OMAPPTR(pScrn);
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+	int i;
+	Bool ret;
+
+	if (pOMAP->flip_mode == mode)
+		return TRUE;
+
+	/* the flip modes only share contents through the root bo */
+	if (pOMAP->flip_mode == OMAP_FLIP_ENABLED ||
+	    pOMAP->flip_mode == OMAP_FLIP_SPANNING) {
+		if (!drmmode_set_blit_mode(pScrn))
+			return FALSE;
+	}
+
+	if (mode == OMAP_FLIP_SPANNING && !drmmode_span_scanout_alloc(pScrn))
+		return FALSE;
+
+	/* the scanouts are filled from the root bo */
+	OMAPShadowUpdate(pScrn);
+
+	/* Only copy if destination is invalid. */
+	for (i = 0; i < pOMAP->num_scanouts; i++) {
+		OMAPScanoutPtr scanout = &pOMAP->scanouts[i];
+
+		if (!scanout->bo)
+			continue;
+		if (scanout->valid)
+			continue;
+		if (scanout->span != (mode == OMAP_FLIP_SPANNING))
+			continue;
+
+		ret = drmmode_copy_bo(pScrn, pOMAP->scanout, 0, 0,
+					  scanout->bo, scanout->x,
+					  scanout->y, NULL);
+		if (!ret) {
+			ERROR_MSG("Copy scanout to crtc failed");
+			return FALSE;
+		}
+		scanout->valid = TRUE;
+	}
+
+	if (drmmode_atomic_set_scanouts(pScrn, mode)) {
+		pOMAP->flip_mode = mode;
+		return TRUE;
+	}
+
+	for (i = 0; i < xf86_config->num_crtc; i++) {
+		xf86CrtcPtr crtc = xf86_config->crtc[i];
+		if (!drmmode_set_flip_crtc(pScrn, crtc, mode)) {
+			ERROR_MSG("[CRTC:%u] could not set flip mode",
+					drmmode_crtc_id(crtc));
+			goto unwind;
+		}
+	}
+	pOMAP->flip_mode = mode;
+	return TRUE;
+
+unwind:
+	/* try restoring already transitioned CRTCs back to blit mode */
+	while (--i >= 0) {
+		xf86CrtcPtr crtc = xf86_config->crtc[i];
+		if (!drmmode_set_blit_crtc(pScrn, crtc))
+			ERROR_MSG("[CRTC:%u] could not restore blit mode",
+					drmmode_crtc_id(crtc));
+	}
+	return FALSE;
+}
+
+/* Drop all per-crtc scanouts */
+static void drmmode_free_scanouts(ScrnInfoPtr pScrn)
+{
+	OMAPPtr pOMAP = OMAPPTR(pScrn);
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+	int i;
+
+	for (i = 0; i < xf86_config->num_crtc; i++) {
+		drmmode_crtc_private_ptr drmmode_crtc =
+				xf86_config->crtc[i]->driver_private;
+
+		drmmode_crtc->scanout = NULL;
+	}
+	for (i = 0; i < pOMAP->num_scanouts; i++)
+		omap_bo_unreference(pOMAP->scanouts[i].bo);
+	free(pOMAP->scanouts);
+	pOMAP->scanouts = NULL;
+	pOMAP->num_scanouts = 0;
+}
+
+/*
+ * Rebuild the scanout table for the current crtc layout: one scanout per
+ * distinct crtc geometry, which the crtcs with that geometry share.  Bos of
+ * geometries still in use are kept, along with their contents.
+ */
+static Bool drmmode_update_scanouts(ScrnInfoPtr pScrn)
+{
+	OMAPPtr pOMAP = OMAPPTR(pScrn);
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+	OMAPScanoutPtr scanouts, old_scanouts = pOMAP->scanouts;
+	int num = 0, num_old = pOMAP->num_scanouts;
+	OMAPScanoutPtr scanout, old;
+	xf86CrtcPtr crtc;
+	struct omap_bo *bo;
+	Bool valid, transformed = FALSE;
+	BoxRec box;
+	int i, num_crtcs = 0;
+
+	/* room for the span scanout as well */
+	scanouts = calloc(xf86_config->num_crtc + 1, sizeof(*scanouts));
+	if (!scanouts) {
+		ERROR_MSG("Scanout table allocation failed");
+		return FALSE;
+	}
+
+	for (i = 0; i < xf86_config->num_crtc; i++) {
+		drmmode_crtc_private_ptr drmmode_crtc;
+
+		crtc = xf86_config->crtc[i];
+		drmmode_crtc = crtc->driver_private;
+		drmmode_crtc->scanout = NULL;
+		if (!crtc->enabled || !crtc->mode.HDisplay ||
+				!crtc->mode.VDisplay)
+			continue;
+
+		/* what shows transformed copies can't flip, nor can all
+		 * crtcs together */
+		if (drmmode_crtc_transformed(crtc)) {
+			transformed = TRUE;
+			continue;
+		}
+
+		/* clones share the scanout */
+		drmmode_crtc_box(crtc, &box);
+		scanout = drmmode_scanout_from_size(scanouts, num, box.x1,
+				box.y1, box.x2 - box.x1, box.y2 - box.y1);
+		if (scanout) {
+			drmmode_crtc->scanout = scanout;
+			continue;
+		}
+
+		scanout = drmmode_scanout_from_size(old_scanouts, num_old,
+				box.x1, box.y1, box.x2 - box.x1,
+				box.y2 - box.y1);
+		if (scanout && scanout->bo) {
+			/* Use existing BO */
+			bo = scanout->bo;
+			valid = scanout->valid;
+			memset(scanout, 0, sizeof(*scanout));
+		} else {
+			/* Allocate a new BO */
+			bo = omap_bo_new_with_depth(pOMAP->dev,
+					box.x2 - box.x1, box.y2 - box.y1,
+					pScrn->depth, pScrn->bitsPerPixel);
+			if (!bo) {
+				ERROR_MSG("Scanout buffer allocation failed");
+				goto fail;
 			}
+			valid = FALSE;
+		}
+		scanout = drmmode_scanout_add(scanouts, &num, crtc, bo);
+		scanout->valid = valid;
+		drmmode_crtc->scanout = scanout;
+
+		/*
+		 * drmmode_scanout_add() adds a reference, but we either:
+		 * * already have a reference, from a recycled BO
+		 * * was given a reference when a new BO was allocated
+		 */
+		omap_bo_unreference(bo);
+		num_crtcs++;
+	}
+
+	/*
+	 * With several crtcs and none showing the whole root, a window
+	 * covering the root can still flip, see drmmode_set_flip_mode().
+	 */
+	if (num_crtcs > 1 && !transformed &&
+	    !drmmode_scanout_from_size(scanouts, num, 0, 0,
+			pScrn->virtualX, pScrn->virtualY)) {
+		scanout = &scanouts[num++];
+		scanout->width = pScrn->virtualX;
+		scanout->height = pScrn->virtualY;
+		scanout->span = TRUE;
+
+		old = drmmode_span_scanout(pOMAP);
+		if (old && old->width == scanout->width &&
+		    old->height == scanout->height) {
+			/* Use existing BO */
+			scanout->bo = old->bo;
+			scanout->valid = old->valid;
+			memset(old, 0, sizeof(*old));
+		}
+	}
+
+	/* Drop the remaining unused BOs. */
+	for (i = 0; i < num_old; i++)
+		if (old_scanouts[i].bo != NULL) {
+			/*
+			 * Set has_resized when discarding active scanouts. This
+			 * ensures we trigger the blit/flip logic which will
+			 * setcrtc to a valid fb if needed
+			 */
+			pOMAP->has_resized = TRUE;
+			omap_bo_unreference(old_scanouts[i].bo);
+		}
+	free(old_scanouts);
+
+	pOMAP->scanouts = scanouts;
+	pOMAP->num_scanouts = num;
+	return TRUE;
+
+fail:
+	/* the old table lost the bos moved over, drop it all */
+	pOMAP->scanouts = scanouts;
+	pOMAP->num_scanouts = num;
+	drmmode_free_scanouts(pScrn);
+	for (i = 0; i < num_old; i++)
+		omap_bo_unreference(old_scanouts[i].bo);
+	free(old_scanouts);
+	pOMAP->has_resized = TRUE;
+	return FALSE;
+}
+
+static Bool
+drmmode_set_mode_major(xf86CrtcPtr crtc, DisplayModePtr mode,
+		Rotation rotation, int x, int y)
+{
+	ScrnInfoPtr pScrn = crtc->scrn;
+	OMAPPtr pOMAP = OMAPPTR(pScrn);
+	xf86CrtcConfigPtr   xf86_config = XF86_CRTC_CONFIG_PTR(crtc->scrn);
+	Bool ret;
+	int i;
+
+	TRACE_ENTER();
+
+	drmmode_crtc_init_rotation(crtc);
+	ret = xf86CrtcRotate(crtc);
+	if (!ret)
+		goto done;
+
+	// On a modeset, we should switch to blit mode to get a single scanout buffer
+	// and we will switch back to flip mode on the next flip request
+	if (pOMAP->flip_mode == OMAP_FLIP_DISABLED) {
+		int bo_x, bo_y;
+		struct omap_bo *bo = drmmode_blit_scanout(crtc, &bo_x, &bo_y);
+
+		ret = drmmode_set_crtc(pScrn, crtc, bo, bo_x, bo_y);
+	} else
+		ret = drmmode_set_blit_mode(pScrn);
+	if (!ret)
+		goto done;
+
+	/* no longer shown, and must not be flipped to */
+	if (!drmmode_crtc_needs_copies(crtc))
+		drmmode_copies_free(crtc);
+
+	// Fixme - Intel puts this function here, and Nouveau puts it at the end
+	// of this function -> determine what's best for TI'S OMAP4:
+	if (crtc->funcs->gamma_set)
+		crtc->funcs->gamma_set(crtc, crtc->gamma_red, crtc->gamma_green,
+				       crtc->gamma_blue, crtc->gamma_size);
+
+	ret = drmmode_update_scanouts(pScrn);
+	if (!ret) {
+		ERROR_MSG("Update scanouts failed");
+		goto done;
+	}
+
+	// FIXME - DO WE NEED TO CALL TO THE PVR EXA/DRI2 CODE TO UPDATE THEM???
+
+	/* Turn on any outputs on this crtc that may have been disabled: */
+	for (i = 0; i < xf86_config->num_output; i++) {
+		xf86OutputPtr output = xf86_config->output[i];
+
+		if (output->crtc != crtc)
+			continue;
+
+		drmmode_output_dpms(output, DPMSModeOn);
+	}
+
+	/*
+	 * The screen has reconfigured, so reload hw cursor images as needed,
+	 * and adjust cursor positions.
+	 */
+	xf86_reload_cursors(pScrn->pScreen);
+
+done:
+	TRACE_EXIT();
+	return ret;
+}
+
+/* The cursor size before kernels told theirs, and the smallest we use */
+#define DRMMODE_CURSOR_SIZE	64
+
+/* xorg-server 1.19 moves the cursor from its input thread */
+#if GET_ABI_MAJOR(ABI_XINPUT_VERSION) >= 23
+#define drmmode_input_lock()	input_lock()
+#define drmmode_input_unlock()	input_unlock()
+#else
+#define drmmode_input_lock()	OsBlockSIGIO()
+#define drmmode_input_unlock()	OsReleaseSIGIO()
+#endif
+
+/* How long @crtc shows a frame, in ms, 0 if we can't tell */
+static CARD32
+drmmode_crtc_frame_ms(xf86CrtcPtr crtc)
+{
+	double refresh = xf86ModeVRefresh(&crtc->mode);
+
+	return refresh > 0 ? 1000 / refresh : 0;
+}
+
+static void
+drmmode_cursor_move(xf86CrtcPtr crtc)
+{
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	drmmode_ptr drmmode = drmmode_crtc->drmmode;
+
+	drmModeMoveCursor(drmmode->fd, drmmode_crtc->id,
+			drmmode_crtc->cursor_x, drmmode_crtc->cursor_y);
+	drmmode_crtc->cursor_moved = FALSE;
+	drmmode_crtc->cursor_time = GetTimeInMillis();
+}
+
+/* Do cursor moves of @crtc go with its atomic flips? */
+static Bool
+drmmode_cursor_atomic(xf86CrtcPtr crtc)
+{
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+
+	return drmmode_crtc->drmmode->atomic && drmmode_crtc->cursor_plane;
+}
+
+/*
+ * Mice report up to 1000 times a second, much more often than the cursor
+ * is shown anywhere, and each move is an ioctl which may wait for the
+ * vblank.  So a crtc passes on at most one move a frame, and the last move
+ * of a frame goes out with drmmode_cursor_update() unless another follows.
+ * With atomic flips, a move held back may also go with the next flip, see
+ * drmmode_atomic_page_flip().
+ */
+static void
+drmmode_set_cursor_position(xf86CrtcPtr crtc, int x, int y)
+{
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+
+	drmmode_crtc->cursor_x = x;
+	drmmode_crtc->cursor_y = y;
+	drmmode_crtc->cursor_moved = TRUE;
+	if (GetTimeInMillis() - drmmode_crtc->cursor_time >=
+			drmmode_crtc_frame_ms(crtc))
+		drmmode_cursor_move(crtc);
+}
+
+/*
+ * Called before the server sleeps: pass on the cursor moves held back, or
+ * shorten @timeout to wake up when they are due.
+ */
+void
+drmmode_cursor_update(ScrnInfoPtr pScrn, void *timeout)
+{
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+	int i;
+
+	drmmode_input_lock();
+	for (i = 0; i < xf86_config->num_crtc; i++) {
+		xf86CrtcPtr crtc = xf86_config->crtc[i];
+		drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+		CARD32 frame, elapsed;
+
+		if (!crtc->enabled || !drmmode_crtc->cursor_moved)
+			continue;
+
+		frame = drmmode_crtc_frame_ms(crtc);
+		elapsed = GetTimeInMillis() - drmmode_crtc->cursor_time;
+		if (elapsed < frame) {
+			AdjustWaitForDelay(timeout, frame - elapsed);
+			continue;
+		}
+		drmmode_cursor_move(crtc);
+	}
+	drmmode_input_unlock();
+}
+
+static void
+drmmode_hide_cursor(xf86CrtcPtr crtc)
+{
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	drmmode_ptr drmmode = drmmode_crtc->drmmode;
+
+	drmmode_crtc->cursor_visible = FALSE;
+	drmModeSetCursor(drmmode->fd, drmmode_crtc_id(crtc), 0,
+			drmmode->cursor_width, drmmode->cursor_height);
+}
+
+/*
+ * Put the image of @cursor in a bo of @width x @height, transparent beyond
+ * the image.
+ */
+static Bool
+drmmode_cursor_upload(ScrnInfoPtr pScrn, drmmode_cursor_ptr cursor,
+		int width, int height)
+{
+	OMAPPtr pOMAP = OMAPPTR(pScrn);
+	uint8_t *dst;
+	int pitch, y;
+
+	if (!cursor->bo || omap_bo_width(cursor->bo) != width ||
+	    omap_bo_height(cursor->bo) != height) {
+		omap_bo_unreference(cursor->bo);
+		cursor->bo = omap_bo_new_with_format(pOMAP->dev, width, height,
+				DRM_FORMAT_ARGB8888, 32);
+		if (!cursor->bo) {
+			ERROR_MSG("error allocating hw cursor buffer");
+			return FALSE;
+		}
+	}
+
+	dst = omap_bo_map(cursor->bo);
+	if (!dst)
+		return FALSE;
+	pitch = omap_bo_pitch(cursor->bo);
+
+	omap_bo_cpu_prep(cursor->bo, OMAP_GEM_WRITE);
+	if (cursor->width < width || cursor->height < height)
+		memset(dst, 0, pitch * height);
+	for (y = 0; y < cursor->height; y++)
+		memcpy(dst + y * pitch, cursor->image + y * cursor->width,
+				cursor->width * 4);
+	omap_bo_cpu_fini(cursor->bo, 0);
+	return TRUE;
+}
+
+static void
+drmmode_show_cursor(xf86CrtcPtr crtc)
+{
+	ScrnInfoPtr pScrn = crtc->scrn;
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	drmmode_ptr drmmode = drmmode_crtc->drmmode;
+	drmmode_cursor_ptr cursor = drmmode_crtc->cursor;
+	int width = drmmode->cursor_width, height = drmmode->cursor_height;
+	uint32_t handle = 0;
+
+	drmmode_crtc->cursor_visible = TRUE;
+	if (drmmode_crtc->cursor_moved)
+		drmmode_cursor_move(crtc);
+	if (cursor) {
+		handle = omap_bo_handle(cursor->bo);
+		width = omap_bo_width(cursor->bo);
+		height = omap_bo_height(cursor->bo);
+	}
+	if (!drmModeSetCursor(drmmode->fd, drmmode_crtc->id, handle, width,
+			height) || !cursor)
+		return;
+
+	/* some hardware takes nothing but its full size */
+	if (width == drmmode->cursor_width &&
+	    height == drmmode->cursor_height)
+		return;
+	INFO_MSG("[CRTC:%u] %dx%d cursor refused, using %dx%d only",
+			drmmode_crtc->id, width, height,
+			drmmode->cursor_width, drmmode->cursor_height);
+	drmmode->cursor_full_size = TRUE;
+	if (drmmode_cursor_upload(pScrn, cursor, drmmode->cursor_width,
+			drmmode->cursor_height))
+		drmModeSetCursor(drmmode->fd, drmmode_crtc->id,
+				omap_bo_handle(cursor->bo),
+				drmmode->cursor_width, drmmode->cursor_height);
+}
+
+/*
+ * The smallest cursor size holding what is not transparent in @image, the
+ * full-size image xf86 hands us: 64x64, 128x128 and so on up to the
+ * largest the kernel takes.  Smaller cursors are quicker to upload.
+ */
+static void
+drmmode_cursor_size(drmmode_ptr drmmode, const CARD32 *image, int *width,
+		int *height)
+{
+	int max_width = drmmode->cursor_width;
+	int max_height = drmmode->cursor_height;
+	int x, y, used_width = 0, used_height = 0, size;
+
+	*width = max_width;
+	*height = max_height;
+	if (drmmode->cursor_full_size)
+		return;
+
+	for (y = 0; y < max_height; y++) {
+		const CARD32 *row = image + y * max_width;
+
+		for (x = 0; x < max_width; x++) {
+			if (row[x]) {
+				used_width = max(used_width, x + 1);
+				used_height = y + 1;
+			}
+		}
+	}
+
+	for (size = DRMMODE_CURSOR_SIZE; size < max(used_width, used_height);
+			size *= 2)
+		;
+	*width = min(size, max_width);
+	*height = min(size, max_height);
+}
+
+/* FNV-1a, to tell cursor images apart without comparing them all */
+static uint32_t
+drmmode_cursor_hash(const CARD32 *image, int count)
+{
+	uint32_t hash = 2166136261u;
+	int i;
+
+	for (i = 0; i < count; i++)
+		hash = (hash ^ image[i]) * 16777619u;
+	return hash;
+}
+
+/*
+ * Applications and the server cycle through a handful of cursors (arrow,
+ * text, busy), so each crtc keeps the last few in their own bos.  An image
+ * seen before is shown again by just pointing the crtc at its bo, and a new
+ * one goes into the least recently used bo, never the one on screen, which
+ * would tear.
+ */
+static void
+drmmode_load_cursor_argb(xf86CrtcPtr crtc, CARD32 *image)
+{
+	ScrnInfoPtr pScrn = crtc->scrn;
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	drmmode_ptr drmmode = drmmode_crtc->drmmode;
+	drmmode_cursor_ptr cursor = NULL, victim = NULL;
+	CARD32 *crop;
+	uint32_t hash;
+	int width, height, y, i;
+
+	/* the part of the image we keep */
+	drmmode_cursor_size(drmmode, image, &width, &height);
+	crop = malloc(width * height * 4);
+	if (!crop)
+		return;
+	for (y = 0; y < height; y++)
+		memcpy(crop + y * width, image + y * drmmode->cursor_width,
+				width * 4);
+	hash = drmmode_cursor_hash(crop, width * height);
+
+	for (i = 0; i < DRMMODE_CURSOR_CACHE; i++) {
+		drmmode_cursor_ptr c = &drmmode_crtc->cursors[i];
+
+		if (c->image && c->width == width && c->height == height &&
+		    c->hash == hash &&
+		    !memcmp(c->image, crop, width * height * 4)) {
+			cursor = c;
+			break;
+		}
+		if (c != drmmode_crtc->cursor &&
+		    (!victim || c->used < victim->used))
+			victim = c;
+	}
+
+	if (cursor) {
+		free(crop);
+	} else {
+		if (!victim) {
+			free(crop);
+			return;
+		}
+		free(victim->image);
+		victim->image = crop;
+		victim->width = width;
+		victim->height = height;
+		victim->hash = hash;
+		if (!drmmode_cursor_upload(pScrn, victim, width, height)) {
+			free(victim->image);
+			victim->image = NULL;
+			return;
+		}
+		cursor = victim;
+	}
+
+	cursor->used = ++drmmode_crtc->cursor_clock;
+	if (cursor == drmmode_crtc->cursor)
+		return;
+	drmmode_crtc->cursor = cursor;
+	if (drmmode_crtc->cursor_visible)
+		drmmode_show_cursor(crtc);
+}
+
+static void
+drmmode_cursors_free(drmmode_crtc_private_ptr drmmode_crtc)
+{
+	int i;
+
+	for (i = 0; i < DRMMODE_CURSOR_CACHE; i++) {
+		omap_bo_unreference(drmmode_crtc->cursors[i].bo);
+		free(drmmode_crtc->cursors[i].image);
+	}
+}
+
+#ifdef OMAP_SUPPORT_GAMMA
+static void
+drmmode_gamma_set(xf86CrtcPtr crtc, CARD16 *red, CARD16 *green, CARD16 *blue,
+		int size)
+{
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	drmmode_ptr drmmode = drmmode_crtc->drmmode;
+	int ret;
+
+	ret = drmModeCrtcSetGamma(drmmode->fd, drmmode_crtc_id(crtc),
+			size, red, green, blue);
+	if (ret != 0) {
+		xf86DrvMsg(crtc->scrn->scrnIndex, X_ERROR,
+				"failed to set gamma: %s\n", strerror(-ret));
+	}
+}
+#endif
+
+static void
+drmmode_crtc_destroy(xf86CrtcPtr crtc)
+{
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+
+	if (drmmode_crtc->mode_blob_id)
+		drmModeDestroyPropertyBlob(drmmode_crtc->drmmode->fd,
+				drmmode_crtc->mode_blob_id);
+	drmmode_cursors_free(drmmode_crtc);
+	free(drmmode_crtc);
+	crtc->driver_private = NULL;
+}
+
+/*
+ * The xf86 shadow of a transformed crtc, which it renders into and we scan
+ * out, see drmmode_blit_scanout().
+ */
+static void *
+drmmode_shadow_allocate(xf86CrtcPtr crtc, int width, int height)
+{
+	ScrnInfoPtr pScrn = crtc->scrn;
+	OMAPPtr pOMAP = OMAPPTR(pScrn);
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+
+	drmmode_crtc->rotate_bo = omap_bo_new_with_depth(pOMAP->dev, width,
+			height, pScrn->depth, pScrn->bitsPerPixel);
+	if (!drmmode_crtc->rotate_bo) {
+		ERROR_MSG("[CRTC:%u] shadow allocation failed",
+				drmmode_crtc->id);
+		return NULL;
+	}
+	return omap_bo_map(drmmode_crtc->rotate_bo);
+}
+
+static PixmapPtr
+drmmode_shadow_create(xf86CrtcPtr crtc, void *data, int width, int height)
+{
+	ScrnInfoPtr pScrn = crtc->scrn;
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	PixmapPtr pixmap;
+
+	if (!data)
+		data = drmmode_shadow_allocate(crtc, width, height);
+	if (!data)
+		return NULL;
+
+	pixmap = GetScratchPixmapHeader(pScrn->pScreen, width, height,
+			pScrn->depth, pScrn->bitsPerPixel,
+			omap_bo_pitch(drmmode_crtc->rotate_bo), data);
+	if (!pixmap)
+		ERROR_MSG("[CRTC:%u] shadow pixmap creation failed",
+				drmmode_crtc->id);
+	return pixmap;
+}
+
+static void
+drmmode_shadow_destroy(xf86CrtcPtr crtc, PixmapPtr pixmap, void *data)
+{
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+
+	if (pixmap)
+		FreeScratchPixmapHeader(pixmap);
+	if (data) {
+		omap_bo_unreference(drmmode_crtc->rotate_bo);
+		drmmode_crtc->rotate_bo = NULL;
+	}
+}
+
+static const xf86CrtcFuncsRec drmmode_crtc_funcs = {
+		.destroy = drmmode_crtc_destroy,
+		.dpms = drmmode_crtc_dpms,
+		.set_mode_major = drmmode_set_mode_major,
+		.set_cursor_position = drmmode_set_cursor_position,
+		.show_cursor = drmmode_show_cursor,
+		.hide_cursor = drmmode_hide_cursor,
+		.load_cursor_argb = drmmode_load_cursor_argb,
+		.shadow_allocate = drmmode_shadow_allocate,
+		.shadow_create = drmmode_shadow_create,
+		.shadow_destroy = drmmode_shadow_destroy,
+#ifdef OMAP_SUPPORT_GAMMA
+		.gamma_set = drmmode_gamma_set,
+#endif
+};
+
+
+static Bool
+drmmode_crtc_pre_init(ScrnInfoPtr pScrn, drmmode_ptr drmmode,
+		const drmModeResPtr mode_res,
+		const drmModePlaneResPtr plane_res, int num)
+{
+	xf86CrtcPtr crtc;
+	drmmode_crtc_private_ptr drmmode_crtc;
+	Bool ret;
+	uint32_t crtc_id = mode_res->crtcs[num];
+
+	TRACE_ENTER();
+
+	drmmode_crtc = calloc(1, sizeof *drmmode_crtc);
+	if (!drmmode_crtc) {
+		ERROR_MSG("CRTC[%u]: Failed to allocate drmmode_crtc",
+				crtc_id);
+		ret = FALSE;
+		goto out;
+	}
+	drmmode_crtc->id = crtc_id;
+	drmmode_crtc->index = num;
+	drmmode_crtc->drmmode = drmmode;
+	drmmode_crtc->first_modeset = TRUE;
+	RegionNull(&drmmode_crtc->copy_damage[0]);
+	RegionNull(&drmmode_crtc->copy_damage[1]);
+	RegionNull(&drmmode_crtc->dirty);
+	if (drmmode->atomic &&
+	    !drmmode_atomic_init_crtc(pScrn, drmmode_crtc, plane_res, num)) {
+		INFO_MSG("[CRTC:%u] no atomic properties, using legacy modesetting",
+				crtc_id);
+		drmmode->atomic = FALSE;
+	}
+	drmmode_rotation_init(pScrn, drmmode_crtc, plane_res, num);
+
+	crtc = xf86CrtcCreate(pScrn, &drmmode_crtc_funcs);
+	if (crtc == NULL) {
+		ERROR_MSG("CRTC[%u]: Failed to create xf86Crtc", crtc_id);
+		ret = FALSE;
+		goto err_free_drmmode_crtc;
+	}
+
+	crtc->driver_private = drmmode_crtc;
+
+	ret = TRUE;
+	goto out;
+
+err_free_drmmode_crtc:
+	free(drmmode_crtc);
+out:
+	TRACE_EXIT();
+	return ret;
+}
+
+static uint64_t
+drmmode_connector_prop_value(drmModeConnectorPtr koutput, uint32_t prop_id)
+{
+	int i;
+
+	for (i = 0; prop_id && i < koutput->count_props; i++)
+		if (koutput->props[i] == prop_id)
+			return koutput->prop_values[i];
+	return 0;
+}
+
+/*
+ * Replace the output's connector with a freshly probed one, noting whether
+ * the modes have to be read again.
+ */
+static void
+drmmode_output_set_connector(xf86OutputPtr output,
+		drmModeConnectorPtr koutput)
+{
+	drmmode_output_private_ptr drmmode_output = output->driver_private;
+	drmModeConnectorPtr old = drmmode_output->mode_output;
+	uint32_t edid_id = drmmode_output->edid_id;
+
+	if (old->connection != koutput->connection ||
+			old->count_modes != koutput->count_modes ||
+			memcmp(old->modes, koutput->modes,
+					koutput->count_modes * sizeof(*koutput->modes)) ||
+			drmmode_connector_prop_value(old, edid_id) !=
+			drmmode_connector_prop_value(koutput, edid_id))
+		drmmode_output->modes_stale = TRUE;
+
+	drmModeFreeConnector(old);
+	drmmode_output->mode_output = koutput;
+}
+
+static xf86OutputStatus
+drmmode_output_detect(xf86OutputPtr output)
+{
+	drmmode_output_private_ptr drmmode_output = output->driver_private;
+	drmmode_ptr drmmode = drmmode_output->drmmode;
+	drmModeConnectorPtr koutput;
+	xf86OutputStatus status;
+
+	/* at startup and after a hotplug the connectors were just probed */
+	if (!drmmode->outputs_probed) {
+		/* go to the hw and retrieve a new output struct */
+		koutput = drmModeGetConnector(drmmode->fd, drmmode_output->id);
+		if (koutput)
+			drmmode_output_set_connector(output, koutput);
+	}
+
+	switch (drmmode_output->mode_output->connection) {
+	case DRM_MODE_CONNECTED:
+		status = XF86OutputStatusConnected;
+		break;
+	case DRM_MODE_DISCONNECTED:
+		status = XF86OutputStatusDisconnected;
+		break;
+	default:
+	case DRM_MODE_UNKNOWNCONNECTION:
+		status = XF86OutputStatusUnknown;
+		break;
+	}
+	return status;
+}
+
+static Bool
+drmmode_output_mode_valid(xf86OutputPtr output, DisplayModePtr mode)
+{
+	if (mode->type & M_T_DEFAULT)
+		/* Default modes are harmful here. */
+		return MODE_BAD;
+
+	return MODE_OK;
+}
+
+static DisplayModePtr
+drmmode_output_get_modes(xf86OutputPtr output)
+{
+	ScrnInfoPtr pScrn = output->scrn;
+	drmmode_output_private_ptr drmmode_output = output->driver_private;
+	drmModeConnectorPtr koutput = drmmode_output->mode_output;
+	drmmode_ptr drmmode = drmmode_output->drmmode;
+	DisplayModePtr Mode;
+	xf86MonPtr ddc_mon = NULL;
+	uint32_t blob_id;
+	int i;
+
+	/* the EDID is only read again when the kernel replaced its blob */
+	blob_id = drmmode_connector_prop_value(koutput, drmmode_output->edid_id);
+	if (drmmode_output->edid_blob &&
+			drmmode_output->edid_blob->id != blob_id) {
+		drmModeFreePropertyBlob(drmmode_output->edid_blob);
+		drmmode_output->edid_blob = NULL;
+	}
+	if (!drmmode_output->edid_blob && blob_id)
+		drmmode_output->edid_blob =
+				drmModeGetPropertyBlob(drmmode->fd, blob_id);
+
+	if (drmmode_output->edid_blob)
+		ddc_mon = xf86InterpretEDID(pScrn->scrnIndex,
+				drmmode_output->edid_blob->data);
+
+	if (ddc_mon) {
+		xf86OutputSetEDID(output, ddc_mon);
+		xf86SetDDCproperties(pScrn, ddc_mon);
+	}
+
+	if (drmmode_output->modes_stale || !drmmode_output->modes) {
+		while (drmmode_output->modes)
+			xf86DeleteMode(&drmmode_output->modes,
+					drmmode_output->modes);
+
+		DEBUG_MSG("count_modes: %d", koutput->count_modes);
+
+		/* modes should already be available */
+		for (i = 0; i < koutput->count_modes; i++) {
+			Mode = xnfalloc(sizeof(DisplayModeRec));
+
+			drmmode_ConvertFromKMode(pScrn, &koutput->modes[i],
+					Mode);
+			drmmode_output->modes =
+					xf86ModesAdd(drmmode_output->modes, Mode);
+		}
+		drmmode_output->modes_stale = FALSE;
+	}
+
+	return xf86DuplicateModes(pScrn, drmmode_output->modes);
+}
+
+static void
+drmmode_output_destroy(xf86OutputPtr output)
+{
+	drmmode_output_private_ptr drmmode_output = output->driver_private;
+	int i;
+
+	if (drmmode_output->edid_blob)
+		drmModeFreePropertyBlob(drmmode_output->edid_blob);
+	while (drmmode_output->modes)
+		xf86DeleteMode(&drmmode_output->modes, drmmode_output->modes);
+	for (i = 0; i < drmmode_output->num_props; i++) {
+		drmModeFreeProperty(drmmode_output->props[i].mode_prop);
+		free(drmmode_output->props[i].atoms);
+	}
+	free(drmmode_output->props);
+	drmModeFreeConnector(drmmode_output->mode_output);
+	free(drmmode_output);
+	output->driver_private = NULL;
+}
+
+static void
+drmmode_output_dpms(xf86OutputPtr output, int mode)
+{
+	ScrnInfoPtr pScrn = output->scrn;
+	drmmode_output_private_ptr drmmode_output = output->driver_private;
+	drmmode_ptr drmmode = drmmode_output->drmmode;
+	int ret;
+
+	if (!drmmode_output->dpms_id)
+		return;
+
+	ret = drmModeConnectorSetProperty(drmmode->fd, drmmode_output->id,
+			drmmode_output->dpms_id, mode);
+	if (ret)
+		ERROR_MSG("[CONNECTOR:%u] Failed to set [DPMS:%u]",
+				drmmode_output->id, mode);
+}
+
+static Bool
+drmmode_property_ignore(drmModePropertyPtr prop)
+{
+	if (!prop)
+		return TRUE;
+	/* ignore blob prop */
+	if (prop->flags & DRM_MODE_PROP_BLOB)
+		return TRUE;
+	/* ignore standard property */
+	if (!strcmp(prop->name, "EDID") ||
+			!strcmp(prop->name, "DPMS"))
+		return TRUE;
+
+	return FALSE;
+}
+
+static void
+drmmode_output_create_resources(xf86OutputPtr output)
+{
+	drmmode_output_private_ptr drmmode_output = output->driver_private;
+	drmModeConnectorPtr mode_output = drmmode_output->mode_output;
+	drmmode_ptr drmmode = drmmode_output->drmmode;
+	drmModePropertyPtr drmmode_prop;
+	uint32_t value;
+	int i, j, err;
+
+	drmmode_output->props = calloc(mode_output->count_props,
+			sizeof *drmmode_output->props);
+	if (!drmmode_output->props)
+		return;
+
+	drmmode_output->num_props = 0;
+	for (i = 0, j = 0; i < mode_output->count_props; i++) {
+		drmmode_prop = drmModeGetProperty(drmmode->fd, mode_output->props[i]);
+		if (drmmode_property_ignore(drmmode_prop)) {
+			drmModeFreeProperty(drmmode_prop);
+			continue;
+		}
+		drmmode_output->props[j].mode_prop = drmmode_prop;
+		drmmode_output->props[j].index = i;
+		drmmode_output->num_props++;
+		j++;
+	}
+
+	for (i = 0; i < drmmode_output->num_props; i++) {
+		drmmode_prop_ptr p = &drmmode_output->props[i];
+		drmmode_prop = p->mode_prop;
+
+		value = drmmode_output->mode_output->prop_values[p->index];
+		p->value = value;
+		p->value_valid = TRUE;
+
+		if (drmmode_prop->flags & DRM_MODE_PROP_RANGE) {
+			INT32 range[2];
+
+			p->num_atoms = 1;
+			p->atoms = calloc(p->num_atoms, sizeof *p->atoms);
+			if (!p->atoms)
+				continue;
+			p->atoms[0] = MakeAtom(drmmode_prop->name, strlen(drmmode_prop->name), TRUE);
+			range[0] = drmmode_prop->values[0];
+			range[1] = drmmode_prop->values[1];
+			err = RRConfigureOutputProperty(output->randr_output, p->atoms[0],
+					FALSE, TRUE,
+					drmmode_prop->flags & DRM_MODE_PROP_IMMUTABLE ? TRUE : FALSE,
+							2, range);
+			if (err != 0) {
+				xf86DrvMsg(output->scrn->scrnIndex, X_ERROR,
+						"RRConfigureOutputProperty error, %d\n", err);
+			}
+			err = RRChangeOutputProperty(output->randr_output, p->atoms[0],
+					XA_INTEGER, 32, PropModeReplace, 1,
+					&value, FALSE, FALSE);
+			if (err != 0) {
+				xf86DrvMsg(output->scrn->scrnIndex, X_ERROR,
+						"RRChangeOutputProperty error, %d\n", err);
+			}
+		} else if (drmmode_prop->flags & DRM_MODE_PROP_ENUM) {
+			p->num_atoms = drmmode_prop->count_enums + 1;
+			p->atoms = calloc(p->num_atoms, sizeof *p->atoms);
+			if (!p->atoms)
+				continue;
+			p->atoms[0] = MakeAtom(drmmode_prop->name, strlen(drmmode_prop->name), TRUE);
+			for (j = 1; j <= drmmode_prop->count_enums; j++) {
+				struct drm_mode_property_enum *e = &drmmode_prop->enums[j-1];
+				p->atoms[j] = MakeAtom(e->name, strlen(e->name), TRUE);
+			}
+			err = RRConfigureOutputProperty(output->randr_output, p->atoms[0],
+					FALSE, FALSE,
+					drmmode_prop->flags & DRM_MODE_PROP_IMMUTABLE ? TRUE : FALSE,
+							p->num_atoms - 1, (INT32 *)&p->atoms[1]);
+			if (err != 0) {
+				xf86DrvMsg(output->scrn->scrnIndex, X_ERROR,
+						"RRConfigureOutputProperty error, %d\n", err);
+			}
+			for (j = 0; j < drmmode_prop->count_enums; j++)
+				if (drmmode_prop->enums[j].value == value)
+					break;
+			/* there's always a matching value */
+			err = RRChangeOutputProperty(output->randr_output, p->atoms[0],
+					XA_ATOM, 32, PropModeReplace, 1, &p->atoms[j+1], FALSE, FALSE);
+			if (err != 0) {
+				xf86DrvMsg(output->scrn->scrnIndex, X_ERROR,
+						"RRChangeOutputProperty error, %d\n", err);
+			}
+		}
+	}
+}
+
+static Bool
+drmmode_output_set_property(xf86OutputPtr output, Atom property,
+		RRPropertyValuePtr value)
+{
+	drmmode_output_private_ptr drmmode_output = output->driver_private;
+	drmmode_ptr drmmode = drmmode_output->drmmode;
+	int i, ret;
+
+	for (i = 0; i < drmmode_output->num_props; i++) {
+		drmmode_prop_ptr p = &drmmode_output->props[i];
+
+		if (p->atoms[0] != property)
+			continue;
+
+		if (p->mode_prop->flags & DRM_MODE_PROP_RANGE) {
+			uint32_t val;
+
+			if (value->type != XA_INTEGER || value->format != 32 ||
+					value->size != 1)
+				return FALSE;
+			val = *(uint32_t *)value->data;
+
+			ret = drmModeConnectorSetProperty(drmmode->fd,
+					drmmode_output->id,
+					p->mode_prop->prop_id, (uint64_t)val);
+
+			if (ret)
+				return FALSE;
+
+			p->value = val;
+			p->value_valid = TRUE;
+			return TRUE;
+
+		} else if (p->mode_prop->flags & DRM_MODE_PROP_ENUM) {
+			Atom	atom;
+			const char	*name;
+			int		j;
+
+			if (value->type != XA_ATOM || value->format != 32 || value->size != 1)
+				return FALSE;
+			memcpy(&atom, value->data, 4);
+			name = NameForAtom(atom);
+			if (name == NULL)
+				return FALSE;
+
+			/* search for matching name string, then set its value down */
+			for (j = 0; j < p->mode_prop->count_enums; j++) {
+				if (!strcmp(p->mode_prop->enums[j].name, name)) {
+					ret = drmModeConnectorSetProperty(drmmode->fd,
+							drmmode_output->id,
+							p->mode_prop->prop_id,
+							p->mode_prop->enums[j].value);
+
+					if (ret)
+						return FALSE;
+
+					p->value = p->mode_prop->enums[j].value;
+					p->value_valid = TRUE;
+					return TRUE;
+				}
+			}
+
+			return FALSE;
+		}
+	}
+
+	return TRUE;
+}
+
+/*
+ * Read the connector's property values, without the mode probe
+ * GETCONNECTOR can start.
+ */
+static void
+drmmode_output_read_props(xf86OutputPtr output)
+{
+	drmmode_output_private_ptr drmmode_output = output->driver_private;
+	drmmode_ptr drmmode = drmmode_output->drmmode;
+	drmModeObjectPropertiesPtr props;
+	uint32_t i;
+	int j;
+
+	props = drmModeObjectGetProperties(drmmode->fd, drmmode_output->id,
+			DRM_MODE_OBJECT_CONNECTOR);
+	if (!props)
+		return;
+
+	for (i = 0; i < props->count_props; i++) {
+		for (j = 0; j < drmmode_output->num_props; j++) {
+			drmmode_prop_ptr p = &drmmode_output->props[j];
+
+			if (p->mode_prop->prop_id != props->props[i])
+				continue;
+			p->value = props->prop_values[i];
+			p->value_valid = TRUE;
+		}
+	}
+	drmModeFreeObjectProperties(props);
+}
+
+/* Uevents are how the kernel tells us property values changed */
+static void
+drmmode_output_invalidate_props(xf86OutputPtr output)
+{
+	drmmode_output_private_ptr drmmode_output = output->driver_private;
+	int i;
+
+	for (i = 0; i < drmmode_output->num_props; i++)
+		drmmode_output->props[i].value_valid = FALSE;
+}
+
+static Bool
+drmmode_output_get_property(xf86OutputPtr output, Atom property)
+{
+	drmmode_output_private_ptr drmmode_output = output->driver_private;
+	drmmode_prop_ptr p = NULL;
+	uint64_t value;
+	int err, i;
+
+	for (i = 0; i < drmmode_output->num_props; i++) {
+		p = &drmmode_output->props[i];
+		if (p->atoms[0] == property)
+			break;
+	}
+	if (i == drmmode_output->num_props)
+		return FALSE;
+
+	if (!p->value_valid && output->scrn->vtSema)
+		drmmode_output_read_props(output);
+
+	if (p->value_valid)
+		value = p->value;
+	else if (!output->scrn->vtSema)
+		value = drmmode_output->mode_output->prop_values[p->index];
+	else
+		return FALSE;
+
+	if (p->mode_prop->flags & DRM_MODE_PROP_RANGE) {
+		err = RRChangeOutputProperty(output->randr_output,
+				property, XA_INTEGER, 32,
+				PropModeReplace, 1, &value,
+				FALSE, FALSE);
+
+		return !err;
+	} else if (p->mode_prop->flags & DRM_MODE_PROP_ENUM) {
+		int		j;
+
+		/* search for matching name string, then set its value down */
+		for (j = 0; j < p->mode_prop->count_enums; j++) {
+			if (p->mode_prop->enums[j].value == value)
+				break;
+		}
+
+		err = RRChangeOutputProperty(output->randr_output, property,
+				XA_ATOM, 32, PropModeReplace, 1,
+				&p->atoms[j+1], FALSE, FALSE);
+
+		return !err;
+	}
+
+	return FALSE;
+}
+
+static const xf86OutputFuncsRec drmmode_output_funcs = {
+		.create_resources = drmmode_output_create_resources,
+		.dpms = drmmode_output_dpms,
+		.detect = drmmode_output_detect,
+		.mode_valid = drmmode_output_mode_valid,
+		.get_modes = drmmode_output_get_modes,
+		.set_property = drmmode_output_set_property,
+		.get_property = drmmode_output_get_property,
+		.destroy = drmmode_output_destroy
+};
+
+// FIXME - Eliminate the following values that aren't accurate for OMAP4:
+const char *output_names[] = { "None",
+		"VGA",
+		"DVI-I",
+		"DVI-D",
+		"DVI-A",
+		"Composite",
+		"SVIDEO",
+		"LVDS",
+		"CTV",
+		"DIN",
+		"DP",
+		"HDMI",
+		"HDMI",
+		"TV",
+		"eDP",
+};
+#define NUM_OUTPUT_NAMES (sizeof(output_names) / sizeof(output_names[0]))
+
+static Bool
+drmmode_output_pre_init(ScrnInfoPtr pScrn, drmmode_ptr drmmode,
+		drmModeConnectorPtr koutput)
+{
+	xf86OutputPtr output;
+	drmModeEncoderPtr kencoder;
+	drmmode_output_private_ptr drmmode_output;
+	char name[32];
+	CARD32 possible_crtcs, possible_clones;
+	uint32_t connector_id = koutput->connector_id;
+
+	Bool ret;
+
+	TRACE_ENTER();
+
+	/*
+	 * Fetch possible clones and crtcs from this connector's encoder.
+	 * We assume here that there is only one possible encoder for this
+	 * connector.
+	 */
+	kencoder = drmModeGetEncoder(drmmode->fd, koutput->encoders[0]);
+	if (!kencoder) {
+		ERROR_MSG("[CONNECTOR:%u] Failed drmModeGetEncoder",
+				connector_id);
+		ret = FALSE;
+		goto err_free_drm_mode_connector;
+	}
+
+	possible_crtcs = kencoder->possible_crtcs;
+	possible_clones = kencoder->possible_clones;
+	drmModeFreeEncoder(kencoder);
+
+	if (koutput->connector_type >= NUM_OUTPUT_NAMES)
+		snprintf(name, 32, "Unknown%d-%d", koutput->connector_type,
+				koutput->connector_type_id);
+	else
+		snprintf(name, 32, "%s-%d",
+				output_names[koutput->connector_type],
+				koutput->connector_type_id);
+
+	drmmode_output = calloc(1, sizeof *drmmode_output);
+	if (!drmmode_output) {
+		ERROR_MSG("[CONNECTOR:%u] Failed to allocate drmmode_output",
+				connector_id);
+		ret = FALSE;
+		goto err_free_drm_mode_connector;
+	}
+
+	drmmode_output->id = connector_id;
+	drmmode_output->mode_output = koutput;
+	drmmode_output->drmmode = drmmode;
+	drmmode_output->edid_id = drmmode_get_prop_id(drmmode->fd,
+			koutput->count_props, koutput->props,
+			"EDID", DRM_MODE_PROP_BLOB | DRM_MODE_PROP_IMMUTABLE);
+	drmmode_output->dpms_id = drmmode_get_prop_id(drmmode->fd,
+			koutput->count_props, koutput->props,
+			"DPMS", DRM_MODE_PROP_ENUM);
+	if (drmmode->atomic) {
+		static const char *const crtc_id_name[] = { "CRTC_ID" };
+
+		if (!drmmode_get_prop_ids(drmmode->fd, connector_id,
+				DRM_MODE_OBJECT_CONNECTOR, crtc_id_name,
+				&drmmode_output->crtc_id_prop, 1)) {
+			INFO_MSG("[CONNECTOR:%u] no atomic properties, using legacy modesetting",
+					connector_id);
+			drmmode->atomic = FALSE;
+		}
+	}
+
+	output = xf86OutputCreate(pScrn, &drmmode_output_funcs, name);
+	if (!output) {
+		ERROR_MSG("[CONNECTOR:%u] Failed xf86OutputCreate",
+				connector_id);
+		ret = FALSE;
+		goto err_free_drmmode_output;
+	}
+
+	output->mm_width = koutput->mmWidth;
+	output->mm_height = koutput->mmHeight;
+	output->driver_private = drmmode_output;
+
+	output->possible_crtcs = possible_crtcs;
+	output->possible_clones = possible_clones;
+	output->interlaceAllowed = TRUE;
+
+	ret = TRUE;
+	goto out;
+
+err_free_drmmode_output:
+	free(drmmode_output);
+err_free_drm_mode_connector:
+	drmModeFreeConnector(koutput);
+out:
+	TRACE_EXIT();
+	return ret;
+}
+
+static Bool
+drmmode_xf86crtc_resize(ScrnInfoPtr pScrn, int width, int height)
+{
+	OMAPPtr pOMAP = OMAPPTR(pScrn);
+	ScreenPtr pScreen = pScrn->pScreen;
+	struct omap_bo *new_scanout;
+	uint32_t pitch;
+
+	TRACE_ENTER();
+
+	/* if fb required size has changed, realloc! */
+
+	DEBUG_MSG("Resize!  %dx%d", width, height);
+
+	if (  (width != omap_bo_width(pOMAP->scanout))
+	      || (height != omap_bo_height(pOMAP->scanout))
+	      || (pScrn->bitsPerPixel != omap_bo_bpp(pOMAP->scanout)) ) {
+
+		DEBUG_MSG("allocating new scanout buffer: %dx%d",
+				width, height);
+
+		/* allocate new scanout buffer */
+		new_scanout = omap_bo_new_with_depth(pOMAP->dev, width,
+					     height, pScrn->depth,
+					     pScrn->bitsPerPixel);
+		if (!new_scanout) {
+			ERROR_MSG("Error reallocating scanout buffer");
+			return FALSE;
+		}
+
+		pOMAP->has_resized = TRUE;
+		omap_bo_unreference(pOMAP->scanout);
+		pOMAP->scanout = new_scanout;
+		OMAPShadowAlloc(pScrn);
+	}
+
+	pScrn->virtualX = width;
+	pScrn->virtualY = height;
+	pitch = omap_bo_pitch(pOMAP->scanout);
+	pScrn->displayWidth = pitch / ((pScrn->bitsPerPixel + 7) / 8);
+
+	if (pScreen && pScreen->ModifyPixmapHeader) {
+		PixmapPtr rootPixmap = pScreen->GetScreenPixmap(pScreen);
+		pScreen->ModifyPixmapHeader(rootPixmap,
+				pScrn->virtualX, pScrn->virtualY,
+				pScrn->depth, pScrn->bitsPerPixel, pitch,
+				omap_bo_map(pOMAP->scanout));
+	}
+
+	TRACE_EXIT();
+	return TRUE;
+}
+
+/*
+ * Overlay planes
+ *
+ * Overlay planes are given out first come, first served.  One user is a
+ * window that nothing covers and that lies entirely on one crtc; it is
+ * scanned out where it sits on that crtc instead of being copied into the
+ * root window.  The other is an Xv port, which shows its video scaled.
+ * Planes are stacked above the primary plane in the order the kernel lists
+ * them.  Users have to give a plane up as soon as what they show no longer
+ * fits on it, see OMAPDRI2BlockHandler().
+ */
+
+/* The fourcc of the screen's fbs */
+static uint32_t
+drmmode_screen_format(ScrnInfoPtr pScrn)
+{
+	switch (pScrn->depth) {
+	case 16:
+		return DRM_FORMAT_RGB565;
+	case 24:
+		return DRM_FORMAT_XRGB8888;
+	default:
+		return 0;
+	}
+}
+
+/* Look up the zpos property of @plane, unless the kernel won't let us set it */
+static void
+drmmode_plane_init_zpos(int fd, drmmode_plane_ptr plane)
+{
+	drmModeObjectPropertiesPtr props;
+	uint32_t i;
+
+	props = drmModeObjectGetProperties(fd, plane->id, DRM_MODE_OBJECT_PLANE);
+	if (!props)
+		return;
+
+	for (i = 0; i < props->count_props && !plane->zpos_prop; i++) {
+		drmModePropertyPtr prop = drmModeGetProperty(fd, props->props[i]);
+		if (!prop)
+			continue;
+		if (!strcmp(prop->name, "zpos") &&
+		    (prop->flags & DRM_MODE_PROP_RANGE) &&
+		    !(prop->flags & DRM_MODE_PROP_IMMUTABLE) &&
+		    prop->count_values == 2) {
+			plane->zpos_prop = prop->prop_id;
+			plane->zpos_min = prop->values[0];
+			plane->zpos_max = prop->values[1];
+		}
+		drmModeFreeProperty(prop);
+	}
+	drmModeFreeObjectProperties(props);
+}
+
+static Bool
+drmmode_plane_has_format(drmmode_plane_ptr plane, uint32_t format)
+{
+	uint32_t i;
+
+	for (i = 0; i < plane->count_formats; i++) {
+		if (plane->formats[i] == format)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* Log what an overlay plane can do */
+static void
+drmmode_plane_report(ScrnInfoPtr pScrn, drmmode_plane_ptr plane)
+{
+	char *names;
+	uint32_t i;
+
+	names = calloc(plane->count_formats, 5);
+	if (!names)
+		return;
+	for (i = 0; i < plane->count_formats; i++) {
+		memcpy(&names[i * 5], &plane->formats[i], 4);
+		names[i * 5 + 4] = ' ';
+	}
+	if (plane->count_formats)
+		names[plane->count_formats * 5 - 1] = '\0';
+
+	INFO_MSG("[PLANE:%u] overlay for crtcs 0x%x%s, formats: %s", plane->id,
+			plane->possible_crtcs,
+			plane->zpos_prop ? ", movable zpos" : "",
+			plane->count_formats ? names : "none");
+	free(names);
+}
+
+/*
+ * Collect the overlay planes.  Without universal planes the kernel lists
+ * nothing but overlays, and they have no type property.
+ */
+static void
+drmmode_planes_pre_init(ScrnInfoPtr pScrn, drmmode_ptr drmmode,
+		const drmModePlaneResPtr plane_res)
+{
+	int fd = drmmode->fd;
+	uint32_t i;
+
+	if (!plane_res->count_planes)
+		return;
+
+	drmmode->planes = calloc(plane_res->count_planes,
+			sizeof *drmmode->planes);
+	if (!drmmode->planes)
+		return;
+
+	for (i = 0; i < plane_res->count_planes; i++) {
+		drmmode_plane_ptr plane = &drmmode->planes[drmmode->num_planes];
+		uint32_t plane_id = plane_res->planes[i];
+		drmModePlanePtr kplane;
+
+		if (drmmode_get_prop_value(fd, plane_id, DRM_MODE_OBJECT_PLANE,
+				"type", DRM_PLANE_TYPE_OVERLAY)
+				!= DRM_PLANE_TYPE_OVERLAY)
+			continue;
+
+		kplane = drmModeGetPlane(fd, plane_id);
+		if (!kplane)
+			continue;
+		plane->formats = malloc(kplane->count_formats *
+				sizeof *plane->formats);
+		if (plane->formats) {
+			memcpy(plane->formats, kplane->formats,
+					kplane->count_formats *
+					sizeof *plane->formats);
+			plane->count_formats = kplane->count_formats;
+		}
+		plane->possible_crtcs = kplane->possible_crtcs;
+		drmModeFreePlane(kplane);
+		if (!plane->count_formats)
+			continue;
+
+		plane->id = plane_id;
+		if (drmmode->atomic && !drmmode_get_prop_ids(fd, plane_id,
+				DRM_MODE_OBJECT_PLANE, drmmode_plane_prop_names,
+				plane->props, PLANE_NUM_PROPS))
+			memset(plane->props, 0, sizeof(plane->props));
+		drmmode_plane_init_zpos(fd, plane);
+
+		drmmode_plane_report(pScrn, plane);
+		drmmode->num_planes++;
+	}
+}
+
+static void
+drmmode_planes_fini(drmmode_ptr drmmode)
+{
+	int i;
+
+	for (i = 0; i < drmmode->num_planes; i++)
+		free(drmmode->planes[i].formats);
+	free(drmmode->planes);
+}
+
+/* Returns how many overlay planes can show @format */
+int
+drmmode_plane_count(ScrnInfoPtr pScrn, uint32_t format)
+{
+	drmmode_ptr drmmode = drmmode_from_scrn(pScrn);
+	int i, count = 0;
+
+	for (i = 0; i < drmmode->num_planes; i++) {
+		if (drmmode_plane_has_format(&drmmode->planes[i], format))
+			count++;
+	}
+	return count;
+}
+
+/* Returns the plane @owner has, or NULL */
+static drmmode_plane_ptr
+drmmode_plane_from_owner(drmmode_ptr drmmode, void *owner)
+{
+	int i;
+
+	for (i = 0; i < drmmode->num_planes; i++) {
+		if (drmmode->planes[i].owner == owner)
+			return &drmmode->planes[i];
+	}
+	return NULL;
+}
+
+/* Returns the crtc @draw lies entirely on, or NULL */
+static xf86CrtcPtr
+drmmode_crtc_containing(ScrnInfoPtr pScrn, DrawablePtr draw)
+{
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+	int i;
+
+	for (i = 0; i < xf86_config->num_crtc; i++) {
+		xf86CrtcPtr crtc = xf86_config->crtc[i];
+
+		if (!crtc->enabled || crtc->transform_in_use)
+			continue;
+		if (draw->x >= crtc->x && draw->y >= crtc->y &&
+		    draw->x + draw->width <= crtc->x + crtc->mode.HDisplay &&
+		    draw->y + draw->height <= crtc->y + crtc->mode.VDisplay)
+			return crtc;
+	}
+	return NULL;
+}
+
+/* Where @plane goes in the stack on @crtc: above the primary, in list order */
+static uint64_t
+drmmode_plane_zpos(drmmode_ptr drmmode, drmmode_plane_ptr plane,
+		xf86CrtcPtr crtc)
+{
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	uint64_t zpos = plane->zpos_min;
+
+	if (drmmode_crtc->plane_id)
+		zpos = drmmode_get_prop_value(drmmode->fd,
+				drmmode_crtc->plane_id, DRM_MODE_OBJECT_PLANE,
+				"zpos", zpos);
+	zpos += 1 + (plane - drmmode->planes);
+
+	return min(zpos, plane->zpos_max);
+}
+
+/*
+ * Show @src (16.16 fixed point) of @fb_id at @dst on @crtc in a non-blocking
+ * commit, and put the plane above the crtc's own if @zpos.  @user, if not
+ * NULL, is called when it is on screen.  The crtc must not have a flip or
+ * commit in flight.
+ */
+static int
+drmmode_atomic_set_plane(drmmode_ptr drmmode, drmmode_plane_ptr plane,
+		xf86CrtcPtr crtc, uint32_t fb_id, const uint32_t src[4],
+		BoxPtr dst, Bool zpos, OMAPDRMEventPtr user)
+{
+	ScrnInfoPtr pScrn = crtc->scrn;
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	const uint32_t *props = plane->props;
+	drmModeAtomicReqPtr req;
+	drmmode_flip_ptr flip;
+	int ret;
+
+	flip = calloc(1, sizeof *flip);
+	if (!flip)
+		return -ENOMEM;
+	flip->event.handler = drmmode_flip_handler;
+	flip->pScrn = pScrn;
+	flip->user = user;
+	flip->crtc_mask = 1 << drmmode_crtc->index;
+	flip->count = 1;
+
+	req = drmModeAtomicAlloc();
+	if (!req) {
+		free(flip);
+		return -ENOMEM;
+	}
+
+	drmModeAtomicAddProperty(req, plane->id, props[PLANE_FB_ID], fb_id);
+	drmModeAtomicAddProperty(req, plane->id, props[PLANE_CRTC_ID],
+			drmmode_crtc->id);
+	drmModeAtomicAddProperty(req, plane->id, props[PLANE_SRC_X], src[0]);
+	drmModeAtomicAddProperty(req, plane->id, props[PLANE_SRC_Y], src[1]);
+	drmModeAtomicAddProperty(req, plane->id, props[PLANE_SRC_W], src[2]);
+	drmModeAtomicAddProperty(req, plane->id, props[PLANE_SRC_H], src[3]);
+	drmModeAtomicAddProperty(req, plane->id, props[PLANE_CRTC_X], dst->x1);
+	drmModeAtomicAddProperty(req, plane->id, props[PLANE_CRTC_Y], dst->y1);
+	drmModeAtomicAddProperty(req, plane->id, props[PLANE_CRTC_W],
+			dst->x2 - dst->x1);
+	drmModeAtomicAddProperty(req, plane->id, props[PLANE_CRTC_H],
+			dst->y2 - dst->y1);
+	if (plane->zpos_prop && zpos)
+		drmModeAtomicAddProperty(req, plane->id, plane->zpos_prop,
+				drmmode_plane_zpos(drmmode, plane, crtc));
+
+	ret = drmmode_atomic_commit(drmmode->fd, req,
+			DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT,
+			flip);
+	drmModeAtomicFree(req);
+	if (ret) {
+		free(flip);
+		return ret;
+	}
+
+	drmmode_crtc->commit_pending = TRUE;
+	return 0;
+}
+
+/*
+ * Only one commit per crtc can be in flight, so an update of a plane on a
+ * busy crtc waits for drmmode_planes_flush().  An update still waiting is
+ * replaced, and its event completes as if it had been shown.
+ */
+static void
+drmmode_plane_queue(drmmode_plane_ptr plane, xf86CrtcPtr crtc,
+		OMAPDRMEventPtr user)
+{
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	OMAPDRMEventPtr replaced = plane->queued ? plane->queued_event : NULL;
+
+	if (!plane->queued)
+		plane->queued_zpos = plane->crtc != crtc;
+	plane->queued = TRUE;
+	plane->queued_event = user;
+	if (replaced)
+		replaced->handler(replaced, drmmode_crtc->last_frame,
+				drmmode_crtc->last_tv_sec,
+				drmmode_crtc->last_tv_usec);
+}
+
+/* Commit the first plane update waiting for @crtc, once it is idle */
+static void
+drmmode_planes_flush(xf86CrtcPtr crtc)
+{
+	ScrnInfoPtr pScrn = crtc->scrn;
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	drmmode_ptr drmmode = drmmode_crtc->drmmode;
+	int i;
+
+	for (i = 0; i < drmmode->num_planes; i++) {
+		drmmode_plane_ptr plane = &drmmode->planes[i];
+		OMAPDRMEventPtr user = plane->queued_event;
+
+		if (drmmode_crtc->commit_pending || drmmode_crtc->flip_pending)
+			return;
+		if (!plane->queued || plane->crtc != crtc)
+			continue;
+
+		plane->queued = FALSE;
+		plane->queued_event = NULL;
+		if (!drmmode_atomic_set_plane(drmmode, plane, crtc,
+				plane->fb_id, plane->src, &plane->dst,
+				plane->queued_zpos, user))
+			continue;
+
+		ERROR_MSG("[PLANE:%u] [FB:%u] queued update failed: %s",
+				plane->id, plane->fb_id, strerror(errno));
+		if (user)
+			user->handler(user, drmmode_crtc->last_frame,
+					drmmode_crtc->last_tv_sec,
+					drmmode_crtc->last_tv_usec);
+	}
+}
+
+/* Same with the legacy ioctl, which returns once the plane shows @fb_id */
+static int
+drmmode_legacy_set_plane(drmmode_ptr drmmode, drmmode_plane_ptr plane,
+		xf86CrtcPtr crtc, uint32_t fb_id, const uint32_t src[4],
+		BoxPtr dst)
+{
+	if (plane->zpos_prop && plane->crtc != crtc)
+		drmModeObjectSetProperty(drmmode->fd, plane->id,
+				DRM_MODE_OBJECT_PLANE, plane->zpos_prop,
+				drmmode_plane_zpos(drmmode, plane, crtc));
+
+	return drmModeSetPlane(drmmode->fd, plane->id, drmmode_crtc_id(crtc),
+			fb_id, 0, dst->x1, dst->y1, dst->x2 - dst->x1,
+			dst->y2 - dst->y1, src[0], src[1], src[2], src[3]);
+}
+
+/*
+ * Scan out the @src_w x @src_h area at (@src_x, @src_y) of @fb_id, all in
+ * 16.16 fixed point, scaled to @dst on @crtc, whose coordinates are relative
+ * to the crtc.  @format is the fourcc of @fb_id.
+ *
+ * @owner identifies the user: the plane it has already is kept if it still
+ * can be used, otherwise a free one is picked.  @priv, if not NULL, must
+ * start with an OMAPDRMEvent.  If *num_flipped is 1, its handler is called
+ * once the plane shows @fb_id.  If it is 0, the plane is up to date already.
+ *
+ * Returns 0 on success.  Otherwise the owner has no plane any more, because
+ * none is free that can show @format on @crtc, or the kernel said no.
+ */
+int
+drmmode_plane_set(xf86CrtcPtr crtc, void *owner, uint32_t format,
+		uint32_t fb_id, uint32_t src_x, uint32_t src_y, uint32_t src_w,
+		uint32_t src_h, BoxPtr dst, void *priv, int *num_flipped)
+{
+	ScrnInfoPtr pScrn = crtc->scrn;
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	drmmode_ptr drmmode = drmmode_crtc->drmmode;
+	drmmode_plane_ptr plane = drmmode_plane_from_owner(drmmode, owner);
+	uint32_t crtc_bit = 1 << drmmode_crtc->index;
+	const uint32_t src[4] = { src_x, src_y, src_w, src_h };
+	int i, ret;
+
+	*num_flipped = 0;
+
+	if (plane && plane->crtc == crtc && plane->fb_id == fb_id &&
+	    !memcmp(plane->src, src, sizeof(src)) &&
+	    !memcmp(&plane->dst, dst, sizeof(*dst)))
+		return 0;
+
+	/* moving a plane between crtcs would get us an event from each */
+	if (plane && ((plane->crtc && plane->crtc != crtc) ||
+	    !(plane->possible_crtcs & crtc_bit) ||
+	    !drmmode_plane_has_format(plane, format))) {
+		drmmode_plane_hide(pScrn, owner);
+		plane = NULL;
+	}
+	for (i = 0; !plane && i < drmmode->num_planes; i++) {
+		if (!drmmode->planes[i].owner &&
+		    (drmmode->planes[i].possible_crtcs & crtc_bit) &&
+		    drmmode_plane_has_format(&drmmode->planes[i], format))
+			plane = &drmmode->planes[i];
+	}
+	if (!plane) {
+		DEBUG_MSG("[CRTC:%u] no overlay plane free for %.4s",
+				drmmode_crtc->id, (char *)&format);
+		return -EBUSY;
+	}
+	plane->owner = owner;
+
+	ret = -EINVAL;
+	if (OMAP_USE_PAGE_FLIP_EVENTS && drmmode->atomic &&
+	    plane->props[PLANE_FB_ID]) {
+		if (drmmode_crtc->commit_pending ||
+		    drmmode_crtc->flip_pending) {
+			drmmode_plane_queue(plane, crtc, priv);
+			ret = 0;
+		} else {
+			ret = drmmode_atomic_set_plane(drmmode, plane, crtc,
+					fb_id, src, dst, plane->crtc != crtc,
+					priv);
+		}
+		if (!ret && priv)
+			*num_flipped = 1;
+		else if (ret)
+			DEBUG_MSG("[PLANE:%u] atomic update failed: %s",
+					plane->id, strerror(errno));
+	}
+	if (ret)
+		ret = drmmode_legacy_set_plane(drmmode, plane, crtc, fb_id,
+				src, dst);
+	if (ret) {
+		DEBUG_MSG("[PLANE:%u] [FB:%u] %dx%d+%d+%d refused: %s",
+				plane->id, fb_id, dst->x2 - dst->x1,
+				dst->y2 - dst->y1, dst->x1, dst->y1,
+				strerror(errno));
+		drmmode_plane_hide(pScrn, owner);
+		return ret;
+	}
+
+	plane->crtc = crtc;
+	plane->fb_id = fb_id;
+	memcpy(plane->src, src, sizeof(src));
+	plane->dst = *dst;
+	return 0;
+}
+
+/*
+ * Scan out @fb_id, in the screen format and the size of @draw, where @draw
+ * is on screen, see drmmode_plane_set().  Fails if @draw is not entirely on
+ * one crtc.
+ */
+int
+drmmode_plane_show(DrawablePtr draw, void *owner, uint32_t fb_id, void *priv,
+		int *num_flipped)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(draw->pScreen);
+	xf86CrtcPtr crtc = drmmode_crtc_containing(pScrn, draw);
+	BoxRec dst;
+
+	*num_flipped = 0;
+
+	if (!crtc) {
+		drmmode_plane_hide(pScrn, owner);
+		return -ERANGE;
+	}
+
+	dst.x1 = draw->x - crtc->x;
+	dst.y1 = draw->y - crtc->y;
+	dst.x2 = dst.x1 + draw->width;
+	dst.y2 = dst.y1 + draw->height;
+
+	return drmmode_plane_set(crtc, owner, drmmode_screen_format(pScrn),
+			fb_id, 0, 0, draw->width << 16, draw->height << 16,
+			&dst, priv, num_flipped);
+}
+
+/*
+ * Turn off the plane @owner has, if any, and free it.  Once this returns the
+ * fb it showed is no longer scanned out.
+ */
+void
+drmmode_plane_hide(ScrnInfoPtr pScrn, void *owner)
+{
+	drmmode_ptr drmmode = drmmode_from_scrn(pScrn);
+	drmmode_plane_ptr plane = drmmode_plane_from_owner(drmmode, owner);
+
+	if (!plane)
+		return;
+
+	if (plane->queued) {
+		drmmode_crtc_private_ptr drmmode_crtc =
+				plane->crtc->driver_private;
+		OMAPDRMEventPtr user = plane->queued_event;
+
+		plane->queued = FALSE;
+		plane->queued_event = NULL;
+		if (user)
+			user->handler(user, drmmode_crtc->last_frame,
+					drmmode_crtc->last_tv_sec,
+					drmmode_crtc->last_tv_usec);
+	}
+
+	if (plane->crtc) {
+		drmmode_crtc_private_ptr drmmode_crtc =
+				plane->crtc->driver_private;
+
+		drmmode_wait_for_commits(pScrn, 1 << drmmode_crtc->index);
+		if (drmModeSetPlane(drmmode->fd, plane->id, 0, 0, 0,
+				0, 0, 0, 0, 0, 0, 0, 0))
+			ERROR_MSG("[PLANE:%u] failed to disable: %s",
+					plane->id, strerror(errno));
+	}
+
+	plane->owner = NULL;
+	plane->crtc = NULL;
+	plane->fb_id = 0;
+}
+
+static const xf86CrtcConfigFuncsRec drmmode_xf86crtc_config_funcs = {
+		.resize = drmmode_xf86crtc_resize
+};
+
+static void drmmode_crtcs_destroy(ScrnInfoPtr pScrn)
+{
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+
+	/*
+	 * xf86CrtcDestroy() removes crtc from list and memmoves the other
+	 * entries, and decrements num_crtc.
+	 * Hence, as an optimization, we work backwards num_crtc.
+	 */
+	while (xf86_config->num_crtc) {
+		int c = xf86_config->num_crtc - 1;
+		xf86CrtcPtr crtc = xf86_config->crtc[c];
+		xf86CrtcDestroy(crtc);
+	}
+}
+
+static void drmmode_outputs_destroy(ScrnInfoPtr pScrn)
+{
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+
+	/*
+	 * xf86OutputDestroy() removes output from list and memmoves the other
+	 * entries, and decrements num_output.
+	 * Hence, as an optimization, we work backwards num_output.
+	 */
+	while (xf86_config->num_output) {
+		int o = xf86_config->num_output - 1;
+		xf86OutputPtr output = xf86_config->output[o];
+		xf86OutputDestroy(output);
+	}
+}
+
+Bool drmmode_pre_init(ScrnInfoPtr pScrn, int fd)
+{
+	OMAPPtr pOMAP = OMAPPTR(pScrn);
+	drmmode_ptr drmmode;
+	drmModeResPtr mode_res;
+	drmModePlaneResPtr plane_res;
+	uint64_t value;
+	int i;
+	Bool ret, atomic;
+
+	TRACE_ENTER();
+
+//	pScrn->canDoBGNoneRoot = TRUE;
+
+	xf86CrtcConfigInit(pScrn, &drmmode_xf86crtc_config_funcs);
+
+	mode_res = drmModeGetResources(fd);
+	if (!mode_res) {
+		ret = FALSE;
+		goto out;
+	}
+	DEBUG_MSG("Got KMS resources");
+	DEBUG_MSG("  %d connectors, %d encoders",
+			mode_res->count_connectors,
+			mode_res->count_encoders);
+	DEBUG_MSG("  %d crtcs, %d fbs",
+			mode_res->count_crtcs, mode_res->count_fbs);
+	DEBUG_MSG("  %dx%d minimum resolution",
+			mode_res->min_width, mode_res->min_height);
+	DEBUG_MSG("  %dx%d maximum resolution",
+			mode_res->max_width, mode_res->max_height);
+
+	xf86CrtcSetSizeRange(pScrn, 320, 200, mode_res->max_width,
+			mode_res->max_height);
+
+	/* must come before listing the planes, as it exposes primary ones */
+	atomic = pOMAP->atomic_modeset &&
+		!drmSetClientCap(fd, DRM_CLIENT_CAP_ATOMIC, 1);
+
+	plane_res = drmModeGetPlaneResources(fd);
+	if (!plane_res) {
+		ERROR_MSG("drmModeGetPlaneResources failed: %s",
+				strerror(errno));
+		ret = FALSE;
+		goto err_free_drm_resources;
+	}
+	DEBUG_MSG("  %d planes", plane_res->count_planes);
+
+	drmmode = calloc(1, sizeof *drmmode);
+	if (!drmmode) {
+		ERROR_MSG("Failed to allocate drmmode");
+		ret = FALSE;
+		goto err_free_drm_plane_resources;
+	}
+	drmmode->fd = fd;
+
+	if (!drmGetCap(fd, DRM_CAP_ASYNC_PAGE_FLIP, &value) && value)
+		drmmode->async_flip = TRUE;
+	INFO_MSG("Async page flips %ssupported",
+			drmmode->async_flip ? "" : "not ");
+
+	drmmode->cursor_width = DRMMODE_CURSOR_SIZE;
+	drmmode->cursor_height = DRMMODE_CURSOR_SIZE;
+	if (!drmGetCap(fd, DRM_CAP_CURSOR_WIDTH, &value) && value)
+		drmmode->cursor_width = value;
+	if (!drmGetCap(fd, DRM_CAP_CURSOR_HEIGHT, &value) && value)
+		drmmode->cursor_height = value;
+	INFO_MSG("HW Cursor up to %dx%d", drmmode->cursor_width,
+			drmmode->cursor_height);
+	drmmode->atomic = atomic;
+
+	ret = TRUE;
+	for (i = 0; i < mode_res->count_crtcs && ret; i++)
+		ret = drmmode_crtc_pre_init(pScrn, drmmode, mode_res,
+				plane_res, i);
+	if (!ret)
+		goto err_crtcs_destroy;
+	OMAPStartupPhase(pScrn, "KMS resources probed");
+
+	for (i = 0; i < mode_res->count_connectors && ret; i++) {
+		drmModeConnectorPtr koutput =
+				drmModeGetConnector(fd, mode_res->connectors[i]);
+
+		if (!koutput) {
+			ERROR_MSG("[CONNECTOR:%u] Failed drmModeGetConnector",
+					mode_res->connectors[i]);
+			ret = FALSE;
+		} else {
+			ret = drmmode_output_pre_init(pScrn, drmmode, koutput);
 		}
 	}
+	if (!ret)
+		goto err_outputs_destroy;
+	OMAPStartupPhase(pScrn, "outputs pre-initialized");
+
+	INFO_MSG("Using %s modesetting", drmmode->atomic ? "atomic" : "legacy");
+
+	drmmode_planes_pre_init(pScrn, drmmode, plane_res);
+
+	/* the connectors were just probed, don't wait for them again */
+	drmmode->outputs_probed = TRUE;
+	ret = xf86InitialConfiguration(pScrn, TRUE);
+	drmmode->outputs_probed = FALSE;
+	if (!ret) {
+		ERROR_MSG("xf86 Initial Configuration failed");
+		goto err_outputs_destroy;
+	}
+
+	drmModeFreePlaneResources(plane_res);
+	drmModeFreeResources(mode_res);
+	goto out;
+
+err_outputs_destroy:
+	drmmode_outputs_destroy(pScrn);
+err_crtcs_destroy:
+	drmmode_crtcs_destroy(pScrn);
+	drmmode_planes_fini(drmmode);
+	free(drmmode);
+err_free_drm_plane_resources:
+	drmModeFreePlaneResources(plane_res);
+err_free_drm_resources:
+	drmModeFreeResources(mode_res);
+out:
+	TRACE_EXIT();
+	return ret;
+}
+
+void
+drmmode_adjust_frame(ScrnInfoPtr pScrn, int x, int y)
+{
+	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
+	xf86OutputPtr output = config->output[config->compat_output];
+	xf86CrtcPtr crtc = output->crtc;
+	int saved_x, saved_y;
+	Bool ret;
+
+	if (!crtc || !crtc->enabled)
+		return;
+
+	saved_x = crtc->x;
+	saved_y = crtc->y;
+	ret = drmmode_set_mode_major(crtc, &crtc->mode, crtc->rotation, x, y);
+	if (!ret) {
+		crtc->x = saved_x;
+		crtc->y = saved_y;
+	}
+}
+
+/*
+ * Page Flipping and vblank events
+ */
+
+static void
+drmmode_event_handler(int fd, unsigned int frame, unsigned int tv_sec,
+		unsigned int tv_usec, void *user_data)
+{
+	OMAPDRMEventPtr event = user_data;
+
+	event->handler(event, frame, tv_sec, tv_usec);
+}
+
+static drmEventContext event_context = {
+		.version = DRM_EVENT_CONTEXT_VERSION,
+		.vblank_handler = drmmode_event_handler,
+		.page_flip_handler = drmmode_event_handler,
+};
+
+static void
+drmmode_flip_handler(OMAPDRMEventPtr event, unsigned int frame,
+		unsigned int tv_sec, unsigned int tv_usec)
+{
+	drmmode_flip_ptr flip = (drmmode_flip_ptr)event;
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(flip->pScrn);
+	OMAPDRMEventPtr user = flip->user;
+	Bool done = (--flip->count == 0);
+	int i;
+
+	/* The crtcs must look idle before the last call to the user handler,
+	 * which may well flip again right away.
+	 */
+	for (i = 0; done && i < xf86_config->num_crtc; i++) {
+		drmmode_crtc_private_ptr drmmode_crtc =
+				xf86_config->crtc[i]->driver_private;
+
+		if (!(flip->crtc_mask & (1 << i)))
+			continue;
+		drmmode_crtc->flip_pending = FALSE;
+		drmmode_crtc->commit_pending = FALSE;
+		drmmode_crtc->last_frame = frame;
+		drmmode_crtc->last_tv_sec = tv_sec;
+		drmmode_crtc->last_tv_usec = tv_usec;
+	}
+
+	if (user)
+		user->handler(user, frame, tv_sec, tv_usec);
+	if (!done)
+		return;
+
+	/* a mailbox flip was waiting behind this one, it goes next */
+	for (i = 0; i < xf86_config->num_crtc; i++) {
+		xf86CrtcPtr crtc = xf86_config->crtc[i];
+		drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+		OMAPDRMEventPtr queued = drmmode_crtc->queued_event;
+
+		if (!(flip->crtc_mask & (1 << i)) || !queued)
+			continue;
+		drmmode_crtc->queued_event = NULL;
+		if (drmmode_crtc_flip(crtc, drmmode_crtc->queued_fb_id, queued,
+				FALSE))
+			queued->handler(queued, frame, tv_sec, tv_usec);
+	}
+
+	/* then the plane updates waiting for the crtcs */
+	for (i = 0; i < xf86_config->num_crtc; i++)
+		if (flip->crtc_mask & (1 << i))
+			drmmode_planes_flush(xf86_config->crtc[i]);
+	free(flip);
+}
+
+/*
+ * Submit a page flip on one crtc.  @user->handler is called when the flip
+ * completes.  Returns 0 on success, otherwise the drmModePageFlip() error.
+ */
+static int
+drmmode_crtc_flip(xf86CrtcPtr crtc, uint32_t fb_id, OMAPDRMEventPtr user,
+		Bool async)
+{
+	ScrnInfoPtr pScrn = crtc->scrn;
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	drmmode_flip_ptr flip;
+	unsigned int flags = 0;
+	int ret;
+
+#if OMAP_USE_PAGE_FLIP_EVENTS
+	flags |= DRM_MODE_PAGE_FLIP_EVENT;
+#endif
+	if (async)
+		flags |= DRM_MODE_PAGE_FLIP_ASYNC;
+
+	flip = calloc(1, sizeof *flip);
+	if (!flip)
+		return -ENOMEM;
+	flip->event.handler = drmmode_flip_handler;
+	flip->pScrn = pScrn;
+	flip->user = user;
+	flip->crtc_mask = 1 << drmmode_crtc->index;
+	flip->count = 1;
+
+	DEBUG_MSG("[CRTC:%u] [FB:%u]%s", drmmode_crtc->id, fb_id,
+			async ? " async" : "");
+	ret = drmModePageFlip(drmmode_crtc->drmmode->fd, drmmode_crtc->id,
+			fb_id, flags, flip);
+	if (ret || !(flags & DRM_MODE_PAGE_FLIP_EVENT)) {
+		free(flip);
+		return ret;
+	}
+
+	drmmode_crtc->flip_pending = TRUE;
+	return 0;
 }
 
+/* Returns TRUE if @crtc shows @draw, see drmmode_crtc_in_drawable(), and
+ * can be flipped
+ */
 static Bool
-drmmode_output_set_property(xf86OutputPtr output, Atom property,
-		RRPropertyValuePtr value)
+drmmode_crtc_shows(xf86CrtcPtr crtc, DrawablePtr draw)
 {
-	drmmode_output_private_ptr drmmode_output = output->driver_private;
-	drmmode_ptr drmmode = drmmode_output->drmmode;
-	int i, ret;
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(crtc->scrn);
+	Bool connected = FALSE;
+	int j;
 
-	for (i = 0; i < drmmode_output->num_props; i++) {
-		drmmode_prop_ptr p = &drmmode_output->props[i];
+	if (!crtc->enabled)
+		return FALSE;
+	/* crtc can be enabled but all the outputs disabled, which
+	   will cause flip to fail with EBUSY, so don't even try.
+	   eventually the mode on this CRTC will be disabled */
+	for (j = 0; j < xf86_config->num_output; j++) {
+		xf86OutputPtr output = xf86_config->output[j];
+		connected = connected || (output->crtc == crtc
+				&& output->status
+				== XF86OutputStatusConnected);
+	}
+	if (!connected)
+		return FALSE;
 
-		if (p->atoms[0] != property)
+	return drmmode_crtc_in_drawable(crtc, draw);
+}
+
+/*
+ * Flip all crtcs showing @draw in a single atomic commit, so they either all
+ * flip or none does.  Returns FALSE if that can't be done, and the caller
+ * falls back to legacy flips.
+ *
+ * Where the kernel does explicit fencing, the planes wait for rendering to
+ * @bo still in flight, and the bos the crtcs showed until now get fences
+ * telling when scanout is done with them, see omap_bo_cpu_prep().
+ *
+ * Cursor moves held back on the crtcs go in the same commit, so the cursor
+ * and the frame under it change together.
+ */
+static Bool
+drmmode_atomic_page_flip(DrawablePtr draw, struct omap_bo *bo,
+		OMAPDRMEventPtr user, int *num_flipped)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(draw->pScreen);
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+	drmmode_ptr drmmode = drmmode_from_scrn(pScrn);
+	uint32_t fb_id = omap_bo_fb(bo);
+	drmModeAtomicReqPtr req;
+	drmmode_flip_ptr flip;
+	uint32_t cursor_mask = 0;
+	int i, ret, in_fence = -1;
+
+	flip = calloc(1, sizeof *flip);
+	if (!flip)
+		return FALSE;
+	flip->event.handler = drmmode_flip_handler;
+	flip->pScrn = pScrn;
+	flip->user = user;
+
+	req = drmModeAtomicAlloc();
+	if (!req) {
+		free(flip);
+		return FALSE;
+	}
+
+	/* the input thread must not move the cursor until the commit is in */
+	drmmode_input_lock();
+	for (i = 0; i < xf86_config->num_crtc; i++) {
+		xf86CrtcPtr crtc = xf86_config->crtc[i];
+		drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+
+		if (!drmmode_crtc_shows(crtc, draw))
 			continue;
+		/* leave a busy crtc to the legacy path and its mailbox */
+		if (drmmode_crtc->flip_pending) {
+			ret = -EBUSY;
+			goto out;
+		}
+		/* each crtc shows its part of a drawable spanning several */
+		drmmode_atomic_add_plane(req, crtc, fb_id, crtc->x - draw->x,
+				crtc->y - draw->y);
+		drmmode_crtc->out_fence = -1;
+		if (drmmode_crtc->out_fence_prop) {
+			if (in_fence < 0)
+				in_fence = omap_bo_get_fence(bo);
+			if (in_fence >= 0)
+				drmModeAtomicAddProperty(req,
+						drmmode_crtc->plane_id,
+						drmmode_crtc->in_fence_prop,
+						in_fence);
+			drmModeAtomicAddProperty(req, drmmode_crtc->id,
+					drmmode_crtc->out_fence_prop,
+					(uintptr_t)&drmmode_crtc->out_fence);
+		}
+		if (drmmode_crtc->cursor_moved && drmmode_cursor_atomic(crtc)) {
+			drmModeAtomicAddProperty(req,
+					drmmode_crtc->cursor_plane,
+					drmmode_crtc->cursor_props[0],
+					(int64_t)drmmode_crtc->cursor_x);
+			drmModeAtomicAddProperty(req,
+					drmmode_crtc->cursor_plane,
+					drmmode_crtc->cursor_props[1],
+					(int64_t)drmmode_crtc->cursor_y);
+			cursor_mask |= 1 << i;
+		}
+		flip->crtc_mask |= 1 << i;
+		flip->count++;
+	}
 
-		if (p->mode_prop->flags & DRM_MODE_PROP_RANGE) {
-			uint32_t val;
+	ret = 0;
+	if (flip->count) {
+		ret = drmmode_atomic_commit(drmmode->fd, req,
+				DRM_MODE_ATOMIC_NONBLOCK |
+				DRM_MODE_PAGE_FLIP_EVENT, flip);
+		if (ret)
+			DEBUG_MSG("[FB:%u] atomic flip failed: %s", fb_id,
+					strerror(errno));
+	}
 
-			if (value->type != XA_INTEGER || value->format != 32 ||
-					value->size != 1)
-				return FALSE;
-			val = *(uint32_t *)value->data;
+	for (i = 0; !ret && i < xf86_config->num_crtc; i++) {
+		drmmode_crtc_private_ptr drmmode_crtc =
+				xf86_config->crtc[i]->driver_private;
 
-			ret = drmModeConnectorSetProperty(drmmode->fd,
-					drmmode_output->id,
-					p->mode_prop->prop_id, (uint64_t)val);
+		if (!(cursor_mask & (1 << i)))
+			continue;
+		drmmode_crtc->cursor_moved = FALSE;
+		drmmode_crtc->cursor_time = GetTimeInMillis();
+	}
 
-			if (ret)
-				return FALSE;
+out:
+	drmmode_input_unlock();
+	drmModeAtomicFree(req);
+	/* the planes hold on to the fence itself */
+	if (in_fence >= 0)
+		close(in_fence);
+	*num_flipped = ret ? 0 : flip->count;
+	if (ret || !flip->count) {
+		free(flip);
+		return !ret;
+	}
 
-			return TRUE;
+	for (i = 0; i < xf86_config->num_crtc; i++) {
+		xf86CrtcPtr crtc = xf86_config->crtc[i];
+		drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
 
-		} else if (p->mode_prop->flags & DRM_MODE_PROP_ENUM) {
-			Atom	atom;
-			const char	*name;
-			int		j;
+		if (!(flip->crtc_mask & (1 << i)))
+			continue;
+		drmmode_crtc->flip_pending = TRUE;
+		drmmode_crtc_set_flip_bo(crtc, bo, drmmode_crtc->out_fence);
+	}
+	return TRUE;
+}
 
-			if (value->type != XA_ATOM || value->format != 32 || value->size != 1)
-				return FALSE;
-			memcpy(&atom, value->data, 4);
-			name = NameForAtom(atom);
-			if (name == NULL)
-				return FALSE;
+/*
+ * Flip all crtcs matching the drawable's position and size to @bo.  @priv
+ * must start with an OMAPDRMEvent, whose handler is called once per flipped
+ * crtc; *num_flipped tells how many.
+ *
+ * A drawable covering the whole root flips every crtc, each to its part of
+ * @bo.  Legacy flips keep the offsets the crtcs were set to, which is why the
+ * crtcs have to be in blit mode or OMAP_FLIP_SPANNING for this.
+ *
+ * With @async the caller wants the new frame shown as soon as possible
+ * rather than at the next vblank.  If the kernel supports it, that is an
+ * async (tearing) flip.  Otherwise, or if the kernel turns the async flip
+ * down, a crtc which is still busy with a previous flip gets this one queued
+ * behind it, replacing (and completing straight away) any flip already
+ * queued there, as a mailbox would.
+ *
+ * Otherwise, with atomic modesetting, all crtcs flip in one commit.
+ */
+int
+drmmode_page_flip(DrawablePtr draw, struct omap_bo *bo, void *priv,
+		Bool async, int* num_flipped)
+{
+	ScreenPtr pScreen = draw->pScreen;
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+	OMAPDRMEventPtr event = priv;
+	uint32_t fb_id = omap_bo_fb(bo);
+	int ret, i;
 
-			/* search for matching name string, then set its value down */
-			for (j = 0; j < p->mode_prop->count_enums; j++) {
-				if (!strcmp(p->mode_prop->enums[j].name, name)) {
-					ret = drmModeConnectorSetProperty(drmmode->fd,
-							drmmode_output->id,
-							p->mode_prop->prop_id,
-							p->mode_prop->enums[j].value);
+	/* a flip can't be queued behind a non-blocking mode transition */
+	drmmode_wait_for_commits(pScrn, drmmode_crtcs_showing(pScrn, draw));
 
-					if (ret)
-						return FALSE;
+	if (OMAP_USE_PAGE_FLIP_EVENTS && !async &&
+	    drmmode_from_scrn(pScrn)->atomic &&
+	    drmmode_atomic_page_flip(draw, bo, event, num_flipped))
+		return 0;
+
+	/* Flip all crtc's that match this drawable's position and size */
+	*num_flipped = 0;
+	for (i = 0; i < xf86_config->num_crtc; i++) {
+		xf86CrtcPtr crtc = xf86_config->crtc[i];
+		drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+		uint32_t crtc_id = drmmode_crtc_id(crtc);
 
-					return TRUE;
-				}
+		if (!drmmode_crtc_shows(crtc, draw))
+			continue;
+		/* no fences on legacy flips, forget what the crtc shows */
+		drmmode_crtc_set_flip_bo(crtc, NULL, -1);
+
+		if (async && drmmode_crtc->drmmode->async_flip &&
+		    !drmmode_crtc->flip_pending) {
+			ret = drmmode_crtc_flip(crtc, fb_id, event, TRUE);
+			if (!ret) {
+				(*num_flipped)++;
+				continue;
 			}
+			DEBUG_MSG("[CRTC:%u] [FB:%u] async flip refused: %s",
+					crtc_id, fb_id, strerror(errno));
+		}
 
-			return FALSE;
+		if (async && drmmode_crtc->flip_pending) {
+			OMAPDRMEventPtr replaced = drmmode_crtc->queued_event;
+
+			drmmode_crtc->queued_fb_id = fb_id;
+			drmmode_crtc->queued_event = event;
+			if (replaced)
+				replaced->handler(replaced,
+						drmmode_crtc->last_frame,
+						drmmode_crtc->last_tv_sec,
+						drmmode_crtc->last_tv_usec);
+			(*num_flipped)++;
+			continue;
 		}
-	}
 
-	return TRUE;
+		ret = drmmode_crtc_flip(crtc, fb_id, event, FALSE);
+		if (ret) {
+			ERROR_MSG("[CRTC:%u] [FB:%u] page flip failed: %s",
+					crtc_id, fb_id, strerror(errno));
+			return ret;
+		}
+		(*num_flipped)++;
+	}
+	return 0;
 }
 
-/* These are borrowed from libdrm/xf86drmMode.c */
-#define U642VOID(x) ((void *)(unsigned long)(x))
-#define VOID2U64(x) ((uint64_t)(unsigned long)(x))
+/*
+ * Damage to the root pixmap
+ *
+ * The per-crtc copies and DIRTYFB each keep their own Damage on the root
+ * pixmap, created the first time they are needed and emptied as they consume
+ * it.
+ */
 
 static Bool
-drmmode_output_get_property_from_connector(xf86OutputPtr output, int prop_idx,
-			uint64_t *val)
+drmmode_damage_root(ScrnInfoPtr pScrn, DamagePtr *damage)
 {
-	drmmode_output_private_ptr drmmode_output = output->driver_private;
-	drmmode_ptr drmmode = drmmode_output->drmmode;
-	struct drm_mode_get_connector conn, counts;
-	struct drm_mode_modeinfo mode;
-	uint64_t *prop_values;
-	Bool r = TRUE;
+	ScreenPtr pScreen = pScrn->pScreen;
 
-retry:
-	memset(&conn, 0, sizeof(struct drm_mode_get_connector));
-	conn.connector_id = drmmode_output->id;
+	if (*damage)
+		return TRUE;
 
-	/*
-	 * This is a hack to prevent the kernel from calling get_modes()
-	 * on this connector when all we really want is a property
-	 * value. In certain cases, fetching the display modes can take
-	 * on the order of seconds, and we don't want to spend that
-	 * long here.
-	 *
-	 * By requesting one mode, the kernel will just fill up modes_ptr with
-	 * the first mode (if it exists), and it'll be a noop if there are
-	 * no modes. It's important that we don't use this mode for anything
-	 * since it could be out-of-date.
-	 */
-	conn.count_modes = 1;
-	conn.modes_ptr = VOID2U64(&mode);
-	if (drmIoctl(drmmode->fd, DRM_IOCTL_MODE_GETCONNECTOR, &conn))
+	*damage = DamageCreate(NULL, NULL, DamageReportNone, TRUE, pScreen,
+			NULL);
+	if (!*damage)
 		return FALSE;
+	DamageRegister(&pScreen->GetScreenPixmap(pScreen)->drawable, *damage);
+	return TRUE;
+}
 
-	counts = conn;
-
-	if (!conn.count_props)
-		return FALSE;
+/* Add the part of @damage @crtc shows to @region, both in root coordinates */
+static void
+drmmode_crtc_add_damage(xf86CrtcPtr crtc, RegionPtr damage, RegionPtr region)
+{
+	RegionRec crtc_damage;
+	BoxRec box;
 
-	conn.props_ptr = VOID2U64(
-			drmMalloc(conn.count_props * sizeof(uint32_t)));
-	if (!conn.props_ptr) {
-		r = FALSE;
-		goto err_allocs;
-	}
+	if (!RegionNotEmpty(damage))
+		return;
 
-	conn.prop_values_ptr = VOID2U64(
-			drmMalloc(conn.count_props * sizeof(uint64_t)));
-	if (!conn.prop_values_ptr) {
-		r = FALSE;
-		goto err_allocs;
-	}
+	drmmode_crtc_box(crtc, &box);
+	RegionInit(&crtc_damage, &box, 1);
+	RegionIntersect(&crtc_damage, &crtc_damage, damage);
+	RegionUnion(region, region, &crtc_damage);
+	RegionUninit(&crtc_damage);
+}
 
-	/* Reset the encoder/mode counts so we don't fetch them */
-	conn.count_encoders = 0;
-	conn.count_modes = 1;
-	if (drmIoctl(drmmode->fd, DRM_IOCTL_MODE_GETCONNECTOR, &conn)) {
-		r = FALSE;
-		goto err_allocs;
-	}
+/*
+ * Copy what changed in the root to the back copy of @crtc and flip to it on
+ * the next vblank.
+ */
+static void
+drmmode_copies_flip(xf86CrtcPtr crtc)
+{
+	ScrnInfoPtr pScrn = crtc->scrn;
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	struct omap_bo *back = drmmode_crtc->copy_bo[1];
+	int ret;
 
-	/*
-	 * The number of props may have changed with a hotplug event in between
-	 * the ioctls, in which case the field is silently ignored by the
-	 * kernel.
-	 */
-	if (counts.count_props < conn.count_props) {
-		drmFree(U642VOID(conn.props_ptr));
-		drmFree(U642VOID(conn.prop_values_ptr));
-		goto retry;
-	}
+	if (!drmmode_copy_to(crtc, back, &drmmode_crtc->copy_damage[1]))
+		return;
 
-	if (conn.count_props <= prop_idx) {
-		r = FALSE;
-		goto err_allocs;
+	ret = drmmode_crtc_flip(crtc, omap_bo_fb(back), NULL, FALSE);
+	if (ret) {
+		DEBUG_MSG("[CRTC:%u] copy flip failed: %s",
+				drmmode_crtc->id, strerror(errno));
+		return;
 	}
 
-	prop_values = U642VOID(conn.prop_values_ptr);
-	*val = prop_values[prop_idx];
-
-err_allocs:
-	drmFree(U642VOID(conn.prop_values_ptr));
-	drmFree(U642VOID(conn.props_ptr));
-
-	return r;
+	RegionEmpty(&drmmode_crtc->copy_damage[1]);
+	exchange(drmmode_crtc->copy_bo[0], drmmode_crtc->copy_bo[1]);
+	exchange(drmmode_crtc->copy_damage[0],
+			drmmode_crtc->copy_damage[1]);
 }
 
-static Bool
-drmmode_output_get_property(xf86OutputPtr output, Atom property)
+/*
+ * Called before the server sleeps: hand the damage done to the root since
+ * last time to the copies, and flip every crtc which is not still busy with
+ * its last flip.  The others catch up once their flip is done.
+ */
+void
+drmmode_copies_update(ScrnInfoPtr pScrn)
 {
-	drmmode_output_private_ptr drmmode_output = output->driver_private;
-	drmmode_prop_ptr p = NULL;
-	uint64_t value;
-	int err, i;
+	OMAPPtr pOMAP = OMAPPTR(pScrn);
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+	drmmode_ptr drmmode = drmmode_from_scrn(pScrn);
+	RegionPtr damage;
+	int i;
 
-	for (i = 0; i < drmmode_output->num_props; i++) {
-		p = &drmmode_output->props[i];
-		if (p->atoms[0] == property)
+	for (i = 0; i < xf86_config->num_crtc; i++) {
+		drmmode_crtc_private_ptr drmmode_crtc =
+				xf86_config->crtc[i]->driver_private;
+
+		if (drmmode_crtc->copy_bo[0])
 			break;
 	}
-	if (i == drmmode_output->num_props)
-		return FALSE;
+	if (i == xf86_config->num_crtc)
+		return;
 
-	if (output->scrn->vtSema) {
-		if (!drmmode_output_get_property_from_connector(output,
-				p->index, &value))
-			return FALSE;
-	} else {
-		value = drmmode_output->mode_output->prop_values[p->index];
+	if (!drmmode_damage_root(pScrn, &drmmode->copy_damage)) {
+		ERROR_MSG("Copy damage tracking failed");
+		return;
 	}
+	damage = DamageRegion(drmmode->copy_damage);
 
-	if (p->mode_prop->flags & DRM_MODE_PROP_RANGE) {
-		err = RRChangeOutputProperty(output->randr_output,
-				property, XA_INTEGER, 32,
-				PropModeReplace, 1, &value,
-				FALSE, FALSE);
-
-		return !err;
-	} else if (p->mode_prop->flags & DRM_MODE_PROP_ENUM) {
-		int		j;
+	for (i = 0; i < xf86_config->num_crtc; i++) {
+		xf86CrtcPtr crtc = xf86_config->crtc[i];
+		drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
 
-		/* search for matching name string, then set its value down */
-		for (j = 0; j < p->mode_prop->count_enums; j++) {
-			if (p->mode_prop->enums[j].value == value)
-				break;
-		}
+		if (!crtc->enabled || !drmmode_crtc->copy_bo[0])
+			continue;
+		/* TearFree copies are replaced by the flip modes */
+		if (pOMAP->flip_mode != OMAP_FLIP_DISABLED &&
+		    !drmmode_crtc->sw_rotate)
+			continue;
 
-		err = RRChangeOutputProperty(output->randr_output, property,
-				XA_ATOM, 32, PropModeReplace, 1,
-				&p->atoms[j+1], FALSE, FALSE);
+		drmmode_crtc_add_damage(crtc, damage,
+				&drmmode_crtc->copy_damage[0]);
+		drmmode_crtc_add_damage(crtc, damage,
+				&drmmode_crtc->copy_damage[1]);
 
-		return !err;
+		if (drmmode_crtc->flip_pending ||
+		    drmmode_crtc->commit_pending ||
+		    !RegionNotEmpty(&drmmode_crtc->copy_damage[1]))
+			continue;
+		drmmode_copies_flip(crtc);
 	}
-
-	return FALSE;
+	DamageEmpty(drmmode->copy_damage);
 }
 
-static const xf86OutputFuncsRec drmmode_output_funcs = {
-		.create_resources = drmmode_output_create_resources,
-		.dpms = drmmode_output_dpms,
-		.detect = drmmode_output_detect,
-		.mode_valid = drmmode_output_mode_valid,
-		.get_modes = drmmode_output_get_modes,
-		.set_property = drmmode_output_set_property,
-		.get_property = drmmode_output_get_property,
-		.destroy = drmmode_output_destroy
-};
+/*
+ * DIRTYFB
+ *
+ * Command-mode panels, USB displays and virtual devices only refresh what we
+ * report with DRM_IOCTL_MODE_DIRTYFB.  Page flips are a full update, so only
+ * crtcs showing the root in blit mode need this.  Reports are at most once a
+ * frame per crtc; damage coming in faster than that is merged.
+ */
 
-// FIXME - Eliminate the following values that aren't accurate for OMAP4:
-const char *output_names[] = { "None",
-		"VGA",
-		"DVI-I",
-		"DVI-D",
-		"DVI-A",
-		"Composite",
-		"SVIDEO",
-		"LVDS",
-		"CTV",
-		"DIN",
-		"DP",
-		"HDMI",
-		"HDMI",
-		"TV",
-		"eDP",
-};
-#define NUM_OUTPUT_NAMES (sizeof(output_names) / sizeof(output_names[0]))
+/* the kernel takes at most this many clip rects per call */
+#define DRMMODE_DIRTY_MAX_CLIPS 256
 
-static Bool
-drmmode_output_pre_init(ScrnInfoPtr pScrn, drmmode_ptr drmmode,
-		const drmModeResPtr mode_res, int num)
+static void
+drmmode_dirty_flush(xf86CrtcPtr crtc)
 {
-	xf86OutputPtr output;
-	drmModeConnectorPtr koutput;
-	drmModeEncoderPtr kencoder;
-	drmmode_output_private_ptr drmmode_output;
-	char name[32];
-	CARD32 possible_crtcs, possible_clones;
-	uint32_t connector_id = mode_res->connectors[num];
-
-	Bool ret;
-
-	TRACE_ENTER();
-
-	koutput = drmModeGetConnector(drmmode->fd, connector_id);
-	if (!koutput) {
-		ERROR_MSG("[CONNECTOR:%u] Failed drmModeGetConnector",
-				connector_id);
-		ret = FALSE;
-		goto out;
-	}
+	ScrnInfoPtr pScrn = crtc->scrn;
+	OMAPPtr pOMAP = OMAPPTR(pScrn);
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	drmmode_ptr drmmode = drmmode_crtc->drmmode;
+	RegionPtr region = &drmmode_crtc->dirty;
+	int n = RegionNumRects(region);
+	BoxPtr box = RegionRects(region);
+	drmModeClip *clips;
+	int i, ret;
 
-	/*
-	 * Fetch possible clones and crtcs from this connector's encoder.
-	 * We assume here that there is only one possible encoder for this
-	 * connector.
-	 */
-	kencoder = drmModeGetEncoder(drmmode->fd, koutput->encoders[0]);
-	if (!kencoder) {
-		ERROR_MSG("[CONNECTOR:%u] Failed drmModeGetEncoder",
-				connector_id);
-		ret = FALSE;
-		goto err_free_drm_mode_connector;
+	/* past the limit the bounding box will do */
+	if (n > DRMMODE_DIRTY_MAX_CLIPS) {
+		box = RegionExtents(region);
+		n = 1;
 	}
 
-	possible_crtcs = kencoder->possible_crtcs;
-	possible_clones = kencoder->possible_clones;
-	drmModeFreeEncoder(kencoder);
-
-	if (koutput->connector_type >= NUM_OUTPUT_NAMES)
-		snprintf(name, 32, "Unknown%d-%d", koutput->connector_type,
-				koutput->connector_type_id);
-	else
-		snprintf(name, 32, "%s-%d",
-				output_names[koutput->connector_type],
-				koutput->connector_type_id);
-
-	drmmode_output = calloc(1, sizeof *drmmode_output);
-	if (!drmmode_output) {
-		ERROR_MSG("[CONNECTOR:%u] Failed to allocate drmmode_output",
-				connector_id);
-		ret = FALSE;
-		goto err_free_drm_mode_connector;
+	clips = calloc(n, sizeof *clips);
+	if (!clips)
+		return;
+	for (i = 0; i < n; i++) {
+		clips[i].x1 = box[i].x1;
+		clips[i].y1 = box[i].y1;
+		clips[i].x2 = box[i].x2;
+		clips[i].y2 = box[i].y2;
 	}
 
-	drmmode_output->id = connector_id;
-	drmmode_output->mode_output = koutput;
-	drmmode_output->drmmode = drmmode;
-	drmmode_output->dpms_id = drmmode_get_prop_id(drmmode->fd,
-			koutput->count_props, koutput->props,
-			"DPMS", DRM_MODE_PROP_ENUM);
-
-	output = xf86OutputCreate(pScrn, &drmmode_output_funcs, name);
-	if (!output) {
-		ERROR_MSG("[CONNECTOR:%u] Failed xf86OutputCreate",
-				connector_id);
-		ret = FALSE;
-		goto err_free_drmmode_output;
+	ret = drmModeDirtyFB(drmmode->fd, omap_bo_fb(pOMAP->scanout), clips, n);
+	if (ret == -ENOSYS) {
+		INFO_MSG("DIRTYFB not needed after all");
+		drmmode->dirty_fb = FALSE;
+	} else if (ret) {
+		DEBUG_MSG("[CRTC:%u] DIRTYFB failed: %s", drmmode_crtc->id,
+				strerror(-ret));
 	}
-
-	output->mm_width = koutput->mmWidth;
-	output->mm_height = koutput->mmHeight;
-	output->driver_private = drmmode_output;
-
-	output->possible_crtcs = possible_crtcs;
-	output->possible_clones = possible_clones;
-	output->interlaceAllowed = TRUE;
-
-	ret = TRUE;
-	goto out;
-
-err_free_drmmode_output:
-	free(drmmode_output);
-err_free_drm_mode_connector:
-	drmModeFreeConnector(koutput);
-out:
-	TRACE_EXIT();
-	return ret;
+	free(clips);
+	RegionEmpty(region);
 }
 
-static Bool
-drmmode_xf86crtc_resize(ScrnInfoPtr pScrn, int width, int height)
+/*
+ * Called before the server sleeps: report the root damage to every crtc due
+ * for it.  @timeout is shortened so that we wake up for the others.
+ */
+void
+drmmode_dirty_update(ScrnInfoPtr pScrn, void *timeout)
 {
 	OMAPPtr pOMAP = OMAPPTR(pScrn);
-	ScreenPtr pScreen = pScrn->pScreen;
-	struct omap_bo *new_scanout;
-	uint32_t pitch;
-
-	TRACE_ENTER();
-
-	/* if fb required size has changed, realloc! */
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+	drmmode_ptr drmmode = drmmode_from_scrn(pScrn);
+	CARD32 now = GetTimeInMillis();
+	RegionPtr damage;
+	int i;
 
-	DEBUG_MSG("Resize!  %dx%d", width, height);
+	if (!drmmode->dirty_fb)
+		return;
 
-	if (  (width != omap_bo_width(pOMAP->scanout))
-	      || (height != omap_bo_height(pOMAP->scanout))
-	      || (pScrn->bitsPerPixel != omap_bo_bpp(pOMAP->scanout)) ) {
+	if (!drmmode_damage_root(pScrn, &drmmode->dirty_damage)) {
+		ERROR_MSG("DIRTYFB damage tracking failed, disabling");
+		drmmode->dirty_fb = FALSE;
+		return;
+	}
+	damage = DamageRegion(drmmode->dirty_damage);
 
-		DEBUG_MSG("allocating new scanout buffer: %dx%d",
-				width, height);
+	for (i = 0; i < xf86_config->num_crtc; i++) {
+		xf86CrtcPtr crtc = xf86_config->crtc[i];
+		drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+		CARD32 frame, elapsed;
 
-		/* allocate new scanout buffer */
-		new_scanout = omap_bo_new_with_depth(pOMAP->dev, width,
-					     height, pScrn->depth,
-					     pScrn->bitsPerPixel);
-		if (!new_scanout) {
-			ERROR_MSG("Error reallocating scanout buffer");
-			return FALSE;
+		if (!crtc->enabled)
+			continue;
+
+		/* crtcs which flip are updated whole */
+		if (pOMAP->flip_mode != OMAP_FLIP_DISABLED ||
+		    drmmode_crtc->copy_bo[0]) {
+			RegionEmpty(&drmmode_crtc->dirty);
+			continue;
 		}
 
-		pOMAP->has_resized = TRUE;
-		omap_bo_unreference(pOMAP->scanout);
-		pOMAP->scanout = new_scanout;
-	}
+		drmmode_crtc_add_damage(crtc, damage, &drmmode_crtc->dirty);
+		if (!RegionNotEmpty(&drmmode_crtc->dirty))
+			continue;
 
-	pScrn->virtualX = width;
-	pScrn->virtualY = height;
-	pitch = omap_bo_pitch(pOMAP->scanout);
-	pScrn->displayWidth = pitch / ((pScrn->bitsPerPixel + 7) / 8);
+		frame = drmmode_crtc_frame_ms(crtc);
+		elapsed = now - drmmode_crtc->dirty_time;
+		if (elapsed < frame) {
+			AdjustWaitForDelay(timeout, frame - elapsed);
+			continue;
+		}
 
-	if (pScreen && pScreen->ModifyPixmapHeader) {
-		PixmapPtr rootPixmap = pScreen->GetScreenPixmap(pScreen);
-		pScreen->ModifyPixmapHeader(rootPixmap,
-				pScrn->virtualX, pScrn->virtualY,
-				pScrn->depth, pScrn->bitsPerPixel, pitch,
-				omap_bo_map(pOMAP->scanout));
+		drmmode_dirty_flush(crtc);
+		drmmode_crtc->dirty_time = now;
 	}
-
-	TRACE_EXIT();
-	return TRUE;
+	DamageEmpty(drmmode->dirty_damage);
 }
 
-static const xf86CrtcConfigFuncsRec drmmode_xf86crtc_config_funcs = {
-		.resize = drmmode_xf86crtc_resize
-};
-
-static void drmmode_crtcs_destroy(ScrnInfoPtr pScrn)
+static void
+drmmode_copies_fini(ScrnInfoPtr pScrn)
 {
 	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+	drmmode_ptr drmmode = drmmode_from_scrn(pScrn);
+	int i;
 
-	/*
-	 * xf86CrtcDestroy() removes crtc from list and memmoves the other
-	 * entries, and decrements num_crtc.
-	 * Hence, as an optimization, we work backwards num_crtc.
-	 */
-	while (xf86_config->num_crtc) {
-		int c = xf86_config->num_crtc - 1;
-		xf86CrtcPtr crtc = xf86_config->crtc[c];
-		xf86CrtcDestroy(crtc);
+	if (drmmode->copy_damage) {
+		DamageDestroy(drmmode->copy_damage);
+		drmmode->copy_damage = NULL;
 	}
+	for (i = 0; i < xf86_config->num_crtc; i++)
+		drmmode_copies_free(xf86_config->crtc[i]);
 }
 
-static void drmmode_outputs_destroy(ScrnInfoPtr pScrn)
+static void
+drmmode_dirty_fini(ScrnInfoPtr pScrn)
 {
 	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+	drmmode_ptr drmmode = drmmode_from_scrn(pScrn);
+	int i;
 
-	/*
-	 * xf86OutputDestroy() removes output from list and memmoves the other
-	 * entries, and decrements num_output.
-	 * Hence, as an optimization, we work backwards num_output.
-	 */
-	while (xf86_config->num_output) {
-		int o = xf86_config->num_output - 1;
-		xf86OutputPtr output = xf86_config->output[o];
-		xf86OutputDestroy(output);
+	if (drmmode->dirty_damage) {
+		DamageDestroy(drmmode->dirty_damage);
+		drmmode->dirty_damage = NULL;
+	}
+	for (i = 0; i < xf86_config->num_crtc; i++) {
+		drmmode_crtc_private_ptr drmmode_crtc =
+				xf86_config->crtc[i]->driver_private;
+
+		RegionEmpty(&drmmode_crtc->dirty);
 	}
 }
 
-Bool drmmode_pre_init(ScrnInfoPtr pScrn, int fd)
-{
-	drmmode_ptr drmmode;
-	drmModeResPtr mode_res;
-	drmModePlaneResPtr plane_res;
-	int i;
-	Bool ret;
+/*
+ * Hot Plug Event handling:
+ *
+ * Probing a connector can mean a slow DDC transfer, so the connectors named
+ * by the uevents are probed on a thread, once a burst of uevents has settled.
+ * The main thread then swaps the new connectors in and lets RandR look at
+ * them, without probing the rest again.
+ */
 
-	TRACE_ENTER();
+/* how long the uevents of one plug have to stay quiet */
+#define DRMMODE_HOTPLUG_SETTLE_MS 50
 
-//	pScrn->canDoBGNoneRoot = TRUE;
+struct drmmode_hotplug_connector {
+	uint32_t id;
+	/* protected by the lock */
+	Bool pending;
+	drmModeConnectorPtr probed;
+};
 
-	xf86CrtcConfigInit(pScrn, &drmmode_xf86crtc_config_funcs);
+struct drmmode_hotplug {
+	int fd;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	Bool quit;
+	/* bumped for each uevent */
+	unsigned int serial;
+	unsigned int probed_serial;
+	/* indexed like xf86_config->output */
+	struct drmmode_hotplug_connector *connectors;
+	int num_connectors;
+	/* the thread writes to pipe[1] when it probed something */
+	int pipe[2];
+	InputHandlerProc handler;
+};
 
-	mode_res = drmModeGetResources(fd);
-	if (!mode_res) {
-		ret = FALSE;
-		goto out;
+static void
+drmmode_hotplug_wait(struct drmmode_hotplug *hotplug, int ms)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ts.tv_sec += ms / 1000;
+	ts.tv_nsec += (ms % 1000) * 1000000;
+	if (ts.tv_nsec >= 1000000000) {
+		ts.tv_sec++;
+		ts.tv_nsec -= 1000000000;
 	}
-	DEBUG_MSG("Got KMS resources");
-	DEBUG_MSG("  %d connectors, %d encoders",
-			mode_res->count_connectors,
-			mode_res->count_encoders);
-	DEBUG_MSG("  %d crtcs, %d fbs",
-			mode_res->count_crtcs, mode_res->count_fbs);
-	DEBUG_MSG("  %dx%d minimum resolution",
-			mode_res->min_width, mode_res->min_height);
-	DEBUG_MSG("  %dx%d maximum resolution",
-			mode_res->max_width, mode_res->max_height);
+	pthread_cond_timedwait(&hotplug->wake, &hotplug->lock, &ts);
+}
 
-	xf86CrtcSetSizeRange(pScrn, 320, 200, mode_res->max_width,
-			mode_res->max_height);
+static void *
+drmmode_hotplug_main(void *arg)
+{
+	struct drmmode_hotplug *hotplug = arg;
+	unsigned int serial;
+	int i;
 
-	plane_res = drmModeGetPlaneResources(fd);
-	if (!plane_res) {
-		ERROR_MSG("drmModeGetPlaneResources failed: %s",
-				strerror(errno));
-		ret = FALSE;
-		goto err_free_drm_resources;
-	}
-	DEBUG_MSG("  %d planes", plane_res->count_planes);
+	pthread_mutex_lock(&hotplug->lock);
+	while (!hotplug->quit) {
+		if (hotplug->serial == hotplug->probed_serial) {
+			pthread_cond_wait(&hotplug->wake, &hotplug->lock);
+			continue;
+		}
 
-	drmmode = calloc(1, sizeof *drmmode);
-	if (!drmmode) {
-		ERROR_MSG("Failed to allocate drmmode");
-		ret = FALSE;
-		goto err_free_drm_plane_resources;
-	}
-	drmmode->fd = fd;
+		/* coalesce a burst of uevents */
+		do {
+			serial = hotplug->serial;
+			drmmode_hotplug_wait(hotplug, DRMMODE_HOTPLUG_SETTLE_MS);
+		} while (serial != hotplug->serial && !hotplug->quit);
+		hotplug->probed_serial = serial;
 
-	ret = TRUE;
-	for (i = 0; i < mode_res->count_crtcs && ret; i++)
-		ret = drmmode_crtc_pre_init(pScrn, drmmode, mode_res,
-				plane_res, i);
-	if (!ret)
-		goto err_crtcs_destroy;
+		for (i = 0; i < hotplug->num_connectors && !hotplug->quit; i++) {
+			struct drmmode_hotplug_connector *c =
+					&hotplug->connectors[i];
+			drmModeConnectorPtr koutput;
 
-	for (i = 0; i < mode_res->count_connectors && ret; i++)
-		ret = drmmode_output_pre_init(pScrn, drmmode, mode_res, i);
-	if (!ret)
-		goto err_outputs_destroy;
+			if (!c->pending)
+				continue;
+			c->pending = FALSE;
 
-	ret = xf86InitialConfiguration(pScrn, TRUE);
-	if (!ret) {
-		ERROR_MSG("xf86 Initial Configuration failed");
-		goto err_outputs_destroy;
-	}
+			pthread_mutex_unlock(&hotplug->lock);
+			koutput = drmModeGetConnector(hotplug->fd, c->id);
+			pthread_mutex_lock(&hotplug->lock);
 
-	drmModeFreePlaneResources(plane_res);
-	drmModeFreeResources(mode_res);
-	goto out;
+			if (!koutput)
+				continue;
+			if (c->probed)
+				drmModeFreeConnector(c->probed);
+			c->probed = koutput;
+		}
 
-err_outputs_destroy:
-	drmmode_outputs_destroy(pScrn);
-err_crtcs_destroy:
-	drmmode_crtcs_destroy(pScrn);
-	free(drmmode);
-err_free_drm_plane_resources:
-	drmModeFreePlaneResources(plane_res);
-err_free_drm_resources:
-	drmModeFreeResources(mode_res);
-out:
-	TRACE_EXIT();
-	return ret;
+		/* a full pipe already has the main thread's attention */
+		if (write(hotplug->pipe[1], "", 1) < 0)
+			continue;
+	}
+	pthread_mutex_unlock(&hotplug->lock);
+
+	return NULL;
 }
 
-void
-drmmode_adjust_frame(ScrnInfoPtr pScrn, int x, int y)
+/* Main thread: hand the probed connectors to RandR */
+static void
+drmmode_hotplug_notify(int fd, void *closure)
 {
-	xf86CrtcConfigPtr config = XF86_CRTC_CONFIG_PTR(pScrn);
-	xf86OutputPtr output = config->output[config->compat_output];
-	xf86CrtcPtr crtc = output->crtc;
-	int saved_x, saved_y;
-	Bool ret;
+	ScrnInfoPtr pScrn = closure;
+	drmmode_ptr drmmode = drmmode_from_scrn(pScrn);
+	struct drmmode_hotplug *hotplug = drmmode->hotplug;
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+	Bool changed = FALSE;
+	char buf[16];
+	int i;
 
-	if (!crtc || !crtc->enabled)
-		return;
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
 
-	saved_x = crtc->x;
-	saved_y = crtc->y;
-	ret = drmmode_set_mode_major(crtc, &crtc->mode, crtc->rotation, x, y);
-	if (!ret) {
-		crtc->x = saved_x;
-		crtc->y = saved_y;
+	pthread_mutex_lock(&hotplug->lock);
+	for (i = 0; i < hotplug->num_connectors; i++) {
+		struct drmmode_hotplug_connector *c = &hotplug->connectors[i];
+
+		if (!c->probed)
+			continue;
+		drmmode_output_set_connector(xf86_config->output[i], c->probed);
+		c->probed = NULL;
+		changed = TRUE;
 	}
+	pthread_mutex_unlock(&hotplug->lock);
+
+	if (!changed)
+		return;
+
+	drmmode->outputs_probed = TRUE;
+	RRGetInfo(xf86ScrnToScreen(pScrn), TRUE);
+	drmmode->outputs_probed = FALSE;
 }
 
 /*
- * Page Flipping
+ * Queue connector @id for the thread to probe, or all of them if 0 or a
+ * connector we don't know.
  */
-
 static void
-page_flip_handler(int fd, unsigned int sequence, unsigned int tv_sec,
-		unsigned int tv_usec, void *user_data)
+drmmode_hotplug_queue(struct drmmode_hotplug *hotplug, uint32_t id)
 {
-	OMAPDRI2SwapComplete(user_data);
-}
+	int i, found = 0;
 
-static drmEventContext event_context = {
-		.version = DRM_EVENT_CONTEXT_VERSION,
-		.page_flip_handler = page_flip_handler,
-};
+	pthread_mutex_lock(&hotplug->lock);
+	for (i = 0; id && i < hotplug->num_connectors; i++) {
+		if (hotplug->connectors[i].id == id) {
+			hotplug->connectors[i].pending = TRUE;
+			found++;
+		}
+	}
+	for (i = 0; !found && i < hotplug->num_connectors; i++)
+		hotplug->connectors[i].pending = TRUE;
+	hotplug->serial++;
+	pthread_cond_signal(&hotplug->wake);
+	pthread_mutex_unlock(&hotplug->lock);
+}
 
-int
-drmmode_page_flip(DrawablePtr draw, uint32_t fb_id, void *priv,
-		int* num_flipped)
+static void
+drmmode_hotplug_fini(ScrnInfoPtr pScrn)
 {
-	ScreenPtr pScreen = draw->pScreen;
-	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
-	OMAPPtr pOMAP = OMAPPTR(pScrn);
-	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
-	int ret, i;
-	unsigned int flags = 0;
+	drmmode_ptr drmmode = drmmode_from_scrn(pScrn);
+	struct drmmode_hotplug *hotplug = drmmode->hotplug;
+	int i;
 
-#if OMAP_USE_PAGE_FLIP_EVENTS
-	flags |= DRM_MODE_PAGE_FLIP_EVENT;
-#endif
+	if (!hotplug)
+		return;
 
-	/* Flip all crtc's that match this drawable's position and size */
-	*num_flipped = 0;
-	for (i = 0; i < xf86_config->num_crtc; i++) {
-		xf86CrtcPtr crtc = xf86_config->crtc[i];
-		uint32_t crtc_id = drmmode_crtc_id(crtc);
-		Bool connected = FALSE;
-		int j;
+	pthread_mutex_lock(&hotplug->lock);
+	hotplug->quit = TRUE;
+	pthread_cond_signal(&hotplug->wake);
+	pthread_mutex_unlock(&hotplug->lock);
+	pthread_join(hotplug->thread, NULL);
+
+	xf86RemoveGeneralHandler(hotplug->handler);
+	close(hotplug->pipe[0]);
+	close(hotplug->pipe[1]);
+	for (i = 0; i < hotplug->num_connectors; i++)
+		if (hotplug->connectors[i].probed)
+			drmModeFreeConnector(hotplug->connectors[i].probed);
+	pthread_cond_destroy(&hotplug->wake);
+	pthread_mutex_destroy(&hotplug->lock);
+	free(hotplug->connectors);
+	free(hotplug);
+	drmmode->hotplug = NULL;
+}
 
-		if (!crtc->enabled)
-			continue;
-		/* crtc can be enabled but all the outputs disabled, which
-		   will cause flip to fail with EBUSY, so don't even try.
-		   eventually the mode on this CRTC will be disabled */
-		for (j = 0; j < xf86_config->num_output; j++) {
-			xf86OutputPtr output = xf86_config->output[j];
-			connected = connected || (output->crtc == crtc
-					&& output->status
-					== XF86OutputStatusConnected);
-		}
-		if (!connected)
-			continue;
+/*
+ * Start the probing thread.  Without it uevents make RandR probe all the
+ * connectors on the main thread, as before.
+ */
+static void
+drmmode_hotplug_init(ScrnInfoPtr pScrn)
+{
+	drmmode_ptr drmmode = drmmode_from_scrn(pScrn);
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+	struct drmmode_hotplug *hotplug;
+	sigset_t all, saved;
+	int i, ret;
 
-		if (crtc->x != draw->x || crtc->y != draw->y ||
-		    crtc->mode.HDisplay != draw->width ||
-		    crtc->mode.VDisplay != draw->height)
-			continue;
+	hotplug = calloc(1, sizeof(*hotplug));
+	if (!hotplug)
+		return;
+	hotplug->connectors = calloc(xf86_config->num_output,
+			sizeof(*hotplug->connectors));
+	if (!hotplug->connectors)
+		goto err_free_hotplug;
+	hotplug->num_connectors = xf86_config->num_output;
+	for (i = 0; i < xf86_config->num_output; i++) {
+		drmmode_output_private_ptr drmmode_output =
+				xf86_config->output[i]->driver_private;
 
-		DEBUG_MSG("[CRTC:%u] [FB:%u]", crtc_id, fb_id);
-		ret = drmModePageFlip(pOMAP->drmFD, crtc_id, fb_id, flags,
-				priv);
-		if (ret) {
-			ERROR_MSG("[CRTC:%u] [FB:%u] page flip failed: %s",
-					crtc_id, fb_id, strerror(errno));
-			return ret;
-		}
-		(*num_flipped)++;
+		hotplug->connectors[i].id = drmmode_output->id;
+	}
+	hotplug->fd = drmmode->fd;
+
+	if (pipe(hotplug->pipe))
+		goto err_free_connectors;
+	fcntl(hotplug->pipe[0], F_SETFL, O_NONBLOCK);
+	fcntl(hotplug->pipe[1], F_SETFL, O_NONBLOCK);
+	fcntl(hotplug->pipe[0], F_SETFD, FD_CLOEXEC);
+	fcntl(hotplug->pipe[1], F_SETFD, FD_CLOEXEC);
+
+	hotplug->handler = xf86AddGeneralHandler(hotplug->pipe[0],
+			drmmode_hotplug_notify, pScrn);
+	if (!hotplug->handler)
+		goto err_close_pipe;
+
+	pthread_mutex_init(&hotplug->lock, NULL);
+	pthread_cond_init(&hotplug->wake, NULL);
+
+	/* the thread inherits the signal mask */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &saved);
+	ret = pthread_create(&hotplug->thread, NULL, drmmode_hotplug_main,
+			hotplug);
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+	if (ret) {
+		ERROR_MSG("Couldn't start the hotplug thread: %s",
+				strerror(ret));
+		goto err_destroy_lock;
 	}
-	return 0;
-}
 
-/*
- * Hot Plug Event handling:
- */
+	drmmode->hotplug = hotplug;
+	return;
+
+err_destroy_lock:
+	pthread_cond_destroy(&hotplug->wake);
+	pthread_mutex_destroy(&hotplug->lock);
+	xf86RemoveGeneralHandler(hotplug->handler);
+err_close_pipe:
+	close(hotplug->pipe[0]);
+	close(hotplug->pipe[1]);
+err_free_connectors:
+	free(hotplug->connectors);
+err_free_hotplug:
+	free(hotplug);
+}
 
 static void
 drmmode_handle_uevents(int fd, void *closure)
@@ -1799,7 +5061,7 @@ drmmode_handle_uevents(int fd, void *closure)
 	OMAPPtr pOMAP = OMAPPTR(pScrn);
 	drmmode_ptr drmmode = drmmode_from_scrn(pScrn);
 	struct udev_device *dev;
-	const char *hotplug;
+	const char *hotplug, *connector;
 	struct stat s;
 	dev_t udev_devnum;
 
@@ -1823,13 +5085,26 @@ drmmode_handle_uevents(int fd, void *closure)
 	}
 
 	hotplug = udev_device_get_property_value(dev, "HOTPLUG");
+	/* newer kernels name the connector that changed */
+	connector = udev_device_get_property_value(dev, "CONNECTOR");
 
-	xf86DrvMsg(pScrn->scrnIndex, X_INFO, "hotplug=%s, match=%d\n", hotplug,
+	xf86DrvMsg(pScrn->scrnIndex, X_INFO, "hotplug=%s, connector=%s, match=%d\n",
+			hotplug, connector ? connector : "all",
 			!memcmp(&s.st_rdev, &udev_devnum, sizeof (dev_t)));
 
 	if (memcmp(&s.st_rdev, &udev_devnum, sizeof (dev_t)) == 0 &&
 			hotplug && atoi(hotplug) == 1) {
-		RRGetInfo(xf86ScrnToScreen(pScrn), TRUE);
+		xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+		int i;
+
+		for (i = 0; i < xf86_config->num_output; i++)
+			drmmode_output_invalidate_props(xf86_config->output[i]);
+
+		if (drmmode->hotplug)
+			drmmode_hotplug_queue(drmmode->hotplug,
+					connector ? strtoul(connector, NULL, 10) : 0);
+		else
+			RRGetInfo(xf86ScrnToScreen(pScrn), TRUE);
 	}
 	udev_device_unref(dev);
 }
@@ -1872,6 +5147,7 @@ drmmode_uevent_init(ScrnInfoPtr pScrn)
 	}
 
 	drmmode->uevent_monitor = mon;
+	drmmode_hotplug_init(pScrn);
 
 	ret = TRUE;
 	goto out;
@@ -1894,6 +5170,7 @@ drmmode_uevent_fini(ScrnInfoPtr pScrn)
 	TRACE_ENTER();
 
 	drmmode = drmmode_from_scrn(pScrn);
+	drmmode_hotplug_fini(pScrn);
 	u = udev_monitor_get_udev(drmmode->uevent_monitor);
 	xf86RemoveGeneralHandler(drmmode->uevent_handler);
 	drmmode->uevent_handler = NULL;
@@ -1933,7 +5210,8 @@ drmmode_screen_init(ScrnInfoPtr pScrn)
 	Bool ret;
 
 	/* Per ScreenInit cursor initialization */
-	ret = xf86_cursors_init(pScreen, CURSORW, CURSORH, HARDWARE_CURSOR_ARGB);
+	ret = xf86_cursors_init(pScreen, drmmode->cursor_width,
+			drmmode->cursor_height, HARDWARE_CURSOR_ARGB);
 	if (!ret) {
 		ERROR_MSG("xf86_cursors_init() failed");
 		goto out;
@@ -1945,6 +5223,12 @@ drmmode_screen_init(ScrnInfoPtr pScrn)
 
 	AddGeneralSocket(drmmode->fd);
 
+	/* only devices which need DIRTYFB implement it */
+	drmmode->dirty_fb = drmModeDirtyFB(drmmode->fd,
+			omap_bo_fb(OMAPPTR(pScrn)->scanout), NULL, 0) != -ENOSYS;
+	if (drmmode->dirty_fb)
+		INFO_MSG("Reporting damage with DIRTYFB");
+
 	/* Register a wakeup handler to get informed on DRM events */
 	ret = RegisterBlockAndWakeupHandlers((BlockHandlerProcPtr)NoopDDA,
 			drmmode_wakeup_handler, pScrn);
@@ -1971,6 +5255,11 @@ drmmode_close_screen(ScrnInfoPtr pScrn)
 	drmmode_ptr drmmode = drmmode_from_scrn(pScrn);
 	ScreenPtr pScreen = xf86ScrnToScreen(pScrn);
 
+	drmmode_wait_for_swaps(pScrn, ~0);
+	drmmode_release_flip_bos(pScrn);
+	drmmode_copies_fini(pScrn);
+	drmmode_dirty_fini(pScrn);
+	drmmode_free_scanouts(pScrn);
 	RemoveBlockAndWakeupHandlers((BlockHandlerProcPtr)NoopDDA,
 			drmmode_wakeup_handler, pScrn);
 	RemoveGeneralSocket(drmmode->fd);
@@ -1978,7 +5267,81 @@ drmmode_close_screen(ScrnInfoPtr pScrn)
 	xf86_cursors_fini(pScreen);
 }
 
-void drmmode_copy_fb(ScrnInfoPtr pScrn)
+/*
+ * Copy what @crtc shows to where it will show the root window.  Returns FALSE
+ * if its fb couldn't be read, e.g. when we are not allowed its GEM handle.
+ */
+static Bool
+drmmode_copy_crtc_fb(ScrnInfoPtr pScrn, xf86CrtcPtr crtc)
+{
+	OMAPPtr pOMAP = OMAPPTR(pScrn);
+	drmmode_crtc_private_ptr drmmode_crtc = crtc->driver_private;
+	int fd = drmmode_crtc->drmmode->fd;
+	drmModeCrtcPtr kcrtc;
+	drmModeFBPtr fb = NULL;
+	struct omap_bo *bo = NULL;
+	struct drm_gem_close req = { 0 };
+	BoxRec box;
+	RegionRec region;
+	int dmabuf;
+	Bool ret = FALSE;
+
+	if (!crtc->enabled || crtc->desiredRotation != RR_Rotate_0)
+		return FALSE;
+
+	kcrtc = drmModeGetCrtc(fd, drmmode_crtc->id);
+	if (!kcrtc)
+		return FALSE;
+	if (!kcrtc->buffer_id || !kcrtc->mode_valid)
+		goto free_crtc;
+
+	fb = drmModeGetFB(fd, kcrtc->buffer_id);
+	if (!fb)
+		goto free_crtc;
+	if (!fb->handle)
+		goto free_fb;
+	req.handle = fb->handle;
+
+	if (fb->bpp != pScrn->bitsPerPixel || fb->depth != pScrn->depth) {
+		DEBUG_MSG("[CRTC:%u] [FB:%u] is depth %u, not %d",
+				drmmode_crtc->id, fb->fb_id, fb->depth,
+				pScrn->depth);
+		goto close_handle;
+	}
+
+	if (drmPrimeHandleToFD(fd, fb->handle, DRM_CLOEXEC, &dmabuf))
+		goto close_handle;
+	/* the import gets back the same handle, which the bo now owns */
+	bo = omap_bo_from_fd(pOMAP->dev, dmabuf, fb->width, fb->height,
+			fb->pitch, fb->depth, fb->bpp);
+	close(dmabuf);
+	if (!bo)
+		goto close_handle;
+
+	box.x1 = kcrtc->x;
+	box.y1 = kcrtc->y;
+	box.x2 = kcrtc->x + kcrtc->width;
+	box.y2 = kcrtc->y + kcrtc->height;
+	RegionInit(&region, &box, 1);
+	ret = drmmode_copy_bo(pScrn, bo, crtc->desiredX - kcrtc->x,
+			crtc->desiredY - kcrtc->y, pOMAP->scanout, 0, 0,
+			&region);
+	RegionUninit(&region);
+	omap_bo_unreference(bo);
+	goto free_fb;
+
+close_handle:
+	drmIoctl(fd, DRM_IOCTL_GEM_CLOSE, &req);
+free_fb:
+	drmModeFreeFB(fb);
+free_crtc:
+	drmModeFreeCrtc(kcrtc);
+	return ret;
+}
+
+/* For devices whose fbs we can't read, copy the fbdev */
+static void
+drmmode_copy_fbdev(ScrnInfoPtr pScrn)
 {
 	OMAPPtr pOMAP = OMAPPTR(pScrn);
 	int dst_cpp = (pScrn->bitsPerPixel + 7) / 8;
@@ -2038,7 +5401,7 @@ void drmmode_copy_fb(ScrnInfoPtr pScrn)
 	drmmode_copy_from_to(src, 0, 0, vinfo.xres_virtual, vinfo.yres_virtual,
 			src_pitch, src_cpp,
 			dst, 0, 0, pScrn->virtualX, pScrn->virtualY,
-			dst_pitch, dst_cpp);
+			dst_pitch, dst_cpp, NULL);
 
 	omap_bo_cpu_fini(pOMAP->scanout, 0);
 
@@ -2052,3 +5415,19 @@ munmap_src:
 close_fd:
 	close(fd);
 }
+
+/*
+ * For a smooth start, give the root window what the crtcs show now, which
+ * drmmode_set_crtc() then flips to without a modeset where it can.
+ */
+void drmmode_copy_fb(ScrnInfoPtr pScrn)
+{
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+	int i, copied = 0;
+
+	for (i = 0; i < xf86_config->num_crtc; i++)
+		copied += drmmode_copy_crtc_fb(pScrn, xf86_config->crtc[i]);
+
+	if (!copied)
+		drmmode_copy_fbdev(pScrn);
+}
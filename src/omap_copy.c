@@ -0,0 +1,96 @@
+/* -*- mode: C; c-file-style: "k&r"; tab-width 4; indent-tabs-mode: t; -*- */
+
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <string.h>
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define OMAP_COPY_NEON 1
+#endif
+
+#include "omap_copy.h"
+
+#ifdef OMAP_COPY_NEON
+/*
+ * Most of our copies land in write-combined scanout memory, where wide
+ * stores of whole 64 byte lines beat the small and unaligned stores
+ * memcpy() tends to end rows with.  Reads from the (cached) back buffer
+ * are prefetched a few lines ahead.
+ */
+static inline void
+copy_row_neon(uint8_t *dst, const uint8_t *src, int width)
+{
+	while (width >= 64) {
+		uint8x16_t a, b, c, d;
+
+		__builtin_prefetch(src + 256);
+		a = vld1q_u8(src);
+		b = vld1q_u8(src + 16);
+		c = vld1q_u8(src + 32);
+		d = vld1q_u8(src + 48);
+		vst1q_u8(dst, a);
+		vst1q_u8(dst + 16, b);
+		vst1q_u8(dst + 32, c);
+		vst1q_u8(dst + 48, d);
+		src += 64;
+		dst += 64;
+		width -= 64;
+	}
+	while (width >= 16) {
+		vst1q_u8(dst, vld1q_u8(src));
+		src += 16;
+		dst += 16;
+		width -= 16;
+	}
+	if (width)
+		memcpy(dst, src, width);
+}
+#endif
+
+void
+omap_copy_rows(uint8_t *dst, int dst_pitch, const uint8_t *src,
+		int src_pitch, int width, int height)
+{
+	int y;
+
+	if (width <= 0 || height <= 0)
+		return;
+
+	/* whole lines of equal pitch are one contiguous copy */
+	if (width == dst_pitch && width == src_pitch) {
+		width *= height;
+		height = 1;
+	}
+
+	for (y = 0; y < height; y++, src += src_pitch, dst += dst_pitch) {
+#ifdef OMAP_COPY_NEON
+		copy_row_neon(dst, src, width);
+#else
+		memcpy(dst, src, width);
+#endif
+	}
+}
@@ -32,11 +32,14 @@
 
 #include "omap_driver.h"
 #include "omap_exa.h"
+#include "omap_copy.h"
 
 #include <time.h>
 
 #include "xf86drmMode.h"
 #include "dri2.h"
+#include "property.h"
+#include "X11/Xatom.h"
 
 /* any point to support earlier? */
 #if DRI2INFOREC_VERSION < 4
@@ -75,6 +78,58 @@ typedef struct {
 #define OMAPBUF(p)	((OMAPDRI2BufferPtr)(p))
 #define DRIBUF(p)	((DRI2BufferPtr)(&(p)->base))
 
+/* Why canflip() said no: */
+enum {
+	OMAP_FLIP_REJECT_NOT_WINDOW,
+	OMAP_FLIP_REJECT_SIZE,			/* back buffer and drawable differ */
+	OMAP_FLIP_REJECT_NO_SCANOUT,	/* not matching any crtc */
+	OMAP_FLIP_REJECT_CLIPPED,
+	OMAP_FLIP_REJECT_RESIZED,		/* has_resized */
+	OMAP_FLIP_NUM_REJECTS
+};
+
+static const char *const flip_reject_names[OMAP_FLIP_NUM_REJECTS] = {
+	"window", "size", "scanout", "clipped", "resized",
+};
+
+/* schedule to complete latency, bucket n counts < 2^n ms, the last the rest */
+#define OMAP_LATENCY_BUCKETS 8
+
+/*
+ * Per-drawable swap statistics, kept when Option "SwapStats" is set and
+ * published on the root window as the _ARMSOC_SWAP_STATS property.
+ */
+typedef struct _OMAPDRI2Stats {
+	XID draw_id;
+	unsigned long flips;
+	unsigned long overlays;
+	unsigned long blits;
+	unsigned long failures;
+	unsigned long rejects[OMAP_FLIP_NUM_REJECTS];
+	unsigned long latency[OMAP_LATENCY_BUCKETS];
+	/* swaps completed after their target frame, and by how many frames */
+	unsigned long late_swaps;
+	unsigned long missed_vblanks;
+	struct _OMAPDRI2Stats *next;
+} OMAPDRI2StatsRec, *OMAPDRI2StatsPtr;
+
+/* don't update the property more than once a second */
+#define OMAP_STATS_INTERVAL_MS 1000
+
+/*
+ * A window whose swaps go to an overlay plane instead of being blitted.
+ * pPixmap holds the bo the plane shows, which every swap exchanges with the
+ * back buffer.  The window itself is only brought up to date when it loses
+ * the plane, see plane_release().
+ */
+typedef struct _OMAPDRI2Plane {
+	XID draw_id;
+	PixmapPtr pPixmap;
+	/* pPixmap holds a frame of the window, and has been on screen */
+	Bool shown;
+	struct _OMAPDRI2Plane *next;
+} OMAPDRI2PlaneRec, *OMAPDRI2PlanePtr;
+
 
 static inline DrawablePtr
 dri2draw(DrawablePtr pDraw, DRI2BufferPtr buf)
@@ -92,31 +147,34 @@ dri2draw(DrawablePtr pDraw, DRI2BufferPtr buf)
  *    (a) is a WINDOW
  *    (b) has a buffer object, and the buffer object size exactly matches
  *        the drawable size.
- *    (c) has the same dimensions as one of the scanouts
+ *    (c) has the same dimensions as one of the scanouts, which includes
+ *        covering the whole root of a multi-crtc layout
  *
  * Note: Even if a drawable may be flippable, it will not actually be flipped
  * if it is clipped.
  */
 static Bool
-mayflip(DrawablePtr pDraw, struct omap_bo *back_bo)
+mayflip(DrawablePtr pDraw, struct omap_bo *back_bo, int *reject)
 {
 	ScreenPtr pScreen = pDraw->pScreen;
 	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
-	OMAPPtr pOMAP = OMAPPTR(pScrn);
 	Bool ret;
 
 	if (pDraw->type != DRAWABLE_WINDOW) {
+		*reject = OMAP_FLIP_REJECT_NOT_WINDOW;
 		ret = FALSE;
 		goto out;
 	}
 
 	if (back_bo && (omap_bo_width(back_bo) != pDraw->width ||
 	    omap_bo_height(back_bo) != pDraw->height)) {
+		*reject = OMAP_FLIP_REJECT_SIZE;
 		ret = FALSE;
 		goto out;
 	}
 
-	if (!drmmode_scanout_from_drawable(pOMAP->scanouts, pDraw)) {
+	if (!drmmode_scanout_from_drawable(pScrn, pDraw)) {
+		*reject = OMAP_FLIP_REJECT_NO_SCANOUT;
 		ret = FALSE;
 		goto out;
 	}
@@ -142,9 +200,11 @@ out:
  *    (c) has the same dimensions as one of the scanouts
  *    (d) has exactly one clip region
  *    (e) has exactly one clip region, and the regions dimensions match its own
+ *
+ * If not, *reject is set to one of the OMAP_FLIP_REJECT_* reasons.
  */
 static Bool
-canflip(DrawablePtr pDraw, struct omap_bo *back_bo)
+canflip(DrawablePtr pDraw, struct omap_bo *back_bo, int *reject)
 {
 	ScreenPtr pScreen = pDraw->pScreen;
 	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
@@ -155,7 +215,7 @@ canflip(DrawablePtr pDraw, struct omap_bo *back_bo)
 	int width = 0;
 	int height = 0;
 
-	if (!mayflip(pDraw, back_bo)) {
+	if (!mayflip(pDraw, back_bo, reject)) {
 		ret = FALSE;
 		goto out;
 	}
@@ -164,6 +224,7 @@ canflip(DrawablePtr pDraw, struct omap_bo *back_bo)
 
 	num_rects = RegionNumRects(&pWindow->clipList);
 	if (num_rects != 1) {
+		*reject = OMAP_FLIP_REJECT_CLIPPED;
 		ret = FALSE;
 		goto out;
 	}
@@ -172,6 +233,7 @@ canflip(DrawablePtr pDraw, struct omap_bo *back_bo)
 	width = pBox->x2 - pBox->x1;
 	height = pBox->y2 - pBox->y1;
 	if (width != pDraw->width || height != pDraw->height) {
+		*reject = OMAP_FLIP_REJECT_CLIPPED;
 		ret = FALSE;
 		goto out;
 	}
@@ -184,6 +246,40 @@ out:
 	return ret;
 }
 
+/*
+ * Returns true if the swaps of a drawable could go to an overlay plane: it
+ * is an opaque, unredirected window which nothing covers, and its back buffer
+ * matches its size.  Whether it lies on a single crtc and whether a plane is
+ * free is up to drmmode_plane_show().
+ */
+static Bool
+canoverlay(DrawablePtr pDraw, struct omap_bo *back_bo)
+{
+	ScreenPtr pScreen = pDraw->pScreen;
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	OMAPPtr pOMAP = OMAPPTR(pScrn);
+	WindowPtr pWindow = (WindowPtr)pDraw;
+	BoxPtr pBox;
+
+	if (!pOMAP->overlay_planes || pOMAP->has_resized || !pScrn->vtSema)
+		return FALSE;
+
+	if (pDraw->type != DRAWABLE_WINDOW || pDraw->depth != pScrn->depth ||
+	    draw2pix(pDraw) != pScreen->GetScreenPixmap(pScreen))
+		return FALSE;
+
+	if (!back_bo || omap_bo_width(back_bo) != pDraw->width ||
+	    omap_bo_height(back_bo) != pDraw->height)
+		return FALSE;
+
+	if (RegionNumRects(&pWindow->clipList) != 1)
+		return FALSE;
+	pBox = RegionRects(&pWindow->clipList);
+	return (pBox->x1 == pDraw->x && pBox->y1 == pDraw->y &&
+		pBox->x2 == pDraw->x + pDraw->width &&
+		pBox->y2 == pDraw->y + pDraw->height);
+}
+
 /**
  * Create Buffer.
  *
@@ -240,7 +336,8 @@ OMAPDRI2CreateBuffer(DrawablePtr pDraw, unsigned int attachment,
 	DRIBUF(buf)->pitch = exaGetPixmapPitch(pPixmap);
 	DRIBUF(buf)->cpp = pPixmap->drawable.bitsPerPixel / 8;
 	DRIBUF(buf)->format = format;
-	DRIBUF(buf)->flags = 0;//omap_bo_get_dirty(bo) ? DRI2_ARMSOC_PRIVATE_CRC_DIRTY : 0;
+	DRIBUF(buf)->flags = (bo && omap_bo_get_dirty(bo)) ?
+			DRI2_ARMSOC_PRIVATE_CRC_DIRTY : 0;
 	buf->pPixmap = pPixmap;
 	buf->previous_canflip = -1;
 
@@ -278,22 +375,156 @@ OMAPDRI2DestroyBuffer(DrawablePtr pDraw, DRI2BufferPtr buffer)
 	free(buf);
 }
 
-/**
+/*
+ * Returns TRUE if the pixmap's bo can be addressed using the pixmap's own
+ * geometry and pitch.
+ */
+static Bool
+pixmap_bo_matches(PixmapPtr pPixmap, struct omap_bo *bo)
+{
+	DrawablePtr pDraw = &pPixmap->drawable;
+
+	return (omap_bo_width(bo) == pDraw->width &&
+		omap_bo_height(bo) == pDraw->height &&
+		omap_bo_bpp(bo) == pDraw->bitsPerPixel &&
+		omap_bo_pitch(bo) == pPixmap->devKind);
+}
+
+/*
+ * Copy straight from bo to bo when the source is a pixmap and both sides are
+ * armsoc bos of the same format, rather than paying for GC validation, EXA
+ * PrepareAccess and pixman on what is a plain memory copy.
  *
+ * Returns FALSE without touching anything if the fb path has to be used.
  */
-static void
-OMAPDRI2CopyRegion(DrawablePtr pDraw, RegionPtr pRegion,
-		DRI2BufferPtr pDstBuffer, DRI2BufferPtr pSrcBuffer)
+static Bool
+OMAPDRI2CopyDirect(DrawablePtr pSrcDraw, DrawablePtr pDstDraw,
+		RegionPtr pRegion)
 {
-	ScreenPtr pScreen = pDraw->pScreen;
+	ScreenPtr pScreen = pDstDraw->pScreen;
 	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
-	DrawablePtr pSrcDraw = dri2draw(pDraw, pSrcBuffer);
-	DrawablePtr pDstDraw = dri2draw(pDraw, pDstBuffer);
+	OMAPPtr pOMAP = OMAPPTR(pScrn);
+	PixmapPtr pSrcPix, pDstPix;
+	struct omap_bo *src_bo, *dst_bo;
+	int dst_xoff = 0, dst_yoff = 0;
+	int cpp, src_pitch, dst_pitch, n;
+	uint8_t *src, *dst;
+	RegionRec region, clip;
+	BoxRec bounds;
+	BoxPtr box;
+
+	if (pSrcDraw->type != DRAWABLE_PIXMAP)
+		return FALSE;
+	if (pSrcDraw->bitsPerPixel != pDstDraw->bitsPerPixel ||
+	    pSrcDraw->depth != pDstDraw->depth ||
+	    pSrcDraw->bitsPerPixel < 8)
+		return FALSE;
+
+	pSrcPix = (PixmapPtr)pSrcDraw;
+	pDstPix = draw2pix(pDstDraw);
+	src_bo = OMAPPixmapBo(pSrcPix);
+	dst_bo = OMAPPixmapBo(pDstPix);
+	if (!src_bo || !dst_bo || src_bo == dst_bo)
+		return FALSE;
+
+	/* In flip mode the root pixmap is backed by a per-crtc bo, and only
+	 * PrepareAccess knows how to get back to the root bo for writing.
+	 */
+	if (pDstPix == pScreen->GetScreenPixmap(pScreen) &&
+	    dst_bo != pOMAP->scanout)
+		return FALSE;
+
+	if (!pixmap_bo_matches(pSrcPix, src_bo) ||
+	    !pixmap_bo_matches(pDstPix, dst_bo))
+		return FALSE;
+
+	/* with ShadowFB the root is drawn in the shadow */
+	src = OMAPBoCpuMap(pScrn, src_bo);
+	dst = OMAPBoCpuMap(pScrn, dst_bo);
+	if (!src || !dst)
+		return FALSE;
+
+	/* Work out what to copy in destination drawable coordinates, which
+	 * for windows are screen coordinates, honouring the window clip like
+	 * a ClipByChildren GC would.
+	 */
+	bounds.x1 = pDstDraw->x;
+	bounds.y1 = pDstDraw->y;
+	bounds.x2 = pDstDraw->x + min(pSrcDraw->width, pDstDraw->width);
+	bounds.y2 = pDstDraw->y + min(pSrcDraw->height, pDstDraw->height);
+
+	RegionNull(&region);
+	RegionCopy(&region, pRegion);
+	RegionTranslate(&region, pDstDraw->x, pDstDraw->y);
+	if (pDstDraw->type == DRAWABLE_WINDOW) {
+		RegionIntersect(&region, &region,
+				&((WindowPtr)pDstDraw)->clipList);
+#ifdef COMPOSITE
+		/* redirected windows have their own pixmap */
+		dst_xoff = -pDstPix->screen_x;
+		dst_yoff = -pDstPix->screen_y;
+#endif
+	}
+	RegionInit(&clip, &bounds, 1);
+	RegionIntersect(&region, &region, &clip);
+	RegionUninit(&clip);
+
+	if (!RegionNotEmpty(&region)) {
+		RegionUninit(&region);
+		return TRUE;
+	}
+
+	/* acquire for write first, as drmmode_copy_bo() does */
+	if (omap_bo_cpu_prep(dst_bo, OMAP_GEM_WRITE)) {
+		RegionUninit(&region);
+		return FALSE;
+	}
+	if (omap_bo_cpu_prep(src_bo, OMAP_GEM_READ)) {
+		omap_bo_cpu_fini(dst_bo, OMAP_GEM_WRITE);
+		RegionUninit(&region);
+		return FALSE;
+	}
+
+	DamageRegionAppend(pDstDraw, &region);
+
+	cpp = pDstDraw->bitsPerPixel / 8;
+	src_pitch = omap_bo_pitch(src_bo);
+	dst_pitch = omap_bo_pitch(dst_bo);
+	box = RegionRects(&region);
+	n = RegionNumRects(&region);
+	for (; n--; box++) {
+		int sx = box->x1 - pDstDraw->x;
+		int sy = box->y1 - pDstDraw->y;
+		int dx = box->x1 + dst_xoff;
+		int dy = box->y1 + dst_yoff;
+
+		omap_copy_rows(dst + dy * dst_pitch + dx * cpp, dst_pitch,
+				src + sy * src_pitch + sx * cpp, src_pitch,
+				(box->x2 - box->x1) * cpp, box->y2 - box->y1);
+	}
+
+	omap_bo_cpu_fini(src_bo, OMAP_GEM_READ);
+	omap_bo_cpu_fini(dst_bo, OMAP_GEM_WRITE);
+
+	DamageRegionProcessPending(pDstDraw);
+	RegionUninit(&region);
+
+	return TRUE;
+}
+
+/*
+ * Copy @pRegion (in drawable coordinates) of @pSrcDraw to @pDstDraw.
+ */
+static void
+OMAPDRI2Copy(DrawablePtr pSrcDraw, DrawablePtr pDstDraw, RegionPtr pRegion,
+		int width, int height)
+{
+	ScreenPtr pScreen = pDstDraw->pScreen;
 	RegionPtr pCopyClip;
 	GCPtr pGC;
 
-	DEBUG_MSG("pDraw=%p, pDstBuffer=%p (%p), pSrcBuffer=%p (%p)",
-			pDraw, pDstBuffer, pSrcDraw, pSrcBuffer, pDstDraw);
+	if (OMAPDRI2CopyDirect(pSrcDraw, pDstDraw, pRegion))
+		return;
 
 	pGC = GetScratchGC(pDstDraw->depth, pScreen);
 	if (!pGC) {
@@ -305,20 +536,52 @@ OMAPDRI2CopyRegion(DrawablePtr pDraw, RegionPtr pRegion,
 	(*pGC->funcs->ChangeClip) (pGC, CT_REGION, pCopyClip, 0);
 	ValidateGC(pDstDraw, pGC);
 
-	/* If the dst is the framebuffer, and we had a way to
-	 * schedule a deferred blit synchronized w/ vsync, that
-	 * would be a nice thing to do utilize here to avoid
-	 * tearing..  when we have sync object support for GEM
-	 * buffers, I think we could do something more clever
-	 * here.
-	 */
-
 	pGC->ops->CopyArea(pSrcDraw, pDstDraw, pGC,
-			0, 0, pDraw->width, pDraw->height, 0, 0);
+			0, 0, width, height, 0, 0);
 
 	FreeScratchGC(pGC);
 }
 
+/*
+ * Blit the whole of a back buffer pixmap to the drawable, for blit swaps.
+ */
+static void
+OMAPDRI2BlitSwap(PixmapPtr pSrcPixmap, DrawablePtr pDraw)
+{
+	BoxRec box = {
+			.x1 = 0,
+			.y1 = 0,
+			.x2 = pDraw->width,
+			.y2 = pDraw->height,
+	};
+	RegionRec region;
+
+	RegionInit(&region, &box, 0);
+	OMAPDRI2Copy(&pSrcPixmap->drawable, pDraw, &region,
+			pDraw->width, pDraw->height);
+	RegionUninit(&region);
+}
+
+/**
+ * CopyRegion is used by the DRI2 core for front/fake-front copies and for
+ * swap interval 0, which must complete immediately.  Swaps which can wait
+ * for vsync are queued from OMAPDRI2ScheduleSwap() instead.
+ */
+static void
+OMAPDRI2CopyRegion(DrawablePtr pDraw, RegionPtr pRegion,
+		DRI2BufferPtr pDstBuffer, DRI2BufferPtr pSrcBuffer)
+{
+	ScreenPtr pScreen = pDraw->pScreen;
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	DrawablePtr pSrcDraw = dri2draw(pDraw, pSrcBuffer);
+	DrawablePtr pDstDraw = dri2draw(pDraw, pDstBuffer);
+
+	DEBUG_MSG("pDraw=%p, pDstBuffer=%p (%p), pSrcBuffer=%p (%p)",
+			pDraw, pDstBuffer, pSrcDraw, pSrcBuffer, pDstDraw);
+
+	OMAPDRI2Copy(pSrcDraw, pDstDraw, pRegion, pDraw->width, pDraw->height);
+}
+
 static uint64_t gettime_us(void)
 {
 	struct timespec tv;
@@ -339,7 +602,7 @@ OMAPDRI2GetMSC(DrawablePtr pDraw, CARD64 *ust, CARD64 *msc)
 	ScreenPtr pScreen = pDraw->pScreen;
 	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
 	OMAPPtr pOMAP = OMAPPTR(pScrn);
-	int crtc_index = drmmode_crtc_index_from_drawable(pScrn, pDraw);
+	int crtc_index = drmmode_crtc_index_covering_drawable(pScrn, pDraw);
 	drmVBlank vbl = { .request = {
 		.type = DRM_VBLANK_RELATIVE |
 			(crtc_index << DRM_VBLANK_HIGH_CRTC_SHIFT),
@@ -348,9 +611,7 @@ OMAPDRI2GetMSC(DrawablePtr pDraw, CARD64 *ust, CARD64 *msc)
 	int ret;
 
 	/*
-	 * Drawable not full screen, use *monotonic* ust value.
-	 * Note, this is slightly different than other drivers which try harder
-	 * to match a Drawable to a crtc.
+	 * Drawable not on any crtc, use *monotonic* ust value.
 	 */
 	if (crtc_index == -1) {
 		if (ust)
@@ -381,10 +642,32 @@ OMAPDRI2GetMSC(DrawablePtr pDraw, CARD64 *ust, CARD64 *msc)
 	return TRUE;
 }
 
+/* The crtc a swap of @pDraw not flipping any crtc is timed to, as a mask */
+static uint32_t
+crtc_mask_covering(ScrnInfoPtr pScrn, DrawablePtr pDraw)
+{
+	int crtc_index = drmmode_crtc_index_covering_drawable(pScrn, pDraw);
+
+	return crtc_index == -1 ? 0 : 1 << crtc_index;
+}
+
 #define OMAP_SWAP_FAKE_FLIP (1 << 0)
 #define OMAP_SWAP_FAIL      (1 << 1)
 
+/*
+ * Upper bound on how far ahead of the current frame a blit swap may be
+ * queued.  The DRI2 core asks for the previous target plus the swap
+ * interval, which is meaningless once the window has moved to a crtc with
+ * a different frame counter.  Targets beyond it go to the next frame
+ * instead, and the client is told so in the swap reply.
+ */
+#define OMAP_MAX_SWAP_AHEAD 64
+
+typedef struct _OMAPDRISwapCmd OMAPDRISwapCmd;
+
 struct _OMAPDRISwapCmd {
+	/* must be first, we are the user data of the flip/vblank event */
+	OMAPDRMEvent event;
 	int type;
 	ClientPtr client;
 	ScreenPtr pScreen;
@@ -396,13 +679,169 @@ struct _OMAPDRISwapCmd {
 	PixmapPtr pSrcPixmap;
 	DRI2SwapEventPtr func;
 	int swapCount;
+	/* crtcs the swap is queued for, see drmmode_swap_queued() */
+	uint32_t crtc_mask;
 	int flags;
 	int x;
 	int y;
 	void *data;
+	/* frame and timestamp of the event that completed the swap */
+	unsigned int frame;
+	unsigned int tv_sec;
+	unsigned int tv_usec;
+	/* the frame we want to complete on, or 0 if unknown, and for swaps
+	 * waiting on a vblank event, the pending_blits link
+	 */
+	unsigned int target_frame;
+	OMAPDRISwapCmd *next;
+	/* when the swap was scheduled, for the statistics */
+	uint64_t schedule_us;
 };
 
-void
+/*
+ * Find or add the statistics of a drawable.  Returns NULL if statistics are
+ * not enabled.
+ */
+static OMAPDRI2StatsPtr
+swap_stats_get(OMAPPtr pOMAP, XID draw_id)
+{
+	OMAPDRI2StatsPtr stats;
+
+	if (!pOMAP->swap_stats_enabled)
+		return NULL;
+
+	for (stats = pOMAP->swap_stats; stats; stats = stats->next) {
+		if (stats->draw_id == draw_id)
+			return stats;
+	}
+
+	stats = calloc(1, sizeof *stats);
+	if (!stats)
+		return NULL;
+	stats->draw_id = draw_id;
+	stats->next = pOMAP->swap_stats;
+	pOMAP->swap_stats = stats;
+	return stats;
+}
+
+static void
+swap_stats_free(OMAPPtr pOMAP)
+{
+	while (pOMAP->swap_stats) {
+		OMAPDRI2StatsPtr stats = pOMAP->swap_stats;
+		pOMAP->swap_stats = stats->next;
+		free(stats);
+	}
+}
+
+/*
+ * Replace the _ARMSOC_SWAP_STATS property on the root window with one line
+ * per drawable, forgetting drawables which have gone away since.
+ */
+static void
+swap_stats_publish(ScreenPtr pScreen)
+{
+	static const char name[] = "_ARMSOC_SWAP_STATS";
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	OMAPPtr pOMAP = OMAPPTR(pScrn);
+	OMAPDRI2StatsPtr *link, stats;
+	DrawablePtr pDraw;
+	char *buf;
+	size_t size = 0, len = 0;
+	int i;
+
+	if (!pScreen->root)
+		return;
+
+	for (link = &pOMAP->swap_stats; (stats = *link); ) {
+		if (dixLookupDrawable(&pDraw, stats->draw_id, serverClient,
+				M_ANY, DixReadAccess) != Success) {
+			*link = stats->next;
+			free(stats);
+			continue;
+		}
+		/* comfortably more than the longest possible line */
+		size += 1024;
+		link = &stats->next;
+	}
+
+	buf = malloc(size + 1);
+	if (!buf)
+		return;
+	buf[0] = '\0';
+
+	for (stats = pOMAP->swap_stats; stats; stats = stats->next) {
+		len += snprintf(buf + len, size + 1 - len,
+				"0x%lx: flips %lu overlays %lu blits %lu "
+				"failed %lu late %lu missed %lu reject",
+				(unsigned long)stats->draw_id, stats->flips,
+				stats->overlays, stats->blits, stats->failures,
+				stats->late_swaps, stats->missed_vblanks);
+		for (i = 0; i < OMAP_FLIP_NUM_REJECTS; i++)
+			len += snprintf(buf + len, size + 1 - len, " %s:%lu",
+					flip_reject_names[i], stats->rejects[i]);
+		len += snprintf(buf + len, size + 1 - len, " latency_ms");
+		for (i = 0; i < OMAP_LATENCY_BUCKETS; i++)
+			len += snprintf(buf + len, size + 1 - len, " %s%d:%lu",
+					i < OMAP_LATENCY_BUCKETS - 1 ? "<" : ">=",
+					1 << min(i, OMAP_LATENCY_BUCKETS - 2),
+					stats->latency[i]);
+		len += snprintf(buf + len, size + 1 - len, "\n");
+	}
+
+	dixChangeWindowProperty(serverClient, pScreen->root,
+			MakeAtom(name, sizeof(name) - 1, TRUE), XA_STRING, 8,
+			PropModeReplace, len, buf, TRUE);
+	free(buf);
+}
+
+/*
+ * Account for a completed swap.
+ */
+static void
+swap_stats_complete(OMAPDRISwapCmd *cmd)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(cmd->pScreen);
+	OMAPPtr pOMAP = OMAPPTR(pScrn);
+	OMAPDRI2StatsPtr stats = swap_stats_get(pOMAP, cmd->draw_id);
+	uint64_t latency_ms;
+	CARD32 now;
+	int bucket;
+
+	if (!stats)
+		return;
+
+	/* a flip no crtc took, as when they are all off, showed nothing */
+	if (cmd->flags & OMAP_SWAP_FAIL)
+		stats->failures++;
+	else if (cmd->type == DRI2_BLIT_COMPLETE)
+		stats->blits++;
+	else if (cmd->type == DRI2_EXCHANGE_COMPLETE)
+		stats->overlays++;
+	else if (!(cmd->flags & OMAP_SWAP_FAKE_FLIP))
+		stats->flips++;
+
+	latency_ms = (gettime_us() - cmd->schedule_us) / 1000;
+	for (bucket = 0; bucket < OMAP_LATENCY_BUCKETS - 1; bucket++) {
+		if (latency_ms < (1ULL << bucket))
+			break;
+	}
+	stats->latency[bucket]++;
+
+	if (cmd->frame && cmd->target_frame &&
+	    (int)(cmd->frame - cmd->target_frame) > 0) {
+		stats->late_swaps++;
+		stats->missed_vblanks += cmd->frame - cmd->target_frame;
+	}
+
+	now = GetTimeInMillis();
+	if (now - pOMAP->swap_stats_time >= OMAP_STATS_INTERVAL_MS) {
+		pOMAP->swap_stats_time = now;
+		swap_stats_publish(cmd->pScreen);
+	}
+}
+
+static void
 OMAPDRI2SwapComplete(OMAPDRISwapCmd *cmd)
 {
 	ScreenPtr pScreen = cmd->pScreen;
@@ -415,38 +854,39 @@ OMAPDRI2SwapComplete(OMAPDRISwapCmd *cmd)
 	if (--cmd->swapCount > 0)
 		return;
 
+	swap_stats_complete(cmd);
+
 	if ((cmd->flags & OMAP_SWAP_FAIL) == 0) {
 		status = dixLookupDrawable(&pDraw, cmd->draw_id, serverClient,
 				M_ANY, DixWriteAccess);
 
 		if (status == Success) {
-			if (cmd->type != DRI2_BLIT_COMPLETE && (cmd->flags & OMAP_SWAP_FAKE_FLIP) == 0) {
-				assert(cmd->type == DRI2_FLIP_COMPLETE);
+			if (cmd->type == DRI2_FLIP_COMPLETE && (cmd->flags & OMAP_SWAP_FAKE_FLIP) == 0) {
 				OMAPPixmapExchange(cmd->pSrcPixmap, cmd->pDstPixmap);
 			}
 
-			DRI2SwapComplete(cmd->client, pDraw, 0, 0, 0, cmd->type,
+			DRI2SwapComplete(cmd->client, pDraw, cmd->frame,
+					cmd->tv_sec, cmd->tv_usec, cmd->type,
 					cmd->func, cmd->data);
 
 			if (cmd->type == DRI2_BLIT_COMPLETE) {
 				/* For blits, invalidate the per-crtc scanouts.
 				 */
-				for (i = 0; i < MAX_SCANOUTS; i++) {
+				for (i = 0; i < pOMAP->num_scanouts; i++) {
 					pOMAP->scanouts[i].valid = FALSE;
 				}
-			} else {
-				assert(cmd->type == DRI2_FLIP_COMPLETE);
+			} else if (cmd->type == DRI2_FLIP_COMPLETE) {
 				dst_priv = exaGetPixmapDriverPrivate(cmd->pDstPixmap);
 				/* For flips, validate the per-crtc scanout.
 				 */
-				for (i = 0; i < MAX_SCANOUTS; i++) {
+				for (i = 0; i < pOMAP->num_scanouts; i++) {
 					if (pOMAP->scanouts[i].bo == dst_priv->bo) {
 						pOMAP->scanouts[i].valid = TRUE;
 						break;
 					}
 				}
 				if ((cmd->flags & OMAP_SWAP_FAKE_FLIP) == 0) {
-					drmmode_scanout_set(pOMAP->scanouts, cmd->x, cmd->y, dst_priv->bo);
+					drmmode_scanout_set(pScrn, cmd->x, cmd->y, dst_priv->bo);
 				}
 			}
 		}
@@ -457,12 +897,250 @@ OMAPDRI2SwapComplete(OMAPDRISwapCmd *cmd)
 	pScreen->DestroyPixmap(cmd->pSrcPixmap);
 	pScreen->DestroyPixmap(cmd->pDstPixmap);
 	if (cmd->type != DRI2_BLIT_COMPLETE) {
-		pOMAP->pending_flips--;
+		drmmode_swap_done(pScrn, cmd->crtc_mask);
 	}
 
 	free(cmd);
 }
 
+static void
+OMAPDRI2FlipEvent(OMAPDRMEventPtr event, unsigned int frame,
+		unsigned int tv_sec, unsigned int tv_usec)
+{
+	OMAPDRISwapCmd *cmd = (OMAPDRISwapCmd *)event;
+
+	cmd->frame = frame;
+	cmd->tv_sec = tv_sec;
+	cmd->tv_usec = tv_usec;
+	OMAPDRI2SwapComplete(cmd);
+}
+
+static void
+OMAPDRI2VBlankEvent(OMAPDRMEventPtr event, unsigned int frame,
+		unsigned int tv_sec, unsigned int tv_usec)
+{
+	OMAPDRISwapCmd *cmd = (OMAPDRISwapCmd *)event;
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(cmd->pScreen);
+	OMAPPtr pOMAP = OMAPPTR(pScrn);
+	OMAPDRISwapCmd **link, *later;
+	DrawablePtr pDraw;
+
+	cmd->frame = frame;
+	cmd->tv_sec = tv_sec;
+	cmd->tv_usec = tv_usec;
+
+	for (link = &pOMAP->pending_blits; *link != cmd; link = &(*link)->next)
+		;
+	*link = cmd->next;
+
+	/* If a newer blit of the same drawable is due on this vblank too, it
+	 * would overwrite whatever we copy now, so leave the copy to it.
+	 */
+	for (later = cmd->next; later; later = later->next) {
+		if (later->draw_id == cmd->draw_id &&
+		    later->type == DRI2_BLIT_COMPLETE &&
+		    (int)(later->target_frame - frame) <= 0)
+			break;
+	}
+
+	if (later) {
+		DEBUG_MSG("blit for frame %u coalesced", frame);
+	} else if (dixLookupDrawable(&pDraw, cmd->draw_id, serverClient,
+			M_ANY, DixWriteAccess) == Success) {
+		OMAPDRI2BlitSwap(cmd->pSrcPixmap, pDraw);
+	}
+
+	OMAPDRI2SwapComplete(cmd);
+}
+
+/*
+ * Queue a blit swap for the vblank of the crtc showing most of the drawable,
+ * at or after the target msc requested by the DRI2 core.  The copy itself is
+ * done from OMAPDRI2VBlankEvent() as soon as the vblank event arrives.
+ *
+ * Returns FALSE if the drawable is not on any crtc or the vblank event could
+ * not be requested, in which case the caller should complete immediately.
+ */
+static Bool
+OMAPDRI2ScheduleVBlankSwap(DrawablePtr pDraw, OMAPDRISwapCmd *cmd,
+		CARD64 *target_msc, CARD64 divisor, CARD64 remainder)
+{
+	ScreenPtr pScreen = pDraw->pScreen;
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	OMAPPtr pOMAP = OMAPPTR(pScrn);
+	int crtc_index = drmmode_crtc_index_covering_drawable(pScrn, pDraw);
+	OMAPDRISwapCmd **link;
+	CARD64 current_msc, target;
+	drmVBlank vbl;
+
+	if (crtc_index == -1)
+		return FALSE;
+
+	vbl.request.type = DRM_VBLANK_RELATIVE |
+			(crtc_index << DRM_VBLANK_HIGH_CRTC_SHIFT);
+	vbl.request.sequence = 0;
+	if (drmWaitVBlank(pOMAP->drmFD, &vbl)) {
+		ERROR_MSG("get vblank counter failed: %s", strerror(errno));
+		return FALSE;
+	}
+	current_msc = vbl.reply.sequence;
+
+	target = *target_msc;
+	if (divisor == 0 || current_msc < target) {
+		/* the client learns the frame actually used from the reply,
+		 * which DRI2 fills in from *target_msc */
+		if (target > current_msc + OMAP_MAX_SWAP_AHEAD)
+			DEBUG_MSG("swap target %llu is more than %d frames after %llu, using the next frame",
+					(unsigned long long)target,
+					OMAP_MAX_SWAP_AHEAD,
+					(unsigned long long)current_msc);
+		if (target <= current_msc ||
+		    target > current_msc + OMAP_MAX_SWAP_AHEAD)
+			target = current_msc + 1;
+	} else {
+		target = current_msc - (current_msc % divisor) + remainder;
+		if (target <= current_msc)
+			target += divisor;
+	}
+
+	cmd->event.handler = OMAPDRI2VBlankEvent;
+	cmd->target_frame = target;
+
+	vbl.request.type = DRM_VBLANK_ABSOLUTE | DRM_VBLANK_EVENT |
+			(crtc_index << DRM_VBLANK_HIGH_CRTC_SHIFT);
+	vbl.request.sequence = target;
+	vbl.request.signal = (unsigned long)cmd;
+	if (drmWaitVBlank(pOMAP->drmFD, &vbl)) {
+		ERROR_MSG("queue vblank event failed: %s", strerror(errno));
+		return FALSE;
+	}
+
+	/* keep the queue in submission order, for coalescing */
+	for (link = &pOMAP->pending_blits; *link; link = &(*link)->next)
+		;
+	cmd->next = NULL;
+	*link = cmd;
+
+	*target_msc = target;
+	return TRUE;
+}
+
+/*
+ * Take a window off its overlay plane and forget about it.  Unless the
+ * window is gone, the frame on the plane is copied into it first, so that
+ * nothing flickers.
+ */
+static void
+plane_release(ScreenPtr pScreen, OMAPDRI2PlanePtr *link)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	OMAPDRI2PlanePtr plane = *link;
+	DrawablePtr pDraw;
+
+	DEBUG_MSG("window 0x%lx leaves its plane", (unsigned long)plane->draw_id);
+
+	if (plane->shown && dixLookupDrawable(&pDraw, plane->draw_id,
+			serverClient, M_WINDOW, DixWriteAccess) == Success)
+		OMAPDRI2BlitSwap(plane->pPixmap, pDraw);
+	drmmode_plane_hide(pScrn, plane);
+
+	*link = plane->next;
+	pScreen->DestroyPixmap(plane->pPixmap);
+	free(plane);
+}
+
+static OMAPDRI2PlanePtr *
+plane_link(OMAPPtr pOMAP, XID draw_id)
+{
+	OMAPDRI2PlanePtr *link;
+
+	for (link = &pOMAP->dri2_planes; *link; link = &(*link)->next) {
+		if ((*link)->draw_id == draw_id)
+			return link;
+	}
+	return NULL;
+}
+
+/*
+ * Swap by scanning the back buffer out on an overlay plane, and handing the
+ * bo the plane showed until now to the client as its next back buffer.  The
+ * swap completes when the plane shows the new frame.
+ *
+ * Returns FALSE if no plane could be had, the window has none then and the
+ * caller blits.
+ */
+static Bool
+OMAPDRI2PlaneSwap(DrawablePtr pDraw, OMAPDRISwapCmd *cmd)
+{
+	ScreenPtr pScreen = pDraw->pScreen;
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	OMAPPtr pOMAP = OMAPPTR(pScrn);
+	struct omap_bo *back_bo = OMAPPixmapBo(cmd->pSrcPixmap);
+	OMAPDRI2PlanePtr *link = plane_link(pOMAP, pDraw->id);
+	OMAPDRI2PlanePtr plane;
+	struct omap_bo *bo;
+	CARD64 ust, msc;
+	int num_flipped;
+
+	/* the bos swap places, so they had better be alike */
+	if (link) {
+		bo = OMAPPixmapBo((*link)->pPixmap);
+		if (omap_bo_width(bo) != omap_bo_width(back_bo) ||
+		    omap_bo_height(bo) != omap_bo_height(back_bo) ||
+		    omap_bo_pitch(bo) != omap_bo_pitch(back_bo))
+			plane_release(pScreen, link);
+	}
+
+	link = plane_link(pOMAP, pDraw->id);
+	if (link) {
+		plane = *link;
+	} else {
+		plane = calloc(1, sizeof *plane);
+		if (!plane)
+			return FALSE;
+		plane->pPixmap = pScreen->CreatePixmap(pScreen,
+				cmd->pSrcPixmap->drawable.width,
+				cmd->pSrcPixmap->drawable.height,
+				cmd->pSrcPixmap->drawable.depth, 0);
+		bo = plane->pPixmap ? OMAPPixmapBo(plane->pPixmap) : NULL;
+		if (!bo || omap_bo_pitch(bo) != omap_bo_pitch(back_bo)) {
+			if (plane->pPixmap)
+				pScreen->DestroyPixmap(plane->pPixmap);
+			free(plane);
+			return FALSE;
+		}
+		plane->draw_id = pDraw->id;
+		plane->next = pOMAP->dri2_planes;
+		pOMAP->dri2_planes = plane;
+		link = &pOMAP->dri2_planes;
+	}
+
+	OMAPPixmapExchange(plane->pPixmap, cmd->pSrcPixmap);
+	cmd->type = DRI2_EXCHANGE_COMPLETE;
+
+	if (drmmode_plane_show(pDraw, plane,
+			omap_bo_fb(OMAPPixmapBo(plane->pPixmap)), cmd,
+			&num_flipped)) {
+		OMAPPixmapExchange(plane->pPixmap, cmd->pSrcPixmap);
+		plane_release(pScreen, link);
+		return FALSE;
+	}
+
+	plane->shown = TRUE;
+	cmd->crtc_mask = crtc_mask_covering(pScrn, pDraw);
+	drmmode_swap_queued(pScrn, cmd->crtc_mask);
+	cmd->swapCount = num_flipped;
+	if (cmd->swapCount == 0) {
+		if (OMAPDRI2GetMSC(pDraw, &ust, &msc)) {
+			cmd->frame = msc;
+			cmd->tv_sec = ust / 1000000;
+			cmd->tv_usec = ust % 1000000;
+		}
+		OMAPDRI2SwapComplete(cmd);
+	}
+	return TRUE;
+}
+
 /**
  * ScheduleSwap is responsible for requesting a DRM vblank event for the
  * appropriate frame.
@@ -488,13 +1166,18 @@ OMAPDRI2ScheduleSwap(ClientPtr client, DrawablePtr pDraw,
 	OMAPDRI2BufferPtr dst = OMAPBUF(pDstBuffer);
 	OMAPDRISwapCmd *cmd;
 	OMAPPixmapPrivPtr src_priv, dst_priv;
-	int new_canflip, ret, num_flipped;
+	OMAPDRI2StatsPtr stats;
+	OMAPDRI2PlanePtr *plane_link_p;
+	int new_canflip, ret, num_flipped, reject;
+	Bool overlay;
 	RegionRec region;
+	CARD64 msc;
 
 	cmd = calloc(1, sizeof *cmd);
 	if (!cmd)
 		return FALSE;
 
+	cmd->event.handler = OMAPDRI2FlipEvent;
 	cmd->client = client;
 	cmd->pScreen = pScreen;
 	cmd->draw_id = pDraw->id;
@@ -507,6 +1190,16 @@ OMAPDRI2ScheduleSwap(ClientPtr client, DrawablePtr pDraw,
 	cmd->x = pDraw->x;
 	cmd->y = pDraw->y;
 
+	stats = swap_stats_get(pOMAP, pDraw->id);
+	if (stats) {
+		cmd->schedule_us = gettime_us();
+		if (OMAPDRI2GetMSC(pDraw, NULL, &msc) && msc)
+			cmd->target_frame = msc + 1;
+	}
+
+	src_priv = exaGetPixmapDriverPrivate(src->pPixmap);
+	dst_priv = exaGetPixmapDriverPrivate(dst->pPixmap);
+
 	region.extents.x1 = region.extents.y1 = 0;
 	region.extents.x2 = cmd->pDstPixmap->drawable.width;
 	region.extents.y2 = cmd->pDstPixmap->drawable.height;
@@ -515,28 +1208,35 @@ OMAPDRI2ScheduleSwap(ClientPtr client, DrawablePtr pDraw,
 
 	DEBUG_MSG("%d -> %d", pSrcBuffer->attachment, pDstBuffer->attachment);
 
-	src_priv = exaGetPixmapDriverPrivate(src->pPixmap);
-	dst_priv = exaGetPixmapDriverPrivate(dst->pPixmap);
-
 	/* src bo was just rendered to by GPU so it is not dirty */
 	omap_bo_clear_dirty(src_priv->bo);
-	new_canflip = canflip(pDraw, src_priv->bo);
-
-	/* If we can flip using a crtc scanout, switch the front buffer bo */
+	new_canflip = canflip(pDraw, src_priv->bo, &reject);
+	if (stats && !new_canflip)
+		stats->rejects[reject]++;
+	else if (stats && pOMAP->has_resized)
+		stats->rejects[OMAP_FLIP_REJECT_RESIZED]++;
+
+	/* windows which can't be flipped may still fit on an overlay plane */
+	overlay = !new_canflip && canoverlay(pDraw, src_priv->bo);
+	plane_link_p = overlay ? NULL : plane_link(pOMAP, pDraw->id);
+	if (plane_link_p)
+		plane_release(pScreen, plane_link_p);
+
+	/* If we can flip using a crtc scanout, switch the front buffer bo.
+	 * A window covering several crtcs flips on the span scanout.
+	 */
 	if (new_canflip && !pOMAP->has_resized) {
-		struct omap_bo *old_bo;
+		OMAPScanoutPtr scanout;
 
-		old_bo = dst_priv->bo;
-		dst_priv->bo = drmmode_scanout_from_drawable(pOMAP->scanouts,
-				pDraw)->bo;
-		omap_bo_reference(dst_priv->bo);
-		if (!drmmode_set_flip_mode(pScrn)) {
+		scanout = drmmode_scanout_from_drawable(pScrn, pDraw);
+		if (!drmmode_set_flip_mode(pScrn, scanout->span ?
+				OMAP_FLIP_SPANNING : OMAP_FLIP_ENABLED)) {
 			ERROR_MSG("Could not set flip mode");
 			new_canflip = FALSE;
-			omap_bo_unreference(dst_priv->bo);
-			dst_priv->bo = old_bo;
 		} else {
-			omap_bo_unreference(old_bo);
+			omap_bo_reference(scanout->bo);
+			omap_bo_unreference(dst_priv->bo);
+			dst_priv->bo = scanout->bo;
 		}
 	} else {
 		struct omap_bo *old_bo;
@@ -548,6 +1248,9 @@ OMAPDRI2ScheduleSwap(ClientPtr client, DrawablePtr pDraw,
 			ERROR_MSG("Could not set blit mode");
 			omap_bo_unreference(pOMAP->scanout);
 			DamageRegionProcessPending(&cmd->pDstPixmap->drawable);
+			if (stats)
+				stats->failures++;
+			free(cmd);
 			return FALSE;
 		}
 		omap_bo_unreference(old_bo);
@@ -593,9 +1296,15 @@ OMAPDRI2ScheduleSwap(ClientPtr client, DrawablePtr pDraw,
 		DEBUG_MSG("can flip:  %d", src_fb_id);
 		cmd->type = DRI2_FLIP_COMPLETE;
 		/* TODO: handle rollback if only multiple CRTC flip is only partially successful
+		 * (legacy flips only, atomic ones flip all CRTCs or none)
 		 */
-		pOMAP->pending_flips++;
-		ret = drmmode_page_flip(pDraw, src_fb_id, cmd, &num_flipped);
+		cmd->crtc_mask = drmmode_crtcs_showing(pScrn, pDraw);
+		drmmode_swap_queued(pScrn, cmd->crtc_mask);
+		/* Never async: the DRI2 core blits swap interval 0 itself, so
+		 * every swap we see is meant to be synced to vblank.
+		 */
+		ret = drmmode_page_flip(pDraw, src_priv->bo, cmd, FALSE,
+				&num_flipped);
 
 		/* If using page flip events, we'll trigger an immediate completion in
 		 * the case that no CRTCs were enabled to be flipped.  If not using page
@@ -629,20 +1338,17 @@ OMAPDRI2ScheduleSwap(ClientPtr client, DrawablePtr pDraw,
 				OMAPDRI2SwapComplete(cmd);
 			}
 		}
+	} else if (overlay && OMAPDRI2PlaneSwap(pDraw, cmd)) {
+		/* on an overlay plane, completes with the plane update */
 	} else {
-		/* fallback to blit: */
-		BoxRec box = {
-				.x1 = 0,
-				.y1 = 0,
-				.x2 = pDraw->width,
-				.y2 = pDraw->height,
-		};
-		RegionRec region;
-		RegionInit(&region, &box, 0);
-		OMAPDRI2CopyRegion(pDraw, &region, pDstBuffer, pSrcBuffer);
+		/* fallback to blit, synchronised to vblank where possible: */
 		cmd->type = DRI2_BLIT_COMPLETE;
-		OMAPDRI2SwapComplete(cmd);
 		pOMAP->has_resized = FALSE;
+		if (!OMAPDRI2ScheduleVBlankSwap(pDraw, cmd, target_msc, divisor,
+				remainder)) {
+			OMAPDRI2BlitSwap(cmd->pSrcPixmap, pDraw);
+			OMAPDRI2SwapComplete(cmd);
+		}
 	}
 
 	return TRUE;
@@ -679,7 +1385,8 @@ OMAPDRI2ReuseBufferNotify(DrawablePtr pDraw, DRI2BufferPtr buffer)
 	OMAPPixmapPrivPtr omap_priv = exaGetPixmapDriverPrivate(pPixmap);
 
 	buffer->name = omap_bo_get_name(omap_priv->bo);
-	buffer->flags = 0;// omap_bo_get_dirty(omap_priv->bo) ? DRI2_ARMSOC_PRIVATE_CRC_DIRTY : 0;
+	buffer->flags = omap_bo_get_dirty(omap_priv->bo) ?
+			DRI2_ARMSOC_PRIVATE_CRC_DIRTY : 0;
 }
 
 /**
@@ -722,6 +1429,50 @@ OMAPDRI2ScreenInit(ScreenPtr pScreen)
 	return DRI2ScreenInit(pScreen, &info);
 }
 
+/**
+ * Called before the server sleeps: windows on overlay planes follow their
+ * window around, and go back to being blitted as soon as they are covered,
+ * unmapped, destroyed or no longer on a single crtc.
+ */
+void
+OMAPDRI2BlockHandler(ScreenPtr pScreen)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	OMAPPtr pOMAP = OMAPPTR(pScrn);
+	OMAPDRI2PlanePtr *link, plane;
+	DrawablePtr pDraw;
+	int num_flipped;
+
+	for (link = &pOMAP->dri2_planes; (plane = *link); ) {
+		struct omap_bo *bo = OMAPPixmapBo(plane->pPixmap);
+
+		if (dixLookupDrawable(&pDraw, plane->draw_id, serverClient,
+				M_WINDOW, DixReadAccess) == Success &&
+		    canoverlay(pDraw, bo) &&
+		    !drmmode_plane_show(pDraw, plane, omap_bo_fb(bo), NULL,
+				&num_flipped)) {
+			link = &plane->next;
+			continue;
+		}
+		plane_release(pScreen, link);
+	}
+}
+
+/**
+ * Put every window on an overlay plane back into the root window, e.g. when
+ * leaving the VT, as whoever has the display next may well turn the planes
+ * off behind our back.
+ */
+void
+OMAPDRI2ReleasePlanes(ScreenPtr pScreen)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	OMAPPtr pOMAP = OMAPPTR(pScrn);
+
+	while (pOMAP->dri2_planes)
+		plane_release(pScreen, &pOMAP->dri2_planes);
+}
+
 /**
  * The DRI2 CloseScreen() function.. unregister ourself w/ DRI2 core.
  */
@@ -730,9 +1481,11 @@ OMAPDRI2CloseScreen(ScreenPtr pScreen)
 {
 	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
 	OMAPPtr pOMAP = OMAPPTR(pScrn);
-	while (pOMAP->pending_flips > 0) {
+	drmmode_wait_for_swaps(pScrn, ~0);
+	while (pOMAP->pending_blits) {
 		DEBUG_MSG("waiting..");
 		drmmode_wait_for_event(pScrn);
 	}
+	swap_stats_free(pOMAP);
 	DRI2CloseScreen(pScreen);
 }
@@ -0,0 +1,167 @@
+/* -*- mode: C; c-file-style: "k&r"; tab-width 4; indent-tabs-mode: t; -*- */
+
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include "omap_driver.h"
+#include "omap_exa.h"
+
+#ifdef HAVE_DRI3_H
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "dri3.h"
+#include "misyncshm.h"
+
+/*
+ * DRI3 backend.
+ *
+ * Buffers are shared with clients as dma-bufs (PRIME) instead of GEM flink
+ * names, so no per-buffer round trip is needed and client allocated buffers
+ * can be scanned out directly, see omap_bo_from_fd().
+ */
+
+static int
+OMAPDRI3Open(ScreenPtr pScreen, RRProviderPtr provider, int *fdp)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	OMAPPtr pOMAP = OMAPPTR(pScrn);
+	drm_magic_t magic;
+	int fd;
+
+	fd = open(pOMAP->deviceName, O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		ERROR_MSG("Cannot open %s: %s", pOMAP->deviceName,
+				strerror(errno));
+		return BadAlloc;
+	}
+
+	/* a primary node has to be authenticated to be of any use, render
+	 * nodes don't know about magic and don't need it
+	 */
+	if (!drmGetMagic(fd, &magic) && drmAuthMagic(pOMAP->drmFD, magic)) {
+		ERROR_MSG("Cannot authenticate DRI3 client: %s",
+				strerror(errno));
+		close(fd);
+		return BadMatch;
+	}
+
+	*fdp = fd;
+	return Success;
+}
+
+static PixmapPtr
+OMAPDRI3PixmapFromFd(ScreenPtr pScreen, int fd, CARD16 width, CARD16 height,
+		CARD16 stride, CARD8 depth, CARD8 bpp)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	OMAPPtr pOMAP = OMAPPTR(pScrn);
+	OMAPPixmapPrivPtr priv;
+	PixmapPtr pPixmap;
+	struct omap_bo *bo;
+
+	if (!width || !height || !depth || (bpp != 16 && bpp != 32) ||
+	    stride < width * bpp / 8)
+		return NULL;
+
+	bo = omap_bo_from_fd(pOMAP->dev, fd, width, height, stride, depth,
+			bpp);
+	if (!bo)
+		return NULL;
+
+	pPixmap = pScreen->CreatePixmap(pScreen, 0, 0, depth, 0);
+	if (!pPixmap) {
+		omap_bo_unreference(bo);
+		return NULL;
+	}
+
+	/* with a bo of the right size in place, the header update below
+	 * keeps it rather than allocating a new one
+	 */
+	priv = exaGetPixmapDriverPrivate(pPixmap);
+	omap_bo_unreference(priv->bo);
+	priv->bo = bo;
+
+	if (!pScreen->ModifyPixmapHeader(pPixmap, width, height, depth, bpp,
+			stride, NULL)) {
+		ERROR_MSG("failed to set up %ux%u pixmap for dma-buf",
+				width, height);
+		pScreen->DestroyPixmap(pPixmap);
+		return NULL;
+	}
+
+	return pPixmap;
+}
+
+static int
+OMAPDRI3FdFromPixmap(ScreenPtr pScreen, PixmapPtr pPixmap, CARD16 *stride,
+		CARD32 *size)
+{
+	struct omap_bo *bo = OMAPPixmapBo(pPixmap);
+
+	if (!bo || omap_bo_pitch(bo) > UINT16_MAX)
+		return -1;
+
+	*stride = omap_bo_pitch(bo);
+	*size = omap_bo_pitch(bo) * omap_bo_height(bo);
+	return omap_bo_to_fd(bo);
+}
+
+static dri3_screen_info_rec omap_dri3_screen_info = {
+	.version = 0,
+
+	.open = OMAPDRI3Open,
+	.pixmap_from_fd = OMAPDRI3PixmapFromFd,
+	.fd_from_pixmap = OMAPDRI3FdFromPixmap,
+};
+
+Bool
+OMAPDRI3ScreenInit(ScreenPtr pScreen)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	OMAPPtr pOMAP = OMAPPTR(pScrn);
+
+	if (!omap_device_has_prime(pOMAP->dev)) {
+		INFO_MSG("No PRIME support, DRI3 disabled");
+		return FALSE;
+	}
+
+	/* DRI3 clients synchronize through shared memory fences */
+	if (!miSyncShmScreenInit(pScreen))
+		return FALSE;
+
+	return dri3_screen_init(pScreen, &omap_dri3_screen_info);
+}
+
+#else /* HAVE_DRI3_H */
+
+Bool
+OMAPDRI3ScreenInit(ScreenPtr pScreen)
+{
+	return FALSE;
+}
+
+#endif /* HAVE_DRI3_H */
@@ -31,12 +31,15 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <time.h>
 
 #ifdef HAVE_CONFIG_H
 #include "config.h"
 #endif
 
 #include "omap_driver.h"
+#include "omap_copy.h"
+#include "omap_thread.h"
 #include "compat-api.h"
 
 Bool omapDebug = 0;
@@ -51,12 +54,15 @@ static Bool OMAPPreInit(ScrnInfoPtr pScrn, int flags);
 static Bool OMAPScreenInit(SCREEN_INIT_ARGS_DECL);
 static void OMAPLoadPalette(ScrnInfoPtr pScrn, int numColors, int *indices,
 		LOCO * colors, VisualPtr pVisual);
+static Bool OMAPCreateScreenResources(ScreenPtr pScreen);
 static Bool OMAPCloseScreen(CLOSE_SCREEN_ARGS_DECL);
 static Bool OMAPSwitchMode(SWITCH_MODE_ARGS_DECL);
 static void OMAPAdjustFrame(ADJUST_FRAME_ARGS_DECL);
 static Bool OMAPEnterVT(VT_FUNC_ARGS_DECL);
 static void OMAPLeaveVT(VT_FUNC_ARGS_DECL);
 static void OMAPFreeScreen(FREE_SCREEN_ARGS_DECL);
+static void OMAPBlockHandler(BLOCKHANDLER_ARGS_DECL);
+static uint64_t OMAPTimeUs(void);
 
 
 
@@ -90,11 +96,21 @@ static SymTabRec OMAPChipsets[] = {
 /** Supported options, as enum values. */
 typedef enum {
 	OPTION_DEBUG,
+	OPTION_SWAP_STATS,
+	OPTION_ATOMIC,
+	OPTION_OVERLAY_PLANES,
+	OPTION_TEARFREE,
+	OPTION_SHADOW_FB,
 } OMAPOpts;
 
 /** Supported options. */
 static const OptionInfoRec OMAPOptions[] = {
 	{ OPTION_DEBUG,		"Debug",	OPTV_BOOLEAN,	{0},	FALSE },
+	{ OPTION_SWAP_STATS,	"SwapStats",	OPTV_BOOLEAN,	{0},	FALSE },
+	{ OPTION_ATOMIC,	"Atomic",	OPTV_BOOLEAN,	{0},	FALSE },
+	{ OPTION_OVERLAY_PLANES,	"OverlayPlanes",	OPTV_BOOLEAN,	{0},	FALSE },
+	{ OPTION_TEARFREE,	"TearFree",	OPTV_BOOLEAN,	{0},	FALSE },
+	{ OPTION_SHADOW_FB,	"ShadowFB",	OPTV_BOOLEAN,	{0},	FALSE },
 	{ -1,			NULL,		OPTV_NONE,	{0},	FALSE }
 };
 
@@ -423,6 +439,7 @@ OMAPPreInit(ScrnInfoPtr pScrn, int flags)
 	/* Allocate the driver's Screen-specific, "private" data structure: */
 	OMAPGetRec(pScrn);
 	pOMAP = OMAPPTR(pScrn);
+	pOMAP->startup_us = OMAPTimeUs();
 
 	pOMAP->pEntityInfo = xf86GetEntityInfo(pScrn->entityList[0]);
 
@@ -472,6 +489,7 @@ OMAPPreInit(ScrnInfoPtr pScrn, int flags)
 		goto fail;
 	}
 	DEBUG_MSG("Became DRM master.");
+	OMAPStartupPhase(pScrn, "DRM opened");
 
 	/* create DRM device instance: */
 	pOMAP->dev = omap_device_new(pOMAP->drmFD, pScrn);
@@ -494,6 +512,26 @@ OMAPPreInit(ScrnInfoPtr pScrn, int flags)
 	/* Determine if the user wants debug messages turned on: */
 	omapDebug = xf86ReturnOptValBool(pOMAP->pOptionInfo, OPTION_DEBUG, FALSE);
 
+	pOMAP->swap_stats_enabled = xf86ReturnOptValBool(pOMAP->pOptionInfo,
+			OPTION_SWAP_STATS, FALSE);
+
+	pOMAP->atomic_modeset = xf86ReturnOptValBool(pOMAP->pOptionInfo,
+			OPTION_ATOMIC, FALSE);
+
+	pOMAP->overlay_planes = xf86ReturnOptValBool(pOMAP->pOptionInfo,
+			OPTION_OVERLAY_PLANES, FALSE);
+
+	pOMAP->tearfree = xf86ReturnOptValBool(pOMAP->pOptionInfo,
+			OPTION_TEARFREE, FALSE);
+	if (pOMAP->tearfree)
+		INFO_MSG("TearFree enabled");
+
+	/* whether the shadow pays off depends on how the SoC maps bos */
+	pOMAP->shadow_fb = xf86ReturnOptValBool(pOMAP->pOptionInfo,
+			OPTION_SHADOW_FB, omap_device_prefer_shadow(pOMAP->dev));
+	if (pOMAP->shadow_fb)
+		INFO_MSG("ShadowFB enabled");
+
 	/*
 	 * Select the video modes:
 	 */
@@ -565,10 +603,11 @@ OMAPScreenInit(SCREEN_INIT_ARGS_DECL)
 	if (!OMAPMapMem(pScrn))
 		return FALSE;
 
-	/* For a smooth transition from console to X, copy the current fbcon
-	 * contents to the root window.
+	/* For a smooth transition from console to X, copy what the crtcs
+	 * show to the root window.
 	 */
 	drmmode_copy_fb(pScrn);
+	OMAPShadowAlloc(pScrn);
 
 	/* The root window pixmap bo (pOMAP->scanout) has valid contents now,
 	 * so we start out claiming we're in blit mode.
@@ -577,7 +616,7 @@ OMAPScreenInit(SCREEN_INIT_ARGS_DECL)
 	 *    xf86SetDesiredModes() ->
 	 *     drmmode_set_mode_major() ->
 	 *      drmmode_set_crtc() ->
-	 *       drmModeSetCrtc()
+	 *       drmModeSetCrtc(), or just a flip if the mode stays
 	 */
 	pOMAP->flip_mode = OMAP_FLIP_DISABLED;
 
@@ -692,6 +731,15 @@ OMAPScreenInit(SCREEN_INIT_ARGS_DECL)
 		goto fail;
 	}
 
+	if (!OMAPPresentScreenInit(pScreen))
+		WARNING_MSG("Present extension not available");
+
+	if (!OMAPDRI3ScreenInit(pScreen))
+		WARNING_MSG("DRI3 not available");
+
+	if (!OMAPVideoScreenInit(pScreen))
+		WARNING_MSG("Xv overlay not available");
+
 	/* Initialize backing store: */
 //	miInitializeBackingStore(pScreen);
 	xf86SetBackingStore(pScreen);
@@ -739,7 +787,10 @@ OMAPScreenInit(SCREEN_INIT_ARGS_DECL)
 	pScreen->SaveScreen = xf86SaveScreen;
 
 	/* Wrap some screen functions: */
+	wrap(pOMAP, pScreen, CreateScreenResources,
+			OMAPCreateScreenResources);
 	wrap(pOMAP, pScreen, CloseScreen, OMAPCloseScreen);
+	wrap(pOMAP, pScreen, BlockHandler, OMAPBlockHandler);
 
 	if (!drmmode_screen_init(pScrn)) {
 		ERROR_MSG("drmmode_screen_init() failed!");
@@ -763,6 +814,218 @@ OMAPLoadPalette(ScrnInfoPtr pScrn, int numColors, int *indices,
 	TRACE_EXIT();
 }
 
+/* Workers beyond the calling thread for the conversions split in bands */
+#define OMAP_MAX_THREADS	3
+
+/*
+ * The worker threads, started the first time they are asked for.  Returns
+ * NULL if none would start, omap_thread_run() then does all the work in the
+ * calling thread.
+ */
+struct omap_thread_pool *
+OMAPThreadPool(ScrnInfoPtr pScrn)
+{
+	OMAPPtr pOMAP = OMAPPTR(pScrn);
+
+	if (!pOMAP->threads)
+		pOMAP->threads = omap_thread_pool_new(min(
+				sysconf(_SC_NPROCESSORS_ONLN) - 1,
+				OMAP_MAX_THREADS));
+	return pOMAP->threads;
+}
+
+static uint64_t
+OMAPTimeUs(void)
+{
+	struct timespec tv;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &tv))
+		return 0;
+
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_nsec / 1000;
+}
+
+/* Log how long after PreInit started the server got to @phase */
+void
+OMAPStartupPhase(ScrnInfoPtr pScrn, const char *phase)
+{
+	OMAPPtr pOMAP = OMAPPTR(pScrn);
+	uint64_t us;
+
+	if (pOMAP->started)
+		return;
+
+	us = OMAPTimeUs() - pOMAP->startup_us;
+	INFO_MSG("Startup: %s after %u.%03u ms", phase,
+			(unsigned int)(us / 1000), (unsigned int)(us % 1000));
+}
+
+
+/*
+ * ShadowFB
+ *
+ * On many SoCs the CPU maps bos uncached or write-combined, where fb's reads
+ * (blending, scrolling, GetImage) crawl.  With ShadowFB the CPU renders the
+ * root into a cached copy instead, see OMAPPrepareAccess(), and the damaged
+ * boxes are copied to the root bo before the server sleeps.  Whatever the
+ * driver itself writes to the root bo goes to the shadow as well.
+ */
+
+/*
+ * Where the CPU reads and writes @bo: the shadow for the root bo, if there is
+ * one, otherwise the bo's own mapping.
+ */
+void *
+OMAPBoCpuMap(ScrnInfoPtr pScrn, struct omap_bo *bo)
+{
+	OMAPPtr pOMAP = OMAPPTR(pScrn);
+
+	if (bo == pOMAP->scanout && pOMAP->shadow)
+		return pOMAP->shadow;
+	return omap_bo_map(bo);
+}
+
+/*
+ * (Re)allocate the shadow for the current root bo, starting out with its
+ * contents.  On failure we carry on without a shadow.
+ */
+Bool
+OMAPShadowAlloc(ScrnInfoPtr pScrn)
+{
+	OMAPPtr pOMAP = OMAPPTR(pScrn);
+	uint32_t pitch = omap_bo_pitch(pOMAP->scanout);
+	uint32_t height = omap_bo_height(pOMAP->scanout);
+	void *map, *shadow;
+
+	if (!pOMAP->shadow_fb)
+		return TRUE;
+
+	free(pOMAP->shadow);
+	pOMAP->shadow = NULL;
+
+	map = omap_bo_map(pOMAP->scanout);
+	shadow = malloc(pitch * height);
+	if (!map || !shadow) {
+		ERROR_MSG("ShadowFB allocation failed, rendering to scanout");
+		free(shadow);
+		return FALSE;
+	}
+
+	omap_bo_cpu_prep(pOMAP->scanout, OMAP_GEM_READ);
+	omap_copy_rows(shadow, pitch, map, pitch, pitch, height);
+	omap_bo_cpu_fini(pOMAP->scanout, OMAP_GEM_READ);
+
+	pOMAP->shadow = shadow;
+	/* the shadow matches the bo, nothing is left to copy */
+	if (pOMAP->shadow_damage)
+		DamageEmpty(pOMAP->shadow_damage);
+	return TRUE;
+}
+
+/* Copy @box of the shadow to the root bo */
+static void
+OMAPShadowCopyBox(ScrnInfoPtr pScrn, uint8_t *map, const BoxRec *box)
+{
+	OMAPPtr pOMAP = OMAPPTR(pScrn);
+	uint32_t pitch = omap_bo_pitch(pOMAP->scanout);
+	int cpp = omap_bo_Bpp(pOMAP->scanout);
+	size_t offset = box->y1 * pitch + box->x1 * cpp;
+
+	omap_copy_rows(map + offset, pitch,
+			(uint8_t *)pOMAP->shadow + offset, pitch,
+			(box->x2 - box->x1) * cpp, box->y2 - box->y1);
+}
+
+/*
+ * Copy what was drawn to the shadow since last time to the root bo.  Anyone
+ * about to read the root bo, rather than the root pixmap, calls this first.
+ */
+void
+OMAPShadowUpdate(ScrnInfoPtr pScrn)
+{
+	OMAPPtr pOMAP = OMAPPTR(pScrn);
+	RegionPtr damage;
+	uint8_t *map;
+	BoxPtr box;
+	int n;
+
+	if (!pOMAP->shadow || !pOMAP->shadow_damage)
+		return;
+
+	map = omap_bo_map(pOMAP->scanout);
+	if (!map)
+		return;
+
+	damage = DamageRegion(pOMAP->shadow_damage);
+	if (!RegionNotEmpty(damage))
+		return;
+
+	omap_bo_cpu_prep(pOMAP->scanout, OMAP_GEM_WRITE);
+	box = RegionRects(damage);
+	for (n = RegionNumRects(damage); n--; box++)
+		OMAPShadowCopyBox(pScrn, map, box);
+	omap_bo_cpu_fini(pOMAP->scanout, OMAP_GEM_WRITE);
+
+	DamageEmpty(pOMAP->shadow_damage);
+}
+
+/*
+ * Track what is drawn to the root from the start, the root window's
+ * background included.  Nothing has been drawn to the shadow yet, so
+ * without damage tracking we can still drop it.
+ */
+static void
+OMAPShadowDamageInit(ScreenPtr pScreen)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	OMAPPtr pOMAP = OMAPPTR(pScrn);
+
+	if (!pOMAP->shadow)
+		return;
+
+	pOMAP->shadow_damage = DamageCreate(NULL, NULL, DamageReportNone,
+			TRUE, pScreen, NULL);
+	if (!pOMAP->shadow_damage) {
+		ERROR_MSG("ShadowFB damage tracking failed, disabling");
+		free(pOMAP->shadow);
+		pOMAP->shadow = NULL;
+		pOMAP->shadow_fb = FALSE;
+		return;
+	}
+	DamageRegister(&pScreen->GetScreenPixmap(pScreen)->drawable,
+			pOMAP->shadow_damage);
+}
+
+static void
+OMAPShadowFini(ScrnInfoPtr pScrn)
+{
+	OMAPPtr pOMAP = OMAPPTR(pScrn);
+
+	if (pOMAP->shadow_damage) {
+		DamageDestroy(pOMAP->shadow_damage);
+		pOMAP->shadow_damage = NULL;
+	}
+	free(pOMAP->shadow);
+	pOMAP->shadow = NULL;
+}
+
+/**
+ * The driver's CreateScreenResources() function, called once the root
+ * pixmap exists.
+ */
+static Bool
+OMAPCreateScreenResources(ScreenPtr pScreen)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	OMAPPtr pOMAP = OMAPPTR(pScrn);
+
+	unwrap(pOMAP, pScreen, CreateScreenResources);
+	if (!(*pScreen->CreateScreenResources)(pScreen))
+		return FALSE;
+
+	OMAPShadowDamageInit(pScreen);
+	return TRUE;
+}
 
 /**
  * The driver's CloseScreen() function.  This is called at the end of each
@@ -785,6 +1048,7 @@ OMAPCloseScreen(CLOSE_SCREEN_ARGS_DECL)
 		OMAPLeaveVT(VT_FUNC_ARGS(0));
 
 	unwrap(pOMAP, pScreen, CloseScreen);
+	unwrap(pOMAP, pScreen, BlockHandler);
 
 	ret = (*pScreen->CloseScreen)(CLOSE_SCREEN_ARGS);
 
@@ -792,7 +1056,13 @@ OMAPCloseScreen(CLOSE_SCREEN_ARGS_DECL)
 		pOMAP->pOMAPEXA->CloseScreen(CLOSE_SCREEN_ARGS);
 
 	OMAPDRI2CloseScreen(pScreen);
+	OMAPPresentCloseScreen(pScreen);
+	OMAPVideoCloseScreen(pScreen);
 
+	omap_thread_pool_del(pOMAP->threads);
+	pOMAP->threads = NULL;
+
+	OMAPShadowFini(pScrn);
 	OMAPUnmapMem(pScrn);
 
 	pScrn->vtSema = FALSE;
@@ -803,6 +1073,34 @@ OMAPCloseScreen(CLOSE_SCREEN_ARGS_DECL)
 }
 
 
+/**
+ * The driver's BlockHandler() function, called before the server sleeps.
+ */
+static void
+OMAPBlockHandler(BLOCKHANDLER_ARGS_DECL)
+{
+	SCREEN_PTR(arg);
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	OMAPPtr pOMAP = OMAPPTR(pScrn);
+
+	swap(pOMAP, pScreen, BlockHandler);
+	(*pScreen->BlockHandler) (BLOCKHANDLER_ARGS);
+	swap(pOMAP, pScreen, BlockHandler);
+
+	OMAPDRI2BlockHandler(pScreen);
+	OMAPShadowUpdate(pScrn);
+	drmmode_copies_update(pScrn);
+	drmmode_dirty_update(pScrn, pTimeout);
+	drmmode_cursor_update(pScrn, pTimeout);
+
+	/* the root has been drawn and is on its way to the crtcs */
+	if (!pOMAP->started) {
+		OMAPStartupPhase(pScrn, "first frame");
+		pOMAP->started = TRUE;
+	}
+}
+
+
 /**
  * The driver's SwitchMode() function.  Initialize the new mode for the
  * Screen.
@@ -855,6 +1153,7 @@ OMAPEnterVT(VT_FUNC_ARGS_DECL)
 		ERROR_MSG("xf86SetDesiredModes() failed!");
 		return FALSE;
 	}
+	OMAPStartupPhase(pScrn, "first modeset done");
 
 	TRACE_EXIT();
 	return TRUE;
@@ -875,6 +1174,9 @@ OMAPLeaveVT(VT_FUNC_ARGS_DECL)
 
 	TRACE_ENTER();
 
+	OMAPDRI2ReleasePlanes(xf86ScrnToScreen(pScrn));
+	OMAPVideoReleasePlanes(xf86ScrnToScreen(pScrn));
+
 	if (geteuid() == 0) {
 		if (drmDropMaster(pOMAP->drmFD)) {
 			WARNING_MSG("drmDropMaster failed: %s", strerror(errno));
@@ -54,6 +54,7 @@
 #include "xf86RandR12.h"
 #include "xf86drm.h"
 #include "dri2.h"
+#include "damage.h"
 
 #include "omap_dumb.h"
 #include "omap_msg.h"
@@ -74,7 +75,6 @@ enum OMAP_CHIPSET {
 #define OMAP_USE_PAGE_FLIP_EVENTS	1
 /*#define OMAP_SUPPORT_GAMMA		1 -- Not supported on exynos*/
 
-#define MAX_SCANOUTS		3
 #define DRI2_ARMSOC_PRIVATE_CRC_DIRTY 1 /* DRI2 private buffer flag */
 
 typedef struct _OMAPScanout
@@ -85,6 +85,9 @@ typedef struct _OMAPScanout
 	int x;
 	int y;
 	Bool valid;
+	/* covers the whole root, each crtc showing its part of it; the bo is
+	 * only allocated once something flips on it */
+	Bool span;
 } OMAPScanout, *OMAPScanoutPtr;
 
 enum OMAPFlipMode
@@ -98,6 +101,19 @@ enum OMAPFlipMode
 	OMAP_FLIP_INVALID = 0,
 	OMAP_FLIP_ENABLED,
 	OMAP_FLIP_DISABLED,
+	/* all crtcs show the span scanout, see OMAPScanout */
+	OMAP_FLIP_SPANNING,
+};
+
+/**
+ * Anything passed as user data to drmModePageFlip() or drmWaitVBlank()
+ * must start with an OMAPDRMEvent, so that the drmmode event handler can
+ * hand the completion back to whoever queued it.
+ */
+typedef struct _OMAPDRMEvent OMAPDRMEvent, *OMAPDRMEventPtr;
+struct _OMAPDRMEvent {
+	void (*handler)(OMAPDRMEventPtr event, unsigned int frame,
+			unsigned int tv_sec, unsigned int tv_usec);
 };
 
 /** The driver's Screen-specific, "private" data structure. */
@@ -120,10 +136,23 @@ typedef struct _OMAPRec
 	/** Scan-out buffer. */
 	enum OMAPFlipMode	flip_mode;
 	struct omap_bo		*scanout;
-	OMAPScanout scanouts[MAX_SCANOUTS];
+	/** Per-crtc scanouts, one per distinct crtc geometry: */
+	OMAPScanoutPtr		scanouts;
+	int					num_scanouts;
 
 	/** Pointer to the options for this screen. */
 	OptionInfoPtr		pOptionInfo;
+	/** Use atomic modesetting if the kernel has it (Option "Atomic"): */
+	Bool				atomic_modeset;
+	/** Scan windows out on overlay planes (Option "OverlayPlanes"): */
+	Bool				overlay_planes;
+	/** Flip copies of the root in blit mode (Option "TearFree"): */
+	Bool				tearfree;
+	/** Render into a cached copy of the root (Option "ShadowFB"), and
+	 * the root damage not yet copied to the root bo, see OMAPShadowUpdate(): */
+	Bool				shadow_fb;
+	void				*shadow;
+	DamagePtr			shadow_damage;
 
 	/** Save (wrap) the original pScreen functions. */
 	CloseScreenProcPtr				SavedCloseScreen;
@@ -133,10 +162,30 @@ typedef struct _OMAPRec
 	/** Pointer to the entity structure for this screen. */
 	EntityInfoPtr		pEntityInfo;
 
-	/** Flips we are waiting for: */
-	int					pending_flips;
+	/** Blit swaps waiting for their vblank event, oldest first: */
+	struct _OMAPDRISwapCmd	*pending_blits;
+	/** DRI2 windows on overlay planes: */
+	struct _OMAPDRI2Plane	*dri2_planes;
+	/** Xv overlay ports: */
+	struct _OMAPVideoPort	*xv_ports;
+	int					num_xv_ports;
+	/** Workers for Xv conversions and rotation, started on first use,
+	 * see OMAPThreadPool(): */
+	struct omap_thread_pool	*threads;
+	/** Present vblank events waiting for the kernel: */
+	struct _OMAPPresentVBlank	*present_vblanks;
 	/* For invalidating backbuffers on Hotplug */
 	Bool			has_resized;
+
+	/** Per-drawable DRI2 swap statistics (Option "SwapStats"): */
+	Bool				swap_stats_enabled;
+	struct _OMAPDRI2Stats	*swap_stats;
+	CARD32				swap_stats_time;
+
+	/** When PreInit started, and whether the first frame was shown, see
+	 * OMAPStartupPhase(): */
+	uint64_t			startup_us;
+	Bool				started;
 } OMAPRec, *OMAPPtr;
 
 /*
@@ -175,6 +224,17 @@ typedef struct _OMAPRec
 #define ALIGN(val, align)	(((val) + (align) - 1) & ~((align) - 1))
 
 
+/**
+ * ShadowFB functions..
+ */
+Bool OMAPShadowAlloc(ScrnInfoPtr pScrn);
+void OMAPShadowUpdate(ScrnInfoPtr pScrn);
+void *OMAPBoCpuMap(ScrnInfoPtr pScrn, struct omap_bo *bo);
+
+struct omap_thread_pool *OMAPThreadPool(ScrnInfoPtr pScrn);
+void OMAPStartupPhase(ScrnInfoPtr pScrn, const char *phase);
+
+
 /**
  * drmmode functions..
  */
@@ -182,27 +242,65 @@ Bool drmmode_pre_init(ScrnInfoPtr pScrn, int fd);
 Bool drmmode_screen_init(ScrnInfoPtr pScrn);
 void drmmode_close_screen(ScrnInfoPtr pScrn);
 void drmmode_adjust_frame(ScrnInfoPtr pScrn, int x, int y);
-int drmmode_page_flip(DrawablePtr draw, uint32_t fb_id, void *priv,
-		int* num_flipped);
+int drmmode_page_flip(DrawablePtr draw, struct omap_bo *bo, void *priv,
+		Bool async, int* num_flipped);
 void drmmode_wait_for_event(ScrnInfoPtr pScrn);
 void drmmode_copy_fb(ScrnInfoPtr pScrn);
-OMAPScanoutPtr drmmode_scanout_from_drawable(OMAPScanoutPtr scanouts,
+OMAPScanoutPtr drmmode_scanout_from_drawable(ScrnInfoPtr pScrn,
 		DrawablePtr pDraw);
-void drmmode_scanout_set(OMAPScanoutPtr scanouts, int x, int y,
+void drmmode_scanout_set(ScrnInfoPtr pScrn, int x, int y,
 		struct omap_bo *bo);
+Bool drmmode_blit_mode_can_flip(ScrnInfoPtr pScrn, DrawablePtr pDraw,
+		Bool async);
 int drmmode_crtc_id_from_drawable(ScrnInfoPtr pScrn, DrawablePtr pDraw);
 int drmmode_crtc_index_from_drawable(ScrnInfoPtr pScrn, DrawablePtr pDraw);
+int drmmode_crtc_index_covering_drawable(ScrnInfoPtr pScrn, DrawablePtr pDraw);
+uint32_t drmmode_crtcs_showing(ScrnInfoPtr pScrn, DrawablePtr pDraw);
+uint64_t drmmode_crtc_msc(xf86CrtcPtr crtc, uint32_t sequence);
+void drmmode_swap_queued(ScrnInfoPtr pScrn, uint32_t crtc_mask);
+void drmmode_swap_done(ScrnInfoPtr pScrn, uint32_t crtc_mask);
+void drmmode_wait_for_swaps(ScrnInfoPtr pScrn, uint32_t crtc_mask);
 Bool drmmode_set_blit_mode(ScrnInfoPtr pScrn);
-Bool drmmode_set_flip_mode(ScrnInfoPtr pScrn);
+Bool drmmode_set_flip_mode(ScrnInfoPtr pScrn, enum OMAPFlipMode mode);
 Bool drmmode_update_scanout_from_crtcs(ScrnInfoPtr pScrn);
+int drmmode_plane_count(ScrnInfoPtr pScrn, uint32_t format);
+int drmmode_plane_set(xf86CrtcPtr crtc, void *owner, uint32_t format,
+		uint32_t fb_id, uint32_t src_x, uint32_t src_y, uint32_t src_w,
+		uint32_t src_h, BoxPtr dst, void *priv, int *num_flipped);
+int drmmode_plane_show(DrawablePtr draw, void *owner, uint32_t fb_id,
+		void *priv, int *num_flipped);
+void drmmode_plane_hide(ScrnInfoPtr pScrn, void *owner);
+void drmmode_copies_update(ScrnInfoPtr pScrn);
+void drmmode_dirty_update(ScrnInfoPtr pScrn, void *timeout);
+void drmmode_cursor_update(ScrnInfoPtr pScrn, void *timeout);
 
 
 /**
  * DRI2 functions..
  */
-typedef struct _OMAPDRISwapCmd OMAPDRISwapCmd;
 Bool OMAPDRI2ScreenInit(ScreenPtr pScreen);
 void OMAPDRI2CloseScreen(ScreenPtr pScreen);
-void OMAPDRI2SwapComplete(OMAPDRISwapCmd *cmd);
+void OMAPDRI2BlockHandler(ScreenPtr pScreen);
+void OMAPDRI2ReleasePlanes(ScreenPtr pScreen);
+
+
+/**
+ * Present functions..
+ */
+Bool OMAPPresentScreenInit(ScreenPtr pScreen);
+void OMAPPresentCloseScreen(ScreenPtr pScreen);
+
+
+/**
+ * DRI3 functions..
+ */
+Bool OMAPDRI3ScreenInit(ScreenPtr pScreen);
+
+/**
+ * Xv functions..
+ */
+Bool OMAPVideoScreenInit(ScreenPtr pScreen);
+void OMAPVideoCloseScreen(ScreenPtr pScreen);
+void OMAPVideoReleasePlanes(ScreenPtr pScreen);
 
 #endif /* __OMAP_DRV_H__ */
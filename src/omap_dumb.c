@@ -30,11 +30,20 @@
 #include <assert.h>
 #include <errno.h>
 #include <unistd.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#ifdef HAVE_LINUX_DMA_BUF_H
+#include <linux/dma-buf.h>
+#endif
+#ifdef HAVE_LINUX_SYNC_FILE_H
+#include <linux/sync_file.h>
+#endif
 
 #include <xorg-server.h>
 #include <xf86.h>
 #include <xf86drm.h>
 #include <xf86drmMode.h>
+#include <drm_fourcc.h>
 
 #include "omap_dumb.h"
 #include "omap_msg.h"
@@ -81,9 +90,120 @@ void omap_device_del(struct omap_device *dev)
 	free(dev);
 }
 
+int omap_device_has_prime(struct omap_device *dev)
+{
+	return dev->ops->bo_export_fd && dev->ops->bo_import_fd;
+}
+
+/* Whether the SoC backend or the kernel would rather we rendered into a
+ * shadow than into bo mappings */
+int omap_device_prefer_shadow(struct omap_device *dev)
+{
+	uint64_t value;
+
+	if (dev->ops->prefer_shadow)
+		return 1;
+	return !drmGetCap(dev->fd, DRM_CAP_DUMB_PREFER_SHADOW, &value) &&
+			value;
+}
+
 /* buffer-object related functions:
  */
 
+static void omap_bo_hash_add(struct omap_bo *bo)
+{
+	struct omap_bo **bucket;
+
+	bucket = &bo->dev->bo_hash[bo->handle % OMAP_BO_HASH_SIZE];
+	bo->hash_next = *bucket;
+	*bucket = bo;
+}
+
+static void omap_bo_hash_remove(struct omap_bo *bo)
+{
+	struct omap_bo **p;
+
+	p = &bo->dev->bo_hash[bo->handle % OMAP_BO_HASH_SIZE];
+	for (; *p; p = &(*p)->hash_next) {
+		if (*p == bo) {
+			*p = bo->hash_next;
+			break;
+		}
+	}
+}
+
+static struct omap_bo *omap_bo_hash_lookup(struct omap_device *dev,
+		uint32_t handle)
+{
+	struct omap_bo *bo;
+
+	bo = dev->bo_hash[handle % OMAP_BO_HASH_SIZE];
+	for (; bo; bo = bo->hash_next) {
+		if (bo->handle == handle)
+			return bo;
+	}
+	return NULL;
+}
+
+static void omap_gem_close(struct omap_device *dev, uint32_t handle)
+{
+	struct drm_gem_close req = {
+		.handle = handle,
+	};
+
+	drmIoctl(dev->fd, DRM_IOCTL_GEM_CLOSE, &req);
+}
+
+/*
+ * The platforms only allocate 32bpp buffers, so YUV images go in a buffer
+ * big enough to hold all their planes.  The luma plane, or the packed one,
+ * gets the pitch of the buffer, chroma planes follow it.
+ */
+static Bool omap_bo_yuv_size(uint32_t pixel_format, uint32_t width,
+		uint32_t height, uint32_t *bo_width, uint32_t *bo_height)
+{
+	switch (pixel_format) {
+	case DRM_FORMAT_NV12:
+	case DRM_FORMAT_YUV420:
+	case DRM_FORMAT_YVU420:
+		*bo_width = (width + 3) / 4;
+		*bo_height = height + (height + 1) / 2;
+		return TRUE;
+	case DRM_FORMAT_YUYV:
+		*bo_width = (width + 1) / 2;
+		*bo_height = height;
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+/* Fill in where the planes of a @height high image in @pixel_format are */
+static int omap_bo_layout(uint32_t pixel_format, uint32_t pitch,
+		uint32_t height, uint32_t pitches[4], uint32_t offsets[4])
+{
+	uint32_t chroma_height = (height + 1) / 2;
+
+	memset(pitches, 0, 4 * sizeof(*pitches));
+	memset(offsets, 0, 4 * sizeof(*offsets));
+	pitches[0] = pitch;
+
+	switch (pixel_format) {
+	case DRM_FORMAT_NV12:
+		pitches[1] = pitch;
+		offsets[1] = pitch * height;
+		return 2;
+	case DRM_FORMAT_YUV420:
+	case DRM_FORMAT_YVU420:
+		pitches[1] = pitches[2] = pitch / 2;
+		offsets[1] = pitch * height;
+		offsets[2] = offsets[1] + pitches[1] * chroma_height;
+		return 3;
+	default:
+		return 1;
+	}
+}
+
 static struct omap_bo *omap_bo_new(struct omap_device *dev, uint32_t width,
 		uint32_t height, uint8_t depth, uint8_t bpp,
 		uint32_t pixel_format)
@@ -91,6 +211,7 @@ static struct omap_bo *omap_bo_new(struct omap_device *dev, uint32_t width,
 	ScrnInfoPtr pScrn = dev->pScrn;
 	const struct bo_ops *bo_ops = dev->ops;
 	struct omap_bo *new_buf;
+	uint32_t bo_width = width, bo_height = height;
 	uint32_t pitch;
 	const uint32_t flags = 0;
 	int ret;
@@ -99,11 +220,15 @@ static struct omap_bo *omap_bo_new(struct omap_device *dev, uint32_t width,
 	if (!new_buf)
 		return NULL;
 
-	new_buf->priv_bo = bo_ops->bo_create(dev, width, height, flags,
+	if (!depth)
+		omap_bo_yuv_size(pixel_format, width, height,
+				&bo_width, &bo_height);
+
+	new_buf->priv_bo = bo_ops->bo_create(dev, bo_width, bo_height, flags,
 					     &new_buf->handle, &pitch);
 	if (!new_buf->priv_bo) {
 		ERROR_MSG("PLATFORM_BO_CREATE(%ux%u flags: 0x%x) failed: %s",
-				width, height, flags, strerror(errno));
+				bo_width, bo_height, flags, strerror(errno));
 		goto free_buf;
 	}
 
@@ -122,10 +247,11 @@ static struct omap_bo *omap_bo_new(struct omap_device *dev, uint32_t width,
 				new_buf->fb_id, width, height, depth, bpp,
 				pitch, new_buf->handle);
 	} else {
-		uint32_t handles[4] = { new_buf->handle };
-		uint32_t pitches[4] = { pitch };
-		uint32_t offsets[4] = { 0 };
+		uint32_t handles[4] = { new_buf->handle, new_buf->handle,
+				new_buf->handle };
+		uint32_t pitches[4], offsets[4];
 
+		omap_bo_layout(pixel_format, pitch, height, pitches, offsets);
 		ret = drmModeAddFB2(dev->fd, width, height,
 				pixel_format, handles, pitches, offsets,
 				&new_buf->fb_id, 0);
@@ -153,6 +279,9 @@ static struct omap_bo *omap_bo_new(struct omap_device *dev, uint32_t width,
 	new_buf->acquired_exclusive = 0;
 	new_buf->acquire_cnt = 0;
 	new_buf->dirty = TRUE;
+	new_buf->dmabuf_fd = -1;
+	new_buf->fence_fd = -1;
+	omap_bo_hash_add(new_buf);
 
 	return new_buf;
 
@@ -175,19 +304,140 @@ struct omap_bo *omap_bo_new_with_format(struct omap_device *dev, uint32_t width,
 	return omap_bo_new(dev, width, height, 0, bpp, pixel_format);
 }
 
+/*
+ * Wrap a dma-buf shared by a client.  Importing a dma-buf we already know
+ * gives back the same GEM handle, whether it was imported before or is one
+ * of our own bos, and the handle isn't refcounted: so hand out another
+ * reference to the existing bo instead of a second one that would close the
+ * handle under the first.
+ */
+struct omap_bo *omap_bo_from_fd(struct omap_device *dev, int fd,
+		uint32_t width, uint32_t height, uint32_t pitch,
+		uint8_t depth, uint8_t bpp)
+{
+	ScrnInfoPtr pScrn = dev->pScrn;
+	struct omap_bo *new_buf;
+	uint32_t handle;
+	off_t size;
+	int ret;
+
+	if (!omap_device_has_prime(dev))
+		return NULL;
+
+	size = lseek(fd, 0, SEEK_END);
+	if (size != (off_t)-1 && size < (off_t)pitch * height) {
+		ERROR_MSG("dma-buf of %lu bytes too small for %ux%u pitch: %u",
+				(unsigned long)size, width, height, pitch);
+		return NULL;
+	}
+
+	if (dev->ops->bo_import_fd(dev, fd, &handle)) {
+		ERROR_MSG("PLATFORM_BO_IMPORT failed: %s", strerror(errno));
+		return NULL;
+	}
+
+	new_buf = omap_bo_hash_lookup(dev, handle);
+	if (new_buf) {
+		if (new_buf->width != width || new_buf->height != height ||
+		    new_buf->pitch != pitch || new_buf->bpp != bpp) {
+			ERROR_MSG("[BO:%u] is %ux%u pitch: %u bpp: %u, not %ux%u pitch: %u bpp: %u",
+					handle, new_buf->width,
+					new_buf->height, new_buf->pitch,
+					new_buf->bpp, width, height, pitch,
+					bpp);
+			return NULL;
+		}
+		omap_bo_reference(new_buf);
+		return new_buf;
+	}
+
+	new_buf = calloc(1, sizeof(*new_buf));
+	if (!new_buf) {
+		omap_gem_close(dev, handle);
+		return NULL;
+	}
+
+	/* Not every dma-buf can be scanned out, which only rules out
+	 * flipping to it.
+	 */
+	ret = drmModeAddFB(dev->fd, width, height, depth, bpp, pitch, handle,
+			&new_buf->fb_id);
+	if (ret < 0) {
+		DEBUG_MSG("[BO:%u] add FB {%ux%u depth: %u bpp: %u pitch: %u} failed: %s",
+				handle, width, height, depth, bpp, pitch,
+				strerror(errno));
+		new_buf->fb_id = 0;
+	}
+
+	new_buf->dev = dev;
+	new_buf->handle = handle;
+	new_buf->width = width;
+	new_buf->height = height;
+	new_buf->pitch = pitch;
+	new_buf->depth = depth;
+	new_buf->bpp = bpp;
+	new_buf->refcnt = 1;
+	new_buf->dirty = TRUE;
+	new_buf->imported = TRUE;
+	new_buf->dmabuf_fd = -1;
+	new_buf->fence_fd = -1;
+	omap_bo_hash_add(new_buf);
+
+	DEBUG_MSG("[BO:%u] [FB:%u] Imported {%ux%u pitch: %u}",
+			handle, new_buf->fb_id, width, height, pitch);
+
+	return new_buf;
+}
+
+/* Returns a new dma-buf fd for the bo, or -1 */
+int omap_bo_to_fd(struct omap_bo *bo)
+{
+	struct omap_device *dev = bo->dev;
+	ScrnInfoPtr pScrn = dev->pScrn;
+	int fd;
+
+	if (!dev->ops->bo_export_fd)
+		return -1;
+
+	if (dev->ops->bo_export_fd(bo, &fd)) {
+		ERROR_MSG("[BO:%u] PLATFORM_BO_EXPORT failed: %s",
+				bo->handle, strerror(errno));
+		return -1;
+	}
+
+	/* others may render to it now, keep a handle to poll their fences */
+	if (bo->dmabuf_fd < 0)
+		bo->dmabuf_fd = dup(fd);
+
+	return fd;
+}
+
 static void omap_bo_del(struct omap_bo *bo)
 {
 	struct omap_device *dev = bo->dev;
 	ScrnInfoPtr pScrn = dev->pScrn;
 	int res;
 
-	res = drmModeRmFB(dev->fd, bo->fb_id);
-	if (res)
-		ERROR_MSG("[BO:%u] Remove [FB:%u] failed: %s",
-				bo->handle, bo->fb_id,
-				strerror(errno));
-	assert(res == 0);
-	dev->ops->bo_destroy(bo);
+	if (bo->fb_id) {
+		res = drmModeRmFB(dev->fd, bo->fb_id);
+		if (res)
+			ERROR_MSG("[BO:%u] Remove [FB:%u] failed: %s",
+					bo->handle, bo->fb_id,
+					strerror(errno));
+		assert(res == 0);
+	}
+	omap_bo_hash_remove(bo);
+	if (bo->fence_fd >= 0)
+		close(bo->fence_fd);
+	if (bo->dmabuf_fd >= 0)
+		close(bo->dmabuf_fd);
+	if (bo->imported) {
+		if (bo->import_map)
+			munmap(bo->import_map, bo->pitch * bo->height);
+		omap_gem_close(dev, bo->handle);
+	} else {
+		dev->ops->bo_destroy(bo);
+	}
 	free(bo);
 }
 
@@ -214,7 +464,16 @@ uint32_t omap_bo_get_name(struct omap_bo *bo)
 	uint32_t name;
 	int ret;
 
-	ret = dev->ops->bo_get_name(bo, &name);
+	if (bo->imported) {
+		struct drm_gem_flink req = {
+			.handle = bo->handle,
+		};
+
+		ret = drmIoctl(dev->fd, DRM_IOCTL_GEM_FLINK, &req);
+		name = req.name;
+	} else {
+		ret = dev->ops->bo_get_name(bo, &name);
+	}
 	if (ret) {
 		ERROR_MSG("[BO:%u] BO_GET_NAME failed: %s",
 				bo->handle, strerror(errno));
@@ -268,13 +527,60 @@ uint32_t omap_bo_fb(struct omap_bo *bo)
 	return bo->fb_id;
 }
 
+/* Returns how many planes the image in the bo has, and where they are */
+int omap_bo_get_planes(struct omap_bo *bo, uint32_t pitches[4],
+		uint32_t offsets[4])
+{
+	return omap_bo_layout(bo->pixel_format, bo->pitch, bo->height,
+			pitches, offsets);
+}
+
+/* The bo's own dma-buf, exported once and kept until the bo goes away */
+static int omap_bo_dmabuf(struct omap_bo *bo)
+{
+	int fd;
+
+	if (bo->dmabuf_fd >= 0)
+		return bo->dmabuf_fd;
+
+	if (!bo->dev->ops->bo_export_fd || bo->dev->ops->bo_export_fd(bo, &fd))
+		return -1;
+
+	bo->dmabuf_fd = fd;
+	return fd;
+}
+
+/* imported bos are mapped through a dma-buf of their own */
+static void *omap_bo_map_imported(struct omap_bo *bo)
+{
+	void *map_addr;
+	int fd;
+
+	if (bo->import_map)
+		return bo->import_map;
+
+	fd = omap_bo_dmabuf(bo);
+	if (fd < 0)
+		return NULL;
+	map_addr = mmap(NULL, bo->pitch * bo->height, PROT_READ | PROT_WRITE,
+			MAP_SHARED, fd, 0);
+	if (map_addr == MAP_FAILED)
+		return NULL;
+
+	bo->import_map = map_addr;
+	return map_addr;
+}
+
 void *omap_bo_map(struct omap_bo *bo)
 {
 	struct omap_device *dev = bo->dev;
 	ScrnInfoPtr pScrn = dev->pScrn;
 	void *map_addr;
 
-	map_addr = dev->ops->bo_map(bo);
+	if (bo->imported)
+		map_addr = omap_bo_map_imported(bo);
+	else
+		map_addr = dev->ops->bo_map(bo);
 	if (!map_addr) {
 		ERROR_MSG("[BO:%u] bo_MAP failed: %s",
 				bo->handle, strerror(errno));
@@ -284,6 +590,113 @@ void *omap_bo_map(struct omap_bo *bo)
 	return map_addr;
 }
 
+/* Give up on a fence after this long rather than hang the server */
+#define OMAP_FENCE_TIMEOUT_MS	1000
+
+static int omap_fence_wait(int fd, short events)
+{
+	struct pollfd pfd = { .fd = fd, .events = events };
+	int ret;
+
+	do {
+		ret = poll(&pfd, 1, OMAP_FENCE_TIMEOUT_MS);
+	} while (ret < 0 && (errno == EINTR || errno == EAGAIN));
+
+	if (ret == 0)
+		errno = ETIME;
+	return ret > 0 ? 0 : -1;
+}
+
+/* Returns a sync_file signalled with both @a and @b, consuming them */
+static int omap_fence_merge(int a, int b)
+{
+#ifdef SYNC_IOC_MERGE
+	struct sync_merge_data merge = { .name = "armsoc", .fd2 = b };
+#endif
+
+	if (a < 0)
+		return b;
+	if (b < 0)
+		return a;
+
+#ifdef SYNC_IOC_MERGE
+	if (ioctl(a, SYNC_IOC_MERGE, &merge) < 0) {
+		/* keep one of them rather than none */
+		close(b);
+		return a;
+	}
+	close(a);
+	close(b);
+	return merge.fence;
+#else
+	/* scanout lets go of a bo after the flips before, keep the last */
+	close(a);
+	return b;
+#endif
+}
+
+/* Returns a sync_file for pending writes to the bo, e.g. client rendering
+ * to a DRI3 or DRI2 buffer, or -1 if there is nothing to wait for.
+ */
+int omap_bo_get_fence(struct omap_bo *bo)
+{
+	struct omap_device *dev = bo->dev;
+#ifdef DMA_BUF_IOCTL_EXPORT_SYNC_FILE
+	struct dma_buf_export_sync_file req = { .flags = DMA_BUF_SYNC_READ };
+	int fd;
+
+	if (dev->no_sync_file_export)
+		return -1;
+
+	fd = omap_bo_dmabuf(bo);
+	if (fd < 0)
+		return -1;
+
+	if (drmIoctl(fd, DMA_BUF_IOCTL_EXPORT_SYNC_FILE, &req)) {
+		if (errno == ENOTTY || errno == EINVAL)
+			dev->no_sync_file_export = TRUE;
+		return -1;
+	}
+	return req.fd;
+#else
+	(void)dev;
+	return -1;
+#endif
+}
+
+/* Hand @fence_fd, signalled once scanout is done reading the bo, over
+ * to the bo. CPU writes wait for it in omap_bo_cpu_prep().
+ */
+void omap_bo_set_fence(struct omap_bo *bo, int fence_fd)
+{
+	bo->fence_fd = omap_fence_merge(bo->fence_fd, fence_fd);
+}
+
+/* Wait for the fences on the bo that CPU access with @op must not race:
+ * scanout reading it and, through the dma-buf, GPU or client access.
+ */
+static void omap_bo_wait(struct omap_bo *bo, enum omap_gem_op op)
+{
+	ScrnInfoPtr pScrn = bo->dev->pScrn;
+	int fd;
+
+	if ((op & OMAP_GEM_WRITE) && bo->fence_fd >= 0) {
+		if (omap_fence_wait(bo->fence_fd, POLLIN))
+			WARNING_MSG("[BO:%u] scanout fence: %s",
+					bo->handle, strerror(errno));
+		close(bo->fence_fd);
+		bo->fence_fd = -1;
+	}
+
+	/* only shared bos carry fences of others */
+	fd = bo->imported ? omap_bo_dmabuf(bo) : bo->dmabuf_fd;
+	if (fd < 0)
+		return;
+	if (omap_fence_wait(fd, (op & OMAP_GEM_WRITE) ? POLLOUT : POLLIN))
+		WARNING_MSG("[BO:%u] dma-buf fence: %s",
+				bo->handle, strerror(errno));
+}
+
 int omap_bo_cpu_prep(struct omap_bo *bo, enum omap_gem_op op)
 {
 	struct omap_device *dev = bo->dev;
@@ -299,6 +712,7 @@ int omap_bo_cpu_prep(struct omap_bo *bo, enum omap_gem_op op)
 		return 0;
 	}
 
+	omap_bo_wait(bo, op);
 	ret = dev->ops->bo_cpu_prep(bo, op);
 	if (!ret) {
 		bo->acquired_exclusive = op & OMAP_GEM_WRITE;
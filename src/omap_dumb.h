@@ -35,11 +35,17 @@ enum omap_gem_op {
 	OMAP_GEM_WRITE = 0x02,
 };
 
+#define OMAP_BO_HASH_SIZE	64
+
 struct omap_device {
 	int fd;
 	void *bo_dev;
 	const struct bo_ops *ops;
 	ScrnInfoPtr pScrn;
+	/* every live bo, by GEM handle, see omap_bo_from_fd() */
+	struct omap_bo *bo_hash[OMAP_BO_HASH_SIZE];
+	/* kernel lacks DMA_BUF_IOCTL_EXPORT_SYNC_FILE */
+	int no_sync_file_export;
 };
 
 struct omap_bo {
@@ -57,6 +63,14 @@ struct omap_bo {
 	int acquired_exclusive;
 	int acquire_cnt;
 	int dirty;
+	/* wraps a dma-buf from omap_bo_from_fd(), priv_bo is NULL */
+	int imported;
+	void *import_map;
+	struct omap_bo *hash_next;
+	/* cached dma-buf of the bo for fence polling, or -1 */
+	int dmabuf_fd;
+	/* sync_file signalled once scanout no longer reads the bo, or -1 */
+	int fence_fd;
 };
 
 struct omap_device *omap_device_new(int fd, ScrnInfoPtr pScrn);
@@ -70,12 +84,19 @@ void *omap_bo_map(struct omap_bo *bo);
 int omap_bo_cpu_prep(struct omap_bo *bo, enum omap_gem_op op);
 int omap_bo_cpu_fini(struct omap_bo *bo, enum omap_gem_op op);
 int omap_bo_get_dirty(struct omap_bo *bo);
+int omap_bo_get_fence(struct omap_bo *bo);
+void omap_bo_set_fence(struct omap_bo *bo, int fence_fd);
 void omap_bo_clear_dirty(struct omap_bo *bo);
 
 struct omap_bo *omap_bo_new_with_depth(struct omap_device *dev, uint32_t width,
 		uint32_t height, uint8_t depth, uint8_t bpp);
 struct omap_bo *omap_bo_new_with_format(struct omap_device *dev, uint32_t width,
 		uint32_t height, uint32_t pixel_format, uint8_t bpp);
+struct omap_bo *omap_bo_from_fd(struct omap_device *dev, int fd, uint32_t width,
+		uint32_t height, uint32_t pitch, uint8_t depth, uint8_t bpp);
+int omap_bo_to_fd(struct omap_bo *bo);
+int omap_device_has_prime(struct omap_device *dev);
+int omap_device_prefer_shadow(struct omap_device *dev);
 
 /* Getters without side-effects */
 uint32_t omap_bo_width(struct omap_bo *bo);
@@ -85,6 +106,8 @@ uint32_t omap_bo_Bpp(struct omap_bo *bo);
 uint32_t omap_bo_pitch(struct omap_bo *bo);
 uint32_t omap_bo_depth(struct omap_bo *bo);
 uint32_t omap_bo_fb(struct omap_bo *bo);
+int omap_bo_get_planes(struct omap_bo *bo, uint32_t pitches[4],
+		uint32_t offsets[4]);
 
 void omap_bo_reference(struct omap_bo *bo);
 void omap_bo_unreference(struct omap_bo *bo);
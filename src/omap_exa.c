@@ -317,9 +317,9 @@ OMAPPrepareAccess(PixmapPtr pPixmap, int index)
 	if (pPixmap != rootPixmap || priv->bo == pOMAP->scanout) {
 		/* If not the root pixmap, or if the root pixmap is already
 		 * backed by the root bo, just give access to the pixmap's
-		 * current bo.
+		 * current bo (or the shadow of the root bo, with ShadowFB).
 		 */
-		pPixmap->devPrivate.ptr = omap_bo_map(priv->bo);
+		pPixmap->devPrivate.ptr = OMAPBoCpuMap(pScrn, priv->bo);
 	} else if (op & OMAP_GEM_WRITE) {
 		/* For root pixmap write access:
 		 * First, switch to blit mode, which copies all valid per-crtc
@@ -332,7 +332,7 @@ OMAPPrepareAccess(PixmapPtr pPixmap, int index)
 		omap_bo_reference(pOMAP->scanout);
 		omap_bo_unreference(priv->bo);
 		priv->bo = pOMAP->scanout;
-		pPixmap->devPrivate.ptr = omap_bo_map(pOMAP->scanout);
+		pPixmap->devPrivate.ptr = OMAPBoCpuMap(pScrn, pOMAP->scanout);
 	} else if (has_fullsize_bo(pPixmap, priv->bo)) {
 		/* For root pixmap read access:
 		 * If current per-crtc bo has the same dimensions as the root
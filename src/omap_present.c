@@ -0,0 +1,399 @@
+/* -*- mode: C; c-file-style: "k&r"; tab-width 4; indent-tabs-mode: t; -*- */
+
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <strings.h>
+
+#include "omap_driver.h"
+#include "omap_exa.h"
+
+#ifdef HAVE_PRESENT_H
+
+#include "present.h"
+
+/*
+ * Present backend.
+ *
+ * A window flips if the scanout table (pOMAP->scanouts) has an entry for
+ * it, see drmmode_scanout_from_drawable(): a window exactly covering a crtc
+ * flips that crtc to the client's pixmap, and one covering the whole root
+ * of a multi-crtc layout, the span entry DRI2 flips in OMAP_FLIP_SPANNING
+ * mode, flips every crtc, each to its part of the pixmap.  Present does
+ * not use the flip modes though.  Before the first flip the crtcs are put
+ * in blit mode, where each scans out from its place in the root, so that
+ * unflipping is just a flip back to the root scanout (pOMAP->scanout),
+ * whose contents the Present core has restored by then.  Legacy flips
+ * keep those offsets, so a crtc-sized window on a crtc not at (0, 0) only
+ * flips with an atomic commit, see drmmode_blit_mode_can_flip().
+ */
+
+struct _OMAPPresentVBlank {
+	OMAPDRMEvent event;		/* must be first */
+	ScrnInfoPtr pScrn;
+	xf86CrtcPtr crtc;
+	uint64_t event_id;
+	Bool aborted;
+	struct _OMAPPresentVBlank *next;
+};
+
+typedef struct {
+	OMAPDRMEvent event;		/* must be first */
+	ScrnInfoPtr pScrn;
+	/* the crtc whose frame counter Present is told */
+	xf86CrtcPtr crtc;
+	uint64_t event_id;
+	/* crtcs flipped, see drmmode_swap_queued() */
+	uint32_t crtc_mask;
+	/* crtcs still to report completion */
+	int count;
+	/* the flip failed on some crtc, don't tell Present about it */
+	Bool failed;
+} OMAPPresentFlipRec, *OMAPPresentFlipPtr;
+
+static int
+present_crtc_pipe(RRCrtcPtr crtc)
+{
+	xf86CrtcPtr xf86_crtc = crtc->devPrivate;
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(xf86_crtc->scrn);
+	int i;
+
+	for (i = 0; i < xf86_config->num_crtc; i++) {
+		if (xf86_config->crtc[i] == xf86_crtc)
+			return i;
+	}
+	return 0;
+}
+
+static RRCrtcPtr
+OMAPPresentGetCrtc(WindowPtr pWindow)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pWindow->drawable.pScreen);
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+	int index;
+
+	index = drmmode_crtc_index_covering_drawable(pScrn, &pWindow->drawable);
+	if (index == -1)
+		return NULL;
+	return xf86_config->crtc[index]->randr_crtc;
+}
+
+static int
+OMAPPresentGetUstMsc(RRCrtcPtr crtc, CARD64 *ust, CARD64 *msc)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(crtc->pScreen);
+	OMAPPtr pOMAP = OMAPPTR(pScrn);
+	drmVBlank vbl = { .request = {
+		.type = DRM_VBLANK_RELATIVE |
+			(present_crtc_pipe(crtc) << DRM_VBLANK_HIGH_CRTC_SHIFT),
+		.sequence = 0,
+	} };
+
+	if (drmWaitVBlank(pOMAP->drmFD, &vbl)) {
+		ERROR_MSG("get vblank counter failed: %s", strerror(errno));
+		return BadMatch;
+	}
+
+	*ust = ((CARD64)vbl.reply.tval_sec * 1000000) + vbl.reply.tval_usec;
+	*msc = drmmode_crtc_msc(crtc->devPrivate, vbl.reply.sequence);
+	return Success;
+}
+
+static void
+OMAPPresentVBlankEvent(OMAPDRMEventPtr event, unsigned int frame,
+		unsigned int tv_sec, unsigned int tv_usec)
+{
+	struct _OMAPPresentVBlank *vblank = (struct _OMAPPresentVBlank *)event;
+	OMAPPtr pOMAP = OMAPPTR(vblank->pScrn);
+	struct _OMAPPresentVBlank **p;
+
+	for (p = &pOMAP->present_vblanks; *p; p = &(*p)->next) {
+		if (*p == vblank) {
+			*p = vblank->next;
+			break;
+		}
+	}
+
+	if (!vblank->aborted)
+		present_event_notify(vblank->event_id,
+				((uint64_t)tv_sec * 1000000) + tv_usec,
+				drmmode_crtc_msc(vblank->crtc, frame));
+	free(vblank);
+}
+
+static int
+OMAPPresentQueueVBlank(RRCrtcPtr crtc, uint64_t event_id, uint64_t msc)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(crtc->pScreen);
+	OMAPPtr pOMAP = OMAPPTR(pScrn);
+	struct _OMAPPresentVBlank *vblank;
+	drmVBlank vbl;
+
+	vblank = calloc(1, sizeof *vblank);
+	if (!vblank)
+		return BadAlloc;
+
+	vblank->event.handler = OMAPPresentVBlankEvent;
+	vblank->pScrn = pScrn;
+	vblank->crtc = crtc->devPrivate;
+	vblank->event_id = event_id;
+
+	vbl.request.type = DRM_VBLANK_ABSOLUTE | DRM_VBLANK_EVENT |
+			(present_crtc_pipe(crtc) << DRM_VBLANK_HIGH_CRTC_SHIFT);
+	/* the kernel only has the low 32 bits */
+	vbl.request.sequence = (uint32_t)msc;
+	vbl.request.signal = (unsigned long)vblank;
+	if (drmWaitVBlank(pOMAP->drmFD, &vbl)) {
+		ERROR_MSG("queue vblank failed: %s", strerror(errno));
+		free(vblank);
+		return BadAlloc;
+	}
+
+	vblank->next = pOMAP->present_vblanks;
+	pOMAP->present_vblanks = vblank;
+	return Success;
+}
+
+/* The kernel can't take back a vblank event, just forget about it. */
+static void
+OMAPPresentAbortVBlank(RRCrtcPtr crtc, uint64_t event_id, uint64_t msc)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(crtc->pScreen);
+	OMAPPtr pOMAP = OMAPPTR(pScrn);
+	struct _OMAPPresentVBlank *vblank;
+
+	for (vblank = pOMAP->present_vblanks; vblank; vblank = vblank->next) {
+		if (vblank->event_id == event_id) {
+			vblank->aborted = TRUE;
+			break;
+		}
+	}
+}
+
+static void
+OMAPPresentFlush(WindowPtr pWindow)
+{
+	/* nothing is batched up, rendering is done by the time we get here */
+}
+
+static Bool
+OMAPPresentCheckFlip(RRCrtcPtr crtc, WindowPtr pWindow, PixmapPtr pPixmap,
+		Bool sync_flip)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pWindow->drawable.pScreen);
+	OMAPPtr pOMAP = OMAPPTR(pScrn);
+	struct omap_bo *bo = OMAPPixmapBo(pPixmap);
+	Bool ret;
+
+	/* the crtc and fb sizes are stale until the hotplug is handled, and
+	 * with TearFree the crtcs show their own copies of the root */
+	if (pOMAP->has_resized || pOMAP->tearfree) {
+		ret = FALSE;
+		goto out;
+	}
+
+	if (!bo || !omap_bo_fb(bo) ||
+	    omap_bo_width(bo) != pPixmap->drawable.width ||
+	    omap_bo_height(bo) != pPixmap->drawable.height ||
+	    omap_bo_bpp(bo) != pScrn->bitsPerPixel) {
+		ret = FALSE;
+		goto out;
+	}
+
+	/* a crtc must be showing exactly this window, or it covers them all,
+	 * and the flip has to fit the crtcs in blit mode, see OMAPPresentFlip()
+	 */
+	ret = drmmode_blit_mode_can_flip(pScrn, &pWindow->drawable,
+			!sync_flip);
+
+out:
+	DEBUG_MSG("pWindow %ux%u+%d+%d, bo %ux%u check_flip: %d",
+			pWindow->drawable.width, pWindow->drawable.height,
+			pWindow->drawable.x, pWindow->drawable.y,
+			bo ? omap_bo_width(bo) : 0, bo ? omap_bo_height(bo) : 0,
+			ret);
+	return ret;
+}
+
+static void
+OMAPPresentFlipEvent(OMAPDRMEventPtr event, unsigned int frame,
+		unsigned int tv_sec, unsigned int tv_usec)
+{
+	OMAPPresentFlipPtr flip = (OMAPPresentFlipPtr)event;
+
+	if (--flip->count > 0)
+		return;
+
+	if (!flip->failed)
+		present_event_notify(flip->event_id,
+				((uint64_t)tv_sec * 1000000) + tv_usec,
+				drmmode_crtc_msc(flip->crtc, frame));
+	drmmode_swap_done(flip->pScrn, flip->crtc_mask);
+	free(flip);
+}
+
+/*
+ * Page flip every crtc showing @pDraw to @bo.  Returns FALSE if the flip
+ * failed, in which case Present will not hear about @event_id from us.
+ */
+static Bool
+present_page_flip(ScrnInfoPtr pScrn, DrawablePtr pDraw, struct omap_bo *bo,
+		uint64_t event_id, Bool async)
+{
+	xf86CrtcConfigPtr xf86_config = XF86_CRTC_CONFIG_PTR(pScrn);
+	OMAPPresentFlipPtr flip;
+	int ret, num_flipped;
+
+	flip = calloc(1, sizeof *flip);
+	if (!flip)
+		return FALSE;
+
+	flip->event.handler = OMAPPresentFlipEvent;
+	flip->pScrn = pScrn;
+	flip->event_id = event_id;
+
+	flip->crtc_mask = drmmode_crtcs_showing(pScrn, pDraw);
+	if (!flip->crtc_mask) {
+		free(flip);
+		return FALSE;
+	}
+	flip->crtc = xf86_config->crtc[ffs(flip->crtc_mask) - 1];
+	drmmode_swap_queued(pScrn, flip->crtc_mask);
+	ret = drmmode_page_flip(pDraw, bo, flip, async,
+			&num_flipped);
+	if (num_flipped == 0) {
+		drmmode_swap_done(pScrn, flip->crtc_mask);
+		free(flip);
+		return FALSE;
+	}
+
+	/* crtcs that did flip still report back, but only to clean up */
+	flip->count = num_flipped;
+	flip->failed = (ret != 0);
+	return !flip->failed;
+}
+
+static Bool
+OMAPPresentFlip(RRCrtcPtr crtc, uint64_t event_id, uint64_t target_msc,
+		PixmapPtr pPixmap, Bool sync_flip)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(crtc->pScreen);
+
+	/* Leave the per-crtc scanouts alone, unflipping then only has to
+	 * go back to the root scanout.
+	 */
+	if (!drmmode_set_blit_mode(pScrn)) {
+		ERROR_MSG("Could not set blit mode");
+		return FALSE;
+	}
+
+	return present_page_flip(pScrn, &pPixmap->drawable,
+			OMAPPixmapBo(pPixmap), event_id, !sync_flip);
+}
+
+static void
+OMAPPresentUnflip(ScreenPtr pScreen, uint64_t event_id)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	OMAPPtr pOMAP = OMAPPTR(pScrn);
+	PixmapPtr pRootPixmap = pScreen->GetScreenPixmap(pScreen);
+
+	/* the root bo has to catch up with what was restored in the shadow */
+	OMAPShadowUpdate(pScrn);
+	if (present_page_flip(pScrn, &pRootPixmap->drawable, pOMAP->scanout,
+			event_id, FALSE))
+		return;
+
+	/* could not flip back, set the root scanout on every crtc instead */
+	pOMAP->flip_mode = OMAP_FLIP_INVALID;
+	if (!drmmode_set_blit_mode(pScrn))
+		ERROR_MSG("Could not restore root scanout");
+	present_event_notify(event_id, 0, 0);
+}
+
+static present_screen_info_rec omap_present_screen_info = {
+	.version = PRESENT_SCREEN_INFO_VERSION,
+
+	.get_crtc = OMAPPresentGetCrtc,
+	.get_ust_msc = OMAPPresentGetUstMsc,
+	.queue_vblank = OMAPPresentQueueVBlank,
+	.abort_vblank = OMAPPresentAbortVBlank,
+	.flush = OMAPPresentFlush,
+
+	/* async flips fall back to mailbox ones, see drmmode_page_flip() */
+	.capabilities = PresentCapabilityAsync,
+#if OMAP_USE_PAGE_FLIP_EVENTS
+	/* flips have to report back to Present */
+	.check_flip = OMAPPresentCheckFlip,
+	.flip = OMAPPresentFlip,
+	.unflip = OMAPPresentUnflip,
+#endif
+};
+
+Bool
+OMAPPresentScreenInit(ScreenPtr pScreen)
+{
+	return present_screen_init(pScreen, &omap_present_screen_info);
+}
+
+void
+OMAPPresentCloseScreen(ScreenPtr pScreen)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	OMAPPtr pOMAP = OMAPPTR(pScrn);
+	struct _OMAPPresentVBlank *vblank;
+
+	/*
+	 * The server is going away with the DRM fd, and the events with it.
+	 * Otherwise they still come in after the server regenerates, and
+	 * free their records then.
+	 */
+	if (dispatchException & DE_TERMINATE) {
+		while ((vblank = pOMAP->present_vblanks)) {
+			pOMAP->present_vblanks = vblank->next;
+			free(vblank);
+		}
+		return;
+	}
+
+	/* nobody wants the events any more */
+	for (vblank = pOMAP->present_vblanks; vblank; vblank = vblank->next)
+		vblank->aborted = TRUE;
+}
+
+#else /* HAVE_PRESENT_H */
+
+Bool
+OMAPPresentScreenInit(ScreenPtr pScreen)
+{
+	return FALSE;
+}
+
+void
+OMAPPresentCloseScreen(ScreenPtr pScreen)
+{
+}
+
+#endif /* HAVE_PRESENT_H */
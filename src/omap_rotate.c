@@ -0,0 +1,189 @@
+/* -*- mode: C; c-file-style: "k&r"; tab-width 4; indent-tabs-mode: t; -*- */
+
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define OMAP_ROTATE_NEON 1
+#endif
+
+#include "omap_copy.h"
+#include "omap_rotate.h"
+
+/*
+ * Rotating by 90 degrees reads the source along rows and writes the
+ * destination down columns, so one of the two misses the cache on every
+ * pixel.  Working in square tiles keeps both sides of a tile in the cache:
+ * 32 x 32 pixels of 32bpp are 4KiB each.
+ */
+#define OMAP_ROTATE_TILE	32
+
+static inline void
+rotate_pixel(uint8_t *dst, const uint8_t *src, int cpp)
+{
+	switch (cpp) {
+	case 4:
+		memcpy(dst, src, 4);
+		break;
+	case 2:
+		memcpy(dst, src, 2);
+		break;
+	default:
+		memcpy(dst, src, cpp);
+		break;
+	}
+}
+
+static void
+rotate_pixels(uint8_t *dst, int dst_xstep, int dst_ystep,
+		const uint8_t *src, int src_pitch, int width, int height,
+		int cpp)
+{
+	int x, y;
+
+	for (y = 0; y < height; y++) {
+		const uint8_t *s = src + y * src_pitch;
+		uint8_t *d = dst + y * dst_ystep;
+
+		for (x = 0; x < width; x++, s += cpp, d += dst_xstep)
+			rotate_pixel(d, s, cpp);
+	}
+}
+
+#ifdef OMAP_ROTATE_NEON
+/*
+ * Transpose a 4 x 4 block of 32bpp pixels in registers: each source row
+ * becomes a destination column, stored as one 16 byte write.  A negative
+ * @dst_ystep means the columns run backwards.
+ */
+static inline void
+rotate_block_neon(uint8_t *dst, int dst_xstep, int dst_ystep,
+		const uint8_t *src, int src_pitch)
+{
+	uint32x4_t r0, r1, r2, r3, c[4];
+	uint32x4x2_t t01, t23;
+	int i;
+
+	r0 = vld1q_u32((const uint32_t *)src);
+	r1 = vld1q_u32((const uint32_t *)(src + src_pitch));
+	r2 = vld1q_u32((const uint32_t *)(src + 2 * src_pitch));
+	r3 = vld1q_u32((const uint32_t *)(src + 3 * src_pitch));
+
+	t01 = vtrnq_u32(r0, r1);
+	t23 = vtrnq_u32(r2, r3);
+	c[0] = vcombine_u32(vget_low_u32(t01.val[0]),
+			vget_low_u32(t23.val[0]));
+	c[1] = vcombine_u32(vget_low_u32(t01.val[1]),
+			vget_low_u32(t23.val[1]));
+	c[2] = vcombine_u32(vget_high_u32(t01.val[0]),
+			vget_high_u32(t23.val[0]));
+	c[3] = vcombine_u32(vget_high_u32(t01.val[1]),
+			vget_high_u32(t23.val[1]));
+
+	if (dst_ystep < 0) {
+		dst += 3 * dst_ystep;
+		for (i = 0; i < 4; i++) {
+			c[i] = vrev64q_u32(c[i]);
+			c[i] = vcombine_u32(vget_high_u32(c[i]),
+					vget_low_u32(c[i]));
+		}
+	}
+
+	for (i = 0; i < 4; i++)
+		vst1q_u32((uint32_t *)(dst + i * dst_xstep), c[i]);
+}
+#endif
+
+static void
+rotate_tile(uint8_t *dst, int dst_xstep, int dst_ystep,
+		const uint8_t *src, int src_pitch, int width, int height,
+		int cpp)
+{
+#ifdef OMAP_ROTATE_NEON
+	if (cpp == 4 && abs(dst_ystep) == 4) {
+		int w4 = width & ~3, h4 = height & ~3;
+		int x, y;
+
+		for (y = 0; y < h4; y += 4)
+			for (x = 0; x < w4; x += 4)
+				rotate_block_neon(dst + x * dst_xstep +
+						y * dst_ystep, dst_xstep,
+						dst_ystep, src + y * src_pitch +
+						x * 4, src_pitch);
+
+		/* the ragged right and bottom edges */
+		rotate_pixels(dst + w4 * dst_xstep, dst_xstep, dst_ystep,
+				src + w4 * 4, src_pitch, width - w4, h4, cpp);
+		rotate_pixels(dst + h4 * dst_ystep, dst_xstep, dst_ystep,
+				src + h4 * src_pitch, src_pitch, width,
+				height - h4, cpp);
+		return;
+	}
+#endif
+	rotate_pixels(dst, dst_xstep, dst_ystep, src, src_pitch, width,
+			height, cpp);
+}
+
+void
+omap_rotate_rect(uint8_t *dst, int dst_xstep, int dst_ystep,
+		const uint8_t *src, int src_pitch, int width, int height,
+		int cpp)
+{
+	int x, y, w, h;
+
+	if (width <= 0 || height <= 0)
+		return;
+
+	/* rows stay rows: a plain copy, maybe upside down */
+	if (dst_xstep == cpp) {
+		omap_copy_rows(dst, dst_ystep, src, src_pitch, width * cpp,
+				height);
+		return;
+	}
+
+	/* mirrored rows still read and write memory in order */
+	if (dst_xstep == -cpp) {
+		rotate_pixels(dst, dst_xstep, dst_ystep, src, src_pitch, width,
+				height, cpp);
+		return;
+	}
+
+	for (y = 0; y < height; y += OMAP_ROTATE_TILE) {
+		h = height - y < OMAP_ROTATE_TILE ? height - y :
+				OMAP_ROTATE_TILE;
+		for (x = 0; x < width; x += OMAP_ROTATE_TILE) {
+			w = width - x < OMAP_ROTATE_TILE ? width - x :
+					OMAP_ROTATE_TILE;
+			rotate_tile(dst + x * dst_xstep + y * dst_ystep,
+					dst_xstep, dst_ystep,
+					src + y * src_pitch + x * cpp,
+					src_pitch, w, h, cpp);
+		}
+	}
+}
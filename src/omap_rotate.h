@@ -0,0 +1,41 @@
+/* -*- mode: C; c-file-style: "k&r"; tab-width 4; indent-tabs-mode: t; -*- */
+
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#ifndef OMAP_ROTATE_H_
+#define OMAP_ROTATE_H_
+
+#include <stdint.h>
+
+/*
+ * Copy the @width x @height pixels of @cpp bytes at @src, whose rows are
+ * @src_pitch bytes apart, to @dst, where source pixel (x, y) lands at
+ * @dst + x * @dst_xstep + y * @dst_ystep.  Either step may be negative,
+ * which covers all the rotations and reflections of a rectangle.  The two
+ * areas must not overlap.
+ */
+void omap_rotate_rect(uint8_t *dst, int dst_xstep, int dst_ystep,
+		const uint8_t *src, int src_pitch, int width, int height,
+		int cpp);
+
+#endif /* OMAP_ROTATE_H_ */
@@ -0,0 +1,202 @@
+/* -*- mode: C; c-file-style: "k&r"; tab-width 4; indent-tabs-mode: t; -*- */
+
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+
+#include "omap_thread.h"
+
+/*
+ * The calling thread works on the bands too and returns once all of them
+ * are done, so a pool only ever runs one job.  Workers block every signal:
+ * the server's signal handlers expect to run on the main thread.
+ */
+
+struct omap_thread_pool {
+	pthread_mutex_t lock;
+	/* a new job, or the pool going away */
+	pthread_cond_t wake;
+	/* the last band of a job is done */
+	pthread_cond_t done;
+	pthread_t *threads;
+	int num_threads;
+	int quit;
+
+	/* the current job */
+	omap_thread_func func;
+	void *data;
+	int bands;
+	/* the next band to hand out, and how many are still being worked on */
+	int next;
+	int busy;
+	/* bumped for every job so that workers don't take one twice */
+	unsigned int job;
+};
+
+/* Work on bands of the current job until there are none left */
+static void
+omap_thread_work(struct omap_thread_pool *pool)
+{
+	while (pool->next < pool->bands) {
+		int band = pool->next++;
+
+		pool->busy++;
+		pthread_mutex_unlock(&pool->lock);
+		pool->func(pool->data, band, pool->bands);
+		pthread_mutex_lock(&pool->lock);
+		if (!--pool->busy && pool->next == pool->bands)
+			pthread_cond_signal(&pool->done);
+	}
+}
+
+static void *
+omap_thread_main(void *arg)
+{
+	struct omap_thread_pool *pool = arg;
+	unsigned int job = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	while (!pool->quit) {
+		if (pool->job == job) {
+			pthread_cond_wait(&pool->wake, &pool->lock);
+			continue;
+		}
+		job = pool->job;
+		omap_thread_work(pool);
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+/*
+ * Start @threads workers.  Returns NULL if no thread could be started, the
+ * caller then does all the work itself.
+ */
+struct omap_thread_pool *
+omap_thread_pool_new(int threads)
+{
+	struct omap_thread_pool *pool;
+	sigset_t all, saved;
+	int i;
+
+	if (threads <= 0)
+		return NULL;
+
+	pool = calloc(1, sizeof(*pool));
+	if (!pool)
+		return NULL;
+	pool->threads = calloc(threads, sizeof(*pool->threads));
+	if (!pool->threads) {
+		free(pool);
+		return NULL;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->wake, NULL);
+	pthread_cond_init(&pool->done, NULL);
+
+	/* the workers inherit the signal mask */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &saved);
+	for (i = 0; i < threads; i++) {
+		if (pthread_create(&pool->threads[i], NULL, omap_thread_main,
+				pool))
+			break;
+		pool->num_threads++;
+	}
+	pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+	if (!pool->num_threads) {
+		omap_thread_pool_del(pool);
+		return NULL;
+	}
+
+	return pool;
+}
+
+void
+omap_thread_pool_del(struct omap_thread_pool *pool)
+{
+	int i;
+
+	if (!pool)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = 1;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->num_threads; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->done);
+	pthread_cond_destroy(&pool->wake);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->threads);
+	free(pool);
+}
+
+/* How many threads work on a job, counting the caller */
+int
+omap_thread_pool_size(struct omap_thread_pool *pool)
+{
+	return pool ? pool->num_threads + 1 : 1;
+}
+
+/*
+ * Call @func for each of @bands bands of @data, spread over the pool and the
+ * calling thread, and wait for all of them.  Without a pool, the bands are
+ * done one after the other.
+ */
+void
+omap_thread_run(struct omap_thread_pool *pool, omap_thread_func func,
+		void *data, int bands)
+{
+	int band;
+
+	if (!pool || bands <= 1) {
+		for (band = 0; band < bands; band++)
+			func(data, band, bands);
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->func = func;
+	pool->data = data;
+	pool->bands = bands;
+	pool->next = 0;
+	pool->busy = 0;
+	pool->job++;
+	pthread_cond_broadcast(&pool->wake);
+
+	omap_thread_work(pool);
+	while (pool->busy)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
@@ -0,0 +1,43 @@
+/* -*- mode: C; c-file-style: "k&r"; tab-width 4; indent-tabs-mode: t; -*- */
+
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef OMAP_THREAD_H_
+#define OMAP_THREAD_H_
+
+/*
+ * A few worker threads to split CPU heavy work into bands, for the work the
+ * display hardware can't do for us.
+ */
+
+struct omap_thread_pool;
+
+/* Called for each band, from the workers and the calling thread */
+typedef void (*omap_thread_func)(void *data, int band, int bands);
+
+struct omap_thread_pool *omap_thread_pool_new(int threads);
+void omap_thread_pool_del(struct omap_thread_pool *pool);
+int omap_thread_pool_size(struct omap_thread_pool *pool);
+void omap_thread_run(struct omap_thread_pool *pool, omap_thread_func func,
+		void *data, int bands);
+
+#endif /* OMAP_THREAD_H_ */
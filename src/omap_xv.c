@@ -0,0 +1,860 @@
+/* -*- mode: C; c-file-style: "k&r"; tab-width 4; indent-tabs-mode: t; -*- */
+
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <unistd.h>
+
+#include "omap_driver.h"
+#include "omap_exa.h"
+#include "omap_copy.h"
+#include "omap_thread.h"
+#include "omap_yuv.h"
+
+#include "xf86xv.h"
+#include "fourcc.h"
+#include "drm_fourcc.h"
+
+/*
+ * Xv overlay adaptor.
+ *
+ * Each port shows its video on an overlay plane of its own, which does the
+ * colour conversion and the scaling.  Images are copied as they are into
+ * one of two bos per port, so that the plane can keep scanning out the
+ * previous frame while the next one is written.  The plane is stacked above
+ * the screen and cropped to the visible part of the window.  The colour key
+ * is still painted into the window through the GC, so Damage tells every
+ * screen reader (DRI2 copies, screenshots) where the video is.
+ *
+ * Video no plane can show, because all are taken or the crtc is rotated,
+ * is converted to RGB and scaled by the CPU straight into the window's bo
+ * instead.  The blit adaptor, for clients that want more ports than there
+ * are planes, only ever does that.
+ */
+
+#ifndef FOURCC_NV12
+#define FOURCC_NV12 0x3231564e
+#define XVIMAGE_NV12 \
+	{ \
+		FOURCC_NV12, XvYUV, LSBFirst, \
+		{'N', 'V', '1', '2', 0x00, 0x00, 0x00, 0x10, 0x80, 0x00, 0x00, 0xAA, \
+		 0x00, 0x38, 0x9B, 0x71}, \
+		12, XvPlanar, 2, 0, 0, 0, 0, 8, 8, 8, 1, 2, 2, 1, 2, 2, \
+		{'Y', 'U', 'V', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, \
+		 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0}, \
+		XvTopToBottom \
+	}
+#endif
+
+#define OMAP_XV_MAX_WIDTH	4096
+#define OMAP_XV_MAX_HEIGHT	4096
+
+#define OMAP_XV_BLIT_PORTS	16
+
+/* Frames this big are converted by several threads */
+#define OMAP_XV_THREAD_PIXELS	(1920 * 1080)
+
+/* The Xv images we take, and the fourcc of the bos they go in */
+static XF86ImageRec omap_xv_images[] = {
+	XVIMAGE_NV12,
+	XVIMAGE_YV12,
+	XVIMAGE_I420,
+	XVIMAGE_YUY2,
+};
+
+static const uint32_t omap_xv_drm_formats[] = {
+	DRM_FORMAT_NV12,
+	DRM_FORMAT_YVU420,
+	DRM_FORMAT_YUV420,
+	DRM_FORMAT_YUYV,
+};
+
+static XF86VideoEncodingRec omap_xv_encodings[] = {
+	{ 0, "XV_IMAGE", OMAP_XV_MAX_WIDTH, OMAP_XV_MAX_HEIGHT, { 1, 1 } },
+};
+
+static XF86VideoFormatRec omap_xv_formats[] = {
+	{ 15, TrueColor }, { 16, TrueColor }, { 24, TrueColor },
+};
+
+static XF86AttributeRec omap_xv_attributes[] = {
+	{ XvSettable | XvGettable, 0, 0xffffff, "XV_COLORKEY" },
+	{ XvSettable | XvGettable, 0, 1, "XV_AUTOPAINT_COLORKEY" },
+};
+
+static Atom xvColorKey, xvAutopaintColorKey;
+
+struct _OMAPVideoPort {
+	OMAPDRMEvent event;		/* must be first */
+	ScrnInfoPtr pScrn;
+	/* the plane shows bos[cur], the other one is written next */
+	struct omap_bo *bos[2];
+	int cur;
+	uint32_t format;
+	/* the plane hasn't picked up bos[cur] yet */
+	Bool pending;
+	uint32_t colorkey;
+	Bool autopaint;
+	/* where the colour key was painted last */
+	RegionRec clip;
+};
+
+typedef struct _OMAPVideoPort OMAPVideoPortRec, *OMAPVideoPortPtr;
+
+/* A conversion to the destination boxes, split in bands of rows */
+typedef struct {
+	struct omap_yuv_convert *conv;
+	BoxPtr boxes;
+	int num_boxes;
+	BoxRec extents;
+	/* origin of the destination rectangle */
+	int drw_x;
+	int drw_y;
+	/* pixel (x, y) is at dst + (y + y_off) * pitch + (x + x_off) * cpp */
+	uint8_t *dst;
+	int pitch;
+	int cpp;
+	int x_off;
+	int y_off;
+} OMAPVideoBlitJob;
+
+static void
+OMAPVideoFlipHandler(OMAPDRMEventPtr event, unsigned int frame,
+		unsigned int tv_sec, unsigned int tv_usec)
+{
+	OMAPVideoPortPtr port = (OMAPVideoPortPtr)event;
+
+	port->pending = FALSE;
+}
+
+static int
+OMAPVideoImageIndex(int id)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_SIZE(omap_xv_images); i++) {
+		if (omap_xv_images[i].id == id)
+			return i;
+	}
+	return -1;
+}
+
+/*
+ * Where the planes of a @width x @height image of @id are in the client's
+ * buffer.  @width and @height are rounded up to what the image needs.
+ * Returns the size of the image.
+ */
+static int
+OMAPVideoImageLayout(int id, unsigned short *width, unsigned short *height,
+		int *pitches, int *offsets)
+{
+	int pitch[3] = { 0 }, offset[3] = { 0 };
+	int size, i;
+
+	*width = min(ALIGN(*width, 2), OMAP_XV_MAX_WIDTH);
+	*height = min(ALIGN(*height, 2), OMAP_XV_MAX_HEIGHT);
+
+	switch (id) {
+	case FOURCC_NV12:
+		pitch[0] = pitch[1] = ALIGN(*width, 4);
+		offset[1] = pitch[0] * *height;
+		size = offset[1] + pitch[1] * *height / 2;
+		break;
+	case FOURCC_YV12:
+	case FOURCC_I420:
+		pitch[0] = ALIGN(*width, 4);
+		pitch[1] = pitch[2] = ALIGN(*width / 2, 4);
+		offset[1] = pitch[0] * *height;
+		offset[2] = offset[1] + pitch[1] * *height / 2;
+		size = offset[2] + pitch[2] * *height / 2;
+		break;
+	case FOURCC_YUY2:
+	default:
+		pitch[0] = *width * 2;
+		size = pitch[0] * *height;
+		break;
+	}
+
+	for (i = 0; i < 3; i++) {
+		if (pitches)
+			pitches[i] = pitch[i];
+		if (offsets)
+			offsets[i] = offset[i];
+	}
+	return size;
+}
+
+/* Make sure the plane no longer shows the bos, then free them */
+static void
+OMAPVideoFreeBos(ScrnInfoPtr pScrn, OMAPVideoPortPtr port)
+{
+	int i;
+
+	drmmode_plane_hide(pScrn, port);
+	while (port->pending)
+		drmmode_wait_for_event(pScrn);
+
+	for (i = 0; i < 2; i++) {
+		if (port->bos[i])
+			omap_bo_unreference(port->bos[i]);
+		port->bos[i] = NULL;
+	}
+}
+
+static Bool
+OMAPVideoAllocBos(ScrnInfoPtr pScrn, OMAPVideoPortPtr port, uint32_t format,
+		int width, int height)
+{
+	OMAPPtr pOMAP = OMAPPTR(pScrn);
+	int i;
+
+	if (port->bos[0] && port->format == format &&
+	    omap_bo_width(port->bos[0]) == width &&
+	    omap_bo_height(port->bos[0]) == height)
+		return TRUE;
+
+	OMAPVideoFreeBos(pScrn, port);
+
+	for (i = 0; i < 2; i++) {
+		/* all our formats average at most 16 bits per pixel */
+		port->bos[i] = omap_bo_new_with_format(pOMAP->dev, width,
+				height, format, 16);
+		if (!port->bos[i] || !omap_bo_fb(port->bos[i])) {
+			ERROR_MSG("Xv: failed to allocate %dx%d %.4s image",
+					width, height, (char *)&format);
+			OMAPVideoFreeBos(pScrn, port);
+			return FALSE;
+		}
+	}
+	port->format = format;
+	port->cur = 0;
+
+	return TRUE;
+}
+
+/* Copy the client's image, laid out as OMAPVideoImageLayout() says, to @bo */
+static Bool
+OMAPVideoCopyImage(struct omap_bo *bo, int id, const unsigned char *buf,
+		unsigned short width, unsigned short height)
+{
+	uint32_t bo_pitches[4], bo_offsets[4];
+	int pitches[3], offsets[3];
+	uint8_t *dst;
+	int i, planes;
+
+	dst = omap_bo_map(bo);
+	if (!dst || omap_bo_cpu_prep(bo, OMAP_GEM_WRITE))
+		return FALSE;
+
+	OMAPVideoImageLayout(id, &width, &height, pitches, offsets);
+	planes = omap_bo_get_planes(bo, bo_pitches, bo_offsets);
+
+	for (i = 0; i < planes; i++) {
+		/* every plane but the packed one holds 8 bit samples */
+		int bytes = id == FOURCC_YUY2 ? width * 2 : width;
+		int rows = i ? height / 2 : height;
+
+		/* 4:2:0 chroma planes are half as wide, NV12's are interleaved */
+		if (i && id != FOURCC_NV12)
+			bytes /= 2;
+
+		omap_copy_rows(dst + bo_offsets[i], bo_pitches[i],
+				buf + offsets[i], pitches[i], bytes, rows);
+	}
+
+	omap_bo_cpu_fini(bo, OMAP_GEM_WRITE);
+	return TRUE;
+}
+
+static void
+OMAPVideoBlitBand(void *data, int band, int bands)
+{
+	OMAPVideoBlitJob *job = data;
+	int height = job->extents.y2 - job->extents.y1;
+	int y1 = job->extents.y1 + height * band / bands;
+	int y2 = job->extents.y1 + height * (band + 1) / bands;
+	int i;
+
+	for (i = 0; i < job->num_boxes; i++) {
+		BoxPtr box = &job->boxes[i];
+		int by1 = max(box->y1, y1), by2 = min(box->y2, y2);
+
+		if (by1 >= by2)
+			continue;
+		omap_yuv_convert_box(job->conv, band, job->dst +
+				(by1 + job->y_off) * job->pitch +
+				(box->x1 + job->x_off) * job->cpp, job->pitch,
+				box->x1 - job->drw_x, by1 - job->drw_y,
+				box->x2 - job->drw_x, by2 - job->drw_y);
+	}
+}
+
+/* Can we write to the bo of @pPixmap, as laid out for fb? */
+static struct omap_bo *
+OMAPVideoBlitBo(ScrnInfoPtr pScrn, PixmapPtr pPixmap)
+{
+	OMAPPtr pOMAP = OMAPPTR(pScrn);
+	ScreenPtr pScreen = pPixmap->drawable.pScreen;
+	struct omap_bo *bo = OMAPPixmapBo(pPixmap);
+
+	if (!bo)
+		return NULL;
+
+	/* in flip mode only PrepareAccess finds the root bo, see DRI2 */
+	if (pPixmap == pScreen->GetScreenPixmap(pScreen) &&
+	    bo != pOMAP->scanout)
+		return NULL;
+
+	if (omap_bo_width(bo) != pPixmap->drawable.width ||
+	    omap_bo_height(bo) != pPixmap->drawable.height ||
+	    omap_bo_bpp(bo) != pPixmap->drawable.bitsPerPixel ||
+	    omap_bo_pitch(bo) != pPixmap->devKind)
+		return NULL;
+
+	return bo;
+}
+
+/*
+ * Convert and scale the image into the clip of @pDraw.  Straight into the
+ * bo behind it if we can, otherwise into memory and through fb.
+ */
+static int
+OMAPVideoBlit(ScrnInfoPtr pScrn, short src_x, short src_y, short drw_x,
+		short drw_y, short src_w, short src_h, short drw_w, short drw_h,
+		int id, unsigned char *buf, short width, short height,
+		RegionPtr clipBoxes, DrawablePtr pDraw)
+{
+	OMAPPtr pOMAP = OMAPPTR(pScrn);
+	ScreenPtr pScreen = pDraw->pScreen;
+	PixmapPtr pPixmap = draw2pix(pDraw);
+	unsigned short image_w = width, image_h = height;
+	struct omap_yuv_image image;
+	OMAPVideoBlitJob job;
+	struct omap_bo *bo;
+	uint8_t *tmp = NULL;
+	int pitches[3], offsets[3];
+	int bands = 1, ret = Success;
+	RegionRec region;
+	BoxRec box;
+
+	if (OMAPVideoImageIndex(id) < 0)
+		return BadMatch;
+	if (pDraw->bitsPerPixel != 16 && pDraw->bitsPerPixel != 32)
+		return BadMatch;
+	if (src_w <= 0 || src_h <= 0 || drw_w <= 0 || drw_h <= 0)
+		return Success;
+
+	OMAPVideoImageLayout(id, &image_w, &image_h, pitches, offsets);
+	image.width = width;
+	image.height = height;
+	image.planes[0] = buf;
+	image.pitches[0] = pitches[0];
+	switch (id) {
+	case FOURCC_NV12:
+		image.layout = OMAP_YUV_NV12;
+		image.planes[1] = buf + offsets[1];
+		image.pitches[1] = pitches[1];
+		break;
+	case FOURCC_YV12:
+	case FOURCC_I420:
+		/* YV12 has V before U */
+		image.layout = OMAP_YUV_PLANAR_420;
+		image.planes[1] = buf + offsets[id == FOURCC_YV12 ? 2 : 1];
+		image.planes[2] = buf + offsets[id == FOURCC_YV12 ? 1 : 2];
+		image.pitches[1] = pitches[1];
+		image.pitches[2] = pitches[2];
+		break;
+	case FOURCC_YUY2:
+	default:
+		image.layout = OMAP_YUV_YUYV;
+		break;
+	}
+
+	box.x1 = drw_x;
+	box.y1 = drw_y;
+	box.x2 = drw_x + drw_w;
+	box.y2 = drw_y + drw_h;
+	RegionInit(&region, &box, 1);
+	RegionIntersect(&region, &region, clipBoxes);
+	if (!RegionNotEmpty(&region))
+		goto out;
+
+	if (max(width * height, drw_w * drw_h) >= OMAP_XV_THREAD_PIXELS)
+		bands = omap_thread_pool_size(OMAPThreadPool(pScrn));
+
+	job.conv = omap_yuv_convert_new(&image, src_x << 16, src_y << 16,
+			src_w << 16, src_h << 16, drw_w, drw_h,
+			pDraw->bitsPerPixel, bands);
+	if (!job.conv) {
+		ret = BadAlloc;
+		goto out;
+	}
+	job.boxes = RegionRects(&region);
+	job.num_boxes = RegionNumRects(&region);
+	job.extents = *RegionExtents(&region);
+	job.drw_x = drw_x;
+	job.drw_y = drw_y;
+	job.cpp = pDraw->bitsPerPixel / 8;
+
+	bo = OMAPVideoBlitBo(pScrn, pPixmap);
+	if (bo) {
+		job.dst = OMAPBoCpuMap(pScrn, bo);
+		job.pitch = omap_bo_pitch(bo);
+		job.x_off = job.y_off = 0;
+#ifdef COMPOSITE
+		/* redirected windows have their own pixmap */
+		if (pDraw->type == DRAWABLE_WINDOW) {
+			job.x_off = -pPixmap->screen_x;
+			job.y_off = -pPixmap->screen_y;
+		}
+#endif
+		/* the shadow is plain memory, the damage takes the video
+		 * on to the bo, see OMAPShadowUpdate()
+		 */
+		if (!job.dst)
+			bo = NULL;
+		else if (job.dst != pOMAP->shadow &&
+			 omap_bo_cpu_prep(bo, OMAP_GEM_WRITE))
+			bo = NULL;
+	}
+
+	if (bo) {
+		DamageRegionAppend(pDraw, &region);
+		omap_thread_run(pOMAP->threads, OMAPVideoBlitBand, &job, bands);
+		if (job.dst != pOMAP->shadow)
+			omap_bo_cpu_fini(bo, OMAP_GEM_WRITE);
+		DamageRegionProcessPending(pDraw);
+	} else {
+		int w = job.extents.x2 - job.extents.x1;
+		int h = job.extents.y2 - job.extents.y1;
+		RegionPtr pClip;
+		GCPtr pGC;
+
+		job.pitch = ALIGN(w * job.cpp, 4);
+		job.x_off = -job.extents.x1;
+		job.y_off = -job.extents.y1;
+		tmp = job.dst = malloc(job.pitch * h);
+		pGC = GetScratchGC(pDraw->depth, pScreen);
+		pClip = RegionCreate(NULL, 0);
+		if (!tmp || !pGC || !pClip) {
+			if (pGC)
+				FreeScratchGC(pGC);
+			if (pClip)
+				RegionDestroy(pClip);
+			ret = BadAlloc;
+			goto out_conv;
+		}
+
+		omap_thread_run(pOMAP->threads, OMAPVideoBlitBand, &job, bands);
+
+		/* the GC clip is relative to the drawable */
+		RegionCopy(pClip, &region);
+		RegionTranslate(pClip, -pDraw->x, -pDraw->y);
+		(*pGC->funcs->ChangeClip)(pGC, CT_REGION, pClip, 0);
+		ValidateGC(pDraw, pGC);
+		pGC->ops->PutImage(pDraw, pGC, pDraw->depth,
+				job.extents.x1 - pDraw->x,
+				job.extents.y1 - pDraw->y, w, h, 0, ZPixmap,
+				(char *)tmp);
+		FreeScratchGC(pGC);
+	}
+
+out_conv:
+	omap_yuv_convert_free(job.conv);
+out:
+	free(tmp);
+	RegionUninit(&region);
+	return ret;
+}
+
+static void
+OMAPVideoStopVideo(ScrnInfoPtr pScrn, void *data, Bool shutdown)
+{
+	OMAPVideoPortPtr port = data;
+
+	RegionEmpty(&port->clip);
+
+	if (shutdown)
+		OMAPVideoFreeBos(pScrn, port);
+	else
+		drmmode_plane_hide(pScrn, port);
+}
+
+static int
+OMAPVideoSetPortAttribute(ScrnInfoPtr pScrn, Atom attribute, INT32 value,
+		void *data)
+{
+	OMAPVideoPortPtr port = data;
+
+	if (attribute == xvColorKey) {
+		port->colorkey = value & 0xffffff;
+		RegionEmpty(&port->clip);
+	} else if (attribute == xvAutopaintColorKey) {
+		port->autopaint = !!value;
+		RegionEmpty(&port->clip);
+	} else {
+		return BadMatch;
+	}
+
+	return Success;
+}
+
+static int
+OMAPVideoGetPortAttribute(ScrnInfoPtr pScrn, Atom attribute, INT32 *value,
+		void *data)
+{
+	OMAPVideoPortPtr port = data;
+
+	if (attribute == xvColorKey)
+		*value = port->colorkey;
+	else if (attribute == xvAutopaintColorKey)
+		*value = port->autopaint;
+	else
+		return BadMatch;
+
+	return Success;
+}
+
+static void
+OMAPVideoQueryBestSize(ScrnInfoPtr pScrn, Bool motion, short vid_w,
+		short vid_h, short drw_w, short drw_h, unsigned int *p_w,
+		unsigned int *p_h, void *data)
+{
+	/* planes and blits scale to whatever size the client asks for */
+	*p_w = drw_w;
+	*p_h = drw_h;
+}
+
+static int
+OMAPVideoQueryImageAttributes(ScrnInfoPtr pScrn, int id, unsigned short *w,
+		unsigned short *h, int *pitches, int *offsets)
+{
+	return OMAPVideoImageLayout(id, w, h, pitches, offsets);
+}
+
+static int
+OMAPVideoPutImage(ScrnInfoPtr pScrn, short src_x, short src_y, short drw_x,
+		short drw_y, short src_w, short src_h, short drw_w, short drw_h,
+		int id, unsigned char *buf, short width, short height, Bool sync,
+		RegionPtr clipBoxes, void *data, DrawablePtr pDraw)
+{
+	OMAPVideoPortPtr port = data;
+	unsigned short image_w = width, image_h = height;
+	INT32 x1, x2, y1, y2;
+	xf86CrtcPtr crtc;
+	BoxRec dst;
+	int index, next, num_flipped, ret;
+
+	index = OMAPVideoImageIndex(id);
+	if (index < 0)
+		return BadMatch;
+
+	if (!pScrn->vtSema)
+		return Success;
+
+	x1 = src_x << 16;
+	x2 = (src_x + src_w) << 16;
+	y1 = src_y << 16;
+	y2 = (src_y + src_h) << 16;
+	dst.x1 = drw_x;
+	dst.x2 = drw_x + drw_w;
+	dst.y1 = drw_y;
+	dst.y2 = drw_y + drw_h;
+
+	/* clips the source to what the visible part of the window shows */
+	if (!xf86_crtc_clip_video_helper(pScrn, &crtc, NULL, &dst, &x1, &x2,
+			&y1, &y2, clipBoxes, width, height) || !crtc) {
+		OMAPVideoStopVideo(pScrn, port, FALSE);
+		return Success;
+	}
+	if (crtc->rotation != RR_Rotate_0)
+		goto blit;
+
+	OMAPVideoImageLayout(id, &image_w, &image_h, NULL, NULL);
+	if (!OMAPVideoAllocBos(pScrn, port, omap_xv_drm_formats[index],
+			image_w, image_h))
+		goto blit;
+
+	/* the other bo may still be on screen until the last update lands */
+	next = !port->cur;
+	while (port->pending)
+		drmmode_wait_for_event(pScrn);
+
+	if (!OMAPVideoCopyImage(port->bos[next], id, buf, width, height))
+		return BadAlloc;
+
+	dst.x1 -= crtc->x;
+	dst.x2 -= crtc->x;
+	dst.y1 -= crtc->y;
+	dst.y2 -= crtc->y;
+	ret = drmmode_plane_set(crtc, port, port->format,
+			omap_bo_fb(port->bos[next]), x1, y1, x2 - x1, y2 - y1,
+			&dst, port, &num_flipped);
+	if (ret)
+		goto blit;
+	port->cur = next;
+	port->pending = num_flipped > 0;
+
+	if (port->autopaint && !RegionEqual(&port->clip, clipBoxes)) {
+		RegionCopy(&port->clip, clipBoxes);
+		xf86XVFillKeyHelperDrawable(pDraw, port->colorkey, clipBoxes);
+	}
+
+	return Success;
+
+blit:
+	/* no plane for us, the key has to be painted again once we get one */
+	OMAPVideoStopVideo(pScrn, port, FALSE);
+	return OMAPVideoBlit(pScrn, src_x, src_y, drw_x, drw_y, src_w, src_h,
+			drw_w, drw_h, id, buf, width, height, clipBoxes, pDraw);
+}
+
+static void
+OMAPVideoBlitStopVideo(ScrnInfoPtr pScrn, void *data, Bool shutdown)
+{
+}
+
+static int
+OMAPVideoBlitSetPortAttribute(ScrnInfoPtr pScrn, Atom attribute, INT32 value,
+		void *data)
+{
+	return BadMatch;
+}
+
+static int
+OMAPVideoBlitGetPortAttribute(ScrnInfoPtr pScrn, Atom attribute, INT32 *value,
+		void *data)
+{
+	return BadMatch;
+}
+
+static int
+OMAPVideoBlitPutImage(ScrnInfoPtr pScrn, short src_x, short src_y,
+		short drw_x, short drw_y, short src_w, short src_h, short drw_w,
+		short drw_h, int id, unsigned char *buf, short width,
+		short height, Bool sync, RegionPtr clipBoxes, void *data,
+		DrawablePtr pDraw)
+{
+	return OMAPVideoBlit(pScrn, src_x, src_y, drw_x, drw_y, src_w, src_h,
+			drw_w, drw_h, id, buf, width, height, clipBoxes, pDraw);
+}
+
+/* Log and return how many ports we can have, and the images they take */
+static int
+OMAPVideoPlaneCount(ScrnInfoPtr pScrn, XF86ImagePtr images, int *num_images)
+{
+	char names[ARRAY_SIZE(omap_xv_images) * 5 + 1] = "";
+	unsigned int i;
+	int count, ports = 0;
+
+	*num_images = 0;
+	for (i = 0; i < ARRAY_SIZE(omap_xv_images); i++) {
+		count = drmmode_plane_count(pScrn, omap_xv_drm_formats[i]);
+		if (!count)
+			continue;
+		images[(*num_images)++] = omap_xv_images[i];
+		strncat(names, (const char *)omap_xv_images[i].guid, 4);
+		strcat(names, " ");
+		ports = max(ports, count);
+	}
+
+	if (ports)
+		INFO_MSG("Xv: %d overlay ports, images: %s", ports, names);
+	return ports;
+}
+
+static XF86VideoAdaptorPtr
+OMAPVideoSetupOverlay(ScrnInfoPtr pScrn, XF86ImagePtr images)
+{
+	OMAPPtr pOMAP = OMAPPTR(pScrn);
+	XF86VideoAdaptorPtr adaptor;
+	DevUnion *privates;
+	int i, nports, nimages;
+
+	nports = OMAPVideoPlaneCount(pScrn, images, &nimages);
+	if (!nports) {
+		INFO_MSG("No overlay plane takes YUV, Xv overlay disabled");
+		return NULL;
+	}
+
+	pOMAP->xv_ports = calloc(nports, sizeof(*pOMAP->xv_ports));
+	privates = calloc(nports, sizeof(*privates));
+	adaptor = xf86XVAllocateVideoAdaptorRec(pScrn);
+	if (!pOMAP->xv_ports || !privates || !adaptor) {
+		if (adaptor)
+			xf86XVFreeVideoAdaptorRec(adaptor);
+		free(privates);
+		free(pOMAP->xv_ports);
+		pOMAP->xv_ports = NULL;
+		return NULL;
+	}
+
+	xvColorKey = MAKE_ATOM("XV_COLORKEY");
+	xvAutopaintColorKey = MAKE_ATOM("XV_AUTOPAINT_COLORKEY");
+
+	for (i = 0; i < nports; i++) {
+		OMAPVideoPortPtr port = &pOMAP->xv_ports[i];
+
+		port->event.handler = OMAPVideoFlipHandler;
+		port->pScrn = pScrn;
+		port->autopaint = TRUE;
+		/* a key unlikely to turn up anywhere else */
+		port->colorkey = (1 << pScrn->offset.red) |
+				(1 << pScrn->offset.green) |
+				(((pScrn->mask.blue >> pScrn->offset.blue) - 1)
+						<< pScrn->offset.blue);
+		RegionNull(&port->clip);
+		privates[i].ptr = port;
+	}
+	pOMAP->num_xv_ports = nports;
+
+	adaptor->type = XvWindowMask | XvInputMask | XvImageMask;
+	adaptor->flags = VIDEO_OVERLAID_IMAGES;
+	adaptor->name = "armsoc overlay";
+	adaptor->nEncodings = ARRAY_SIZE(omap_xv_encodings);
+	adaptor->pEncodings = omap_xv_encodings;
+	adaptor->nFormats = ARRAY_SIZE(omap_xv_formats);
+	adaptor->pFormats = omap_xv_formats;
+	adaptor->nPorts = nports;
+	adaptor->pPortPrivates = privates;
+	adaptor->nAttributes = ARRAY_SIZE(omap_xv_attributes);
+	adaptor->pAttributes = omap_xv_attributes;
+	adaptor->nImages = nimages;
+	adaptor->pImages = images;
+	adaptor->StopVideo = OMAPVideoStopVideo;
+	adaptor->SetPortAttribute = OMAPVideoSetPortAttribute;
+	adaptor->GetPortAttribute = OMAPVideoGetPortAttribute;
+	adaptor->QueryBestSize = OMAPVideoQueryBestSize;
+	adaptor->PutImage = OMAPVideoPutImage;
+	adaptor->QueryImageAttributes = OMAPVideoQueryImageAttributes;
+
+	return adaptor;
+}
+
+static XF86VideoAdaptorPtr
+OMAPVideoSetupBlit(ScrnInfoPtr pScrn)
+{
+	XF86VideoAdaptorPtr adaptor;
+	DevUnion *privates;
+
+	/* the ports have no state of their own */
+	privates = calloc(OMAP_XV_BLIT_PORTS, sizeof(*privates));
+	adaptor = xf86XVAllocateVideoAdaptorRec(pScrn);
+	if (!privates || !adaptor) {
+		if (adaptor)
+			xf86XVFreeVideoAdaptorRec(adaptor);
+		free(privates);
+		return NULL;
+	}
+
+	adaptor->type = XvWindowMask | XvPixmapMask | XvInputMask |
+			XvImageMask;
+	adaptor->flags = 0;
+	adaptor->name = "armsoc blit";
+	adaptor->nEncodings = ARRAY_SIZE(omap_xv_encodings);
+	adaptor->pEncodings = omap_xv_encodings;
+	adaptor->nFormats = ARRAY_SIZE(omap_xv_formats);
+	adaptor->pFormats = omap_xv_formats;
+	adaptor->nPorts = OMAP_XV_BLIT_PORTS;
+	adaptor->pPortPrivates = privates;
+	adaptor->nAttributes = 0;
+	adaptor->pAttributes = NULL;
+	adaptor->nImages = ARRAY_SIZE(omap_xv_images);
+	adaptor->pImages = omap_xv_images;
+	adaptor->StopVideo = OMAPVideoBlitStopVideo;
+	adaptor->SetPortAttribute = OMAPVideoBlitSetPortAttribute;
+	adaptor->GetPortAttribute = OMAPVideoBlitGetPortAttribute;
+	adaptor->QueryBestSize = OMAPVideoQueryBestSize;
+	adaptor->PutImage = OMAPVideoBlitPutImage;
+	adaptor->QueryImageAttributes = OMAPVideoQueryImageAttributes;
+
+	return adaptor;
+}
+
+Bool
+OMAPVideoScreenInit(ScreenPtr pScreen)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	XF86ImageRec images[ARRAY_SIZE(omap_xv_images)];
+	XF86VideoAdaptorPtr adaptors[2];
+	int i, num_adaptors = 0;
+	Bool ret;
+
+	/* clients take the first adaptor, so planes go first */
+	adaptors[num_adaptors] = OMAPVideoSetupOverlay(pScrn, images);
+	if (adaptors[num_adaptors])
+		num_adaptors++;
+	adaptors[num_adaptors] = OMAPVideoSetupBlit(pScrn);
+	if (adaptors[num_adaptors])
+		num_adaptors++;
+	if (!num_adaptors)
+		return FALSE;
+
+	/* xf86XV copies the adaptors, and of the private arrays only the
+	 * pointers into pOMAP->xv_ports, so the arrays can go too
+	 */
+	ret = xf86XVScreenInit(pScreen, adaptors, num_adaptors);
+	for (i = 0; i < num_adaptors; i++) {
+		free(adaptors[i]->pPortPrivates);
+		xf86XVFreeVideoAdaptorRec(adaptors[i]);
+	}
+	if (!ret) {
+		OMAPVideoCloseScreen(pScreen);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+ * Give up the planes of all ports, for when we are about to lose DRM master.
+ * The next image put brings the video back.
+ */
+void
+OMAPVideoReleasePlanes(ScreenPtr pScreen)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	OMAPPtr pOMAP = OMAPPTR(pScrn);
+	int i;
+
+	for (i = 0; i < pOMAP->num_xv_ports; i++)
+		OMAPVideoStopVideo(pScrn, &pOMAP->xv_ports[i], FALSE);
+}
+
+/* The ports have been shut down by now, see xf86XVCloseScreen() */
+void
+OMAPVideoCloseScreen(ScreenPtr pScreen)
+{
+	ScrnInfoPtr pScrn = xf86ScreenToScrn(pScreen);
+	OMAPPtr pOMAP = OMAPPTR(pScrn);
+	int i;
+
+	for (i = 0; i < pOMAP->num_xv_ports; i++)
+		RegionUninit(&pOMAP->xv_ports[i].clip);
+
+	free(pOMAP->xv_ports);
+	pOMAP->xv_ports = NULL;
+	pOMAP->num_xv_ports = 0;
+}
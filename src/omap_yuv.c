@@ -0,0 +1,560 @@
+/* -*- mode: C; c-file-style: "k&r"; tab-width 4; indent-tabs-mode: t; -*- */
+
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__ARM_NEON__) || defined(__ARM_NEON)
+#include <arm_neon.h>
+#define OMAP_YUV_NEON 1
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define OMAP_YUV_SSE2 1
+#endif
+
+#include "omap_yuv.h"
+
+/*
+ * YUV to RGB conversion with bilinear scaling, for video no overlay plane
+ * can show.
+ *
+ * Each destination row is made in three steps: the two source rows around
+ * it are blended into one, that row is resampled to the destination width,
+ * and the result is converted to RGB.  The first and last step run on
+ * NEON or SSE2 where we have it; resampling is a gather, which neither does
+ * much better than plain C.
+ *
+ * Conversion is BT.601 limited range with 6 bit coefficients, which the
+ * SIMD code can do in saturating 16 bit arithmetic.  The C code does the
+ * same sums, so every path gives the same pixels.
+ */
+
+#define CSC_Y	75	/* 1.164 */
+#define CSC_RV	102	/* 1.596 */
+#define CSC_GU	25	/* 0.391 */
+#define CSC_GV	52	/* 0.813 */
+#define CSC_BU	129	/* 2.018 */
+
+struct omap_yuv_convert {
+	struct omap_yuv_image src;
+	int chroma_w;
+	int chroma_h;
+	int dst_w;
+	int dst_h;
+	int bpp;
+
+	/*
+	 * For each destination column and row, the source sample to its left
+	 * (above) and the weight out of 256 of the one after it.
+	 */
+	int *luma_x;
+	int *chroma_x;
+	int *luma_y;
+	int *chroma_y;
+	uint8_t *luma_xf;
+	uint8_t *chroma_xf;
+	uint8_t *luma_yf;
+	uint8_t *chroma_yf;
+
+	/* the rows a band works on, see omap_yuv_convert_box() */
+	uint8_t *scratch;
+	size_t scratch_size;
+};
+
+static inline uint8_t
+clamp_u8(int v)
+{
+	return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+static void
+csc_row_c(uint8_t *dst, int bpp, const uint8_t *y, const uint8_t *u,
+		const uint8_t *v, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		int c = (y[i] - 16) * CSC_Y;
+		int d = u[i] - 128;
+		int e = v[i] - 128;
+		uint8_t r = clamp_u8((c + CSC_RV * e + 32) >> 6);
+		uint8_t g = clamp_u8((c - CSC_GU * d - CSC_GV * e + 32) >> 6);
+		uint8_t b = clamp_u8((c + CSC_BU * d + 32) >> 6);
+
+		if (bpp == 32)
+			((uint32_t *)dst)[i] = 0xff000000 | r << 16 | g << 8 | b;
+		else
+			((uint16_t *)dst)[i] = (r >> 3) << 11 | (g >> 2) << 5 |
+					b >> 3;
+	}
+}
+
+/* dst = a, blended with b by @f out of 256 */
+static void
+blend_row_c(uint8_t *dst, const uint8_t *a, const uint8_t *b, int n, int f)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		dst[i] = (a[i] * (256 - f) + b[i] * f + 128) >> 8;
+}
+
+static void
+split_uv_c(uint8_t *u, uint8_t *v, const uint8_t *uv, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		u[i] = uv[2 * i];
+		v[i] = uv[2 * i + 1];
+	}
+}
+
+/* @n is the number of pixels, so half as many U and V are written */
+static void
+split_yuyv_c(uint8_t *y, uint8_t *u, uint8_t *v, const uint8_t *yuyv, int n)
+{
+	int i;
+
+	for (i = 0; i < n / 2; i++) {
+		y[2 * i] = yuyv[4 * i];
+		u[i] = yuyv[4 * i + 1];
+		y[2 * i + 1] = yuyv[4 * i + 2];
+		v[i] = yuyv[4 * i + 3];
+	}
+	if (n & 1) {
+		y[n - 1] = yuyv[4 * i];
+		u[i] = yuyv[4 * i + 1];
+		v[i] = yuyv[4 * i + 3];
+	}
+}
+
+#ifdef OMAP_YUV_NEON
+static void
+csc_row(uint8_t *dst, int bpp, const uint8_t *y, const uint8_t *u,
+		const uint8_t *v, int n)
+{
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		int16x8_t c = vreinterpretq_s16_u16(vsubl_u8(vld1_u8(y + i),
+				vdup_n_u8(16)));
+		int16x8_t d = vreinterpretq_s16_u16(vsubl_u8(vld1_u8(u + i),
+				vdup_n_u8(128)));
+		int16x8_t e = vreinterpretq_s16_u16(vsubl_u8(vld1_u8(v + i),
+				vdup_n_u8(128)));
+		int16x8_t yy = vmulq_n_s16(c, CSC_Y);
+		uint8x8_t r, g, b;
+
+		r = vqrshrun_n_s16(vqaddq_s16(yy, vmulq_n_s16(e, CSC_RV)), 6);
+		g = vqrshrun_n_s16(vqsubq_s16(vqsubq_s16(yy,
+				vmulq_n_s16(d, CSC_GU)),
+				vmulq_n_s16(e, CSC_GV)), 6);
+		b = vqrshrun_n_s16(vqaddq_s16(yy, vmulq_n_s16(d, CSC_BU)), 6);
+
+		if (bpp == 32) {
+			uint8x8x4_t px;
+
+			px.val[0] = b;
+			px.val[1] = g;
+			px.val[2] = r;
+			px.val[3] = vdup_n_u8(0xff);
+			vst4_u8(dst + i * 4, px);
+		} else {
+			uint16x8_t px = vshll_n_u8(r, 8);
+
+			px = vsriq_n_u16(px, vshll_n_u8(g, 8), 5);
+			px = vsriq_n_u16(px, vshll_n_u8(b, 8), 11);
+			vst1q_u16((uint16_t *)(dst + i * 2), px);
+		}
+	}
+	csc_row_c(dst + i * bpp / 8, bpp, y + i, u + i, v + i, n - i);
+}
+
+static void
+blend_row(uint8_t *dst, const uint8_t *a, const uint8_t *b, int n, int f)
+{
+	uint8x8_t fa = vdup_n_u8(256 - f), fb = vdup_n_u8(f);
+	int i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		uint8x16_t va = vld1q_u8(a + i), vb = vld1q_u8(b + i);
+		uint16x8_t lo, hi;
+
+		lo = vmull_u8(vget_low_u8(va), fa);
+		lo = vmlal_u8(lo, vget_low_u8(vb), fb);
+		hi = vmull_u8(vget_high_u8(va), fa);
+		hi = vmlal_u8(hi, vget_high_u8(vb), fb);
+		vst1q_u8(dst + i, vcombine_u8(vrshrn_n_u16(lo, 8),
+				vrshrn_n_u16(hi, 8)));
+	}
+	blend_row_c(dst + i, a + i, b + i, n - i, f);
+}
+
+static void
+split_uv(uint8_t *u, uint8_t *v, const uint8_t *uv, int n)
+{
+	int i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		uint8x16x2_t px = vld2q_u8(uv + 2 * i);
+
+		vst1q_u8(u + i, px.val[0]);
+		vst1q_u8(v + i, px.val[1]);
+	}
+	split_uv_c(u + i, v + i, uv + 2 * i, n - i);
+}
+
+static void
+split_yuyv(uint8_t *y, uint8_t *u, uint8_t *v, const uint8_t *yuyv, int n)
+{
+	int i;
+
+	for (i = 0; i + 32 <= n; i += 32) {
+		uint8x16x4_t px = vld4q_u8(yuyv + 2 * i);
+		uint8x16x2_t luma;
+
+		luma.val[0] = px.val[0];
+		luma.val[1] = px.val[2];
+		vst2q_u8(y + i, luma);
+		vst1q_u8(u + i / 2, px.val[1]);
+		vst1q_u8(v + i / 2, px.val[3]);
+	}
+	split_yuyv_c(y + i, u + i / 2, v + i / 2, yuyv + 2 * i, n - i);
+}
+#elif defined(OMAP_YUV_SSE2)
+static void
+csc_row(uint8_t *dst, int bpp, const uint8_t *y, const uint8_t *u,
+		const uint8_t *v, int n)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i round = _mm_set1_epi16(32);
+	int i;
+
+	for (i = 0; i + 8 <= n; i += 8) {
+		__m128i c = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64(
+				(const __m128i *)(y + i)), zero),
+				_mm_set1_epi16(16));
+		__m128i d = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64(
+				(const __m128i *)(u + i)), zero),
+				_mm_set1_epi16(128));
+		__m128i e = _mm_sub_epi16(_mm_unpacklo_epi8(_mm_loadl_epi64(
+				(const __m128i *)(v + i)), zero),
+				_mm_set1_epi16(128));
+		__m128i yy = _mm_mullo_epi16(c, _mm_set1_epi16(CSC_Y));
+		__m128i r, g, b;
+
+		r = _mm_adds_epi16(yy, _mm_mullo_epi16(e,
+				_mm_set1_epi16(CSC_RV)));
+		g = _mm_subs_epi16(_mm_subs_epi16(yy, _mm_mullo_epi16(d,
+				_mm_set1_epi16(CSC_GU))), _mm_mullo_epi16(e,
+				_mm_set1_epi16(CSC_GV)));
+		b = _mm_adds_epi16(yy, _mm_mullo_epi16(d,
+				_mm_set1_epi16(CSC_BU)));
+
+		/* round, shift and clamp to 0..255 */
+		r = _mm_packus_epi16(_mm_srai_epi16(_mm_adds_epi16(r, round),
+				6), zero);
+		g = _mm_packus_epi16(_mm_srai_epi16(_mm_adds_epi16(g, round),
+				6), zero);
+		b = _mm_packus_epi16(_mm_srai_epi16(_mm_adds_epi16(b, round),
+				6), zero);
+
+		if (bpp == 32) {
+			__m128i bg = _mm_unpacklo_epi8(b, g);
+			__m128i ra = _mm_unpacklo_epi8(r, _mm_set1_epi8(-1));
+
+			_mm_storeu_si128((__m128i *)(dst + i * 4),
+					_mm_unpacklo_epi16(bg, ra));
+			_mm_storeu_si128((__m128i *)(dst + i * 4 + 16),
+					_mm_unpackhi_epi16(bg, ra));
+		} else {
+			__m128i px;
+
+			r = _mm_unpacklo_epi8(r, zero);
+			g = _mm_unpacklo_epi8(g, zero);
+			b = _mm_unpacklo_epi8(b, zero);
+			px = _mm_or_si128(_mm_slli_epi16(_mm_srli_epi16(r, 3),
+					11), _mm_slli_epi16(_mm_srli_epi16(g, 2),
+					5));
+			px = _mm_or_si128(px, _mm_srli_epi16(b, 3));
+			_mm_storeu_si128((__m128i *)(dst + i * 2), px);
+		}
+	}
+	csc_row_c(dst + i * bpp / 8, bpp, y + i, u + i, v + i, n - i);
+}
+
+static void
+blend_row(uint8_t *dst, const uint8_t *a, const uint8_t *b, int n, int f)
+{
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i fa = _mm_set1_epi16(256 - f), fb = _mm_set1_epi16(f);
+	const __m128i round = _mm_set1_epi16(128);
+	int i;
+
+	for (i = 0; i + 16 <= n; i += 16) {
+		__m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+		__m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+		__m128i lo, hi;
+
+		/* at most 255 * 256 + 128, which fits unsigned 16 bits */
+		lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(va, zero),
+				fa), _mm_mullo_epi16(_mm_unpacklo_epi8(vb, zero),
+				fb));
+		hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(va, zero),
+				fa), _mm_mullo_epi16(_mm_unpackhi_epi8(vb, zero),
+				fb));
+		lo = _mm_srli_epi16(_mm_add_epi16(lo, round), 8);
+		hi = _mm_srli_epi16(_mm_add_epi16(hi, round), 8);
+		_mm_storeu_si128((__m128i *)(dst + i),
+				_mm_packus_epi16(lo, hi));
+	}
+	blend_row_c(dst + i, a + i, b + i, n - i, f);
+}
+
+#define split_uv split_uv_c
+#define split_yuyv split_yuyv_c
+#else
+#define csc_row csc_row_c
+#define blend_row blend_row_c
+#define split_uv split_uv_c
+#define split_yuyv split_yuyv_c
+#endif
+
+/*
+ * Where each of @n destination samples comes from, for a source @len long
+ * starting at @start, both 16.16, on a grid of @limit samples subsampled by
+ * @shift.  Samples are taken at the centres of the destination pixels.
+ */
+static void
+omap_yuv_positions(int32_t start, int32_t len, int n, int limit, int shift,
+		int *idx, uint8_t *frac)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		int64_t pos = start + ((int64_t)(2 * i + 1) * len) / (2 * n) -
+				0x8000;
+
+		if (pos < 0)
+			pos = 0;
+		pos >>= shift;
+		idx[i] = pos >> 16;
+		frac[i] = (pos >> 8) & 0xff;
+		if (idx[i] >= limit - 1) {
+			idx[i] = limit - 1;
+			frac[i] = 0;
+		}
+	}
+}
+
+/*
+ * Set up converting the @src_w x @src_h area at (@src_x, @src_y) of @src,
+ * all 16.16, to a @dst_w x @dst_h image of @bpp 16 (RGB565) or 32 (XRGB8888),
+ * in up to @bands concurrent bands.
+ */
+struct omap_yuv_convert *
+omap_yuv_convert_new(const struct omap_yuv_image *src, int32_t src_x,
+		int32_t src_y, int32_t src_w, int32_t src_h, int dst_w,
+		int dst_h, int bpp, int bands)
+{
+	struct omap_yuv_convert *conv;
+	int chroma_shift_y;
+
+	if (src->width < 1 || src->height < 1 || dst_w < 1 || dst_h < 1 ||
+	    bands < 1 || (bpp != 16 && bpp != 32))
+		return NULL;
+
+	conv = calloc(1, sizeof(*conv));
+	if (!conv)
+		return NULL;
+
+	conv->src = *src;
+	conv->dst_w = dst_w;
+	conv->dst_h = dst_h;
+	conv->bpp = bpp;
+	conv->chroma_w = (src->width + 1) / 2;
+	chroma_shift_y = src->layout == OMAP_YUV_YUYV ? 0 : 1;
+	conv->chroma_h = (src->height + chroma_shift_y) >> chroma_shift_y;
+
+	conv->luma_x = malloc(dst_w * sizeof(int));
+	conv->chroma_x = malloc(dst_w * sizeof(int));
+	conv->luma_y = malloc(dst_h * sizeof(int));
+	conv->chroma_y = malloc(dst_h * sizeof(int));
+	conv->luma_xf = malloc(dst_w);
+	conv->chroma_xf = malloc(dst_w);
+	conv->luma_yf = malloc(dst_h);
+	conv->chroma_yf = malloc(dst_h);
+
+	/*
+	 * Per band: two source rows and their blend for each of Y, U and V,
+	 * plus a sample more for resampling, and the resampled Y, U and V.
+	 */
+	conv->scratch_size = 3 * (src->width + 1) +
+			6 * (conv->chroma_w + 1) + 3 * dst_w;
+	conv->scratch_size = (conv->scratch_size + 63) & ~63;
+	conv->scratch = malloc(conv->scratch_size * bands);
+
+	if (!conv->luma_x || !conv->chroma_x || !conv->luma_y ||
+	    !conv->chroma_y || !conv->luma_xf || !conv->chroma_xf ||
+	    !conv->luma_yf || !conv->chroma_yf || !conv->scratch) {
+		omap_yuv_convert_free(conv);
+		return NULL;
+	}
+
+	omap_yuv_positions(src_x, src_w, dst_w, src->width, 0,
+			conv->luma_x, conv->luma_xf);
+	omap_yuv_positions(src_x, src_w, dst_w, conv->chroma_w, 1,
+			conv->chroma_x, conv->chroma_xf);
+	omap_yuv_positions(src_y, src_h, dst_h, src->height, 0,
+			conv->luma_y, conv->luma_yf);
+	omap_yuv_positions(src_y, src_h, dst_h, conv->chroma_h, chroma_shift_y,
+			conv->chroma_y, conv->chroma_yf);
+
+	return conv;
+}
+
+void
+omap_yuv_convert_free(struct omap_yuv_convert *conv)
+{
+	if (!conv)
+		return;
+
+	free(conv->luma_x);
+	free(conv->chroma_x);
+	free(conv->luma_y);
+	free(conv->chroma_y);
+	free(conv->luma_xf);
+	free(conv->chroma_xf);
+	free(conv->luma_yf);
+	free(conv->chroma_yf);
+	free(conv->scratch);
+	free(conv);
+}
+
+/* The source row after @row, or @row itself if it is the last one */
+static inline int
+min_row(int row, int rows)
+{
+	return row + 1 < rows ? row + 1 : row;
+}
+
+/* Resample @n samples starting at destination column @x from @row */
+static void
+omap_yuv_resample(uint8_t *dst, const uint8_t *row, const int *idx,
+		const uint8_t *frac, int x, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++) {
+		const uint8_t *p = row + idx[x + i];
+		int f = frac[x + i];
+
+		dst[i] = (p[0] * (256 - f) + p[1] * f + 128) >> 8;
+	}
+}
+
+/* Blend two rows into @dst, and repeat the last sample for resampling */
+static void
+omap_yuv_blend(uint8_t *dst, const uint8_t *a, const uint8_t *b, int n, int f)
+{
+	if (f)
+		blend_row(dst, a, b, n, f);
+	else
+		memcpy(dst, a, n);
+	dst[n] = dst[n - 1];
+}
+
+/*
+ * Convert the destination pixels from (@x1, @y1) up to (@x2, @y2) to @dst,
+ * which points at (@x1, @y1).  Calls for different @band may run at the
+ * same time.
+ */
+void
+omap_yuv_convert_box(struct omap_yuv_convert *conv, int band, uint8_t *dst,
+		int dst_pitch, int x1, int y1, int x2, int y2)
+{
+	const struct omap_yuv_image *src = &conv->src;
+	int w = src->width, cw = conv->chroma_w;
+	int n = x2 - x1;
+	uint8_t *scratch = conv->scratch + band * conv->scratch_size;
+	uint8_t *y_a = scratch, *y_b = y_a + w, *y_t = y_b + w;
+	uint8_t *u_a = y_t + w + 1, *u_b = u_a + cw, *u_t = u_b + cw;
+	uint8_t *v_a = u_t + cw + 1, *v_b = v_a + cw, *v_t = v_b + cw;
+	uint8_t *y_o = v_t + cw + 1, *u_o = y_o + conv->dst_w;
+	uint8_t *v_o = u_o + conv->dst_w;
+	int y;
+
+	if (n <= 0)
+		return;
+
+	for (y = y1; y < y2; y++, dst += dst_pitch) {
+		int la = conv->luma_y[y], lb = min_row(la, src->height);
+		int ca = conv->chroma_y[y], cb = min_row(ca, conv->chroma_h);
+		const uint8_t *ya, *yb, *ua, *ub, *va, *vb;
+
+		switch (src->layout) {
+		case OMAP_YUV_PLANAR_420:
+			ya = src->planes[0] + la * src->pitches[0];
+			yb = src->planes[0] + lb * src->pitches[0];
+			ua = src->planes[1] + ca * src->pitches[1];
+			ub = src->planes[1] + cb * src->pitches[1];
+			va = src->planes[2] + ca * src->pitches[2];
+			vb = src->planes[2] + cb * src->pitches[2];
+			break;
+		case OMAP_YUV_NV12:
+			ya = src->planes[0] + la * src->pitches[0];
+			yb = src->planes[0] + lb * src->pitches[0];
+			split_uv(u_a, v_a, src->planes[1] + ca * src->pitches[1],
+					cw);
+			split_uv(u_b, v_b, src->planes[1] + cb * src->pitches[1],
+					cw);
+			ua = u_a, ub = u_b, va = v_a, vb = v_b;
+			break;
+		case OMAP_YUV_YUYV:
+		default:
+			split_yuyv(y_a, u_a, v_a,
+					src->planes[0] + la * src->pitches[0], w);
+			split_yuyv(y_b, u_b, v_b,
+					src->planes[0] + lb * src->pitches[0], w);
+			ya = y_a, yb = y_b, ua = u_a, ub = u_b, va = v_a, vb = v_b;
+			break;
+		}
+
+		omap_yuv_blend(y_t, ya, yb, w, conv->luma_yf[y]);
+		omap_yuv_blend(u_t, ua, ub, cw, conv->chroma_yf[y]);
+		omap_yuv_blend(v_t, va, vb, cw, conv->chroma_yf[y]);
+
+		omap_yuv_resample(y_o, y_t, conv->luma_x, conv->luma_xf, x1, n);
+		omap_yuv_resample(u_o, u_t, conv->chroma_x, conv->chroma_xf,
+				x1, n);
+		omap_yuv_resample(v_o, v_t, conv->chroma_x, conv->chroma_xf,
+				x1, n);
+
+		csc_row(dst, conv->bpp, y_o, u_o, v_o, n);
+	}
+}
@@ -0,0 +1,56 @@
+/* -*- mode: C; c-file-style: "k&r"; tab-width 4; indent-tabs-mode: t; -*- */
+
+/*
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the next
+ * paragraph) shall be included in all copies or substantial portions of the
+ * Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef OMAP_YUV_H_
+#define OMAP_YUV_H_
+
+#include <stdint.h>
+
+enum omap_yuv_layout {
+	/* Y, U and V planes, chroma halved in both directions */
+	OMAP_YUV_PLANAR_420,
+	/* Y plane and an interleaved UV plane, chroma halved in both directions */
+	OMAP_YUV_NV12,
+	/* Y0 U Y1 V, chroma halved horizontally */
+	OMAP_YUV_YUYV,
+};
+
+struct omap_yuv_image {
+	enum omap_yuv_layout layout;
+	int width;
+	int height;
+	/* Y, U, V; NV12 has UV in planes[1], YUYV everything in planes[0] */
+	const uint8_t *planes[3];
+	int pitches[3];
+};
+
+struct omap_yuv_convert;
+
+struct omap_yuv_convert *omap_yuv_convert_new(const struct omap_yuv_image *src,
+		int32_t src_x, int32_t src_y, int32_t src_w, int32_t src_h,
+		int dst_w, int dst_h, int bpp, int bands);
+void omap_yuv_convert_box(struct omap_yuv_convert *conv, int band,
+		uint8_t *dst, int dst_pitch, int x1, int y1, int x2, int y2);
+void omap_yuv_convert_free(struct omap_yuv_convert *conv);
+
+#endif /* OMAP_YUV_H_ */